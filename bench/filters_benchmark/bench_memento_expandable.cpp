@@ -0,0 +1,124 @@
+/*
+ * This file is part of Memento Filter <https://github.com/n3slami/Memento_Filter>.
+ * Copyright (C) 2024 Navid Eslami.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+
+#include "../bench_template.hpp"
+#include "memento.h"
+#include "memento_int.h"
+
+/**
+ * This file contains the benchmark for the expandable Memento filter, which
+ * starts from a single block and grows as the keys are inserted one by one.
+ */
+
+template <typename t_itr, typename... Args>
+inline QF *init_memento_expandable(const t_itr begin, const t_itr end, const double bpk, Args... args)
+{
+    auto&& t = std::forward_as_tuple(args...);
+    auto queries_temp = std::get<0>(t);
+    auto query_lengths = std::vector<uint64_t>(queries_temp.size());
+    std::transform(queries_temp.begin(), queries_temp.end(), query_lengths.begin(), [](auto x) {
+        auto [left, right, result] = x;
+        return right - left + 1;
+    });
+    const uint64_t seed = 1380;
+    const uint64_t max_range_size = *std::max_element(query_lengths.begin(), query_lengths.end());
+    const double load_factor = 0.95;
+    const uint64_t n_slots = QF_SLOTS_PER_BLOCK;
+    int predef_memento_size = std::get<1>(t);
+    uint32_t memento_bits = 1;
+    if (predef_memento_size == -1) {
+        while ((1ULL << memento_bits) < max_range_size)
+            memento_bits++;
+        memento_bits = memento_bits < 2 ? 2 : memento_bits;
+    }
+    else 
+        memento_bits = predef_memento_size;
+    // One bit of every slot records the length of its fingerprint
+    const uint32_t fingerprint_size = round(bpk * load_factor - memento_bits - 3.125);
+    uint32_t key_size = 0;
+    while ((1ULL << key_size) < n_slots)
+        key_size++;
+    key_size += fingerprint_size;
+    std::cerr << "fingerprint_size=" << fingerprint_size << " memento_bits=" << memento_bits << std::endl;
+
+    QF *qf = (QF *) malloc(sizeof(QF));
+    qf_alloc_options options = {};
+    options.expandable = true;
+    qf_malloc_ex(qf, n_slots, key_size, memento_bits, QF_HASH_DEFAULT, seed, &options);
+    qf_set_auto_resize(qf, true);
+
+    start_timer(build_time);
+
+    const uint64_t memento_mask = (1ULL << memento_bits) - 1;
+    for (auto it = begin; it != end; ++it)
+        qf_insert_single(qf, *it >> memento_bits, *it & memento_mask, QF_NO_LOCK);
+
+    stop_timer(build_time);
+
+    return qf;
+}
+
+template <typename value_type>
+inline bool query_memento_expandable(QF *f, const value_type left, const value_type right)
+{
+    value_type l_key = left >> f->metadata->memento_bits;
+    value_type l_memento = left & ((1ULL << f->metadata->memento_bits) - 1);
+    if (left == right) {
+        return qf_point_query(f, l_key, l_memento, QF_NO_LOCK);
+    }
+    value_type r_key = right >> f->metadata->memento_bits;
+    value_type r_memento = right & ((1ULL << f->metadata->memento_bits) - 1);
+    return qf_range_query(f, l_key, l_memento, r_key, r_memento, QF_NO_LOCK);
+}
+
+inline size_t size_memento_expandable(QF *f)
+{
+    return qf_get_total_size_in_bytes(f);
+}
+
+int main(int argc, char const *argv[])
+{
+    auto parser = init_parser("bench-memento-expandable");
+
+    try
+    {
+        parser.parse_args(argc, argv);
+    }
+    catch (const std::runtime_error &err)
+    {
+        std::cerr << err.what() << std::endl;
+        std::cerr << parser;
+        std::exit(1);
+    }
+
+    auto [ keys, queries, arg, memento_size ] = read_parser_arguments_memento(parser);
+
+    experiment(pass_fun(init_memento_expandable), pass_ref(query_memento_expandable), 
+                pass_ref(size_memento_expandable), arg, keys, queries, queries, memento_size);
+
+    print_test();
+
+    return 0;
+}
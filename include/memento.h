@@ -22,6 +22,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -83,6 +84,10 @@ extern "C" {
 		 hashed. */
 #define QF_KEY_IS_HASH (0x08)
 
+	/* Access modes for qf_open_file. */
+#define QF_USEFILE_READ_ONLY (0x01)
+#define QF_USEFILE_READ_WRITE (0x02)
+
 	/******************************************
       CQF defines low-level constructor and destructor operations that are
       designed to enable the application to manage the memory used by the CQF. 
@@ -108,7 +113,8 @@ extern "C" {
      * the contents of the buffers. Use this function if you have read a
      * Memento filter, e.g. off of disk or network, and want to begin using
      * that stream of bytes as a Memento filter instance. This function takes
-     * ownership of buffer.  
+     * ownership of buffer. Returns 0 if the runtime data cannot be allocated,
+     * or if the filter was built with a different QF_BLOCK_OFFSET_WIDTH.
      */
 	uint64_t qf_use(QF *qf, void *buffer, uint64_t buffer_len);
 
@@ -124,7 +130,16 @@ extern "C" {
      * Allocate a new Memento filter using `nslots` at `buffer` and copy
      * elements from `qf` into it. If there is not enough space at the buffer
      * then it will return the total size needed in bytes to initialize the new
-     * filter. Note that `nslots` must be twice the number of slots in `qf`.
+     * filter. `nslots` may be any size larger than that of `qf`, e.g., 1.25
+     * times its size. Between two doublings, the filter grows in steps of
+     * 1/QF_SPLIT_GROUP_SIZE by splitting evenly spread slots in two, so
+     * `nslots` is rounded up to the next step. Keys homed in a split slot use
+     * one fingerprint bit less until the filter has doubled. Like
+     * qf_resize_malloc, this function lengthens the key by one bit every time
+     * an expandable filter doubles, and keeps it otherwise. Returns 0,
+     * leaving `qf` unchanged, if `qf` lives in a file or in shared memory,
+     * or if the memory for the runtime data of the new filter or for the
+     * copy cannot be allocated.
 	 */
 	uint64_t qf_resize(QF *qf, uint64_t nslots, void *buffer, uint64_t buffer_len);
 
@@ -140,23 +155,383 @@ extern "C" {
 
 	bool qf_free(QF *qf);
 
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * Placement options for qf_malloc_ex:
+     *
+     *   - page_size: back the table with transparent huge pages (madvise
+     *   with MADV_HUGEPAGE), or with explicit 2MB or 1GB huge pages (mmap
+     *   with MAP_HUGETLB). If no explicit huge pages of the requested size
+     *   are available, the table falls back to transparent huge pages.
+     *
+     *   - numa_policy, numa_nodes: bind the table to, or interleave it
+     *   across, the NUMA nodes in the `numa_nodes` bitmask.
+     *
+     *   - prefault: map the table with mmap and fault it in whole at
+     *   allocation time. Otherwise, a table obtained with mmap is faulted in
+     *   lazily, by the threads that first touch each page.
+     *
+     *   - block_layout: PACKED stores the 64-slot blocks back to back.
+     *   CACHE_ALIGNED pads every block to a multiple of 64 bytes and aligns
+     *   its metadata words, so that a block never shares a cache line with
+     *   its neighbors, at the cost of some padding per block. SPLIT stores
+     *   the offsets, the occupieds bitmaps, the runends bitmaps and the slots
+     *   of all blocks in four separate arrays, so that scans over the
+     *   bitmaps stay in a dense region of memory.
+     *
+     *   - snapshots: keep the table in a memory file, so that qf_snapshot
+     *   can share its pages with the snapshots instead of copying them.
+     *   Explicit huge pages are replaced by transparent ones.
+     *
+     *   - allocator: the hooks from which the filter allocates its runtime
+     *   data, its locks, the scratch space of resizes, and its table unless
+     *   it is mapped with mmap. NULL stands for malloc and free. The hooks
+     *   are copied into the filter, but their context must outlive it.
+     *
+     *   - expandable: let the filter grow without bound. Every doubling
+     *   takes a quotient bit from the fingerprints, and a plain filter
+     *   keeps the length of its keys, so its fingerprints run out after
+     *   about `key_bits` - log2(`nslots`) doublings. An expandable filter
+     *   lengthens its keys instead, and spends one more bit per slot to
+     *   record how long each fingerprint is: new keys get fingerprints as
+     *   long as those of the initial filter, so the false positive rate
+     *   stays bounded, while the fingerprints of the keys inserted before a
+     *   doubling lose a bit. A query matches a shortened fingerprint if it
+     *   agrees with its remaining bits, and returns 2 for such a match. Once
+     *   a fingerprint has no bits left, its prefix set is copied into both
+     *   home slots it splits into, so pick fingerprints with a few bits more
+     *   than the number of doublings expected before most keys are
+     *   replaced. The keys may grow up to 64 bits.
+     *
+     * The options also apply to the tables allocated when the filter is
+     * resized with qf_resize_malloc or qf_shrink.
+     */
+	/*
+     * Allocator hooks. `alloc` returns `size` bytes aligned to `alignment`,
+     * a power of two, or NULL on failure. `realloc` grows or shrinks a
+     * block obtained from the hooks, keeping its contents and alignment; it
+     * may be NULL, in which case the block is copied with `alloc` and
+     * `free`. `free` releases a block of `size` bytes. All of them receive
+     * `ctx` as their first argument, e.g., an arena or a pool of buffers.
+     * The hooks may be called concurrently by the threads of a parallel
+     * resize.
+     */
+	typedef struct {
+		void *(*alloc)(void *ctx, size_t size, size_t alignment);
+		void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size,
+                            size_t alignment);
+		void (*free)(void *ctx, void *ptr, size_t size);
+		void *ctx;
+	} qf_allocator;
+
+	enum qf_page_size {
+		QF_PAGES_DEFAULT,
+		QF_PAGES_TRANSPARENT_HUGE,
+		QF_PAGES_HUGE_2MB,
+		QF_PAGES_HUGE_1GB
+	};
+
+	enum qf_numa_policy {
+		QF_NUMA_DEFAULT,
+		QF_NUMA_BIND,
+		QF_NUMA_INTERLEAVE
+	};
+
+	enum qf_block_layout {
+		QF_BLOCK_LAYOUT_PACKED,
+		QF_BLOCK_LAYOUT_CACHE_ALIGNED,
+		QF_BLOCK_LAYOUT_SPLIT
+	};
+
+	typedef struct {
+		enum qf_page_size page_size;
+		enum qf_numa_policy numa_policy;
+		uint64_t numa_nodes;
+		bool prefault;
+		enum qf_block_layout block_layout;
+		bool snapshots;
+		const qf_allocator *allocator;
+		bool expandable;
+	} qf_alloc_options;
+
+	/*
+     * Same as qf_malloc, but places the table as specified by `options`.
+     * Returns false if the memory cannot be allocated, mapped or bound to
+     * the requested NUMA nodes. With default options, this is qf_malloc.
+     */
+	bool qf_malloc_ex(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t memento_bits,
+                    enum qf_hashmode hash_mode, uint32_t seed,
+                    const qf_alloc_options *options);
+
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * Create a Memento filter whose metadata and blocks live in `filename`,
+     * which is created or truncated, and mapped into memory. Updates reach
+     * the file lazily; call qf_sync to write them back. Release the filter
+     * with qf_free, which also closes the file.
+     */
+	bool qf_create_file(QF *qf, uint64_t nslots, uint64_t key_bits, 
+                        uint64_t memento_bits, enum qf_hashmode hash_mode, 
+                        uint32_t seed, const char *filename);
+
+	/*
+     * Map the Memento filter stored in `filename`, e.g., by qf_create_file,
+     * without reading or copying the table: only the runtime data is
+     * rebuilt, and the table is paged in as it is queried. `flag` is
+     * QF_USEFILE_READ_ONLY or QF_USEFILE_READ_WRITE; a read-only filter
+     * cannot be modified. Returns false if the file does not hold a filter
+     * with the byte order and block offset width of this build.
+     * File-backed filters cannot be resized: the resize functions return an
+     * error, and so do insertions that need the resize policy to grow the
+     * filter.
+     */
+	bool qf_open_file(QF *qf, const char *filename, int flag);
+
+	/*
+     * Write back the modified pages of a file-backed filter and wait for
+     * them to reach the file. Returns false if the filter is not backed by
+     * a file or if the write back fails.
+     */
+	bool qf_sync(const QF *qf);
+
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * Create a Memento filter in the POSIX shared memory segment `name` (see
+     * shm_open), which must not exist yet. The segment holds the
+     * metadata, the blocks and the locks, so the processes that attach to
+     * it with qf_attach_shm share a single copy of the filter and
+     * synchronize through the same locks. Release the filter with qf_free,
+     * which only detaches from the segment; qf_unlink_shm removes it.
+     */
+	bool qf_create_shm(QF *qf, uint64_t nslots, uint64_t key_bits,
+                        uint64_t memento_bits, enum qf_hashmode hash_mode,
+                        uint32_t seed, const char *name);
+
+	/*
+     * Attach to a filter created by qf_create_shm. `flag` is
+     * QF_USEFILE_READ_ONLY or QF_USEFILE_READ_WRITE; a read-only process
+     * cannot modify the table, but still takes the locks, so it needs write
+     * access to the segment. A shared filter cannot be resized: the resize
+     * functions return an error, and so do insertions that need the resize
+     * policy to grow the filter.
+     */
+	bool qf_attach_shm(QF *qf, const char *name, int flag);
+
+	/* Remove the shared memory segment `name`. Processes that are attached
+     * to it keep their mapping. */
+	bool qf_unlink_shm(const char *name);
+
+	/*
+     * Write `qf` to `fd` in a versioned format: a header followed
+     * by the blocks in large chunks, each with a CRC32C checksum. The format
+     * does not depend on the block layout or the width of the block offsets
+     * of the host. Like the rest of the filter, it assumes a little-endian
+     * host.
+     */
+	bool qf_serialize_to_fd(const QF *qf, int fd);
+
+	/*
+     * Read a filter written by qf_serialize_to_fd from `fd` into a new
+     * filter allocated as by qf_malloc_ex with `options`, which may be NULL.
+     * Returns false, leaving `qf` unallocated, if the data is truncated, is
+     * of an unknown version, fails a checksum, or does not fit in memory.
+     */
+	bool qf_deserialize_from_fd(QF *qf, int fd, const qf_alloc_options *options);
+
+	/*
+     * Incremental checkpoints. Once dirty tracking is started, the filter
+     * records which regions of QF_DIRTY_REGION_BLOCKS blocks it modifies.
+     * qf_checkpoint_incremental writes only the regions modified since the
+     * previous checkpoint, or since the last qf_serialize_to_fd, together
+     * with a manifest of these regions and the counters of the filter. To
+     * restore a filter, load the last full serialization with
+     * qf_deserialize_from_fd and apply the checkpoints taken after it, in
+     * order, with qf_apply_checkpoint_from_fd. After a resize, the next
+     * checkpoint holds the whole filter. Checkpoints must not run
+     * concurrently with modifications of the filter.
+     *
+     * qf_apply_checkpoint_from_fd reads and checks the whole checkpoint
+     * before modifying `qf`, and returns false, leaving `qf` untouched, if
+     * it is truncated or corrupted or does not fit `qf`.
+     *
+     * qf_start_dirty_tracking returns false if the bitmap of modified regions
+     * cannot be allocated. Once it is on, a resize or a checkpoint that
+     * changes the geometry of the filter fails, leaving the filter as it
+     * was, if the bitmap of the new filter cannot be allocated.
+     */
+	bool qf_start_dirty_tracking(QF *qf);
+
+	bool qf_checkpoint_incremental(QF *qf, int fd);
+
+	bool qf_apply_checkpoint_from_fd(QF *qf, int fd);
+
+	/*
+     * Create a read-only snapshot of `qf` in `snap`, which keeps answering
+     * queries as `qf` did when it was taken, while `qf` is modified. Release
+     * it with qf_free. If `qf` was allocated with the `snapshots` option, the
+     * snapshot shares the pages of `qf`, and a page is copied only when `qf`
+     * first modifies it: taking a snapshot costs O(1) the first time, and
+     * then O(modified regions) if the previous snapshots were released, or a
+     * copy of the table if some are still alive. Otherwise, the snapshot is
+     * a copy of the table. Snapshots must not be taken concurrently with
+     * modifications of `qf`. Returns false, leaving `qf` as it was, if the
+     * snapshot cannot be allocated or mapped.
+     */
+	bool qf_snapshot(const QF *qf, QF *snap);
+
     /****************** NEW IN MEMENTO ******************/
 	/* 
      * Resize the Memento filter instance to the specified number of slots.
      * Uses malloc() to obtain the new memory, and calls free() on the old
-     * memory. Return value:
+     * memory, or the allocator hooks of the filter. Return value:
 	 *    >= 0: number of keys copied during resizing.
-     * Note that `nslots` must be twice the number of slots in `qf`.
+	 *    QF_NO_MEMORY: the memory for the new table cannot be obtained;
+	 *    `qf` is left unchanged.
+	 *    QF_INVALID: `qf` lives in a file or in shared memory (see
+	 *    qf_create_file and qf_create_shm) and cannot move out of it; `qf`
+	 *    is left unchanged.
+     * As in qf_resize, `nslots` may be any size larger than that of `qf`.
 	 */
 	int64_t qf_resize_malloc(QF *qf, uint64_t nslots);
 
+	/* 
+     * Same as qf_resize_malloc, but the new table is built by `num_threads`
+     * threads, each copying a disjoint range of the filter. The result is
+     * identical to that of qf_resize_malloc. No other operation may run on
+     * `qf` while it is being resized.
+	 */
+	int64_t qf_resize_malloc_parallel(QF *qf, uint64_t nslots, uint32_t num_threads);
+
+	/* 
+     * Shrink the Memento filter instance to the specified number of slots,
+     * using malloc() and free() like qf_resize_malloc. The filter cannot
+     * become smaller than the size it was created with, and `nslots` is
+     * rounded up as in qf_resize; if that is not smaller than the current
+     * size, nothing is done. The hash bits that no longer select a home slot
+     * move into the fingerprints, and prefix sets that end up with the same
+     * fingerprint are merged. Return value:
+	 *    >= 0: number of keys in the filter.
+	 *    QF_NO_SPACE: the contents do not fit in `nslots` slots; `qf` is
+	 *    left unchanged.
+	 *    QF_NO_MEMORY, QF_INVALID: as in qf_resize_malloc.
+	 */
+	int64_t qf_shrink(QF *qf, uint64_t nslots);
+
+	/*
+     * Merge `qfa` and `qfb` into `qfc`, which must not be initialized. The
+     * inputs must have been created with the same number of slots, key bits,
+     * memento bits, hash mode and seed, e.g., as partitions of one data set
+     * built in parallel; they may have been resized differently since. `qfc`
+     * is allocated like qf_resize_malloc would, at the size of the largest
+     * input or larger if the contents need it, and takes its resize policy
+     * and allocation options from `qfa`. The prefix sets of the inputs are
+     * merged in order and written front to back, so merging is linear in
+     * the size of the filters. Return value:
+	 *    >= 0: number of keys in `qfc`.
+	 *    QF_INVALID: the inputs are not compatible.
+	 *    QF_NO_MEMORY: the memory for `qfc` cannot be obtained.
+	 */
+	int64_t qf_merge(const QF *qfa, const QF *qfb, QF *qfc);
+
+	/* Same as qf_merge, for `nqf` inputs. */
+	int64_t qf_multi_merge(const QF *const qf_arr[], int nqf, QF *qfr);
+
+	/*
+     * Split `src` into `lo` and `hi`, which must not be initialized, by the
+     * top bit of its quotients. This undoes the last doubling of `src`: the
+     * outputs have half its slots and one quotient bit less, and that bit
+     * goes back into their fingerprints, so they are as accurate as `src`
+     * and the original keys are not needed. `src` must have been grown to a
+     * power of two times its original size, e.g., by qf_resize_malloc. The
+     * outputs can be merged back with qf_merge, and take their resize
+     * policy and allocation options from `src`. Return value:
+	 *    >= 0: number of keys in `lo` and `hi` together.
+	 *    QF_INVALID: `src` is at its original size, was grown by a
+	 *    fraction of its size, or is expandable.
+	 *    QF_NO_SPACE: one of the halves gets more keys than it can hold.
+	 *    QF_NO_MEMORY: the memory for the outputs cannot be obtained.
+	 * `lo` and `hi` are left uninitialized on failure.
+	 */
+	int64_t qf_split(const QF *src, QF *lo, QF *hi);
+
+	/* The output of qf_split(qf, ...) that holds `key`: 0 for `lo`, 1 for
+     * `hi`. */
+	int qf_split_side(const QF *qf, uint64_t key, uint8_t flags);
+
+	/*
+     * Called before every automatic resize with the size that the policy
+     * picked, which is larger than that of `qf` when growing and smaller when
+     * shrinking. The callback may change `*nslots`, or return false to cancel
+     * the resize, in which case an insertion that needed the space fails with
+     * QF_NO_SPACE.
+     */
+	typedef bool (*qf_resize_callback)(const QF *qf, uint64_t *nslots, void *arg);
+
+	/*
+     * Decides when and how Memento filter resizes itself:
+     *
+     *   - auto_resize: grow the filter with qf_resize_malloc once an
+     *   insertion finds it loaded beyond `max_load_factor`, or once an
+     *   insertion lands more than `max_probe_distance` slots away from its
+     *   home slot. Without it, such insertions fail with QF_NO_SPACE and a
+     *   warning, respectively.
+     *
+     *   - growth_factor: factor by which automatic resizing grows the filter,
+     *   e.g. 1.25 or 1.5 to keep the size of the filter closer to that of the
+     *   dataset, at the cost of more frequent resizes.
+     *
+     *   - auto_shrink: shrink the filter with qf_shrink once deletions bring
+     *   its load below `shrink_load_factor`, so that its load becomes twice
+     *   that factor. The gap to both thresholds keeps the filter from
+     *   shrinking and growing back repeatedly, so `shrink_load_factor` must be
+     *   below half of `max_load_factor`.
+     *
+     *   - resize_callback, resize_callback_arg: see qf_resize_callback. The
+     *   callback is not stored in the filter's buffer, so it must be set again
+     *   after qf_use.
+     */
+	typedef struct {
+		bool auto_resize;
+		double max_load_factor;
+		uint64_t max_probe_distance;
+		double growth_factor;
+		bool auto_shrink;
+		double shrink_load_factor;
+		qf_resize_callback resize_callback;
+		void *resize_callback_arg;
+	} qf_resize_policy;
+
+	/* 
+     * Fill `policy` with the policy that filters are created with: no
+     * automatic resizing, a maximum load factor of 0.95, a maximum probe
+     * distance of 1000, a growth factor of 2, a shrink load factor of 0.25
+     * and no callback.
+     */
+	void qf_get_default_resize_policy(qf_resize_policy *policy);
+
+	/* Set and get the resize policy of `qf`. Setting a policy whose
+     * thresholds are out of range returns false and leaves `qf` as it was. */
+	bool qf_set_resize_policy(QF *qf, const qf_resize_policy *policy);
+	void qf_get_resize_policy(const QF *qf, qf_resize_policy *policy);
+
 	/*
      * Turn on automatic resizing. Resizing is performed by calling
      * qf_resize_malloc, so the Memento filter instance must meet the
-     * requirements of that function. 
+     * requirements of that function. Shorthand for setting `auto_resize`
+     * in the resize policy of `qf`.
      */
 	void qf_set_auto_resize(QF *qf, bool enabled);
 
+	/* Shorthand for setting `growth_factor` in the resize policy of `qf`. */
+	bool qf_set_growth_factor(QF *qf, double growth_factor);
+
+	/*
+     * Shorthands for setting `auto_shrink` and `shrink_load_factor` in the
+     * resize policy of `qf`.
+     */
+	void qf_set_auto_shrink(QF *qf, bool enabled);
+	bool qf_set_shrink_load_factor(QF *qf, double load_factor);
+
 	/***********************************
       Functions for modifying Memento filter.
 	***********************************/
@@ -164,6 +539,7 @@ extern "C" {
 #define QF_NO_SPACE (-1)
 #define QF_COULDNT_LOCK (-2)
 #define QF_DOESNT_EXIST (-3)
+#define QF_NO_MEMORY (-6)
 	
     /****************** NEW IN MEMENTO ******************/
 	/*
@@ -237,6 +613,20 @@ extern "C" {
     int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
                         uint64_t r_key, uint64_t r_memento, uint8_t flags);
 
+    /* NEW IN MEMENTO
+     * Runs qf_range_query on the `n` filters in `filters`, which must share
+     * their hash mode and seed, e.g., one filter per sorted run of an LSM
+     * tree. Every prefix is hashed once for all the filters, and the home
+     * slots of the filters are prefetched before they are probed. Sets bit
+     * `i % 64` of `may_contain[i / 64]` if filter `i` may hold a point in the
+     * range and clears it otherwise, so `may_contain` must have room for
+     * (n + 63) / 64 words. Returns the number of filters that may hold a
+     * point in the range, which is 0 if `n` is 0.
+     * */
+    int64_t qf_multi_range_query(const QF *const *filters, size_t n, uint64_t l_key,
+                                uint64_t l_memento, uint64_t r_key, uint64_t r_memento,
+                                uint64_t *may_contain, uint8_t flags);
+
 	/****************************************
       Metadata accessors.
 	****************************************/
@@ -248,10 +638,48 @@ extern "C" {
 
 	/* Space usage info. */
 	bool     qf_is_auto_resize_enabled(const QF *qf);
+	double   qf_get_growth_factor(const QF *qf);
+	bool     qf_is_auto_shrink_enabled(const QF *qf);
 	uint64_t qf_get_total_size_in_bytes(const QF *qf);
 	uint64_t qf_get_nslots(const QF *qf);
 	uint64_t qf_get_num_occupied_slots(const QF *qf);
 
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * Where the memory of a filter goes. qf_get_total_size_in_bytes counts
+     * only the blocks; the breakdown covers everything the filter holds:
+     *
+     *   - slot_bytes: the fingerprints and mementos of the `nslots` home
+     *   slots.
+     *   - overflow_slot_bytes: the slots past the home slots, into which
+     *   the last runs spill.
+     *   - bitmap_bytes: the occupieds and runends bitmaps.
+     *   - offset_bytes: the block offsets.
+     *   - metadata_bytes: the header in front of the blocks.
+     *   - slack_bytes: the padding of the block layout, the word of slack
+     *   after the slots, and the rounding of a mapped table to pages.
+     *   - runtime_bytes: the runtime data, including the bitmaps of dirty
+     *   tracking and snapshots.
+     *   - lock_bytes: the lock array.
+     *   - total_bytes: the sum of the above.
+     *   - bits_per_key: total_bytes in bits over the number of mementos
+     *   stored, or 0 if the filter is empty.
+     */
+	typedef struct {
+		uint64_t slot_bytes;
+		uint64_t overflow_slot_bytes;
+		uint64_t bitmap_bytes;
+		uint64_t offset_bytes;
+		uint64_t metadata_bytes;
+		uint64_t slack_bytes;
+		uint64_t runtime_bytes;
+		uint64_t lock_bytes;
+		uint64_t total_bytes;
+		double bits_per_key;
+	} qf_memory_stats;
+
+	void qf_get_memory_breakdown(const QF *qf, qf_memory_stats *stats);
+
 	/* Bit-sizes info. */
 	uint64_t qf_get_num_key_bits(const QF *qf);
 	uint64_t qf_get_num_memento_bits(const QF *qf);
@@ -309,7 +737,8 @@ extern "C" {
 	 *   >= 0: Iterator is still valid, and the value returned is the number
      *   of associated mementos with `key`. The prefix hash of the current
      *   element is stored in `key`, and the mementos are stored in increasing
-     *   order in `mementos`.
+     *   order in `mementos`. In an expandable filter, the hash bits that a
+     *   shortened fingerprint lost are 0.
 	 *   == QFI_INVALID: iterator has reached end.
 	 */
     int qfi_get_hash(const QFi *qfi, uint64_t *key, uint64_t *mementos);
@@ -341,13 +770,6 @@ extern "C" {
 	void qf_copy(QF *dest, const QF *src);
 
 #ifdef QF_ITERATOR
-	/* merge two QFs into the third one. Note: merges with any existing
-		 values in qfc.  */
-	void qf_merge(const QF *qfa, const QF *qfb, QF *qfc);
-
-	/* merge multiple QFs into the final QF one. */
-	void qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr);
-
 	/* find cosine similarity between two QFs. */
 	uint64_t qf_inner_product(const QF *qfa, const QF *qfb);
 
@@ -356,6 +778,268 @@ extern "C" {
 	uint64_t qf_magnitude(const QF *qf);
 #endif /* QF_ITERATOR */
 
+	/***********************************
+      Sharded Memento filter.
+	************************************/
+
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * A set of `num_shards` independent Memento filters that together act as
+     * one. A key goes to the shard picked by the high bits of its prefix
+     * hash, which the filters do not use until they grow past
+     * 64 - log2(num_shards) key bits. Every shard has its own locks and its
+     * own resize policy, so it grows, shrinks and serializes on its own, and
+     * a resize stalls only the keys of that shard. A range query over one or
+     * two prefixes touches at most two shards.
+     *
+     * With QF_KEY_IS_HASH, or with QF_HASH_NONE, the high bits of the key
+     * itself pick the shard, so the keys must be spread over all 64 bits.
+     */
+	typedef struct qf_sharded qf_sharded;
+
+	/*
+     * Create `num_shards` filters, a power of two, each as if by qf_malloc_ex
+     * with `nslots_per_shard` slots and the remaining arguments. `options`
+     * may be NULL. The shard of a key is picked by log2(`num_shards`) hash
+     * bits above its `key_bits`, and the hash has 64 bits, or 63 with
+     * QF_HASH_INVERTIBLE. Returns false if the hash is too short for both,
+     * or if any shard cannot be allocated.
+     */
+	bool qf_sharded_malloc(qf_sharded *sqf, uint32_t num_shards, uint64_t nslots_per_shard,
+                    uint64_t key_bits, uint64_t memento_bits, enum qf_hashmode hash_mode,
+                    uint32_t seed, const qf_alloc_options *options);
+
+	bool qf_sharded_free(qf_sharded *sqf);
+
+	/* The number of shards and the shard at `index`, for per-shard
+     * operations such as qf_resize_malloc or qf_get_memory_breakdown. */
+	uint32_t qf_sharded_get_num_shards(const qf_sharded *sqf);
+	QF *qf_sharded_get_shard(const qf_sharded *sqf, uint32_t index);
+
+	/* The index of the shard that holds `key`. */
+	uint32_t qf_sharded_shard_of(const qf_sharded *sqf, uint64_t key, uint8_t flags);
+
+	/* Set the resize policy of every shard. Returns false, as
+     * qf_set_resize_policy does, if the policy is out of range. */
+	bool qf_sharded_set_resize_policy(qf_sharded *sqf, const qf_resize_policy *policy);
+
+	/* Same as the functions without the `sharded` in their names, applied to
+     * the shards that the keys map to. */
+	int qf_sharded_insert_mementos(qf_sharded *sqf, uint64_t key, uint64_t mementos[],
+                    uint64_t memento_count, uint8_t flags);
+	int64_t qf_sharded_insert_single(qf_sharded *sqf, uint64_t key, uint64_t memento,
+                    uint8_t flags);
+	int qf_sharded_delete_single(qf_sharded *sqf, uint64_t key, uint64_t memento,
+                    uint8_t flags);
+	int qf_sharded_point_query(const qf_sharded *sqf, uint64_t key, uint64_t memento,
+                    uint8_t flags);
+	int qf_sharded_range_query(const qf_sharded *sqf, uint64_t l_key, uint64_t l_memento,
+                    uint64_t r_key, uint64_t r_memento, uint8_t flags);
+
+	/* Totals over all shards. */
+	uint64_t qf_sharded_get_sum_of_counts(const qf_sharded *sqf);
+	uint64_t qf_sharded_get_total_size_in_bytes(const qf_sharded *sqf);
+
+	/***********************************
+      Key-range partitioned Memento filter.
+	************************************/
+
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * A set of Memento filters, each holding the prefixes in one range of
+     * the key domain, for workloads of long range queries. A range query
+     * visits only the partitions it overlaps and skips empty ones. Each
+     * partition grows on its own, and once it holds more than
+     * `split_threshold` keys it is split at its median prefix, so that hot
+     * key ranges end up in partitions of their own.
+     *
+     * To hand every key to the half that owns it, a split reads the
+     * prefixes back from the filter, so the partitions hash them with an
+     * invertible hash on `key_bits` bits, as in QF_HASH_INVERTIBLE, and
+     * prefixes must fit in `key_bits` bits. Flags may not include
+     * QF_KEY_IS_HASH.
+     *
+     * The container is not thread-safe: callers must serialize all calls,
+     * since an insertion may split a partition.
+     */
+	typedef struct qf_partitioned qf_partitioned;
+
+	/*
+     * Create a container with a single partition covering all prefixes.
+     * Partitions are created with `nslots` slots, or more if they need
+     * them, rounded up to a power of two, with automatic resizing on. A
+     * `split_threshold` of 0 turns automatic splits off. `options` may be
+     * NULL. Partitions are never expandable, since splits read their
+     * prefixes back.
+     */
+	bool qf_partitioned_malloc(qf_partitioned *pqf, uint64_t nslots, uint64_t key_bits,
+                    uint64_t memento_bits, uint64_t split_threshold,
+                    const qf_alloc_options *options);
+
+	bool qf_partitioned_free(qf_partitioned *pqf);
+
+	/*
+     * The number of partitions, and the partition at `index`, in increasing
+     * order of keys, which holds the prefixes from `min_key` to `max_key`,
+     * both inclusive. `min_key` and `max_key` may be NULL.
+     */
+	uint32_t qf_partitioned_get_num_partitions(const qf_partitioned *pqf);
+	QF *qf_partitioned_get_partition(const qf_partitioned *pqf, uint32_t index,
+                    uint64_t *min_key, uint64_t *max_key);
+
+	/*
+     * Split the partition at `index` in two at its median prefix. Returns 0
+     * on success, QF_INVALID if all of its keys share a single prefix, or
+     * QF_NO_MEMORY, in which case the partition is left as it was.
+     */
+	int qf_partitioned_split(qf_partitioned *pqf, uint32_t index);
+
+	/* Set the resize policy of every partition, including future ones.
+     * Returns false, as qf_set_resize_policy does, if the policy is out of
+     * range. */
+	bool qf_partitioned_set_resize_policy(qf_partitioned *pqf, const qf_resize_policy *policy);
+
+	/* Same as the functions without the `partitioned` in their names,
+     * applied to the partitions that the keys fall into. */
+	int qf_partitioned_insert_mementos(qf_partitioned *pqf, uint64_t key, uint64_t mementos[],
+                    uint64_t memento_count, uint8_t flags);
+	int64_t qf_partitioned_insert_single(qf_partitioned *pqf, uint64_t key, uint64_t memento,
+                    uint8_t flags);
+	int qf_partitioned_delete_single(qf_partitioned *pqf, uint64_t key, uint64_t memento,
+                    uint8_t flags);
+	int qf_partitioned_point_query(const qf_partitioned *pqf, uint64_t key, uint64_t memento,
+                    uint8_t flags);
+	int qf_partitioned_range_query(const qf_partitioned *pqf, uint64_t l_key, uint64_t l_memento,
+                    uint64_t r_key, uint64_t r_memento, uint8_t flags);
+
+	/* Totals over all partitions. */
+	uint64_t qf_partitioned_get_sum_of_counts(const qf_partitioned *pqf);
+	uint64_t qf_partitioned_get_total_size_in_bytes(const qf_partitioned *pqf);
+
+	/***********************************
+      Time-windowed Memento filter.
+	************************************/
+
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * A ring of `num_epochs` Memento filters, one per epoch of
+     * `epoch_length` time units, for keys that are only queried while they
+     * are recent. Epoch `e` holds the keys inserted with a time in
+     * [e * epoch_length, (e + 1) * epoch_length). An insertion goes to the
+     * epoch of its time, and a query only visits the epochs that overlap its
+     * time range. The container holds the newest `num_epochs` epochs: once
+     * an insertion opens a newer epoch, the epochs that fall out of the
+     * window are freed as a whole, without deleting their keys. A filter is
+     * allocated the first time its epoch is inserted into.
+     *
+     * The container is not thread-safe: callers must serialize all calls,
+     * since an insertion may expire epochs.
+     */
+	typedef struct qf_windowed qf_windowed;
+
+	/*
+     * Create an empty container whose epochs are created as if by
+     * qf_malloc_ex with `nslots_per_epoch` slots and the remaining
+     * arguments. `options` may be NULL. Returns false if the ring cannot be
+     * allocated.
+     */
+	bool qf_windowed_malloc(qf_windowed *wqf, uint32_t num_epochs, uint64_t epoch_length,
+                    uint64_t nslots_per_epoch, uint64_t key_bits, uint64_t memento_bits,
+                    enum qf_hashmode hash_mode, uint32_t seed,
+                    const qf_alloc_options *options);
+
+	bool qf_windowed_free(qf_windowed *wqf);
+
+	/*
+     * The filter of the epoch that holds `time`, or NULL if that epoch has
+     * expired, is not open yet, or has no keys.
+     */
+	QF *qf_windowed_get_epoch(const qf_windowed *wqf, uint64_t time);
+
+	/* Free the epochs that end at or before `time`. */
+	void qf_windowed_expire(qf_windowed *wqf, uint64_t time);
+
+	/* Set the resize policy of every epoch, including future ones. Returns
+     * false, as qf_set_resize_policy does, if the policy is out of range. */
+	bool qf_windowed_set_resize_policy(qf_windowed *wqf, const qf_resize_policy *policy);
+
+	/*
+     * Same as the functions without the `windowed` in their names, applied
+     * to the epoch of `time`. An insertion into an epoch newer than all the
+     * others opens it and expires the epochs that fall out of the window.
+     * Insertions and deletions of expired times return QF_INVALID, and
+     * insertions may return QF_NO_MEMORY if the filter of the epoch cannot
+     * be allocated.
+     */
+	int qf_windowed_insert_mementos(qf_windowed *wqf, uint64_t time, uint64_t key,
+                    uint64_t mementos[], uint64_t memento_count, uint8_t flags);
+	int64_t qf_windowed_insert_single(qf_windowed *wqf, uint64_t time, uint64_t key,
+                    uint64_t memento, uint8_t flags);
+	int qf_windowed_delete_single(qf_windowed *wqf, uint64_t time, uint64_t key,
+                    uint64_t memento, uint8_t flags);
+
+	/*
+     * Queries over the epochs that overlap [`l_time`, `r_time`], both
+     * inclusive, which are probed together with qf_multi_range_query.
+     * Returns 1 if any of them may hold the key or range, and 0 otherwise.
+     */
+	int qf_windowed_point_query(const qf_windowed *wqf, uint64_t l_time, uint64_t r_time,
+                    uint64_t key, uint64_t memento, uint8_t flags);
+	int qf_windowed_range_query(const qf_windowed *wqf, uint64_t l_time, uint64_t r_time,
+                    uint64_t l_key, uint64_t l_memento, uint64_t r_key, uint64_t r_memento,
+                    uint8_t flags);
+
+	/* Totals over the live epochs. */
+	uint64_t qf_windowed_get_sum_of_counts(const qf_windowed *wqf);
+	uint64_t qf_windowed_get_total_size_in_bytes(const qf_windowed *wqf);
+
+    /****************** NEW IN MEMENTO ******************/
+	/*
+     * String keys. A codec maps a byte string to the integer formed by the
+     * first `prefix_bits` bits of the string, read big-endian and padded with
+     * zero bytes. The mapping preserves the lexicographic (memcmp) order of
+     * the strings, so a range of strings maps to the range between the
+     * encodings of its ends, and the low memento_bits of an encoding are its
+     * memento. Strings that agree on their first `prefix_bits` bits share an
+     * encoding, which shows up as false positives.
+     *
+     * If all keys share a common prefix, e.g., the scheme and host of URLs,
+     * stripping it lets `prefix_bits` cover the bytes that tell the keys
+     * apart. Strings that do not start with the common prefix map to 0 if
+     * they sort before it and to the largest encoding if they sort after it.
+     * The codec points to `common_prefix` rather than copying it.
+     */
+	typedef struct qf_string_codec {
+		const uint8_t *common_prefix;   // NULL if no prefix is stripped
+		size_t common_prefix_len;
+		uint32_t prefix_bits;           // 1 to 64
+	} qf_string_codec;
+
+	void qf_string_codec_init(qf_string_codec *codec, uint32_t prefix_bits,
+                    const void *common_prefix, size_t common_prefix_len);
+
+	/* The encoding of the `len` bytes at `key`. */
+	uint64_t qf_string_encode(const qf_string_codec *codec, const void *key, size_t len);
+
+	/*
+     * Same as the functions without the `string` in their names, applied to
+     * the encoding of `key`, which is split into a prefix key and the low
+     * memento_bits of the filter as its memento. `prefix_bits` must be
+     * larger than the memento_bits of the filter. The range of
+     * qf_range_query_string is [`l_key`, `r_key`], both inclusive, where
+     * `l_key` does not sort after `r_key`; as with qf_range_query, its cost
+     * grows with the number of prefix keys the range spans.
+     */
+	int64_t qf_insert_string(QF *qf, const qf_string_codec *codec, const void *key,
+                    size_t len, uint8_t flags);
+	int qf_delete_string(QF *qf, const qf_string_codec *codec, const void *key,
+                    size_t len, uint8_t flags);
+	int qf_point_query_string(const QF *qf, const qf_string_codec *codec,
+                    const void *key, size_t len, uint8_t flags);
+	int qf_range_query_string(const QF *qf, const qf_string_codec *codec,
+                    const void *l_key, size_t l_len, const void *r_key, size_t r_len,
+                    uint8_t flags);
+
 	/***********************************
 		Debugging functions.
 	************************************/
@@ -43,12 +43,39 @@ extern "C" {
 #define QF_BLOCK_OFFSET_BITS (6)
 
 #define QF_SLOTS_PER_BLOCK (1ULL << QF_BLOCK_OFFSET_BITS)
+
+    /* Width of the block offsets: 8, 16 or 32. An offset saturates once the
+     * runs that spill into its block from previous blocks get longer than it
+     * can store, and finding the start of the block then takes a walk back
+     * over the cluster. 8 bits suffice for uniform data; wider offsets keep
+     * this constant-time for long clusters, e.g., with skewed prefixes and
+     * large memento lists, at the cost of 1 or 3 more bytes per block. */
+#ifndef QF_BLOCK_OFFSET_WIDTH
+#define QF_BLOCK_OFFSET_WIDTH 8
+#endif
+#if QF_BLOCK_OFFSET_WIDTH == 8
+    typedef uint8_t qf_block_offset_t;
+#elif QF_BLOCK_OFFSET_WIDTH == 16
+    typedef uint16_t qf_block_offset_t;
+#elif QF_BLOCK_OFFSET_WIDTH == 32
+    typedef uint32_t qf_block_offset_t;
+#else
+#error "QF_BLOCK_OFFSET_WIDTH must be 8, 16 or 32"
+#endif
 #define QF_METADATA_WORDS_PER_BLOCK ((QF_SLOTS_PER_BLOCK + 63) / 64)
 
+    /* Growing the filter by a fraction of its size splits `split_buckets` out
+     * of every QF_SPLIT_GROUP_SIZE home slots in two. */
+#define QF_SPLIT_GROUP_BITS (4)
+#define QF_SPLIT_GROUP_SIZE (1ULL << QF_SPLIT_GROUP_BITS)
+
+    /* Granularity of the dirty tracking used by incremental checkpoints. */
+#define QF_DIRTY_REGION_BLOCKS (64)
+
     typedef struct __attribute__ ((__packed__)) qfblock {
         /* Code works with uint16_t, uint32_t, etc, but uint8_t seems just as fast as
          * anything else */
-        uint8_t offset;
+        qf_block_offset_t offset;
         uint64_t occupieds[QF_METADATA_WORDS_PER_BLOCK];
         uint64_t runends[QF_METADATA_WORDS_PER_BLOCK];
 
@@ -67,6 +94,13 @@ extern "C" {
 #endif
     } qfblock;
 
+    /* Where a field of the blocks lives: the field of block i starts
+     * `start + i * stride` bytes after the first block. */
+    typedef struct qf_array_layout {    // NEW IN MEMENTO
+        uint64_t start;
+        uint64_t stride;
+    } qf_array_layout;
+
     // struct __attribute__ ((__packed__)) qfblock;
     // typedef struct qfblock qfblock;
 
@@ -84,12 +118,29 @@ extern "C" {
         uint64_t locks_acquired_single_attempt;
     } wait_time_data;
 
+    /* A memory file holding the table of a filter, whose pages are shared
+     * with the snapshots of the filter. */
+    typedef struct qf_snapshot_base {   // NEW IN MEMENTO
+        int fd;
+        volatile int refcount;          // the filter and its snapshots that map it
+        qf_allocator allocator;         // the one this struct comes from
+    } qf_snapshot_base;
+
     typedef struct quotient_filter_runtime_data {
         file_info f_info;
         uint64_t num_locks;
-        volatile int metadata_lock;
+        volatile int *metadata_lock;            // NEW IN MEMENTO: the word after the locks
         volatile int *locks;
         wait_time_data *wait_times;
+        qf_resize_callback resize_callback;     // NEW IN MEMENTO
+        void *resize_callback_arg;              // NEW IN MEMENTO
+        qf_alloc_options alloc_options;         // NEW IN MEMENTO
+        qf_allocator allocator;                 // NEW IN MEMENTO
+        uint64_t mapped_size;                   // NEW IN MEMENTO: 0 if the filter was malloc'd
+        uint64_t *dirty_regions;                // NEW IN MEMENTO: NULL unless dirty tracking is on
+        qf_snapshot_base *snapshot_base;        // NEW IN MEMENTO: NULL unless snapshots are enabled
+        uint64_t *snapshot_dirty_regions;       // NEW IN MEMENTO: non-NULL if the table is a private view of snapshot_base
+        bool shared_locks;                      // NEW IN MEMENTO: the locks live in a shared memory segment
     } quotient_filter_runtime_data;
 
     typedef quotient_filter_runtime_data qfruntime;
@@ -98,15 +149,30 @@ extern "C" {
         uint64_t magic_endian_number;
         enum qf_hashmode hash_mode;
         uint32_t auto_resize;
+        double max_load_factor;             // NEW IN MEMENTO
+        uint64_t max_probe_distance;        // NEW IN MEMENTO
+        double growth_factor;               // NEW IN MEMENTO
+        uint32_t auto_shrink;               // NEW IN MEMENTO
+        double shrink_load_factor;          // NEW IN MEMENTO
         uint64_t total_size_in_bytes;
         uint32_t seed;
         uint64_t nslots;
         uint64_t xnslots;
         uint64_t key_bits;
         uint64_t original_quotient_bits;    // NEW IN MEMENTO
+        uint64_t original_nslots;           // NEW IN MEMENTO
+        uint64_t split_buckets;             // NEW IN MEMENTO
         uint64_t memento_bits;              // NEW IN MEMENTO
         uint64_t fingerprint_bits;
+        uint32_t expandable;                // NEW IN MEMENTO
         uint64_t bits_per_slot;
+        enum qf_block_layout block_layout;  // NEW IN MEMENTO
+        uint64_t block_size;                // NEW IN MEMENTO
+        uint32_t block_offset_width;        // NEW IN MEMENTO
+        qf_array_layout offsets_layout;     // NEW IN MEMENTO
+        qf_array_layout occupieds_layout;   // NEW IN MEMENTO
+        qf_array_layout runends_layout;     // NEW IN MEMENTO
+        qf_array_layout slots_layout;       // NEW IN MEMENTO
         __uint128_t range;
         uint64_t nblocks;
         uint64_t nelts;
@@ -124,6 +190,57 @@ extern "C" {
 
     typedef quotient_filter QF;
 
+    struct qf_sharded {             // NEW IN MEMENTO
+        QF *shards;
+        uint32_t num_shards;
+        uint32_t shard_bits;        // log2(num_shards)
+        enum qf_hashmode hash_mode;
+        uint32_t seed;
+        qf_allocator allocator;     // the one `shards` comes from
+    };
+
+    typedef struct qf_partition {   // NEW IN MEMENTO
+        uint64_t min_key;           // the partition holds the prefixes from min_key
+        uint64_t split_count;       // the number of keys that triggers the next split
+        QF qf;
+    } qf_partition;
+
+    struct qf_partitioned {         // NEW IN MEMENTO
+        qf_partition *partitions;   // sorted by min_key, the first one starting at 0
+        uint32_t num_partitions;
+        uint32_t capacity;
+        uint64_t nslots;
+        uint64_t key_bits;
+        uint64_t memento_bits;
+        uint64_t split_threshold;
+        qf_resize_policy policy;
+        qf_alloc_options options;
+        qf_allocator allocator;     // the one `partitions` comes from
+    };
+
+    typedef struct qf_window_epoch {    // NEW IN MEMENTO
+        uint64_t id;                    // time / epoch_length of the epoch
+        bool allocated;                 // whether `qf` holds a filter
+        QF qf;
+    } qf_window_epoch;
+
+    struct qf_windowed {                // NEW IN MEMENTO
+        qf_window_epoch *epochs;        // epoch `id` lives at index id % num_epochs
+        uint32_t num_epochs;
+        uint64_t epoch_length;
+        uint64_t newest_id;             // of the newest epoch inserted into
+        bool started;                   // whether `newest_id` is set
+        uint64_t expired_id;            // epochs before this one were expired by qf_windowed_expire
+        uint64_t nslots;
+        uint64_t key_bits;
+        uint64_t memento_bits;
+        enum qf_hashmode hash_mode;
+        uint32_t seed;
+        qf_resize_policy policy;
+        qf_alloc_options options;
+        qf_allocator allocator;         // the one `epochs` comes from
+    };
+
     // The below struct is used to instrument the code.
     // It is not used in normal operations of the CQF.
     typedef struct {
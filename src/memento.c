@@ -17,6 +17,10 @@
  *      comments of the form "NEW IN MEMENTO."
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // NEW IN MEMENTO: for mremap
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -30,6 +34,12 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 #include "hashutil.h"
 #include "memento.h"
@@ -45,9 +55,29 @@
   ((nbits) == 64 ? 0xffffffffffffffff : MAX_VALUE(nbits))
 #define NUM_SLOTS_TO_LOCK (1ULL<<16)
 #define CLUSTER_SIZE (1ULL<<14)
+
+// NEW IN MEMENTO: the fields of a block are found through the array layouts
+// in the metadata, so the same code serves interleaved and split layouts.
+#define BLOCK_FIELD(qf, layout, block_index)                            \
+  ((char *)(qf)->blocks + (qf)->metadata->layout.start                  \
+   + (block_index) * (qf)->metadata->layout.stride)
+#define BLOCK_OFFSET(qf, block_index)                                   \
+  (*(qf_block_offset_t *)BLOCK_FIELD(qf, offsets_layout, block_index))
+#define BLOCK_OCCUPIEDS(qf, block_index)                                \
+  ((uint64_t *)BLOCK_FIELD(qf, occupieds_layout, block_index))
+#define BLOCK_RUNENDS(qf, block_index)                                  \
+  ((uint64_t *)BLOCK_FIELD(qf, runends_layout, block_index))
+#define BLOCK_SLOTS(qf, block_index)                                    \
+  ((uint8_t *)BLOCK_FIELD(qf, slots_layout, block_index))
 #define METADATA_WORD(qf,field,slot_index)                              \
-  (get_block((qf), (slot_index) /                                       \
-             QF_SLOTS_PER_BLOCK)->field[((slot_index)  % QF_SLOTS_PER_BLOCK) / 64])
+  (((uint64_t *)BLOCK_FIELD((qf), field##_layout, (slot_index) /        \
+             QF_SLOTS_PER_BLOCK))[((slot_index)  % QF_SLOTS_PER_BLOCK) / 64])
+// NEW IN MEMENTO: the same fields, for writing. These record the block as
+// modified for incremental checkpoints.
+#define MUTABLE_BLOCK_OFFSET(qf, block_index)                           \
+  (*(mark_block_dirty((qf), (block_index)), &BLOCK_OFFSET(qf, block_index)))
+#define MUTABLE_METADATA_WORD(qf,field,slot_index)                      \
+  (*(mark_dirty((qf), (slot_index)), &METADATA_WORD(qf, field, slot_index)))
 
 #define GET_NO_LOCK(flag) (flag & QF_NO_LOCK)
 #define GET_TRY_ONCE_LOCK(flag) (flag & QF_TRY_ONCE_LOCK)
@@ -90,7 +120,7 @@
     { \
     while (filled_bits < (bit_cnt)) { \
         const uint64_t byte_pos = bit_pos / 8; \
-        uint64_t *p = (uint64_t *)&get_block(qf, (block_ind))->slots[byte_pos]; \
+        uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, (block_ind))[byte_pos]; \
         uint64_t tmp; \
         memcpy(&tmp, p, sizeof(tmp)); \
         tmp >>= (bit_pos % 8); \
@@ -111,7 +141,7 @@
 #define INIT_PAYLOAD_WORD(qf, payload, filled_bits, bit_pos, block_ind) \
     { \
     uint64_t byte_pos = bit_pos / 8; \
-    uint64_t *p = (uint64_t *)&get_block(qf, (block_ind))->slots[byte_pos]; \
+    uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, (block_ind))[byte_pos]; \
     memcpy(&payload, p, sizeof(payload)); \
     filled_bits = bit_pos % 8; \
     bit_pos -= bit_pos % 8; \
@@ -135,8 +165,9 @@
         payload &= ~(mask << filled_bits); \
         payload |= (val_copy & mask) << filled_bits; \
         uint64_t byte_pos = bit_pos / 8; \
-        uint64_t *p = (uint64_t *)&get_block(qf, (block_ind))->slots[byte_pos]; \
+        uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, (block_ind))[byte_pos]; \
         memcpy(p, &payload, sizeof(payload)); \
+        mark_block_dirty(qf, (block_ind)); \
         bit_pos += max_filled_bits; \
         if (bit_pos >= bits_per_block) { \
             bit_pos = 0; \
@@ -147,7 +178,7 @@
         filled_bits = 0; \
         max_filled_bits = (bits_per_block - bit_pos < 64 ? \
                            bits_per_block - bit_pos : 64); \
-        p = (uint64_t *)&get_block(qf, (block_ind))->slots[bit_pos / 8]; \
+        p = (uint64_t *)&BLOCK_SLOTS(qf, (block_ind))[bit_pos / 8]; \
         memcpy(&payload, p, sizeof(payload)); \
     } \
     if (filled_bits + val_bit_cnt <= max_filled_bits) { \
@@ -160,11 +191,14 @@
 #define FLUSH_PAYLOAD_WORD(qf, payload, filled_bits, bit_pos, block_ind) \
     { \
     uint64_t byte_pos = bit_pos / 8; \
-    uint64_t *p = (uint64_t *)&get_block(qf, (block_ind))->slots[byte_pos]; \
+    uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, (block_ind))[byte_pos]; \
     memcpy(p, &payload, sizeof(payload)); \
+    mark_block_dirty(qf, (block_ind)); \
     }
 
 #define DISTANCE_FROM_HOME_SLOT_CUTOFF 1000
+#define MAX_LOAD_FACTOR 0.95    // NEW IN MEMENTO
+#define SHRINK_LOAD_FACTOR 0.25     // NEW IN MEMENTO
 #define BILLION 1000000000L
 
 #ifdef DEBUG
@@ -243,6 +277,13 @@ static inline uint32_t fast_reduce(uint32_t hash, uint32_t n) {
     return (uint32_t) (((uint64_t) hash * n) >> 32);
 }
 
+// Same as fast_reduce, for filters with more than 2^32 original home slots.
+// NEW IN MEMENTO
+__attribute__((always_inline))
+static inline uint64_t fast_reduce_64(uint64_t hash, uint64_t n) {
+    return (uint64_t) (((__uint128_t) hash * n) >> 64);
+}
+
 /**
  * Try to acquire a lock once and return even if the lock is busy.
  * If spin flag is set, then spin until the lock is available.
@@ -370,13 +411,13 @@ static void qf_unlock(QF *qf, uint64_t hash_bucket_index, bool small)
 static void modify_metadata(QF *qf, uint64_t *metadata, int cnt)
 {
 #ifdef LOG_WAIT_TIME
-	qf_spin_lock(qf, &qf->runtimedata->metadata_lock,
+	qf_spin_lock(qf, qf->runtimedata->metadata_lock,
 							 qf->runtimedata->num_locks, QF_WAIT_FOR_LOCK);
 #else
-	qf_spin_lock(&qf->runtimedata->metadata_lock, QF_WAIT_FOR_LOCK);
+	qf_spin_lock(qf->runtimedata->metadata_lock, QF_WAIT_FOR_LOCK);
 #endif
 	*metadata = *metadata + cnt;
-	qf_spin_unlock(&qf->runtimedata->metadata_lock);
+	qf_spin_unlock(qf->runtimedata->metadata_lock);
 	return;
 }
 
@@ -599,13 +640,67 @@ static inline qfblock *get_block(const QF *qf, uint64_t block_index)
 {
 	return &qf->blocks[block_index];
 }
-#else
-static inline qfblock *get_block(const QF *qf, uint64_t block_index)
+#endif
+
+/*
+ * With dirty tracking on, the filter keeps one bit per QF_DIRTY_REGION_BLOCKS
+ * blocks, which is set whenever the region is modified. Incremental
+ * checkpoints write the regions with their bit set, and then clear them.
+ * A filter whose table is a copy-on-write view of the pages it shares with
+ * its snapshots keeps a second such bitmap, see qf_snapshot.
+ */
+
+// NEW IN MEMENTO
+static inline uint64_t dirty_region_count(const QF *qf)
 {
-	return (qfblock *)(((char *)qf->blocks) + block_index * (sizeof(qfblock) +
-						QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8));
+	return (qf->metadata->nblocks + QF_DIRTY_REGION_BLOCKS - 1) / QF_DIRTY_REGION_BLOCKS;
+}
+
+// Size in bytes of a bitmap with one bit per region.
+// NEW IN MEMENTO
+static inline uint64_t region_bitmap_bytes(const QF *qf)
+{
+	return (dirty_region_count(qf) + 63) / 64 * sizeof(uint64_t);
+}
+
+// NEW IN MEMENTO
+static inline void set_region_bit(uint64_t *regions, const uint64_t region)
+{
+	const uint64_t bit = 1ULL << (region % 64);
+	if (!(regions[region / 64] & bit))
+		__atomic_fetch_or(&regions[region / 64], bit, __ATOMIC_RELAXED);
+}
+
+// NEW IN MEMENTO
+static inline void mark_dirty(const QF *qf, const uint64_t slot_index)
+{
+	uint64_t *dirty_regions = qf->runtimedata->dirty_regions;
+	uint64_t *snapshot_dirty_regions = qf->runtimedata->snapshot_dirty_regions;
+	if (dirty_regions == NULL && snapshot_dirty_regions == NULL)
+		return;
+	const uint64_t region = slot_index / (QF_SLOTS_PER_BLOCK * QF_DIRTY_REGION_BLOCKS);
+	if (dirty_regions != NULL)
+		set_region_bit(dirty_regions, region);
+	if (snapshot_dirty_regions != NULL)
+		set_region_bit(snapshot_dirty_regions, region);
+}
+
+// NEW IN MEMENTO
+static inline void mark_block_dirty(const QF *qf, const uint64_t block_index)
+{
+	mark_dirty(qf, block_index * QF_SLOTS_PER_BLOCK);
+}
+
+// Marks the slots in [first, last] as modified.
+// NEW IN MEMENTO
+static inline void mark_dirty_range(const QF *qf, const uint64_t first, const uint64_t last)
+{
+	if (qf->runtimedata->dirty_regions == NULL && qf->runtimedata->snapshot_dirty_regions == NULL)
+		return;
+	const uint64_t region_slots = QF_SLOTS_PER_BLOCK * QF_DIRTY_REGION_BLOCKS;
+	for (uint64_t i = first - first % region_slots; i <= last; i += region_slots)
+		mark_dirty(qf, i);
 }
-#endif
 
 static inline int is_runend(const QF *qf, uint64_t index)
 {
@@ -632,6 +727,7 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 	assert(index < qf->metadata->xnslots);
 	get_block(qf, index / QF_SLOTS_PER_BLOCK)->slots[index % QF_SLOTS_PER_BLOCK] =
 		value & BITMASK(qf->metadata->bits_per_slot);
+	mark_dirty(qf, index);
 }
 
 #elif QF_BITS_PER_SLOT > 0
@@ -643,8 +739,8 @@ static inline uint64_t get_slot(const QF *qf, uint64_t index)
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
 	assert(index < qf->metadata->xnslots);
-    uint64_t *p = (uint64_t *)&get_block(qf, index /
-            QF_SLOTS_PER_BLOCK)->slots[(index %
+    uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, index /
+            QF_SLOTS_PER_BLOCK)[(index %
                 QF_SLOTS_PER_BLOCK)
             * QF_BITS_PER_SLOT / 8];
     return (uint64_t)(((*p) >> (((index % QF_SLOTS_PER_BLOCK) * QF_BITS_PER_SLOT) %
@@ -656,8 +752,9 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
 	assert(index < qf->metadata->xnslots);
-    uint64_t *p = (uint64_t *)&get_block(qf, index /
-            QF_SLOTS_PER_BLOCK)->slots[(index %
+	mark_dirty(qf, index);
+    uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, index /
+            QF_SLOTS_PER_BLOCK)[(index %
                 QF_SLOTS_PER_BLOCK)
             * QF_BITS_PER_SLOT / 8];
 	uint64_t t = *p;
@@ -680,8 +777,8 @@ static inline uint64_t get_slot(const QF *qf, uint64_t index)
 	assert(index < qf->metadata->xnslots);
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
-    uint64_t *p = (uint64_t *)&get_block(qf, index /
-            QF_SLOTS_PER_BLOCK)->slots[(index %
+    uint64_t *p = (uint64_t *)&BLOCK_SLOTS(qf, index /
+            QF_SLOTS_PER_BLOCK)[(index %
                 QF_SLOTS_PER_BLOCK)
             * qf->metadata->bits_per_slot / 8];
     // you cannot just do *p to get the value, undefined behavior
@@ -695,10 +792,10 @@ static inline uint64_t get_slot(const QF *qf, uint64_t index)
 static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 {
 	assert(index < qf->metadata->xnslots);
+	mark_dirty(qf, index);
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
-	uint64_t *p = (uint64_t *) &get_block(qf, index / QF_SLOTS_PER_BLOCK)
-                                ->slots[(index % QF_SLOTS_PER_BLOCK) 
+	uint64_t *p = (uint64_t *) &BLOCK_SLOTS(qf, index / QF_SLOTS_PER_BLOCK)[(index % QF_SLOTS_PER_BLOCK) 
                                         * qf->metadata->bits_per_slot / 8];
 	// This is undefined:
 	//uint64_t t = *p;
@@ -722,12 +819,11 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index);
 
 static inline uint64_t block_offset(const QF *qf, uint64_t blockidx)
 {
-	/* If we have extended counters and a 16-bit (or larger) offset
-		 field, then we can safely ignore the possibility of overflowing
-		 that field. */
-	if (sizeof(qf->blocks[0].offset) > 1 ||
-			get_block(qf, blockidx)->offset < BITMASK(8*sizeof(qf->blocks[0].offset)))
-		return get_block(qf, blockidx)->offset;
+	/* The offset saturates at its maximum value, whatever its width; long
+		 memento lists can make clusters long enough to saturate even a 16-bit
+		 offset. */
+	if (BLOCK_OFFSET(qf, blockidx) < BITMASK(8*sizeof(qf->blocks[0].offset)))
+		return BLOCK_OFFSET(qf, blockidx);
 
 	return run_end(qf, QF_SLOTS_PER_BLOCK * blockidx - 1) - QF_SLOTS_PER_BLOCK *
 		blockidx + 1;
@@ -739,7 +835,7 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
 	uint64_t bucket_intrablock_offset = hash_bucket_index % QF_SLOTS_PER_BLOCK;
 	uint64_t bucket_blocks_offset = block_offset(qf, bucket_block_index);
 
-    uint64_t bucket_intrablock_rank = bitrank(get_block(qf, bucket_block_index)->occupieds[0],
+    uint64_t bucket_intrablock_rank = bitrank(BLOCK_OCCUPIEDS(qf, bucket_block_index)[0],
                                                 bucket_intrablock_offset);
 
 	if (bucket_intrablock_rank == 0) {
@@ -753,7 +849,7 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
                                                             QF_SLOTS_PER_BLOCK;
 	uint64_t runend_ignore_bits  = bucket_blocks_offset % QF_SLOTS_PER_BLOCK;
 	uint64_t runend_rank         = bucket_intrablock_rank - 1;
-    uint64_t runend_block_offset = bitselectv(get_block(qf, runend_block_index)->runends[0],
+    uint64_t runend_block_offset = bitselectv(BLOCK_RUNENDS(qf, runend_block_index)[0],
                                                         runend_ignore_bits, runend_rank);
 	if (runend_block_offset == QF_SLOTS_PER_BLOCK) {
         if (bucket_blocks_offset == 0 && bucket_intrablock_rank == 0) {
@@ -762,11 +858,11 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
             return hash_bucket_index;
         } else {
             do {
-                runend_rank -= popcntv(get_block(qf, runend_block_index)->runends[0],
+                runend_rank -= popcntv(BLOCK_RUNENDS(qf, runend_block_index)[0],
                                         runend_ignore_bits);
                 runend_block_index++;
                 runend_ignore_bits  = 0;
-                runend_block_offset = bitselectv(get_block(qf, runend_block_index)->runends[0],
+                runend_block_offset = bitselectv(BLOCK_RUNENDS(qf, runend_block_index)[0],
                                                 runend_ignore_bits, runend_rank);
             } while (runend_block_offset == QF_SLOTS_PER_BLOCK);
         }
@@ -782,13 +878,13 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
 
 static inline int offset_lower_bound(const QF *qf, uint64_t slot_index)
 {
-	const qfblock *b = get_block(qf, slot_index / QF_SLOTS_PER_BLOCK);
+	const uint64_t block_index = slot_index / QF_SLOTS_PER_BLOCK;
 	const uint64_t slot_offset = slot_index % QF_SLOTS_PER_BLOCK;
-	const uint64_t boffset = b->offset;
-	const uint64_t occupieds = b->occupieds[0] & BITMASK(slot_offset+1);
+	const uint64_t boffset = BLOCK_OFFSET(qf, block_index);
+	const uint64_t occupieds = BLOCK_OCCUPIEDS(qf, block_index)[0] & BITMASK(slot_offset+1);
 	assert(QF_SLOTS_PER_BLOCK == 64);
 	if (boffset <= slot_offset) {
-		const uint64_t runends = (b->runends[0] & BITMASK(slot_offset)) >> boffset;
+		const uint64_t runends = (BLOCK_RUNENDS(qf, block_index)[0] & BITMASK(slot_offset)) >> boffset;
 		return popcnt(occupieds) - popcnt(runends);
 	}
 	return boffset - slot_offset + popcnt(occupieds);
@@ -875,6 +971,7 @@ static inline void shift_remainders(QF *qf, uint64_t start_index, uint64_t
 	uint64_t empty_offset = empty_index % QF_SLOTS_PER_BLOCK;
 
 	assert (start_index <= empty_index && empty_index < qf->metadata->xnslots);
+	mark_dirty_range(qf, start_index, empty_index);
 
 	while (start_block < empty_block) {
 		memmove(&get_block(qf, empty_block)->slots[1],
@@ -893,7 +990,7 @@ static inline void shift_remainders(QF *qf, uint64_t start_index, uint64_t
 
 #else
 
-#define REMAINDER_WORD(qf, i) ((uint64_t *)&(get_block(qf, (i)/qf->metadata->bits_per_slot)->slots[8 * ((i) % qf->metadata->bits_per_slot)]))
+#define REMAINDER_WORD(qf, i) ((uint64_t *)&(BLOCK_SLOTS(qf, (i)/qf->metadata->bits_per_slot)[8 * ((i) % qf->metadata->bits_per_slot)]))
 
 static inline void shift_remainders(QF *qf, const uint64_t start_index, 
         const uint64_t empty_index)
@@ -902,6 +999,7 @@ static inline void shift_remainders(QF *qf, const uint64_t start_index,
 	const uint64_t first_word = start_index * qf->metadata->bits_per_slot / 64;
 	int bend = ((empty_index + 1) * qf->metadata->bits_per_slot) % 64;
 	const int bstart = (start_index * qf->metadata->bits_per_slot) % 64;
+	mark_dirty_range(qf, start_index, empty_index);
 
     assert(first_word <= last_word);
 	while (last_word != first_word) {
@@ -921,7 +1019,7 @@ void qf_dump_block(const QF *qf, uint64_t i)
 {
 	uint64_t j;
 
-	printf("%-192d", get_block(qf, i)->offset);
+	printf("%-192d", BLOCK_OFFSET(qf, i));
 	printf("\n");
 
 	for (j = 0; j < QF_SLOTS_PER_BLOCK; j++) {
@@ -934,17 +1032,17 @@ void qf_dump_block(const QF *qf, uint64_t i)
 	for (j = 0; j < QF_SLOTS_PER_BLOCK; j++) {
         for (int k = 0; k < qf->metadata->bits_per_slot - 1; k++)
             printf(" ");
-		printf("%d ", (get_block(qf, i)->occupieds[j/64] & (1ULL << (j%64))) ? 1 : 0);
+		printf("%d ", (BLOCK_OCCUPIEDS(qf, i)[j/64] & (1ULL << (j%64))) ? 1 : 0);
     }
-	printf("\npopcnt=%d\n", popcnt(get_block(qf, i)->occupieds[0]));
+	printf("\npopcnt=%d\n", popcnt(BLOCK_OCCUPIEDS(qf, i)[0]));
     puts("______________________________________________________________________");
 
 	for (j = 0; j < QF_SLOTS_PER_BLOCK; j++) {
         for (int k = 0; k < qf->metadata->bits_per_slot - 1; k++)
             printf(" ");
-		printf("%d ", (get_block(qf, i)->runends[j/64] & (1ULL << (j%64))) ? 1 : 0);
+		printf("%d ", (BLOCK_RUNENDS(qf, i)[j/64] & (1ULL << (j%64))) ? 1 : 0);
     }
-	printf("\npopcnt=%d\n", popcnt(get_block(qf, i)->runends[0]));
+	printf("\npopcnt=%d\n", popcnt(BLOCK_RUNENDS(qf, i)[0]));
     puts("______________________________________________________________________");
 
 #if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32
@@ -1080,6 +1178,7 @@ static inline void shift_slots(QF *qf, int64_t first, uint64_t last,
 	if (distance == 1)
 		shift_remainders(qf, first, last+1);
 	else {
+        mark_dirty_range(qf, first, last + distance);
         // Simple implementation
 		//for (i = last; i >= first; i--)
 		//	set_slot(qf, i + distance, get_slot(qf, i));
@@ -1129,8 +1228,8 @@ static inline void shift_slots(QF *qf, int64_t first, uint64_t last,
             x_extra = 8 * sizeof(payload) - x_prefix - move_bits;
             y_extra = 8 * sizeof(payload) - y_prefix - move_bits;
 
-            uint8_t *dest = get_block(qf, y_last_block)->slots + j;
-            uint8_t *src = get_block(qf, x_last_block)->slots + i;
+            uint8_t *dest = BLOCK_SLOTS(qf, y_last_block) + j;
+            uint8_t *src = BLOCK_SLOTS(qf, x_last_block) + i;
             memcpy(&w_i, src, sizeof(w_i));
             memcpy(&w_j, dest, sizeof(w_j));
             payload = (w_j & (BITMASK(y_prefix) | (BITMASK(y_extra) << (64 - y_extra))))
@@ -1168,21 +1267,21 @@ static inline void shift_runends(QF *qf, int64_t first, uint64_t last,
         // overwriting parts of the bitmap that it shouldn't have touched. The
         // issue came up when `distance > 1`, and is fixed now.
         const uint64_t first_runends_replacement = METADATA_WORD(qf, runends, first) & (~BITMASK(bstart));
-        METADATA_WORD(qf, runends, 64*last_word) = shift_into_b((last_word == first_word + 1 ? first_runends_replacement
+        MUTABLE_METADATA_WORD(qf, runends, 64*last_word) = shift_into_b((last_word == first_word + 1 ? first_runends_replacement
                                                                                              : METADATA_WORD(qf, runends, 64*(last_word-1))),
                                                                 METADATA_WORD(qf, runends, 64*last_word),
                                                                 0, bend, distance);
         bend = 64;
         last_word--;
         while (last_word != first_word) {
-            METADATA_WORD(qf, runends, 64*last_word) = shift_into_b((last_word == first_word + 1 ? first_runends_replacement
+            MUTABLE_METADATA_WORD(qf, runends, 64*last_word) = shift_into_b((last_word == first_word + 1 ? first_runends_replacement
                                                                                              : METADATA_WORD(qf, runends, 64*(last_word-1))),
                                                                     METADATA_WORD(qf, runends, 64*last_word),
                                                                     0, bend, distance);
             last_word--;
         }
     }
-    METADATA_WORD(qf, runends, 64*last_word) = shift_into_b(0LL, METADATA_WORD(qf, runends, 64*last_word),
+    MUTABLE_METADATA_WORD(qf, runends, 64*last_word) = shift_into_b(0LL, METADATA_WORD(qf, runends, 64*last_word),
                                                             bstart, bend, distance);
 
 }
@@ -1213,14 +1312,14 @@ static inline bool insert_replace_slots_and_shift_remainders_and_runends_and_off
 		shift_runends(qf, insert_index, empties[ninserts - 1] - 1, ninserts);
 
 		for (i = noverwrites; i < total_remainders - 1; i++)
-            METADATA_WORD(qf, runends, overwrite_index + i) &= ~(1ULL <<
+            MUTABLE_METADATA_WORD(qf, runends, overwrite_index + i) &= ~(1ULL <<
                                 (((overwrite_index + i) % QF_SLOTS_PER_BLOCK)
                                 % 64));
 
 		switch (operation) {
 			case 0: /* insert into empty bucket */
 				assert (noverwrites == 0);
-				METADATA_WORD(qf, runends, overwrite_index + total_remainders - 1) |=
+				MUTABLE_METADATA_WORD(qf, runends, overwrite_index + total_remainders - 1) |=
 					1ULL << (((overwrite_index + total_remainders - 1) %
 										QF_SLOTS_PER_BLOCK) % 64);
 				break;
@@ -1228,12 +1327,12 @@ static inline bool insert_replace_slots_and_shift_remainders_and_runends_and_off
 				METADATA_WORD(qf, runends, overwrite_index + noverwrites - 1)      &=
 					~(1ULL << (((overwrite_index + noverwrites - 1) % QF_SLOTS_PER_BLOCK) %
 										 64));
-				METADATA_WORD(qf, runends, overwrite_index + total_remainders - 1) |=
+				MUTABLE_METADATA_WORD(qf, runends, overwrite_index + total_remainders - 1) |=
 					1ULL << (((overwrite_index + total_remainders - 1) %
 										QF_SLOTS_PER_BLOCK) % 64);
 				break;
 			case 2: /* insert into bucket */
-				METADATA_WORD(qf, runends, overwrite_index + total_remainders - 1) &=
+				MUTABLE_METADATA_WORD(qf, runends, overwrite_index + total_remainders - 1) &=
 					~(1ULL << (((overwrite_index + total_remainders - 1) %
 											QF_SLOTS_PER_BLOCK) % 64));
 				break;
@@ -1248,10 +1347,10 @@ static inline bool insert_replace_slots_and_shift_remainders_and_runends_and_off
 						 empties[ninserts - 1 - npreceding_empties]  / QF_SLOTS_PER_BLOCK < i)
 				npreceding_empties++;
 
-			if (get_block(qf, i)->offset + ninserts - npreceding_empties < BITMASK(8*sizeof(qf->blocks[0].offset)))
-				get_block(qf, i)->offset += ninserts - npreceding_empties;
+			if (BLOCK_OFFSET(qf, i) + ninserts - npreceding_empties < BITMASK(8*sizeof(qf->blocks[0].offset)))
+				MUTABLE_BLOCK_OFFSET(qf, i) += ninserts - npreceding_empties;
 			else
-				get_block(qf, i)->offset = (uint8_t) BITMASK(8*sizeof(qf->blocks[0].offset));
+				MUTABLE_BLOCK_OFFSET(qf, i) = (qf_block_offset_t) BITMASK(8*sizeof(qf->blocks[0].offset));
 		}
 	}
 
@@ -1271,7 +1370,7 @@ static inline int32_t remove_slots_and_shift_remainders_and_runends_and_offsets(
     // If this is the last thing in its run, then we may need to set a new runend bit
     const bool was_runend = is_runend(qf, remove_index + remove_length - 1);
     if (was_runend && !only_item_in_run)
-        METADATA_WORD(qf, runends, remove_index - 1) |= 1ULL << ((remove_index - 1) % 64);
+        MUTABLE_METADATA_WORD(qf, runends, remove_index - 1) |= 1ULL << ((remove_index - 1) % 64);
 
     // shift slots back one run at a time
     uint64_t original_bucket = bucket_index;
@@ -1313,10 +1412,10 @@ static inline int32_t remove_slots_and_shift_remainders_and_runends_and_offsets(
         for (i = remove_index; i < current_slot; i++) {
             set_slot(qf, i, get_slot(qf, i + 1));
             if (is_runend(qf, i) != is_runend(qf, i + 1))
-                METADATA_WORD(qf, runends, i) ^= 1ULL << (i % 64);
+                MUTABLE_METADATA_WORD(qf, runends, i) ^= 1ULL << (i % 64);
         }
         set_slot(qf, i, 0);
-        METADATA_WORD(qf, runends, i) &= ~(1ULL << (i % 64));
+        MUTABLE_METADATA_WORD(qf, runends, i) &= ~(1ULL << (i % 64));
 
         current_distance--;
     }
@@ -1324,7 +1423,7 @@ static inline int32_t remove_slots_and_shift_remainders_and_runends_and_offsets(
     // reset the occupied bit of the hash bucket index if the hash is the
     // only item in the run and is removed completely.
     if (only_item_in_run)
-        METADATA_WORD(qf, occupieds, bucket_index) &= ~(1ULL << (bucket_index % 64));
+        MUTABLE_METADATA_WORD(qf, occupieds, bucket_index) &= ~(1ULL << (bucket_index % 64));
 
     // update the offset bits.
     // find the number of occupied slots in the original_bucket block.
@@ -1339,11 +1438,11 @@ static inline int32_t remove_slots_and_shift_remainders_and_runends_and_offsets(
             // runend spans across the block
             // update the offset of the next block
             if (runend_index / QF_SLOTS_PER_BLOCK == original_block) { // if the run ends in the same block
-                get_block(qf, original_block + 1)->offset = 0;
+                MUTABLE_BLOCK_OFFSET(qf, original_block + 1) = 0;
             } else { // if the last run spans across the block
                 const uint32_t max_offset = (uint32_t) BITMASK(8 * sizeof(qf->blocks[0].offset));
                 const uint32_t new_offset = runend_index - last_occupieds_hash_index;
-                get_block(qf, original_block + 1)->offset = new_offset < max_offset ? new_offset : max_offset;
+                MUTABLE_BLOCK_OFFSET(qf, original_block + 1) = new_offset < max_offset ? new_offset : max_offset;
             }
             original_block++;
         }
@@ -1365,9 +1464,9 @@ static inline int32_t make_empty_slot_for_memento_list(QF *qf,
     shift_runends(qf, pos - 1, next_empty - 1, 1);
     for (uint32_t i = bucket_index / QF_SLOTS_PER_BLOCK + 1; 
             i <= next_empty / QF_SLOTS_PER_BLOCK; i++) {
-        if (get_block(qf, i)->offset + 1
+        if (BLOCK_OFFSET(qf, i) + 1
                 <= BITMASK(8 * sizeof(qf->blocks[0].offset)))
-            get_block(qf, i)->offset++;
+            MUTABLE_BLOCK_OFFSET(qf, i)++;
     }
     modify_metadata(qf, &qf->metadata->noccupied_slots, 1);
     return 0;
@@ -1426,11 +1525,11 @@ static inline int32_t make_n_empty_slots_for_memento_list(QF *qf,
                 break;
             }
         }
-        if (get_block(qf, i)->offset + n - npreceding_empties 
+        if (BLOCK_OFFSET(qf, i) + n - npreceding_empties 
                 < BITMASK(8 * sizeof(qf->blocks[0].offset)))
-            get_block(qf, i)->offset += n - npreceding_empties;
+            MUTABLE_BLOCK_OFFSET(qf, i) += n - npreceding_empties;
         else
-            get_block(qf, i)->offset = BITMASK(8 * sizeof(qf->blocks[0].offset));
+            MUTABLE_BLOCK_OFFSET(qf, i) = BITMASK(8 * sizeof(qf->blocks[0].offset));
     }
     modify_metadata(qf, &qf->metadata->noccupied_slots, n);
 
@@ -2043,6 +2142,67 @@ static inline uint64_t next_matching_fingerprint_in_run(const QF *qf, uint64_t p
     return pos;
 }
 
+// Whether the fingerprint `stored` of an expandable filter, which may have
+// lost some of its bits in doublings, is a prefix of `fingerprint`. The top
+// set bit of both marks their length.
+// NEW IN MEMENTO
+static inline bool fingerprint_extends(const uint64_t stored, const uint64_t fingerprint)
+{
+    const uint64_t stored_len = highbit_position(stored);
+    return stored_len <= highbit_position(fingerprint)
+            && ((stored ^ fingerprint) & BITMASK(stored_len)) == 0;
+}
+
+// Same as next_matching_fingerprint_in_run, but an expandable filter also
+// matches the shortened fingerprints that `fingerprint` extends. They sort
+// before the longer ones, so the shortest match comes first.
+__attribute__((always_inline))
+static inline uint64_t next_compatible_fingerprint_in_run(const QF *qf, uint64_t pos,
+        const uint64_t fingerprint)     // NEW IN MEMENTO
+{
+    if (!qf->metadata->expandable)
+        return next_matching_fingerprint_in_run(qf, pos, fingerprint);
+
+    uint64_t current_fingerprint, current_memento;
+    uint64_t next_fingerprint, next_memento;
+    while (true) {
+        current_fingerprint = GET_FINGERPRINT(qf, pos);
+        current_memento = GET_MEMENTO(qf, pos);
+        if (fingerprint < current_fingerprint)
+            return -1;
+
+        pos++;
+        if (fingerprint_extends(current_fingerprint, fingerprint))
+            return pos - 1;
+        else if (is_runend(qf, pos - 1))
+            return -1;
+
+        next_fingerprint = GET_FINGERPRINT(qf, pos);
+        if (current_fingerprint > next_fingerprint) {
+            next_memento = GET_MEMENTO(qf, pos);
+            pos++;
+            if (current_memento >= next_memento) {
+                // Mementos encoded as a sorted list
+                pos += number_of_slots_used_for_memento_list(qf, pos);
+            }
+            if (is_runend(qf, pos - 1)) {
+                return -1;
+            }
+        }
+    }
+    return pos;
+}
+
+// The positive result of a query whose `fingerprint` matched the stored
+// `current_fingerprint`: 2 if the match is a shortened fingerprint, which
+// can be rejuvenated, and 1 otherwise.
+// NEW IN MEMENTO
+static inline int match_result(const QF *qf, const uint64_t current_fingerprint,
+                                const uint64_t fingerprint)
+{
+    return (qf->metadata->expandable && current_fingerprint != fingerprint) ? 2 : 1;
+}
+
 static inline uint64_t lower_bound_fingerprint_in_run(const QF *qf, uint64_t pos,
         uint64_t fingerprint)   // NEW IN MEMENTO
 {
@@ -2102,17 +2262,109 @@ static inline uint64_t upper_bound_fingerprint_in_run(const QF *qf, uint64_t pos
     return pos;
 }
 
+/*
+ * The low `original_quotient_bits` bits of a hash are reduced to one of the
+ * `original_nslots` original quotients, i.e., the home slots that the filter
+ * had when it was created. Every time the filter doubles, the quotients are
+ * extended by a hash bit taken from the bottom of the fingerprint, which
+ * becomes the top bit of the quotient extension. In between, the filter can
+ * grow by a fraction of its size: out of every QF_SPLIT_GROUP_SIZE home slots,
+ * the first `split_buckets` ones are split in two adjacent home slots using
+ * the bottom bit of their fingerprints. Spreading the split home slots evenly
+ * keeps the load of the filter uniform.
+ */
+
+// Number of extension bits of the quotients.
+// NEW IN MEMENTO
+static inline uint64_t get_extension_bits(const QF *qf)
+{
+    return qf->metadata->key_bits - qf->metadata->fingerprint_bits 
+                - qf->metadata->original_quotient_bits;
+}
+
+// Number of split home slots before home slot `bucket` of the unsplit filter.
+// NEW IN MEMENTO
+static inline uint64_t split_bucket_count(const uint64_t bucket, const uint64_t split_buckets)
+{
+    const uint64_t group_pos = bucket & BITMASK(QF_SPLIT_GROUP_BITS);
+    return (bucket >> QF_SPLIT_GROUP_BITS) * split_buckets 
+                + (group_pos < split_buckets ? group_pos : split_buckets);
+}
+
+// Replaces the low bits of `hash` by its fast-reduced original quotient.
+// Filters with 2^32 original home slots or more reduce their quotients with
+// a 64-bit multiplication, since the count does not fit in 32 bits.
+// NEW IN MEMENTO
+static inline uint64_t reduce_hash(const QF *qf, const uint64_t hash)
+{
+    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
+    const uint64_t orig_quotient = hash & BITMASK(orig_quotient_size);
+    const uint64_t fast_reduced_part = (qf->metadata->original_nslots > UINT32_MAX
+            ? fast_reduce_64(orig_quotient << (64 - orig_quotient_size), 
+                            qf->metadata->original_nslots)
+            : fast_reduce(orig_quotient << (32 - orig_quotient_size), 
+                            qf->metadata->original_nslots));
+    return (hash & ~BITMASK(orig_quotient_size)) | fast_reduced_part;
+}
+
+// Maps an (already fast-reduced) hash to its home slot and fingerprint in `qf`.
+// NEW IN MEMENTO
+static inline void hash_to_bucket_and_fingerprint(const QF *qf, const uint64_t hash,
+                                    uint64_t *bucket, uint64_t *fingerprint)
+{
+    uint32_t bucket_index_hash_size = qf->metadata->key_bits - qf->metadata->fingerprint_bits;
+    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
+	*bucket = ((hash & BITMASK(orig_quotient_size)) << (bucket_index_hash_size - orig_quotient_size))
+                | ((hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
+    const uint64_t split_buckets = qf->metadata->split_buckets;
+    if (split_buckets) {
+        const bool is_split = (*bucket & BITMASK(QF_SPLIT_GROUP_BITS)) < split_buckets;
+        *bucket += split_bucket_count(*bucket, split_buckets);
+        if (is_split)
+            *bucket += (hash >> bucket_index_hash_size++) & 1;
+    }
+    *fingerprint = (hash >> bucket_index_hash_size) 
+                        & BITMASK(qf->metadata->key_bits - bucket_index_hash_size);
+    // The fingerprints of expandable filters carry a marker bit above them
+    if (qf->metadata->expandable)
+        *fingerprint |= 1ULL << (qf->metadata->key_bits - bucket_index_hash_size);
+}
+
+// Inverse of hash_to_bucket_and_fingerprint: returns the hash bits that
+// determine home slot `bucket`, and the position of the fingerprint in the hash.
+// NEW IN MEMENTO
+static inline uint64_t bucket_to_hash(const QF *qf, uint64_t bucket, 
+                                    uint32_t *fingerprint_shift)
+{
+    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
+    const uint64_t extension_bits = get_extension_bits(qf);
+    const uint64_t split_buckets = qf->metadata->split_buckets;
+    uint64_t split_hash_bit = 0;
+    *fingerprint_shift = orig_quotient_size + extension_bits;
+    if (split_buckets) {
+        const uint64_t group_size = QF_SPLIT_GROUP_SIZE + split_buckets;
+        const uint64_t group = bucket / group_size;
+        const uint64_t group_pos = bucket - group * group_size;
+        if (group_pos < 2 * split_buckets) {
+            bucket = (group << QF_SPLIT_GROUP_BITS) + group_pos / 2;
+            split_hash_bit = (group_pos & 1ULL) << (*fingerprint_shift)++;
+        }
+        else
+            bucket = (group << QF_SPLIT_GROUP_BITS) + group_pos - split_buckets;
+    }
+    return (bucket >> extension_bits) 
+                | ((bucket & BITMASK(extension_bits)) << orig_quotient_size)
+                | split_hash_bit;
+}
+
 static inline int insert_mementos(QF *qf, const __uint128_t hash,
         const uint64_t mementos[], const uint64_t memento_count, 
         const uint32_t actual_fingerprint_size, const uint8_t runtime_lock)     // NEW IN MEMENTO
 {
 	int ret_distance = 0;
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - qf->metadata->fingerprint_bits;
-    const uint64_t hash_fingerprint = (hash >> bucket_index_hash_size) 
-                                            & BITMASK(actual_fingerprint_size);
-    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
-	const uint64_t hash_bucket_index = ((hash & BITMASK(orig_quotient_size)) << (bucket_index_hash_size - orig_quotient_size))
-                        | ((hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
+    uint64_t hash_bucket_index, hash_fingerprint;
+    hash_to_bucket_and_fingerprint(qf, hash, &hash_bucket_index, &hash_fingerprint);
+    hash_fingerprint &= BITMASK(actual_fingerprint_size);
 
 
 #ifdef DEBUG
@@ -2219,11 +2471,11 @@ static inline int insert_mementos(QF *qf, const __uint128_t hash,
             }
         }
 
-        if (get_block(qf, i)->offset + new_slot_count - npreceding_empties 
+        if (BLOCK_OFFSET(qf, i) + new_slot_count - npreceding_empties 
                                 < BITMASK(8 * sizeof(qf->blocks[0].offset)))
-            get_block(qf, i)->offset += new_slot_count - npreceding_empties;
+            MUTABLE_BLOCK_OFFSET(qf, i) += new_slot_count - npreceding_empties;
         else
-            get_block(qf, i)->offset = BITMASK(8 * sizeof(qf->blocks[0].offset));
+            MUTABLE_BLOCK_OFFSET(qf, i) = BITMASK(8 * sizeof(qf->blocks[0].offset));
     }
 
     uint64_t runend_index = run_end(qf, hash_bucket_index);
@@ -2238,9 +2490,9 @@ static inline int insert_mementos(QF *qf, const __uint128_t hash,
             shift_slots(qf, insert_index, empty_runs[0] - 1, new_slot_count);
             shift_runends(qf, insert_index, empty_runs[0] - 1, new_slot_count);
         }
-        METADATA_WORD(qf, runends, runend_index) &= ~(1ULL << 
+        MUTABLE_METADATA_WORD(qf, runends, runend_index) &= ~(1ULL << 
                 ((runend_index % QF_SLOTS_PER_BLOCK) % 64));
-        METADATA_WORD(qf, runends, runend_index + new_slot_count) |= 1ULL << 
+        MUTABLE_METADATA_WORD(qf, runends, runend_index + new_slot_count) |= 1ULL << 
                 (((runend_index + new_slot_count) % QF_SLOTS_PER_BLOCK) % 64);
     }
     else {
@@ -2255,9 +2507,9 @@ static inline int insert_mementos(QF *qf, const __uint128_t hash,
             }
         }
 
-        METADATA_WORD(qf, runends, insert_index + new_slot_count - 1) |= 1ULL << 
+        MUTABLE_METADATA_WORD(qf, runends, insert_index + new_slot_count - 1) |= 1ULL << 
                 (((insert_index + new_slot_count - 1) % QF_SLOTS_PER_BLOCK) % 64);
-        METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
+        MUTABLE_METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
                 ((hash_bucket_index % QF_SLOTS_PER_BLOCK) % 64);
     }
 
@@ -2279,45 +2531,318 @@ static inline int insert_mementos(QF *qf, const __uint128_t hash,
  * Code that uses the above to implement fingerprint-memento operations. *
  *************************************************************************/
 
+// Rounds `nslots` up to the next size that a filter with `orig_nslots`
+// original quotients can have, and returns the corresponding number of
+// extension bits and split home slots.
+// NEW IN MEMENTO
+static inline uint64_t round_to_split_size(const uint64_t orig_nslots, const uint64_t nslots,
+                            uint64_t *extension_bits, uint64_t *split_buckets)
+{
+    *extension_bits = 0;
+    while ((orig_nslots << (*extension_bits + 1)) <= nslots)
+        (*extension_bits)++;
+    const uint64_t unsplit_nslots = orig_nslots << *extension_bits;
+    *split_buckets = 0;
+    while (unsplit_nslots + split_bucket_count(unsplit_nslots, *split_buckets) < nslots)
+        (*split_buckets)++;
+    if (*split_buckets == QF_SPLIT_GROUP_SIZE) {
+        (*extension_bits)++;
+        *split_buckets = 0;
+        return unsplit_nslots << 1;
+    }
+    return unsplit_nslots + split_bucket_count(unsplit_nslots, *split_buckets);
+}
+
+/*
+ * In the cache-aligned block layout, every block is padded to a multiple of
+ * the cache line size, and starts QF_BLOCK_ALIGNMENT_SHIFT bytes into its
+ * first line: the offset then fills the end of an 8-byte word, the
+ * occupieds and runends words are 8-byte aligned, and a block never shares a
+ * line with its neighbors. The blocks start at a cache line boundary of the
+ * buffer, so the buffer itself should be cache line aligned.
+ */
+/*
+ * In the split block layout, the offsets, the occupieds, the runends and the
+ * slots of all blocks are stored in four separate dense arrays, each starting
+ * at a cache line boundary. Scans over the metadata bitmaps, e.g., when
+ * looking for the end of a run or for an empty slot, then touch only the
+ * bitmaps and not the slots in between them.
+ */
+#define QF_CACHE_LINE_SIZE (64)
+#define QF_BLOCK_ALIGNMENT_SHIFT (sizeof(uint64_t) - sizeof(qf_block_offset_t))
+
+// Size in bytes of a block.
+// NEW IN MEMENTO
+static inline uint64_t block_size_for_layout(const enum qf_block_layout layout,
+                                            const uint64_t bits_per_slot)
+{
+#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
+	assert(layout == QF_BLOCK_LAYOUT_PACKED);
+	return sizeof(qfblock);
+#else
+	const uint64_t packed_size = sizeof(qfblock) + QF_SLOTS_PER_BLOCK * bits_per_slot / 8;
+	if (layout == QF_BLOCK_LAYOUT_PACKED || layout == QF_BLOCK_LAYOUT_SPLIT)
+		return packed_size;
+	return (QF_BLOCK_ALIGNMENT_SHIFT + packed_size + QF_CACHE_LINE_SIZE - 1) 
+                / QF_CACHE_LINE_SIZE * QF_CACHE_LINE_SIZE;
+#endif
+}
+
+// Position of the first block relative to the start of the buffer.
+// NEW IN MEMENTO
+static inline uint64_t blocks_offset_for_layout(const enum qf_block_layout layout)
+{
+	if (layout == QF_BLOCK_LAYOUT_PACKED)
+		return sizeof(qfmetadata);
+	const uint64_t aligned_offset = (sizeof(qfmetadata) + QF_CACHE_LINE_SIZE - 1) 
+                                    / QF_CACHE_LINE_SIZE * QF_CACHE_LINE_SIZE;
+	if (layout == QF_BLOCK_LAYOUT_SPLIT)
+		return aligned_offset;
+	return aligned_offset + QF_BLOCK_ALIGNMENT_SHIFT;
+}
+
+// Where the offsets, occupieds, runends and slots of each block are placed
+// relative to the first block. Returns the size in bytes of all blocks.
+// NEW IN MEMENTO
+static inline uint64_t layout_block_arrays(const enum qf_block_layout layout,
+        const uint64_t nblocks, const uint64_t bits_per_slot, qf_array_layout *offsets,
+        qf_array_layout *occupieds, qf_array_layout *runends, qf_array_layout *slots)
+{
+	const uint64_t block_size = block_size_for_layout(layout, bits_per_slot);
+	if (layout != QF_BLOCK_LAYOUT_SPLIT) {
+		offsets->start = 0;
+		occupieds->start = sizeof(qf_block_offset_t);
+		runends->start = occupieds->start + QF_METADATA_WORDS_PER_BLOCK * sizeof(uint64_t);
+		slots->start = sizeof(qfblock);
+		offsets->stride = occupieds->stride = runends->stride = slots->stride = block_size;
+		return nblocks * block_size;
+	}
+
+#define ROUND_TO_CACHE_LINE(x) (((x) + QF_CACHE_LINE_SIZE - 1) / QF_CACHE_LINE_SIZE * QF_CACHE_LINE_SIZE)
+	assert(QF_BITS_PER_SLOT == 0);
+	offsets->stride = sizeof(qf_block_offset_t);
+	occupieds->stride = runends->stride = QF_METADATA_WORDS_PER_BLOCK * sizeof(uint64_t);
+	slots->stride = QF_SLOTS_PER_BLOCK * bits_per_slot / 8;
+	offsets->start = 0;
+	occupieds->start = offsets->start + ROUND_TO_CACHE_LINE(nblocks * offsets->stride);
+	runends->start = occupieds->start + ROUND_TO_CACHE_LINE(nblocks * occupieds->stride);
+	slots->start = runends->start + ROUND_TO_CACHE_LINE(nblocks * runends->stride);
+	// The slots are read a word at a time, so leave a word of slack at the end
+	return slots->start + ROUND_TO_CACHE_LINE(nblocks * slots->stride + sizeof(uint64_t));
+#undef ROUND_TO_CACHE_LINE
+}
+
+/*
+ * Allocator hooks. Everything a filter allocates on the heap, i.e., its
+ * runtime data, its locks and bitmaps, the scratch space of resizes, and its
+ * table unless it is mapped with mmap, comes from the hooks stored in its
+ * runtime data. Failures are reported to the caller instead of terminating
+ * the process.
+ */
+
+// NEW IN MEMENTO
+static void *system_alloc(void *ctx, size_t size, size_t alignment)
+{
+	(void)ctx;
+	if (alignment <= sizeof(uint64_t))
+		return malloc(size);
+	void *ptr;
+	if (posix_memalign(&ptr, alignment, size) != 0)
+		return NULL;
+	return ptr;
+}
+
+// NEW IN MEMENTO
+static void *system_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size,
+                            size_t alignment)
+{
+	(void)ctx;
+	if (alignment <= sizeof(uint64_t))
+		return realloc(ptr, new_size);
+	void *new_ptr;
+	if (posix_memalign(&new_ptr, alignment, new_size) != 0)
+		return NULL;
+	memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+	free(ptr);
+	return new_ptr;
+}
+
+// NEW IN MEMENTO
+static void system_free(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+static const qf_allocator system_allocator = {system_alloc, system_realloc, system_free, NULL};
+
+// NEW IN MEMENTO
+static inline void *qf_alloc(const qf_allocator *allocator, const size_t size,
+                             const size_t alignment)
+{
+	return allocator->alloc(allocator->ctx, size, alignment);
+}
+
+// NEW IN MEMENTO
+static inline void *qf_zalloc(const qf_allocator *allocator, const size_t size,
+                              const size_t alignment)
+{
+	void *ptr = allocator->alloc(allocator->ctx, size, alignment);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+// Resizes a block from `allocator`. On failure, returns NULL and leaves the
+// block untouched.
+// NEW IN MEMENTO
+static inline void *qf_realloc(const qf_allocator *allocator, void *ptr, const size_t old_size,
+                               const size_t new_size, const size_t alignment)
+{
+	if (ptr == NULL)
+		return allocator->alloc(allocator->ctx, new_size, alignment);
+	if (allocator->realloc != NULL)
+		return allocator->realloc(allocator->ctx, ptr, old_size, new_size, alignment);
+	void *new_ptr = allocator->alloc(allocator->ctx, new_size, alignment);
+	if (new_ptr == NULL)
+		return NULL;
+	memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+	allocator->free(allocator->ctx, ptr, old_size);
+	return new_ptr;
+}
+
+// NEW IN MEMENTO
+static inline void qf_dealloc(const qf_allocator *allocator, void *ptr, const size_t size)
+{
+	if (ptr != NULL)
+		allocator->free(allocator->ctx, ptr, size);
+}
+
+// Allocates zeroed runtime data for `qf` from `allocator`.
+// NEW IN MEMENTO
+static bool alloc_runtime(QF *qf, const qf_allocator *allocator)
+{
+	qf->runtimedata = (qfruntime *)qf_zalloc(allocator, sizeof(qfruntime), sizeof(uint64_t));
+	if (qf->runtimedata == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for runtime data.\n");
+		return false;
+	}
+	qf->runtimedata->allocator = *allocator;
+	return true;
+}
+
+// The number of slots of a filter with `nslots` home slots, including the
+// slots that the last runs spill into.
+// NEW IN MEMENTO
+static inline uint64_t xnslots_for(const uint64_t nslots)
+{
+	return nslots + 10 * sqrt((double) nslots);
+}
+
+// The number of locks of a filter with `xnslots` slots.
+// NEW IN MEMENTO
+static inline uint64_t num_locks_for(const uint64_t xnslots)
+{
+	return xnslots / NUM_SLOTS_TO_LOCK + 2;
+}
+
+// The size of the lock array, which holds the metadata lock after the locks.
+// NEW IN MEMENTO
+static inline uint64_t lock_array_bytes(const uint64_t num_locks)
+{
+	return (num_locks + 1) * sizeof(volatile int);
+}
+
+// Sizes and allocates the locks of `qf` from its metadata.
+// NEW IN MEMENTO
+static bool init_runtime_locks(QF *qf)
+{
+	const qf_allocator *allocator = &qf->runtimedata->allocator;
+	qf->runtimedata->num_locks = num_locks_for(qf->metadata->xnslots);
+
+	/* initialize all the locks to 0 */
+	qf->runtimedata->locks = (volatile int *)qf_zalloc(allocator, 
+                                    lock_array_bytes(qf->runtimedata->num_locks),
+                                    sizeof(uint64_t));
+	if (qf->runtimedata->locks == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for runtime locks.\n");
+		return false;
+	}
+	qf->runtimedata->metadata_lock = &qf->runtimedata->locks[qf->runtimedata->num_locks];
+	qf->runtimedata->shared_locks = false;
+#ifdef LOG_WAIT_TIME
+	qf->runtimedata->wait_times = (wait_time_data *)qf_zalloc(allocator, 
+                                    (qf->runtimedata->num_locks + 1) * sizeof(wait_time_data),
+                                    sizeof(uint64_t));
+	if (qf->runtimedata->wait_times == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for runtime wait_times.\n");
+		qf_dealloc(allocator, (void *)qf->runtimedata->locks,
+                    lock_array_bytes(qf->runtimedata->num_locks));
+		return false;
+	}
+#endif
+	return true;
+}
+
 static inline uint64_t init_filter(QF *qf, uint64_t nslots, uint64_t key_bits,
         uint64_t memento_bits, enum qf_hashmode hash_mode, uint32_t seed,
-        void *buffer, uint64_t buffer_len, const uint64_t orig_quotient_bit_cnt)    // NEW IN MEMENTO
+        void *buffer, uint64_t buffer_len, const uint64_t orig_quotient_bit_cnt,
+        const uint64_t orig_nslots, const enum qf_block_layout layout,
+        const bool expandable, const bool buffer_is_zeroed)    // NEW IN MEMENTO
 {
 	uint64_t num_slots, xnslots, nblocks;
 	uint64_t fingerprint_bits, bits_per_slot;
+	uint64_t split_buckets = 0;
 	uint64_t size;
 	uint64_t total_num_bytes;
 
+	if (orig_nslots) {
+        uint64_t extension_bits;
+        nslots = round_to_split_size(orig_nslots, nslots, &extension_bits, &split_buckets);
+        assert(key_bits > orig_quotient_bit_cnt + extension_bits);
+        fingerprint_bits = key_bits - orig_quotient_bit_cnt - extension_bits;
+    }
+
     /* nslots can be any number now, as opposed to just being able to be a power of 2! */
 	num_slots = nslots;
-	xnslots = nslots + 10 * sqrt((double) nslots);
+	xnslots = xnslots_for(nslots);
 	nblocks = (xnslots + QF_SLOTS_PER_BLOCK - 1) / QF_SLOTS_PER_BLOCK;
-	fingerprint_bits = key_bits;
-	while (nslots > 1) {
-		assert(fingerprint_bits > 0);
-		fingerprint_bits--;
-		nslots >>= 1;
-	}
-    fingerprint_bits -= (popcnt(num_slots) > 1);
+	if (!orig_nslots) {
+        fingerprint_bits = key_bits;
+        while (nslots > 1) {
+            assert(fingerprint_bits > 0);
+            fingerprint_bits--;
+            nslots >>= 1;
+        }
+        fingerprint_bits -= (popcnt(num_slots) > 1);
+    }
 
-	bits_per_slot = fingerprint_bits + memento_bits;
+	// Expandable filters spend a bit per slot on the length of the fingerprint
+	assert(key_bits <= 64);
+	bits_per_slot = fingerprint_bits + memento_bits + (expandable ? 1 : 0);
 	assert(QF_BITS_PER_SLOT == 0 || QF_BITS_PER_SLOT == bits_per_slot);
 	assert(bits_per_slot > 1);
-#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
-	size = nblocks * sizeof(qfblock);
-#else
-	size = nblocks * (sizeof(qfblock) + QF_SLOTS_PER_BLOCK * bits_per_slot / 8);
-#endif
+	const uint64_t block_size = block_size_for_layout(layout, bits_per_slot);
+	qf_array_layout offsets, occupieds, runends, slots;
+	size = layout_block_arrays(layout, nblocks, bits_per_slot, &offsets, &occupieds,
+                               &runends, &slots);
 
-	total_num_bytes = sizeof(qfmetadata) + size;
+	total_num_bytes = blocks_offset_for_layout(layout) + size;
 	if (buffer == NULL || total_num_bytes > buffer_len)
 		return total_num_bytes;
-	memset(buffer, 0, total_num_bytes);
+	if (!buffer_is_zeroed)
+		memset(buffer, 0, total_num_bytes);
 	qf->metadata = (qfmetadata *)(buffer);
-	qf->blocks = (qfblock *)(qf->metadata + 1);
+	qf->blocks = (qfblock *)((char *)buffer + blocks_offset_for_layout(layout));
 
 	qf->metadata->magic_endian_number = MAGIC_NUMBER;
 	qf->metadata->auto_resize = 0;
+	qf->metadata->max_load_factor = MAX_LOAD_FACTOR;
+	qf->metadata->max_probe_distance = DISTANCE_FROM_HOME_SLOT_CUTOFF;
+	qf->metadata->growth_factor = 2.0;
+	qf->metadata->auto_shrink = 0;
+	qf->metadata->shrink_load_factor = SHRINK_LOAD_FACTOR;
 	qf->metadata->hash_mode = hash_mode;
 	qf->metadata->total_size_in_bytes = size;
 	qf->metadata->seed = seed;
@@ -2327,9 +2852,19 @@ static inline uint64_t init_filter(QF *qf, uint64_t nslots, uint64_t key_bits,
 	qf->metadata->original_quotient_bits = (orig_quotient_bit_cnt ?
                                               orig_quotient_bit_cnt 
                                             : key_bits - fingerprint_bits);
+	qf->metadata->original_nslots = (orig_nslots ? orig_nslots : num_slots);
+	qf->metadata->split_buckets = split_buckets;
 	qf->metadata->memento_bits = memento_bits;
 	qf->metadata->fingerprint_bits = fingerprint_bits;
+	qf->metadata->expandable = expandable ? 1 : 0;
 	qf->metadata->bits_per_slot = bits_per_slot;
+	qf->metadata->block_layout = layout;
+	qf->metadata->block_size = block_size;
+	qf->metadata->offsets_layout = offsets;
+	qf->metadata->occupieds_layout = occupieds;
+	qf->metadata->runends_layout = runends;
+	qf->metadata->slots_layout = slots;
+	qf->metadata->block_offset_width = QF_BLOCK_OFFSET_WIDTH;
 
 	qf->metadata->range = qf->metadata->nslots;
 	qf->metadata->range <<= qf->metadata->fingerprint_bits \
@@ -2340,25 +2875,15 @@ static inline uint64_t init_filter(QF *qf, uint64_t nslots, uint64_t key_bits,
 	qf->metadata->ndistinct_elts = 0;
 	qf->metadata->noccupied_slots = 0;
 
-	qf->runtimedata->num_locks = (qf->metadata->xnslots / NUM_SLOTS_TO_LOCK) + 2;
+	qf->runtimedata->f_info.fd = -1;
 	qf->runtimedata->f_info.filepath = NULL;
-
-	/* initialize all the locks to 0 */
-	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks, 
-                                                    sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data *)calloc(qf->runtimedata->num_locks + 1,
-														    sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
-	}
-#endif
+	qf->runtimedata->dirty_regions = NULL;
+	qf->runtimedata->snapshot_dirty_regions = NULL;
+	qf->runtimedata->snapshot_base = NULL;
+	qf->runtimedata->resize_callback = NULL;
+	qf->runtimedata->resize_callback_arg = NULL;
+	if (!init_runtime_locks(qf))
+		return 0;
 	return total_num_bytes;
 }
 
@@ -2366,245 +2891,2554 @@ uint64_t qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t memento_bi
                  enum qf_hashmode hash_mode, uint32_t seed, void *buffer,
                  uint64_t buffer_len)   // NEW IN MEMENTO
 {
+    const uint64_t total_num_bytes = init_filter(qf, nslots, key_bits, memento_bits, hash_mode,
+                                                seed, NULL, 0, 0, 0, QF_BLOCK_LAYOUT_PACKED, false,
+                                                false);
+    if (buffer == NULL || total_num_bytes > buffer_len)
+        return total_num_bytes;
+    // The caller provides the runtime data, which qf_destroy releases with free()
+    qf->runtimedata->allocator = system_allocator;
     return init_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed,
-                        buffer, buffer_len, 0);
+                        buffer, buffer_len, 0, 0, QF_BLOCK_LAYOUT_PACKED, false, false);
 }
 
-uint64_t qf_use(QF* qf, void* buffer, uint64_t buffer_len)
+// Same as qf_use, with the runtime data allocated from `allocator`.
+// NEW IN MEMENTO
+static uint64_t use_filter(QF* qf, void* buffer, uint64_t buffer_len,
+                            const qf_allocator *allocator)
 {
 	qf->metadata = (qfmetadata *)(buffer);
-	if (qf->metadata->total_size_in_bytes + sizeof(qfmetadata) > buffer_len) {
-		return qf->metadata->total_size_in_bytes + sizeof(qfmetadata);
-	}
-	qf->blocks = (qfblock *)(qf->metadata + 1);
-
-	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
-	if (qf->runtimedata == NULL) {
-		perror("Couldn't allocate memory for runtime data.");
-		exit(EXIT_FAILURE);
+	// The blocks are laid out differently with a different offset width
+	if (qf->metadata->block_offset_width != QF_BLOCK_OFFSET_WIDTH) {
+		fprintf(stderr, "The CQF was built with %u-bit block offsets.\n",
+                qf->metadata->block_offset_width);
+		return 0;
 	}
-	/* initialize all the locks to 0 */
-	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-													sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
+	const uint64_t blocks_offset = blocks_offset_for_layout(qf->metadata->block_layout);
+	if (qf->metadata->total_size_in_bytes + blocks_offset > buffer_len) {
+		return qf->metadata->total_size_in_bytes + blocks_offset;
 	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data *)calloc(qf->runtimedata->num_locks + 1,
-															sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
+	qf->blocks = (qfblock *)((char *)buffer + blocks_offset);
+
+	if (!alloc_runtime(qf, allocator))
+		return 0;
+	qf->runtimedata->f_info.fd = -1;
+	if (!init_runtime_locks(qf)) {
+		qf_dealloc(allocator, qf->runtimedata, sizeof(qfruntime));
+		return 0;
 	}
-#endif
 
-	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+	return blocks_offset + qf->metadata->total_size_in_bytes;
+}
+
+uint64_t qf_use(QF* qf, void* buffer, uint64_t buffer_len)
+{
+	return use_filter(qf, buffer, buffer_len, &system_allocator);
 }
 
 void *qf_destroy(QF *qf)
 {
-	assert(qf->runtimedata->locks != NULL);
-	free((void *)qf->runtimedata->locks);
 	assert(qf->runtimedata != NULL);
-	free(qf->runtimedata);
+	assert(qf->runtimedata->locks != NULL);
+	const qf_allocator allocator = qf->runtimedata->allocator;
+	if (!qf->runtimedata->shared_locks)
+		qf_dealloc(&allocator, (void *)qf->runtimedata->locks, 
+                    lock_array_bytes(qf->runtimedata->num_locks));
+#ifdef LOG_WAIT_TIME
+	qf_dealloc(&allocator, qf->runtimedata->wait_times,
+                (qf->runtimedata->num_locks + 1) * sizeof(wait_time_data));
+#endif
+	const uint64_t region_bitmap_size = region_bitmap_bytes(qf);
+	qf_dealloc(&allocator, qf->runtimedata->dirty_regions, region_bitmap_size);
+	qf_dealloc(&allocator, qf->runtimedata->snapshot_dirty_regions, region_bitmap_size);
+	qf_dealloc(&allocator, qf->runtimedata, sizeof(qfruntime));
 
 	return (void *)qf->metadata;
 }
 
-static inline bool malloc_filter(QF *qf, const uint64_t nslots, const uint64_t key_bits, 
-        const uint64_t memento_bits, const enum qf_hashmode hash_mode, const uint32_t seed, 
-        const uint64_t orig_quotient_size)  // NEW IN MEMENTO
-{
-	uint64_t total_num_bytes = init_filter(qf, nslots, key_bits, memento_bits,
-                                    hash_mode, seed, NULL, 0, orig_quotient_size);
-
-	void *buffer = malloc(total_num_bytes);
-	if (buffer == NULL) {
-		perror("Couldn't allocate memory for the CQF.");
-		exit(EXIT_FAILURE);
-	}
-
-	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
-	if (qf->runtimedata == NULL) {
-		perror("Couldn't allocate memory for runtime data.");
-		exit(EXIT_FAILURE);
-	}
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
 
-	uint64_t init_size = init_filter(qf, nslots, key_bits, memento_bits, hash_mode, 
-                                seed, buffer, total_num_bytes, orig_quotient_size);
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
 
-	if (init_size == total_num_bytes)
-		return true;
+// Applies the NUMA policy of `options` to a mapping, and asks for transparent
+// huge pages if `advise_huge`.
+// NEW IN MEMENTO
+static bool place_filter_memory(void *buffer, const uint64_t size,
+                                const qf_alloc_options *options, const bool advise_huge)
+{
+#ifdef MADV_HUGEPAGE
+	if (advise_huge)
+		madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+	if (options->numa_policy != QF_NUMA_DEFAULT) {
+		const unsigned long nodemask = options->numa_nodes;
+		const int mode = (options->numa_policy == QF_NUMA_BIND ? MPOL_BIND : MPOL_INTERLEAVE);
+		if (syscall(SYS_mbind, buffer, size, mode, &nodemask,
+                    8 * sizeof(nodemask) + 1, 0) != 0) {
+			perror("Couldn't bind the CQF to the requested NUMA nodes.");
+			return false;
+		}
+	}
+	return true;
+}
+
+// Creates a memory file of `size` bytes, holding the first `len` bytes of
+// `buffer` if it is not NULL. Returns -1 on failure.
+// NEW IN MEMENTO
+static int create_memory_file(const uint64_t size, const void *buffer, uint64_t len)
+{
+	const int fd = syscall(SYS_memfd_create, "memento", MFD_CLOEXEC);
+	if (fd < 0) {
+		perror("Couldn't create a memory file for the CQF.");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("Couldn't extend the memory file of the CQF.");
+		close(fd);
+		return -1;
+	}
+	const uint8_t *buf = (const uint8_t *)buffer;
+	uint64_t pos = 0;
+	while (buffer != NULL && pos < len) {
+		const ssize_t ret = pwrite(fd, buf + pos, len - pos, pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("Couldn't write the memory file of the CQF.");
+			close(fd);
+			return -1;
+		}
+		pos += ret;
+	}
+	return fd;
+}
+
+// Maps at least `size` bytes of zeroed memory placed as specified by
+// `options`, and stores the size of the mapping in `mapped_size`. With
+// snapshots enabled, the memory is a shared mapping of a memory file, which
+// is stored in `memfd`; otherwise, `memfd` is set to -1. Returns NULL on
+// failure.
+// NEW IN MEMENTO
+static void *map_filter_memory(const uint64_t size, const qf_alloc_options *options,
+                                uint64_t *mapped_size, int *memfd)
+{
+	void *buffer = MAP_FAILED;
+	bool advise_huge = false;
+	*memfd = -1;
+	if (options->snapshots) {
+		// Explicit huge pages would be copied whole on the first write after
+		// a snapshot, so the memory file only asks for transparent ones
+		const uint64_t page_size = sysconf(_SC_PAGESIZE);
+		*mapped_size = (size + page_size - 1) / page_size * page_size;
+		*memfd = create_memory_file(*mapped_size, NULL, 0);
+		if (*memfd < 0)
+			return NULL;
+		buffer = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, *memfd, 0);
+		if (buffer == MAP_FAILED) {
+			perror("Couldn't map the memory file of the CQF.");
+			close(*memfd);
+			return NULL;
+		}
+		advise_huge = options->page_size != QF_PAGES_DEFAULT;
+	}
+	else {
+		uint64_t huge_page_size = 0;
+		int huge_page_flags = 0;
+#ifdef MAP_HUGETLB
+		if (options->page_size == QF_PAGES_HUGE_2MB) {
+			huge_page_size = 1ULL << 21;
+			huge_page_flags = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+		}
+		else if (options->page_size == QF_PAGES_HUGE_1GB) {
+			huge_page_size = 1ULL << 30;
+			huge_page_flags = MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+		}
+#endif
+		if (huge_page_size) {
+			*mapped_size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+			buffer = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | huge_page_flags, -1, 0);
+		}
+		if (buffer == MAP_FAILED) {
+			// No explicit huge pages of that size are reserved, so fall back to
+			// transparent ones
+			const uint64_t page_size = sysconf(_SC_PAGESIZE);
+			*mapped_size = (size + page_size - 1) / page_size * page_size;
+			buffer = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (buffer == MAP_FAILED)
+				return NULL;
+			advise_huge = options->page_size != QF_PAGES_DEFAULT;
+		}
+	}
+
+	if (!place_filter_memory(buffer, *mapped_size, options, advise_huge)) {
+		munmap(buffer, *mapped_size);
+		if (*memfd >= 0)
+			close(*memfd);
+		return NULL;
+	}
+
+	if (options->prefault) {
+		const uint64_t page_size = sysconf(_SC_PAGESIZE);
+		for (uint64_t i = 0; i < *mapped_size; i += page_size)
+			((volatile uint8_t *)buffer)[i] = 0;
+	}
+	return buffer;
+}
+
+// Wraps the memory file holding the table of a filter, whose only user is
+// the filter itself for now. Returns NULL on failure.
+// NEW IN MEMENTO
+static qf_snapshot_base *new_snapshot_base(const int fd, const qf_allocator *allocator)
+{
+	qf_snapshot_base *base = (qf_snapshot_base *)qf_alloc(allocator, sizeof(qf_snapshot_base),
+                                                        sizeof(uint64_t));
+	if (base == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for the snapshot data.\n");
+		return NULL;
+	}
+	base->fd = fd;
+	base->refcount = 1;
+	base->allocator = *allocator;
+	return base;
+}
+
+// Drops a reference to a memory file, and closes it with the last one.
+// NEW IN MEMENTO
+static void release_snapshot_base(qf_snapshot_base *base)
+{
+	if (__atomic_sub_fetch(&base->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(base->fd);
+		const qf_allocator allocator = base->allocator;
+		qf_dealloc(&allocator, base, sizeof(qf_snapshot_base));
+	}
+}
+
+static inline bool malloc_filter(QF *qf, const uint64_t nslots, const uint64_t key_bits, 
+        const uint64_t memento_bits, const enum qf_hashmode hash_mode, const uint32_t seed, 
+        const uint64_t orig_quotient_size, const uint64_t orig_nslots,
+        const qf_alloc_options *options)  // NEW IN MEMENTO
+{
+	const enum qf_block_layout layout = (options != NULL ? options->block_layout 
+                                                        : QF_BLOCK_LAYOUT_PACKED);
+	const qf_allocator *allocator = (options != NULL && options->allocator != NULL
+                                        ? options->allocator : &system_allocator);
+	const bool expandable = options != NULL && options->expandable;
+	uint64_t total_num_bytes = init_filter(qf, nslots, key_bits, memento_bits,
+                                    hash_mode, seed, NULL, 0, orig_quotient_size,
+                                    orig_nslots, layout, expandable, false);
+
+	void *buffer;
+	uint64_t mapped_size = 0;
+	int memfd = -1;
+	const bool use_mmap = options != NULL && (options->page_size != QF_PAGES_DEFAULT
+                                            || options->numa_policy != QF_NUMA_DEFAULT
+                                            || options->prefault || options->snapshots);
+	if (use_mmap) {
+		buffer = map_filter_memory(total_num_bytes, options, &mapped_size, &memfd);
+		if (buffer == NULL)
+			return false;
+	}
+	else {
+		buffer = qf_alloc(allocator, total_num_bytes, layout == QF_BLOCK_LAYOUT_PACKED 
+                                                        ? sizeof(uint64_t) : QF_CACHE_LINE_SIZE);
+		if (buffer == NULL) {
+			fprintf(stderr, "Couldn't allocate memory for the CQF.\n");
+			return false;
+		}
+	}
+
+	qf_snapshot_base *snapshot_base = NULL;
+	if ((memfd < 0 || (snapshot_base = new_snapshot_base(memfd, allocator)) != NULL)
+            && alloc_runtime(qf, allocator)) {
+		if (init_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed, buffer,
+                        total_num_bytes, orig_quotient_size, orig_nslots, layout, expandable,
+                        use_mmap) == total_num_bytes) {
+			if (options != NULL)
+				qf->runtimedata->alloc_options = *options;
+			// The filter keeps its own copy of the hooks
+			qf->runtimedata->alloc_options.allocator = NULL;
+			qf->runtimedata->mapped_size = mapped_size;
+			qf->runtimedata->snapshot_base = snapshot_base;
+			return true;
+		}
+		qf_dealloc(allocator, qf->runtimedata, sizeof(qfruntime));
+	}
+	if (snapshot_base != NULL)
+		release_snapshot_base(snapshot_base);
+	else if (memfd >= 0)
+		close(memfd);
+	if (use_mmap)
+		munmap(buffer, mapped_size);
 	else
-		return false;
+		qf_dealloc(allocator, buffer, total_num_bytes);
+	return false;
+}
+
+// The options `qf` was allocated with, which the tables replacing its own reuse.
+// NEW IN MEMENTO
+static inline qf_alloc_options filter_alloc_options(const QF *qf)
+{
+	qf_alloc_options options = qf->runtimedata->alloc_options;
+	options.allocator = &qf->runtimedata->allocator;
+	// Filters opened from a file or a buffer have default options
+	options.expandable = qf->metadata->expandable;
+	return options;
 }
 
 bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t memento_bits, 
                 enum qf_hashmode hash_mode, uint32_t seed)  // NEW IN MEMENTO
 {
-    return malloc_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed, 0);
+    return malloc_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed, 0, 0, NULL);
+}
+
+bool qf_malloc_ex(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t memento_bits, 
+                enum qf_hashmode hash_mode, uint32_t seed,
+                const qf_alloc_options *options)  // NEW IN MEMENTO
+{
+    return malloc_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed, 0, 0, options);
 }
 
 bool qf_free(QF *qf)
 {
 	assert(qf->metadata != NULL);
+	const uint64_t mapped_size = qf->runtimedata->mapped_size;
+	const file_info f_info = qf->runtimedata->f_info;
+	qf_snapshot_base *snapshot_base = qf->runtimedata->snapshot_base;
+	const qf_allocator allocator = qf->runtimedata->allocator;
+	const uint64_t size = blocks_offset_for_layout(qf->metadata->block_layout)
+                            + qf->metadata->total_size_in_bytes;
 	void *buffer = qf_destroy(qf);
 	if (buffer != NULL) {
-		free(buffer);
+		if (mapped_size)
+			munmap(buffer, mapped_size);
+		else
+			qf_dealloc(&allocator, buffer, size);
+		if (f_info.filepath != NULL) {
+			close(f_info.fd);
+			free(f_info.filepath);
+		}
+		if (snapshot_base != NULL)
+			release_snapshot_base(snapshot_base);
 		return true;
 	}
 
 	return false;
 }
 
-void qf_copy(QF *dest, const QF *src)
+/****************** NEW IN MEMENTO ******************/
+bool qf_create_file(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t memento_bits,
+                    enum qf_hashmode hash_mode, uint32_t seed, const char *filename)
 {
-	DEBUG_CQF("%s\n","Source CQF");
-	DEBUG_DUMP(src);
-	memcpy(dest->runtimedata, src->runtimedata, sizeof(qfruntime));
-	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
-	memcpy(dest->blocks, src->blocks, src->metadata->total_size_in_bytes);
-	DEBUG_CQF("%s\n","Destination CQF after copy.");
-	DEBUG_DUMP(dest);
+	const uint64_t total_num_bytes = init_filter(qf, nslots, key_bits, memento_bits,
+                                        hash_mode, seed, NULL, 0, 0, 0,
+                                        QF_BLOCK_LAYOUT_PACKED, false, false);
+
+	const int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("Couldn't open file.");
+		return false;
+	}
+	// A freshly extended file reads as zeros, so the blocks are already empty
+	if (ftruncate(fd, total_num_bytes) < 0) {
+		perror("Couldn't extend the file.");
+		close(fd);
+		return false;
+	}
+	void *buffer = mmap(NULL, total_num_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buffer == MAP_FAILED) {
+		perror("Couldn't mmap file.");
+		close(fd);
+		return false;
+	}
+
+	if (alloc_runtime(qf, &system_allocator)) {
+		if (init_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed, buffer,
+                        total_num_bytes, 0, 0, QF_BLOCK_LAYOUT_PACKED, false, true) == total_num_bytes) {
+			qf->runtimedata->mapped_size = total_num_bytes;
+			qf->runtimedata->f_info.filepath = strdup(filename);
+			if (qf->runtimedata->f_info.filepath != NULL) {
+				qf->runtimedata->f_info.fd = fd;
+				return true;
+			}
+			fprintf(stderr, "Couldn't allocate memory for the file path.\n");
+			qf_destroy(qf);
+		}
+		else
+			qf_dealloc(&system_allocator, qf->runtimedata, sizeof(qfruntime));
+	}
+	munmap(buffer, total_num_bytes);
+	close(fd);
+	return false;
 }
 
-void qf_reset(QF *qf)
+bool qf_open_file(QF *qf, const char *filename, int flag)
 {
-	qf->metadata->nelts = 0;
-	qf->metadata->ndistinct_elts = 0;
-	qf->metadata->noccupied_slots = 0;
+	assert(flag == QF_USEFILE_READ_ONLY || flag == QF_USEFILE_READ_WRITE);
+	const int fd = open(filename, flag == QF_USEFILE_READ_ONLY ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		perror("Couldn't open file.");
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		perror("Couldn't stat file.");
+		close(fd);
+		return false;
+	}
+	const uint64_t file_size = sb.st_size;
+	if (file_size < sizeof(qfmetadata)) {
+		fprintf(stderr, "%s is too small to hold a filter.\n", filename);
+		close(fd);
+		return false;
+	}
 
-#ifdef LOG_WAIT_TIME
-	memset(qf->wait_times, 0, (qf->runtimedata->num_locks + 1) 
-                                * sizeof(wait_time_data));
-#endif
-#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
-	memset(qf->blocks, 0, qf->metadata->nblocks* sizeof(qfblock));
+	const int prot = (flag == QF_USEFILE_READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE);
+	void *buffer = mmap(NULL, file_size, prot, MAP_SHARED, fd, 0);
+	if (buffer == MAP_FAILED) {
+		perror("Couldn't mmap file.");
+		close(fd);
+		return false;
+	}
+
+	// Only the runtime data is rebuilt, the table is used in place
+	const qfmetadata *metadata = (const qfmetadata *)buffer;
+	if (metadata->magic_endian_number != MAGIC_NUMBER
+            || metadata->block_offset_width != QF_BLOCK_OFFSET_WIDTH
+            || blocks_offset_for_layout(metadata->block_layout) 
+                + metadata->total_size_in_bytes > file_size) {
+		fprintf(stderr, "%s does not hold a filter that can be used here.\n", filename);
+		munmap(buffer, file_size);
+		close(fd);
+		return false;
+	}
+	if (qf_use(qf, buffer, file_size) != 0) {
+		qf->runtimedata->mapped_size = file_size;
+		qf->runtimedata->f_info.filepath = strdup(filename);
+		if (qf->runtimedata->f_info.filepath != NULL) {
+			qf->runtimedata->f_info.fd = fd;
+			return true;
+		}
+		fprintf(stderr, "Couldn't allocate memory for the file path.\n");
+		qf_destroy(qf);
+	}
+	munmap(buffer, file_size);
+	close(fd);
+	return false;
+}
+
+bool qf_sync(const QF *qf)
+{
+	if (qf->runtimedata->f_info.filepath == NULL)
+		return false;
+	if (msync(qf->metadata, qf->runtimedata->mapped_size, MS_SYNC) < 0) {
+		perror("Couldn't sync the filter to its file.");
+		return false;
+	}
+	return true;
+}
+
+// Where the locks of a filter with a `table_bytes`-byte table live in its
+// shared memory segment: past the table, on pages of their own, so that the
+// table can be mapped read-only while the locks stay writable.
+// NEW IN MEMENTO
+static inline uint64_t shm_locks_offset(const uint64_t table_bytes)
+{
+	const uint64_t page_size = sysconf(_SC_PAGESIZE);
+	return (table_bytes + page_size - 1) / page_size * page_size;
+}
+
+// Replaces the private locks of `qf` with the ones in `segment`.
+// NEW IN MEMENTO
+static void use_shm_locks(QF *qf, void *segment)
+{
+	qfruntime *runtime = qf->runtimedata;
+	qf_dealloc(&runtime->allocator, (void *)runtime->locks, lock_array_bytes(runtime->num_locks));
+	const uint64_t table_bytes = blocks_offset_for_layout(qf->metadata->block_layout)
+                                    + qf->metadata->total_size_in_bytes;
+	runtime->locks = (volatile int *)((char *)segment + shm_locks_offset(table_bytes));
+	runtime->metadata_lock = &runtime->locks[runtime->num_locks];
+	runtime->shared_locks = true;
+}
+
+/****************** NEW IN MEMENTO ******************/
+bool qf_create_shm(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t memento_bits,
+                   enum qf_hashmode hash_mode, uint32_t seed, const char *name)
+{
+	const uint64_t total_num_bytes = init_filter(qf, nslots, key_bits, memento_bits,
+                                        hash_mode, seed, NULL, 0, 0, 0,
+                                        QF_BLOCK_LAYOUT_PACKED, false, false);
+	const uint64_t segment_size = shm_locks_offset(total_num_bytes)
+                                    + lock_array_bytes(num_locks_for(xnslots_for(nslots)));
+
+	// Never reuse an existing segment: truncating it would pull the pages
+	// from under the processes still attached to it
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("Couldn't create the shared memory segment.");
+		return false;
+	}
+	// A freshly extended segment reads as zeros, so the blocks and the locks
+	// are already initialized
+	if (ftruncate(fd, segment_size) < 0) {
+		perror("Couldn't extend the shared memory segment.");
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	void *buffer = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (buffer == MAP_FAILED) {
+		perror("Couldn't mmap the shared memory segment.");
+		shm_unlink(name);
+		return false;
+	}
+
+	if (alloc_runtime(qf, &system_allocator)) {
+		if (init_filter(qf, nslots, key_bits, memento_bits, hash_mode, seed, buffer,
+                        total_num_bytes, 0, 0, QF_BLOCK_LAYOUT_PACKED, false, true) == total_num_bytes) {
+			use_shm_locks(qf, buffer);
+			qf->runtimedata->mapped_size = segment_size;
+			return true;
+		}
+		qf_dealloc(&system_allocator, qf->runtimedata, sizeof(qfruntime));
+	}
+	munmap(buffer, segment_size);
+	shm_unlink(name);
+	return false;
+}
+
+bool qf_attach_shm(QF *qf, const char *name, int flag)
+{
+	assert(flag == QF_USEFILE_READ_ONLY || flag == QF_USEFILE_READ_WRITE);
+	// Even readers write to the locks
+	const int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		perror("Couldn't open the shared memory segment.");
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		perror("Couldn't stat the shared memory segment.");
+		close(fd);
+		return false;
+	}
+	const uint64_t segment_size = sb.st_size;
+	if (segment_size < sizeof(qfmetadata)) {
+		fprintf(stderr, "%s is too small to hold a filter.\n", name);
+		close(fd);
+		return false;
+	}
+	void *buffer = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (buffer == MAP_FAILED) {
+		perror("Couldn't mmap the shared memory segment.");
+		return false;
+	}
+
+	const qfmetadata *metadata = (const qfmetadata *)buffer;
+	const uint64_t table_bytes = blocks_offset_for_layout(metadata->block_layout)
+                                    + metadata->total_size_in_bytes;
+	if (metadata->magic_endian_number != MAGIC_NUMBER
+            || metadata->block_offset_width != QF_BLOCK_OFFSET_WIDTH
+            || shm_locks_offset(table_bytes)
+                + lock_array_bytes(num_locks_for(metadata->xnslots)) > segment_size) {
+		fprintf(stderr, "%s does not hold a filter that can be used here.\n", name);
+		munmap(buffer, segment_size);
+		return false;
+	}
+	if (flag == QF_USEFILE_READ_ONLY && mprotect(buffer, shm_locks_offset(table_bytes),
+                                                    PROT_READ) < 0) {
+		perror("Couldn't protect the shared memory segment.");
+		munmap(buffer, segment_size);
+		return false;
+	}
+	if (use_filter(qf, buffer, segment_size, &system_allocator) != 0) {
+		use_shm_locks(qf, buffer);
+		qf->runtimedata->mapped_size = segment_size;
+		return true;
+	}
+	munmap(buffer, segment_size);
+	return false;
+}
+
+bool qf_unlink_shm(const char *name)
+{
+	if (shm_unlink(name) < 0) {
+		perror("Couldn't unlink the shared memory segment.");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Serialized format, with all integers little-endian:
+ *
+ *   header: QF_SERIAL_MAGIC, QF_SERIAL_VERSION and the size of the header
+ *           (8 + 4 + 4 bytes), QF_SERIAL_HEADER_FIELDS 8-byte fields, and the
+ *           CRC32C of all of the above (4 bytes). Version 1 has no last
+ *           field, `expandable`, and is read as a filter that is not
+ *           expandable.
+ *   chunks: the blocks in order, QF_SERIAL_CHUNK_BYTES worth of blocks at a
+ *           time. Each chunk is the size of its payload and the CRC32C of
+ *           the payload (4 + 4 bytes), followed by the payload: the offsets
+ *           (4 bytes each, UINT32_MAX if saturated), the occupieds and the
+ *           runends (8 bytes each) and the slots of its blocks.
+ *
+ * The format does not depend on the block layout or the width of the block
+ * offsets, so a filter can be loaded by any build and with any layout. The
+ * slots are written as they are stored in memory, which, like the rest of
+ * the filter, assumes a little-endian host.
+ *
+ * An incremental checkpoint has the same header, with QF_CHECKPOINT_MAGIC
+ * and QF_DIRTY_REGION_BLOCKS in place of the blocks per chunk. It continues
+ * with a manifest chunk, holding the number of regions in the checkpoint
+ * and their indexes in increasing order (8 bytes each), and then a chunk
+ * with the blocks of each of these regions.
+ */
+#define QF_SERIAL_MAGIC 0x544c464f544e454dULL     // "MENTOFLT"
+#define QF_CHECKPOINT_MAGIC 0x504b434f544e454dULL // "MENTOCKP"
+#define QF_SERIAL_VERSION 2
+#define QF_SERIAL_HEADER_FIELDS 23
+#define QF_SERIAL_V1_HEADER_FIELDS 22
+#define QF_SERIAL_HEADER_SIZE (16 + 8 * QF_SERIAL_HEADER_FIELDS + 4)
+#define QF_SERIAL_CHUNK_BYTES (1ULL << 22)
+
+// NEW IN MEMENTO
+static uint32_t crc32c(uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+	crc = ~crc;
+#ifdef __SSE4_2__
+	uint64_t crc64 = crc;
+	for (; len >= sizeof(uint64_t); buf += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, buf, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	for (; len > 0; buf++, len--)
+		crc = _mm_crc32_u8(crc, *buf);
 #else
-	memset(qf->blocks, 0, qf->metadata->nblocks*(sizeof(qfblock) + 
-                QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8));
+	for (; len > 0; buf++, len--) {
+		crc ^= *buf;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
 #endif
+	return ~crc;
 }
 
-int64_t qf_resize_malloc(QF *qf, uint64_t nslots)   // NEW IN MEMENTO
+// NEW IN MEMENTO
+static inline void put_le(uint8_t *p, uint64_t value, const uint32_t nbytes)
 {
-#ifdef DEBUG
-    uint64_t occupied_cnt = 0, runend_cnt = 0;
-    for (uint32_t i = 0; i < qf->metadata->nblocks; i++) {
-        occupied_cnt += popcnt(get_block(qf, i)->occupieds[0]);
-        runend_cnt += popcnt(get_block(qf, i)->runends[0]);
-        assert(occupied_cnt >= runend_cnt);
-    }
-    assert(occupied_cnt == runend_cnt);
-#endif /* DEBUG */
+	for (uint32_t i = 0; i < nbytes; i++, value >>= 8)
+		p[i] = value & 0xff;
+}
 
-	QF new_qf;
-	if (!malloc_filter(&new_qf, nslots, qf->metadata->key_bits,
-                         qf->metadata->memento_bits, qf->metadata->hash_mode,
-                         qf->metadata->seed, qf->metadata->original_quotient_bits))
+// NEW IN MEMENTO
+static inline uint64_t get_le(const uint8_t *p, const uint32_t nbytes)
+{
+	uint64_t value = 0;
+	for (uint32_t i = nbytes; i > 0; i--)
+		value = (value << 8) | p[i - 1];
+	return value;
+}
+
+// NEW IN MEMENTO
+static inline uint64_t double_bits(const double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+// NEW IN MEMENTO
+static inline double bits_double(const uint64_t bits)
+{
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// NEW IN MEMENTO
+static bool write_all(const int fd, const uint8_t *buf, uint64_t len)
+{
+	while (len > 0) {
+		const ssize_t ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("Couldn't write the filter.");
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+// NEW IN MEMENTO
+static bool read_all(const int fd, uint8_t *buf, uint64_t len)
+{
+	while (len > 0) {
+		const ssize_t ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("Couldn't read the filter.");
+			return false;
+		}
+		if (ret == 0) {
+			fprintf(stderr, "The serialized filter is truncated.\n");
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+// Bytes of a serialized block.
+// NEW IN MEMENTO
+static inline uint64_t serialized_block_size(const uint64_t bits_per_slot)
+{
+	return 4 + 2 * QF_METADATA_WORDS_PER_BLOCK * 8 + QF_SLOTS_PER_BLOCK * bits_per_slot / 8;
+}
+
+// Encodes the blocks in [first, first + n) at `p`. Returns the end of the
+// encoding.
+// NEW IN MEMENTO
+static uint8_t *encode_blocks(const QF *qf, const uint64_t first, const uint64_t n, uint8_t *p)
+{
+	const uint64_t slot_bytes = QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8;
+	const uint64_t max_offset = BITMASK(8 * sizeof(qf_block_offset_t));
+	for (uint64_t i = first; i < first + n; i++, p += 4)
+		put_le(p, BLOCK_OFFSET(qf, i) == max_offset ? UINT32_MAX : BLOCK_OFFSET(qf, i), 4);
+	for (uint64_t i = first; i < first + n; i++)
+		for (uint32_t j = 0; j < QF_METADATA_WORDS_PER_BLOCK; j++, p += 8)
+			put_le(p, BLOCK_OCCUPIEDS(qf, i)[j], 8);
+	for (uint64_t i = first; i < first + n; i++)
+		for (uint32_t j = 0; j < QF_METADATA_WORDS_PER_BLOCK; j++, p += 8)
+			put_le(p, BLOCK_RUNENDS(qf, i)[j], 8);
+	// The slots are copied as they are laid out in memory, which is a
+	// little-endian bit string since the slot accessors only support
+	// little-endian hosts
+	for (uint64_t i = first; i < first + n; i++, p += slot_bytes)
+		memcpy(p, BLOCK_SLOTS(qf, i), slot_bytes);
+	return p;
+}
+
+// Decodes the blocks in [first, first + n) from `p`.
+// NEW IN MEMENTO
+static void decode_blocks(QF *qf, const uint64_t first, const uint64_t n, const uint8_t *p)
+{
+	const uint64_t slot_bytes = QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8;
+	const uint64_t max_offset = BITMASK(8 * sizeof(qf_block_offset_t));
+	for (uint64_t i = first; i < first + n; i++, p += 4) {
+		const uint64_t offset = get_le(p, 4);
+		BLOCK_OFFSET(qf, i) = (offset < max_offset ? offset : max_offset);
+	}
+	for (uint64_t i = first; i < first + n; i++)
+		for (uint32_t j = 0; j < QF_METADATA_WORDS_PER_BLOCK; j++, p += 8)
+			BLOCK_OCCUPIEDS(qf, i)[j] = get_le(p, 8);
+	for (uint64_t i = first; i < first + n; i++)
+		for (uint32_t j = 0; j < QF_METADATA_WORDS_PER_BLOCK; j++, p += 8)
+			BLOCK_RUNENDS(qf, i)[j] = get_le(p, 8);
+	for (uint64_t i = first; i < first + n; i++, p += slot_bytes)
+		memcpy(BLOCK_SLOTS(qf, i), p, slot_bytes);
+}
+
+// Offsets that were saturated by a narrower build may fit in this one.
+// NEW IN MEMENTO
+static void unsaturate_offsets(QF *qf, const uint64_t first, const uint64_t n)
+{
+	const uint64_t max_offset = BITMASK(8 * sizeof(qf_block_offset_t));
+	for (uint64_t i = first; i < first + n; i++) {
+		if (BLOCK_OFFSET(qf, i) == max_offset) {
+			const uint64_t offset = block_offset(qf, i);
+			if (offset < max_offset)
+				BLOCK_OFFSET(qf, i) = offset;
+		}
+	}
+}
+
+// Writes the payload at `buf + 8` as a chunk, framed by its size and CRC32C.
+// NEW IN MEMENTO
+static bool write_chunk(const int fd, uint8_t *buf, const uint64_t payload_size)
+{
+	put_le(buf, payload_size, 4);
+	put_le(buf + 4, crc32c(0, buf + 8, payload_size), 4);
+	return write_all(fd, buf, 8 + payload_size);
+}
+
+// Reads a chunk with a payload of `payload_size` bytes into `buf + 8`.
+// NEW IN MEMENTO
+static bool read_chunk(const int fd, uint8_t *buf, const uint64_t payload_size)
+{
+	if (!read_all(fd, buf, 8) || !read_all(fd, buf + 8, payload_size))
+		return false;
+	if (get_le(buf, 4) != payload_size || get_le(buf + 4, 4) != crc32c(0, buf + 8, payload_size)) {
+		fprintf(stderr, "A chunk of the serialized filter is corrupted.\n");
 		return false;
-	if (qf->metadata->auto_resize)
-		qf_set_auto_resize(&new_qf, true);
+	}
+	return true;
+}
 
-	// copy keys from qf into new_qf
-	QFi qfi;
-	qf_iterator_from_position(qf, &qfi, 0);
-	int64_t ret_numkeys = 0;
-    uint64_t key, memento_count, mementos[1024];
-	do {
-		memento_count = qfi_get_hash(&qfi, &key, mementos);
-#ifdef DEBUG
-        fprintf(stderr, "@ run=%lu current=%lu\n", qfi.run, qfi.current);
-#endif /* DEBUG */
+// NEW IN MEMENTO
+static bool write_header(const int fd, const uint64_t magic, const qfmetadata *md,
+                            const uint64_t blocks_per_chunk)
+{
+	const uint64_t fields[QF_SERIAL_HEADER_FIELDS] = {
+		md->hash_mode, md->seed, md->nslots, md->xnslots, md->key_bits,
+		md->original_quotient_bits, md->original_nslots, md->split_buckets,
+		md->memento_bits, md->fingerprint_bits, md->bits_per_slot, md->nblocks,
+		md->nelts, md->ndistinct_elts, md->noccupied_slots, md->auto_resize,
+		double_bits(md->max_load_factor), md->max_probe_distance,
+		double_bits(md->growth_factor), md->auto_shrink,
+		double_bits(md->shrink_load_factor), blocks_per_chunk, md->expandable
+	};
+	uint8_t header[QF_SERIAL_HEADER_SIZE];
+	put_le(header, magic, 8);
+	put_le(header + 8, QF_SERIAL_VERSION, 4);
+	put_le(header + 12, QF_SERIAL_HEADER_SIZE, 4);
+	for (uint32_t i = 0; i < QF_SERIAL_HEADER_FIELDS; i++)
+		put_le(header + 16 + 8 * i, fields[i], 8);
+	put_le(header + QF_SERIAL_HEADER_SIZE - 4, 
+            crc32c(0, header, QF_SERIAL_HEADER_SIZE - 4), 4);
+	return write_all(fd, header, QF_SERIAL_HEADER_SIZE);
+}
+
+// Reads a header written by write_header, or by the first version of the
+// format, into `fields`.
+// NEW IN MEMENTO
+static bool read_header(const int fd, const uint64_t magic, uint64_t *fields)
+{
+	uint8_t header[QF_SERIAL_HEADER_SIZE];
+	if (!read_all(fd, header, 16))
+		return false;
+	const uint64_t version = get_le(header + 8, 4);
+	const uint32_t nfields = (version == QF_SERIAL_VERSION ? QF_SERIAL_HEADER_FIELDS
+                                : version == 1 ? QF_SERIAL_V1_HEADER_FIELDS : 0);
+	const uint64_t header_size = 16 + 8 * nfields + 4;
+	if (get_le(header, 8) != magic || nfields == 0 || get_le(header + 12, 4) != header_size) {
+		fprintf(stderr, "Not a serialized filter of a supported version.\n");
+		return false;
+	}
+	if (!read_all(fd, header + 16, header_size - 16))
+		return false;
+	if (get_le(header + header_size - 4, 4) != crc32c(0, header, header_size - 4)) {
+		fprintf(stderr, "The header of the serialized filter is corrupted.\n");
+		return false;
+	}
+	for (uint32_t i = 0; i < QF_SERIAL_HEADER_FIELDS; i++)
+		fields[i] = (i < nfields ? get_le(header + 16 + 8 * i, 8) : 0);
+	if (fields[0] > QF_HASH_NONE || fields[4] > 64 || fields[8] >= 64
+            || fields[5] >= fields[4] || fields[6] == 0 || fields[2] < fields[6]
+            || fields[21] == 0 || fields[22] > 1) {
+		fprintf(stderr, "The serialized filter has an invalid geometry.\n");
+		return false;
+	}
+	return true;
+}
+
+// NEW IN MEMENTO
+static inline bool header_geometry_matches(const qfmetadata *md, const uint64_t *fields)
+{
+	return md->hash_mode == fields[0] && md->seed == fields[1] && md->nslots == fields[2]
+            && md->xnslots == fields[3] && md->key_bits == fields[4]
+            && md->original_quotient_bits == fields[5] && md->original_nslots == fields[6]
+            && md->split_buckets == fields[7] && md->memento_bits == fields[8]
+            && md->fingerprint_bits == fields[9] && md->bits_per_slot == fields[10]
+            && md->nblocks == fields[11] && md->expandable == fields[22];
+}
+
+// Allocates an empty filter with the geometry in `fields`.
+// NEW IN MEMENTO
+static bool malloc_filter_from_header(QF *qf, const uint64_t *fields,
+                                        const qf_alloc_options *options)
+{
+	qf_alloc_options header_options;
+	if (options != NULL)
+		header_options = *options;
+	else
+		memset(&header_options, 0, sizeof(header_options));
+	header_options.expandable = fields[22] != 0;
+	if (!malloc_filter(qf, fields[2], fields[4], fields[8], (enum qf_hashmode)fields[0],
+                        fields[1], fields[5], fields[6], &header_options))
+		return false;
+	if (!header_geometry_matches(qf->metadata, fields)) {
+		fprintf(stderr, "The serialized filter has an invalid geometry.\n");
+		qf_free(qf);
+		return false;
+	}
+	return true;
+}
+
+// NEW IN MEMENTO
+static void restore_header_counters(qfmetadata *md, const uint64_t *fields)
+{
+	md->nelts = fields[12];
+	md->ndistinct_elts = fields[13];
+	md->noccupied_slots = fields[14];
+	md->auto_resize = fields[15];
+	md->max_load_factor = bits_double(fields[16]);
+	md->max_probe_distance = fields[17];
+	md->growth_factor = bits_double(fields[18]);
+	md->auto_shrink = fields[19];
+	md->shrink_load_factor = bits_double(fields[20]);
+}
+
+// Allocates the region bitmap `regions` if needed. Returns false on failure.
+// NEW IN MEMENTO
+static bool alloc_region_bitmap(const QF *qf, uint64_t **regions)
+{
+	if (*regions == NULL) {
+		*regions = (uint64_t *)qf_alloc(&qf->runtimedata->allocator, region_bitmap_bytes(qf),
+                                        sizeof(uint64_t));
+		if (*regions == NULL) {
+			fprintf(stderr, "Couldn't allocate memory for dirty tracking.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+// Marks all regions of the bitmap `regions` as modified if `dirty`, or as
+// clean otherwise.
+// NEW IN MEMENTO
+static void fill_region_bitmap(const QF *qf, uint64_t *regions, const bool dirty)
+{
+	const uint64_t nwords = region_bitmap_bytes(qf) / sizeof(uint64_t);
+	memset(regions, dirty ? 0xff : 0, nwords * sizeof(uint64_t));
+	if (dirty && dirty_region_count(qf) % 64)
+		regions[nwords - 1] = BITMASK(dirty_region_count(qf) % 64);
+}
+
+// Turns on dirty tracking, with all regions marked as modified if `dirty`.
+// Returns false if the bitmap cannot be allocated.
+// NEW IN MEMENTO
+static bool init_dirty_regions(QF *qf, const bool dirty)
+{
+	if (!alloc_region_bitmap(qf, &qf->runtimedata->dirty_regions))
+		return false;
+	fill_region_bitmap(qf, qf->runtimedata->dirty_regions, dirty);
+	return true;
+}
+
+// Marks all regions as modified in every bitmap that is in use.
+// NEW IN MEMENTO
+static void mark_all_regions_dirty(QF *qf)
+{
+	if (qf->runtimedata->dirty_regions != NULL)
+		fill_region_bitmap(qf, qf->runtimedata->dirty_regions, true);
+	if (qf->runtimedata->snapshot_dirty_regions != NULL)
+		fill_region_bitmap(qf, qf->runtimedata->snapshot_dirty_regions, true);
+}
+
+bool qf_serialize_to_fd(const QF *qf, int fd)
+{
+	const qfmetadata *md = qf->metadata;
+	const uint64_t blocks_per_chunk = QF_SERIAL_CHUNK_BYTES / serialized_block_size(md->bits_per_slot) + 1;
+	if (!write_header(fd, QF_SERIAL_MAGIC, md, blocks_per_chunk))
+		return false;
+
+	const uint64_t chunk_blocks = (blocks_per_chunk < md->nblocks ? blocks_per_chunk : md->nblocks);
+	const uint64_t buf_size = 8 + chunk_blocks * serialized_block_size(md->bits_per_slot);
+	uint8_t *buf = (uint8_t *)qf_alloc(&qf->runtimedata->allocator, buf_size, sizeof(uint64_t));
+	if (buf == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for serialization.\n");
+		return false;
+	}
+	bool ok = true;
+	for (uint64_t first = 0; ok && first < md->nblocks; first += blocks_per_chunk) {
+		const uint64_t n = (md->nblocks - first < blocks_per_chunk ? md->nblocks - first
+                                                                    : blocks_per_chunk);
+		ok = write_chunk(fd, buf, encode_blocks(qf, first, n, buf + 8) - (buf + 8));
+	}
+	qf_dealloc(&qf->runtimedata->allocator, buf, buf_size);
+	// Later incremental checkpoints build on this one
+	if (ok && qf->runtimedata->dirty_regions != NULL)
+		fill_region_bitmap(qf, qf->runtimedata->dirty_regions, false);
+	return ok;
+}
+
+bool qf_deserialize_from_fd(QF *qf, int fd, const qf_alloc_options *options)
+{
+	// The blocks are read sequentially, so ask for aggressive readahead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	uint64_t fields[QF_SERIAL_HEADER_FIELDS];
+	if (!read_header(fd, QF_SERIAL_MAGIC, fields)
+            || !malloc_filter_from_header(qf, fields, options))
+		return false;
+	qfmetadata *md = qf->metadata;
+	restore_header_counters(md, fields);
+
+	const uint64_t blocks_per_chunk = fields[21];
+	const uint64_t chunk_blocks = (blocks_per_chunk < md->nblocks ? blocks_per_chunk : md->nblocks);
+	const uint64_t buf_size = 8 + chunk_blocks * serialized_block_size(md->bits_per_slot);
+	uint8_t *buf = (uint8_t *)qf_alloc(&qf->runtimedata->allocator, buf_size, sizeof(uint64_t));
+	if (buf == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for deserialization.\n");
+		qf_free(qf);
+		return false;
+	}
+	bool ok = true;
+	for (uint64_t first = 0; ok && first < md->nblocks; first += blocks_per_chunk) {
+		const uint64_t n = (md->nblocks - first < blocks_per_chunk ? md->nblocks - first
+                                                                    : blocks_per_chunk);
+		ok = read_chunk(fd, buf, n * serialized_block_size(md->bits_per_slot));
+		if (ok)
+			decode_blocks(qf, first, n, buf + 8);
+	}
+	qf_dealloc(&qf->runtimedata->allocator, buf, buf_size);
+	if (!ok) {
+		qf_free(qf);
+		return false;
+	}
+	unsaturate_offsets(qf, 0, md->nblocks);
+	return true;
+}
+
+bool qf_start_dirty_tracking(QF *qf)
+{
+	return qf->runtimedata->dirty_regions != NULL || init_dirty_regions(qf, false);
+}
+
+bool qf_checkpoint_incremental(QF *qf, int fd)
+{
+	assert(qf->runtimedata->dirty_regions != NULL);
+	const qfmetadata *md = qf->metadata;
+	const uint64_t nregions = dirty_region_count(qf);
+	const uint64_t nwords = (nregions + 63) / 64;
+	const qf_allocator *allocator = &qf->runtimedata->allocator;
+	const uint64_t buf_size = 8 + (nregions + 1) * sizeof(uint64_t) 
+                                + QF_DIRTY_REGION_BLOCKS * serialized_block_size(md->bits_per_slot);
+	uint64_t *dirty_regions = (uint64_t *)qf_alloc(allocator, nwords * sizeof(uint64_t),
+                                                    sizeof(uint64_t));
+	uint8_t *buf = (uint8_t *)qf_alloc(allocator, buf_size, sizeof(uint64_t));
+	if (dirty_regions == NULL || buf == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for the checkpoint.\n");
+		qf_dealloc(allocator, dirty_regions, nwords * sizeof(uint64_t));
+		qf_dealloc(allocator, buf, buf_size);
+		return false;
+	}
+	uint64_t ndirty = 0;
+	for (uint64_t i = 0; i < nwords; i++) {
+		dirty_regions[i] = __atomic_exchange_n(&qf->runtimedata->dirty_regions[i], 0, 
+                                                __ATOMIC_RELAXED);
+		ndirty += popcnt(dirty_regions[i]);
+	}
+
+	// The manifest lists the regions that follow
+	bool ok = write_header(fd, QF_CHECKPOINT_MAGIC, md, QF_DIRTY_REGION_BLOCKS);
+	uint8_t *p = buf + 8;
+	put_le(p, ndirty, 8);
+	p += 8;
+	for (uint64_t region = 0; region < nregions; region++) {
+		if (dirty_regions[region / 64] & (1ULL << (region % 64))) {
+			put_le(p, region, 8);
+			p += 8;
+		}
+	}
+	ok = ok && write_chunk(fd, buf, p - (buf + 8));
+	for (uint64_t region = 0; ok && region < nregions; region++) {
+		if (dirty_regions[region / 64] & (1ULL << (region % 64))) {
+			const uint64_t first = region * QF_DIRTY_REGION_BLOCKS;
+			const uint64_t n = (md->nblocks - first < QF_DIRTY_REGION_BLOCKS ? md->nblocks - first
+                                                                            : QF_DIRTY_REGION_BLOCKS);
+			ok = write_chunk(fd, buf, encode_blocks(qf, first, n, buf + 8) - (buf + 8));
+		}
+	}
+	// The next checkpoint has to include whatever did not make it
+	if (!ok)
+		for (uint64_t i = 0; i < nwords; i++)
+			__atomic_fetch_or(&qf->runtimedata->dirty_regions[i], dirty_regions[i], 
+                                __ATOMIC_RELAXED);
+	qf_dealloc(allocator, buf, buf_size);
+	qf_dealloc(allocator, dirty_regions, nwords * sizeof(uint64_t));
+	return ok;
+}
+
+bool qf_apply_checkpoint_from_fd(QF *qf, int fd)
+{
+	uint64_t fields[QF_SERIAL_HEADER_FIELDS];
+	if (!read_header(fd, QF_CHECKPOINT_MAGIC, fields))
+		return false;
+	if (fields[21] != QF_DIRTY_REGION_BLOCKS) {
+		fprintf(stderr, "The checkpoint uses regions of a different size.\n");
+		return false;
+	}
+
+	// A checkpoint taken after a resize has a new geometry, and holds all
+	// the regions of the resized filter
+	QF target = *qf;
+	const bool same_geometry = header_geometry_matches(qf->metadata, fields);
+	const qf_alloc_options options = filter_alloc_options(qf);
+	if (!same_geometry && !malloc_filter_from_header(&target, fields, &options))
+		return false;
+	const uint64_t nregions = dirty_region_count(&target);
+	const uint64_t region_size = QF_DIRTY_REGION_BLOCKS * serialized_block_size(fields[10]);
+	const qf_allocator *allocator = &qf->runtimedata->allocator;
+	const uint64_t buf_size = 8 + (nregions + 1) * sizeof(uint64_t) + region_size;
+	uint8_t *buf = (uint8_t *)qf_alloc(allocator, buf_size, sizeof(uint64_t));
+	uint64_t *regions = (uint64_t *)qf_alloc(allocator, nregions * sizeof(uint64_t),
+                                            sizeof(uint64_t));
+	// With a new geometry, the bitmap of dirty tracking is allocated up front,
+	// so that nothing can fail once the filter is replaced
+	const bool tracked = qf->runtimedata->dirty_regions != NULL;
+	bool ok = buf != NULL && regions != NULL
+                && (same_geometry || !tracked || init_dirty_regions(&target, true));
+	if (!ok)
+		fprintf(stderr, "Couldn't allocate memory for the checkpoint.\n");
+
+	ok = ok && read_all(fd, buf, 16);
+	const uint64_t ndirty = (ok ? get_le(buf + 8, 8) : 0);
+	if (ok && (ndirty > nregions || (!same_geometry && ndirty != nregions))) {
+		fprintf(stderr, "The checkpoint manifest is invalid.\n");
+		ok = false;
+	}
+	if (ok) {
+		ok = read_all(fd, buf + 16, ndirty * sizeof(uint64_t));
+		if (ok && (get_le(buf, 4) != (ndirty + 1) * sizeof(uint64_t)
+                    || get_le(buf + 4, 4) != crc32c(0, buf + 8, (ndirty + 1) * sizeof(uint64_t)))) {
+			fprintf(stderr, "The checkpoint manifest is corrupted.\n");
+			ok = false;
+		}
+	}
+	for (uint64_t i = 0; ok && i < ndirty; i++) {
+		regions[i] = get_le(buf + 16 + 8 * i, 8);
+		if (regions[i] >= nregions || (i > 0 && regions[i] <= regions[i - 1])) {
+			fprintf(stderr, "The checkpoint manifest is invalid.\n");
+			ok = false;
+		}
+	}
+
+	// Nothing is modified until every region has been read and checked
+	uint8_t *regions_buf = NULL;
+	const uint64_t regions_buf_size = ndirty * (8 + region_size) + 1;
+	if (ok) {
+		regions_buf = (uint8_t *)qf_alloc(allocator, regions_buf_size, sizeof(uint64_t));
+		if (regions_buf == NULL) {
+			fprintf(stderr, "Couldn't allocate memory for the checkpoint.\n");
+			ok = false;
+		}
+	}
+	for (uint64_t i = 0; ok && i < ndirty; i++) {
+		const uint64_t first = regions[i] * QF_DIRTY_REGION_BLOCKS;
+		const uint64_t n = (fields[11] - first < QF_DIRTY_REGION_BLOCKS ? fields[11] - first
+                                                                        : QF_DIRTY_REGION_BLOCKS);
+		ok = read_chunk(fd, regions_buf + i * (8 + region_size), 
+                        n * serialized_block_size(fields[10]));
+	}
+	if (ok) {
+		for (uint64_t i = 0; i < ndirty; i++) {
+			const uint64_t first = regions[i] * QF_DIRTY_REGION_BLOCKS;
+			const uint64_t n = (fields[11] - first < QF_DIRTY_REGION_BLOCKS ? fields[11] - first
+                                                                            : QF_DIRTY_REGION_BLOCKS);
+			decode_blocks(&target, first, n, regions_buf + i * (8 + region_size) + 8);
+		}
+		for (uint64_t i = 0; i < ndirty; i++) {
+			const uint64_t first = regions[i] * QF_DIRTY_REGION_BLOCKS;
+			const uint64_t n = (fields[11] - first < QF_DIRTY_REGION_BLOCKS ? fields[11] - first
+                                                                            : QF_DIRTY_REGION_BLOCKS);
+			unsaturate_offsets(&target, first, n);
+		}
+		restore_header_counters(target.metadata, fields);
+	}
+	if (ok && same_geometry) {
+		for (uint64_t i = 0; i < ndirty; i++)
+			mark_block_dirty(qf, regions[i] * QF_DIRTY_REGION_BLOCKS);
+	}
+	qf_dealloc(allocator, regions_buf, regions_buf_size);
+	qf_dealloc(allocator, regions, nregions * sizeof(uint64_t));
+	qf_dealloc(allocator, buf, buf_size);
+
+	if (!same_geometry) {
+		if (!ok) {
+			qf_free(&target);
+			return false;
+		}
+		qf_free(qf);
+		memcpy(qf, &target, sizeof(QF));
+	}
+	return ok;
+}
+
+void qf_copy(QF *dest, const QF *src)
+{
+	DEBUG_CQF("%s\n","Source CQF");
+	DEBUG_DUMP(src);
+	// The destination keeps its own memory, locks and file
+	const uint64_t mapped_size = dest->runtimedata->mapped_size;
+	const file_info f_info = dest->runtimedata->f_info;
+	uint64_t *dirty_regions = dest->runtimedata->dirty_regions;
+	uint64_t *snapshot_dirty_regions = dest->runtimedata->snapshot_dirty_regions;
+	qf_snapshot_base *snapshot_base = dest->runtimedata->snapshot_base;
+	const qf_allocator allocator = dest->runtimedata->allocator;
+	volatile int *locks = dest->runtimedata->locks;
+	volatile int *metadata_lock = dest->runtimedata->metadata_lock;
+	const bool shared_locks = dest->runtimedata->shared_locks;
+	const uint64_t num_locks = dest->runtimedata->num_locks;
+	wait_time_data *wait_times = dest->runtimedata->wait_times;
+	memcpy(dest->runtimedata, src->runtimedata, sizeof(qfruntime));
+	dest->runtimedata->allocator = allocator;
+	dest->runtimedata->locks = locks;
+	dest->runtimedata->metadata_lock = metadata_lock;
+	dest->runtimedata->shared_locks = shared_locks;
+	dest->runtimedata->num_locks = num_locks;
+	dest->runtimedata->wait_times = wait_times;
+	dest->runtimedata->mapped_size = mapped_size;
+	dest->runtimedata->f_info = f_info;
+	dest->runtimedata->dirty_regions = dirty_regions;
+	dest->runtimedata->snapshot_dirty_regions = snapshot_dirty_regions;
+	dest->runtimedata->snapshot_base = snapshot_base;
+	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
+	memcpy(dest->blocks, src->blocks, src->metadata->total_size_in_bytes);
+	mark_all_regions_dirty(dest);
+	DEBUG_CQF("%s\n","Destination CQF after copy.");
+	DEBUG_DUMP(dest);
+}
+
+void qf_reset(QF *qf)
+{
+	qf->metadata->nelts = 0;
+	qf->metadata->ndistinct_elts = 0;
+	qf->metadata->noccupied_slots = 0;
+
+#ifdef LOG_WAIT_TIME
+	memset(qf->wait_times, 0, (qf->runtimedata->num_locks + 1) 
+                                * sizeof(wait_time_data));
+#endif
+	memset(qf->blocks, 0, qf->metadata->total_size_in_bytes);
+	mark_all_regions_dirty(qf);
+}
+
+/*
+ * Snapshots. With the `snapshots` allocation option, the table of a filter is
+ * a shared mapping of a memory file. Taking a snapshot maps the file
+ * read-only for the snapshot, and remaps it privately for the filter, so that
+ * the kernel copies a page of the filter only when it is first modified. The
+ * filter then tracks the regions it modifies, and the next snapshot writes
+ * them back to the file if no other snapshot maps it, or copies the filter
+ * to a new memory file otherwise.
+ */
+
+// Writes the bytes [begin, end) of the blocks of `qf` to the same place in
+// its memory file.
+// NEW IN MEMENTO
+static bool write_back_blocks(const QF *qf, const int fd, uint64_t begin, const uint64_t end)
+{
+	const uint64_t blocks_offset = blocks_offset_for_layout(qf->metadata->block_layout);
+	while (begin < end) {
+		const ssize_t ret = pwrite(fd, (const uint8_t *)qf->blocks + begin, end - begin,
+                                    blocks_offset + begin);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("Couldn't write the memory file of the CQF.");
+			return false;
+		}
+		begin += ret;
+	}
+	return true;
+}
+
+// Writes the metadata and the modified regions of a privately mapped filter
+// back to its memory file.
+// NEW IN MEMENTO
+static bool write_back_dirty_regions(const QF *qf, const int fd)
+{
+	const qfmetadata *md = qf->metadata;
+	const uint64_t blocks_offset = blocks_offset_for_layout(md->block_layout);
+	if (pwrite(fd, md, blocks_offset, 0) != (ssize_t)blocks_offset) {
+		perror("Couldn't write the memory file of the CQF.");
+		return false;
+	}
+	const uint64_t *regions = qf->runtimedata->snapshot_dirty_regions;
+	const uint64_t nregions = dirty_region_count(qf);
+	for (uint64_t region = 0; region < nregions; region++) {
+		if (!(regions[region / 64] & (1ULL << (region % 64))))
+			continue;
+		const uint64_t first = region * QF_DIRTY_REGION_BLOCKS;
+		const uint64_t last = (first + QF_DIRTY_REGION_BLOCKS < md->nblocks 
+                                ? first + QF_DIRTY_REGION_BLOCKS : md->nblocks);
+		bool ok;
+		if (md->block_layout == QF_BLOCK_LAYOUT_SPLIT) {
+			const qf_array_layout *fields[3] = {&md->offsets_layout, &md->occupieds_layout,
+                                                &md->runends_layout};
+			ok = true;
+			for (int i = 0; i < 3 && ok; i++)
+				ok = write_back_blocks(qf, fd, fields[i]->start + first * fields[i]->stride,
+                                        fields[i]->start + last * fields[i]->stride);
+			// The slots array is last, and reads and writes of the last slots
+			// may touch the slack after it
+			const uint64_t slots_end = (last == md->nblocks ? md->total_size_in_bytes
+                                        : md->slots_layout.start + last * md->slots_layout.stride);
+			ok = ok && write_back_blocks(qf, fd, md->slots_layout.start 
+                                            + first * md->slots_layout.stride, slots_end);
+		}
+		else {
+			const uint64_t end = (last == md->nblocks ? md->total_size_in_bytes
+                                    : last * md->block_size);
+			ok = write_back_blocks(qf, fd, first * md->block_size, end);
+		}
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+bool qf_snapshot(const QF *qf, QF *snap)
+{
+	qfruntime *runtime = qf->runtimedata;
+	const uint64_t size = blocks_offset_for_layout(qf->metadata->block_layout)
+                            + qf->metadata->total_size_in_bytes;
+	if (runtime->snapshot_base == NULL) {
+		// Without a memory file to share, the snapshot is a copy
+		void *buffer = qf_alloc(&runtime->allocator, size, QF_CACHE_LINE_SIZE);
+		if (buffer == NULL) {
+			fprintf(stderr, "Couldn't allocate memory for the snapshot.\n");
+			return false;
+		}
+		memcpy(buffer, qf->metadata, size);
+		if (use_filter(snap, buffer, size, &runtime->allocator) == 0) {
+			qf_dealloc(&runtime->allocator, buffer, size);
+			return false;
+		}
+		return true;
+	}
+
+	qf_snapshot_base *base = runtime->snapshot_base;
+	const uint64_t mapped_size = runtime->mapped_size;
+	if (runtime->snapshot_dirty_regions != NULL) {
+		// The filter has diverged from its memory file since the last snapshot
+		if (__atomic_load_n(&base->refcount, __ATOMIC_ACQUIRE) == 1) {
+			if (!write_back_dirty_regions(qf, base->fd))
+				return false;
+		}
+		else {
+			const int fd = create_memory_file(mapped_size, qf->metadata, size);
+			if (fd < 0)
+				return false;
+			qf_snapshot_base *new_base = new_snapshot_base(fd, &runtime->allocator);
+			if (new_base == NULL) {
+				close(fd);
+				return false;
+			}
+			release_snapshot_base(base);
+			base = runtime->snapshot_base = new_base;
+		}
+	}
+	// Until the first snapshot succeeds, the filter writes to its memory
+	// file directly and has no bitmap of diverged regions
+	uint64_t *snapshot_dirty_regions = runtime->snapshot_dirty_regions;
+	if (!alloc_region_bitmap(qf, &snapshot_dirty_regions))
+		return false;
+
+	void *buffer = mmap(NULL, mapped_size, PROT_READ, MAP_SHARED, base->fd, 0);
+	if (buffer == MAP_FAILED)
+		perror("Couldn't map the snapshot.");
+	else if (use_filter(snap, buffer, mapped_size, &runtime->allocator) == 0) {
+		munmap(buffer, mapped_size);
+		buffer = MAP_FAILED;
+	}
+	// The table stays at the same address, and its pages are now copied on
+	// the first write. The private mapping is made elsewhere and moved over
+	// the table, so that the table is left as it was if either step fails.
+	void *private_table = MAP_FAILED;
+	if (buffer != MAP_FAILED) {
+		private_table = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                base->fd, 0);
+		if (private_table == MAP_FAILED
+                || mremap(private_table, mapped_size, mapped_size,
+                            MREMAP_MAYMOVE | MREMAP_FIXED, qf->metadata) == MAP_FAILED) {
+			perror("Couldn't remap the CQF.");
+			if (private_table != MAP_FAILED)
+				munmap(private_table, mapped_size);
+			munmap(qf_destroy(snap), mapped_size);
+			private_table = MAP_FAILED;
+		}
+	}
+	if (private_table == MAP_FAILED) {
+		if (runtime->snapshot_dirty_regions == NULL)
+			qf_dealloc(&runtime->allocator, snapshot_dirty_regions, region_bitmap_bytes(qf));
+		return false;
+	}
+	place_filter_memory(qf->metadata, mapped_size, &runtime->alloc_options,
+                        runtime->alloc_options.page_size != QF_PAGES_DEFAULT);
+	runtime->snapshot_dirty_regions = snapshot_dirty_regions;
+	fill_region_bitmap(qf, snapshot_dirty_regions, false);
+
+	snap->runtimedata->mapped_size = mapped_size;
+	__atomic_add_fetch(&base->refcount, 1, __ATOMIC_ACQ_REL);
+	snap->runtimedata->snapshot_base = base;
+	return true;
+}
+
+/*
+ * Resizing streams the prefix sets of the old filter into the new one. The
+ * new table is written front to back, the same way qf_bulk_load lays out its
+ * input: every prefix set is written at the first free slot at or after its
+ * home slot, runends and occupieds are set once a run is complete, and block
+ * offsets are fixed up as runs cross block boundaries. There is no search for
+ * empty slots and no shifting, so resizing is linear in the size of the
+ * filter.
+ */
+
+// NEW IN MEMENTO
+typedef struct {
+    QF *qf;
+    uint64_t run;           // Home slot of the run being written
+    uint64_t run_start;     // First slot of the run being written
+    uint64_t pos;           // Next slot to be written
+    bool run_open;
+    uint64_t nelts;
+    uint64_t ndistinct_elts;
+    uint64_t noccupied_slots;
+} sequential_writer;
+
+// NEW IN MEMENTO
+typedef struct {
+    const QF *qf;           // Filter being read
+    const QF *dest;         // Filter whose geometry is used for the output
+    QFi qfi;
+    uint64_t dest_run;      // Home slot in `dest` of the prefix sets being yielded
+    uint64_t end_run;       // Home slots in `dest` at or after this one are skipped
+    uint64_t src_run;       // Run of `qf` that holds these prefix sets
+    QFi src_run_start;
+    bool src_run_open;
+    bool src_run_started;   // Whether `src_run` and `src_run_start` are set
+    uint64_t src_run_hash;  // Hash bits that determine `src_run`
+    uint32_t src_fingerprint_shift;
+    uint64_t *mementos;
+    uint64_t mementos_capacity;
+    uint64_t bucket;        // Output of the last call to remap_cursor_next
+    uint64_t fingerprint;
+    bool merging;           // Whether `dest` has fewer home slots than `qf`
+    uint64_t *merged;       // Sorted (fingerprint, memento) pairs of `dest_run`
+    uint64_t merged_len;
+    uint64_t merged_pos;
+    uint64_t merged_capacity;
+} remap_cursor;
+
+// Number of slots that write_prefix_set will use for the given prefix set.
+// NEW IN MEMENTO
+static inline uint64_t prefix_set_slot_count(const QF *qf, const uint64_t fingerprint,
+                                const uint64_t *mementos, const uint64_t memento_cnt)
+{
+    if (memento_cnt == 1)
+        return 1;
+    if (fingerprint == 0)
+        return memento_cnt;
+    if (memento_cnt == 2)
+        return 2 + (mementos[0] == mementos[1]);
+
+    const uint64_t memento_bits = qf->metadata->memento_bits;
+    const uint64_t max_memento_value = (1ULL << memento_bits) - 1;
+    const uint64_t list_len = memento_cnt - 2;
+    uint64_t list_bits = (list_len + 1) * memento_bits;
+    if (list_len >= max_memento_value) {
+        uint64_t frag_cnt = 0;
+        for (uint64_t cnt = list_len; cnt; cnt /= max_memento_value)
+            frag_cnt++;
+        list_bits += 2 * (frag_cnt - 1) * memento_bits;
+    }
+    return 2 + (list_bits + qf->metadata->bits_per_slot - 1) / qf->metadata->bits_per_slot;
+}
+
+// Position in the sorted memento list of a prefix set.
+// NEW IN MEMENTO
+typedef struct {
+    uint64_t data;
+    int32_t filled_bits;
+    int64_t bit_pos;
+    uint64_t block_ind;
+} memento_list_reader;
+
+// Decodes the length of the memento list that starts at slot `pos`, i.e.,
+// after the two mementos that open a prefix set, and leaves `r` at its
+// first memento. The length is written in unary-terminated base
+// 2^memento_bits - 1 if it does not fit in a single memento.
+// NEW IN MEMENTO
+static inline uint64_t memento_list_begin(const QF *qf, const uint64_t pos,
+                                          memento_list_reader *r)
+{
+    const uint64_t memento_bits = qf->metadata->memento_bits;
+    const uint64_t max_memento_value = (1ULL << memento_bits) - 1;
+    r->data = 0;
+    r->filled_bits = 0;
+    r->bit_pos = (pos % QF_SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot;
+    r->block_ind = pos / QF_SLOTS_PER_BLOCK;
+    GET_NEXT_DATA_WORD_IF_EMPTY(qf, r->data, r->filled_bits, memento_bits,
+                                r->bit_pos, r->block_ind);
+    uint64_t memento_count = r->data & max_memento_value;
+    r->data >>= memento_bits;
+    r->filled_bits -= memento_bits;
+    if (memento_count == max_memento_value) {
+        uint64_t length = 2, pw = 1;
+        memento_count = 0;
+        while (length) {
+            GET_NEXT_DATA_WORD_IF_EMPTY(qf, r->data, r->filled_bits, memento_bits,
+                                        r->bit_pos, r->block_ind);
+            const uint64_t current_fragment = r->data & max_memento_value;
+            if (current_fragment == max_memento_value) {
+                length++;
+            }
+            else {
+                length--;
+                memento_count += pw * current_fragment;
+                pw *= max_memento_value;
+            }
+            r->data >>= memento_bits;
+            r->filled_bits -= memento_bits;
+        }
+    }
+    return memento_count;
+}
+
+// NEW IN MEMENTO
+static inline uint64_t memento_list_next(const QF *qf, memento_list_reader *r)
+{
+    const uint64_t memento_bits = qf->metadata->memento_bits;
+    GET_NEXT_DATA_WORD_IF_EMPTY(qf, r->data, r->filled_bits, memento_bits,
+                                r->bit_pos, r->block_ind);
+    const uint64_t memento = r->data & BITMASK(memento_bits);
+    r->data >>= memento_bits;
+    r->filled_bits -= memento_bits;
+    return memento;
+}
+
+// Number of mementos in the prefix set that the iterator points to.
+// NEW IN MEMENTO
+static inline uint64_t qfi_memento_count(const QFi *qfi)
+{
+    const QF *qf = qfi->qf;
+    const uint64_t current = qfi->current;
+    if (is_runend(qf, current) 
+            || GET_FINGERPRINT(qf, current) <= GET_FINGERPRINT(qf, current + 1))
+        return 1;
+    if (GET_MEMENTO(qf, current) < GET_MEMENTO(qf, current + 1))
+        return 2;
+
+    memento_list_reader reader;
+    return memento_list_begin(qf, current + 2, &reader) + 2;
+}
+
+// NEW IN MEMENTO
+static inline void sequential_writer_init(sequential_writer *w, QF *qf, uint64_t pos)
+{
+    w->qf = qf;
+    w->run = w->run_start = 0;
+    w->pos = pos;
+    w->run_open = false;
+    w->nelts = w->ndistinct_elts = w->noccupied_slots = 0;
+}
+
+// NEW IN MEMENTO
+static inline void sequential_writer_close_run(sequential_writer *w)
+{
+    QF *qf = w->qf;
+    const uint64_t max_offset = BITMASK(8 * sizeof(qf->blocks[0].offset));
+    MUTABLE_METADATA_WORD(qf, occupieds, w->run) |= 1ULL << ((w->run % QF_SLOTS_PER_BLOCK) % 64);
+    MUTABLE_METADATA_WORD(qf, runends, w->pos - 1) |= 1ULL << (((w->pos - 1) % QF_SLOTS_PER_BLOCK) % 64);
+    for (uint64_t block_ind = w->run / QF_SLOTS_PER_BLOCK + 1; 
+            block_ind <= (w->pos - 1) / QF_SLOTS_PER_BLOCK; block_ind++) {
+        const uint64_t block_start = block_ind * QF_SLOTS_PER_BLOCK;
+        const uint64_t cnt = w->pos - (block_start < w->run_start ? w->run_start : block_start);
+        if (BLOCK_OFFSET(qf, block_ind) + cnt < max_offset)
+            MUTABLE_BLOCK_OFFSET(qf, block_ind) += cnt;
+        else
+            MUTABLE_BLOCK_OFFSET(qf, block_ind) = max_offset;
+    }
+    w->run_open = false;
+}
+
+// Appends a prefix set to the filter. Prefix sets must be appended in the
+// order in which they appear in the filter, i.e. sorted by their home slot
+// and, within a run, by their fingerprints.
+// NEW IN MEMENTO
+static inline int sequential_writer_append(sequential_writer *w, const uint64_t bucket,
+                                    const uint64_t fingerprint, const uint64_t *mementos, 
+                                    const uint64_t memento_cnt)
+{
+    assert(!w->run_open || w->run <= bucket);
+    if (w->run_open && w->run != bucket)
+        sequential_writer_close_run(w);
+    if (!w->run_open) {
+        w->run = bucket;
+        w->run_start = (w->pos < bucket ? bucket : w->pos);
+        w->pos = w->run_start;
+        w->run_open = true;
+    }
+    const uint64_t slot_cnt = prefix_set_slot_count(w->qf, fingerprint, mementos, memento_cnt);
+    if (w->pos + slot_cnt > w->qf->metadata->xnslots)
+        return QF_NO_SPACE;
+    write_prefix_set(w->qf, w->pos, fingerprint, mementos, memento_cnt);
+    w->pos += slot_cnt;
+    w->noccupied_slots += slot_cnt;
+    w->ndistinct_elts++;
+    w->nelts += memento_cnt;
+    return 0;
+}
+
+// NEW IN MEMENTO
+static inline void sequential_writer_finish(sequential_writer *w)
+{
+    if (w->run_open)
+        sequential_writer_close_run(w);
+}
+
+// Tracks where the prefix sets would land without writing them.
+// NEW IN MEMENTO
+static inline void sequential_writer_skip(uint64_t *pos, uint64_t *run, bool *run_open,
+                                    const uint64_t bucket, const uint64_t slot_cnt)
+{
+    if (!*run_open || *run != bucket) {
+        *run = bucket;
+        *pos = (*pos < bucket ? bucket : *pos);
+        *run_open = true;
+    }
+    *pos += slot_cnt;
+}
+
+/*
+ * The remap cursor yields the prefix sets of `qf` in the order in which they
+ * must be laid out in `dest`, i.e., home slot by home slot of `dest`. When the
+ * filter grows, the prefix sets of a home slot of `dest` all come from the
+ * same run of `qf`: the one selected by the hash bits that determine the home
+ * slot. Within that run, they are the ones whose fingerprints agree with
+ * these bits, and they are already sorted by fingerprint. When the filter
+ * shrinks, a home slot of `dest` instead gathers the runs of all the home
+ * slots of `qf` that it absorbs. Their hash bits move into the fingerprints,
+ * so the prefix sets are collected and sorted again, and prefix sets that end
+ * up with the same fingerprint are merged into one. Only the home slots of
+ * `dest` in [`first_run`, `end_run`) are visited.
+ */
+// NEW IN MEMENTO
+static inline bool remap_cursor_init(remap_cursor *c, const QF *qf, const QF *dest,
+                                    const uint64_t first_run, const uint64_t end_run)
+{
+    assert(dest->metadata->original_quotient_bits == qf->metadata->original_quotient_bits);
+    assert(dest->metadata->original_nslots == qf->metadata->original_nslots);
+
+    c->qf = qf;
+    c->dest = dest;
+    c->dest_run = first_run;
+    c->end_run = end_run;
+    c->src_run_open = c->src_run_started = false;
+    const qf_allocator *allocator = &dest->runtimedata->allocator;
+    c->mementos_capacity = 1024;
+    c->mementos = (uint64_t *)qf_alloc(allocator, c->mementos_capacity * sizeof(uint64_t),
+                                        sizeof(uint64_t));
+    c->merging = dest->metadata->nslots < qf->metadata->nslots;
+    c->merged = NULL;
+    c->merged_len = c->merged_pos = c->merged_capacity = 0;
+    if (c->merging) {
+        c->merged_capacity = 1024;
+        c->merged = (uint64_t *)qf_alloc(allocator, 2 * c->merged_capacity * sizeof(uint64_t),
+                                        sizeof(uint64_t));
+    }
+    if (c->mementos == NULL || (c->merging && c->merged == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory for the remap cursor.\n");
+        qf_dealloc(allocator, c->mementos, c->mementos_capacity * sizeof(uint64_t));
+        qf_dealloc(allocator, c->merged, 2 * c->merged_capacity * sizeof(uint64_t));
+        return false;
+    }
+    return true;
+}
+
+// NEW IN MEMENTO
+static inline void remap_cursor_destroy(remap_cursor *c)
+{
+    const qf_allocator *allocator = &c->dest->runtimedata->allocator;
+    qf_dealloc(allocator, c->mementos, c->mementos_capacity * sizeof(uint64_t));
+    qf_dealloc(allocator, c->merged, 2 * c->merged_capacity * sizeof(uint64_t));
+}
+
+// Grows a buffer of `*capacity` words that belongs to `dest` to hold at least
+// `count` words, times `words_per_entry`.
+// NEW IN MEMENTO
+static inline bool reserve_scratch(const QF *dest, uint64_t **buffer, uint64_t *capacity,
+                                    const uint64_t count, const uint64_t words_per_entry)
+{
+    if (count <= *capacity)
+        return true;
+    uint64_t new_capacity = *capacity;
+    while (count > new_capacity)
+        new_capacity *= 2;
+    uint64_t *new_buffer = (uint64_t *)qf_realloc(&dest->runtimedata->allocator, *buffer,
+                                        words_per_entry * *capacity * sizeof(uint64_t),
+                                        words_per_entry * new_capacity * sizeof(uint64_t),
+                                        sizeof(uint64_t));
+    if (new_buffer == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for the remap cursor.\n");
+        return false;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return true;
+}
+
+// NEW IN MEMENTO
+static inline bool remap_cursor_reserve_mementos(remap_cursor *c, const uint64_t memento_count)
+{
+    return reserve_scratch(c->dest, &c->mementos, &c->mementos_capacity, memento_count, 1);
+}
+
+// NEW IN MEMENTO
+static int compare_fingerprint_memento_pairs(const void *a, const void *b)
+{
+    const uint64_t *x = (const uint64_t *)a, *y = (const uint64_t *)b;
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+    if (x[1] != y[1])
+        return x[1] < y[1] ? -1 : 1;
+    return 0;
+}
+
+// Places a prefix set of an expandable filter, of which only the low
+// `known_bits` bits of `hash` are known, in home slot `bucket` of `dest`.
+// Returns false if the prefix set does not belong there. A prefix set whose
+// fingerprint ran out of bits belongs to every home slot that agrees with
+// the bits it kept.
+// NEW IN MEMENTO
+static inline bool remap_expandable_fingerprint(const QF *dest, const uint64_t hash,
+                                    const uint32_t known_bits, const uint64_t bucket,
+                                    uint64_t *fingerprint)
+{
+    uint32_t shift;
+    const uint64_t bucket_hash = bucket_to_hash(dest, bucket, &shift);
+    if ((bucket_hash ^ hash) & BITMASK(known_bits < shift ? known_bits : shift))
+        return false;
+    uint32_t len = (known_bits > shift ? known_bits - shift : 0);
+    if (len > dest->metadata->key_bits - shift)
+        len = dest->metadata->key_bits - shift;
+    *fingerprint = (1ULL << len) | ((hash >> shift) & BITMASK(len));
+    return true;
+}
+
+// Collects the mementos of all the runs of `qf` that are absorbed by home
+// slot `dest_run` of `dest`, keyed and sorted by their fingerprints in `dest`.
+// NEW IN MEMENTO
+static inline bool remap_cursor_gather(remap_cursor *c)
+{
+    const QF *qf = c->qf;
+    uint32_t dest_shift;
+    const uint64_t dest_hash = bucket_to_hash(c->dest, c->dest_run, &dest_shift);
+    const uint32_t src_shift = qf->metadata->original_quotient_bits + get_extension_bits(qf)
+                                + (qf->metadata->split_buckets ? 1 : 0);
+    assert(src_shift >= dest_shift);
+
+    c->merged_len = c->merged_pos = 0;
+    for (uint64_t bits = 0; bits < (1ULL << (src_shift - dest_shift)); bits++) {
+        uint32_t fingerprint_shift;
+        uint64_t src_run, fingerprint;
+        hash_to_bucket_and_fingerprint(qf, dest_hash | (bits << dest_shift), 
+                                        &src_run, &fingerprint);
+        bucket_to_hash(qf, src_run, &fingerprint_shift);
+        // Visit every run once, for the bits that it actually uses
+        if ((bits >> (fingerprint_shift - dest_shift)) || !is_occupied(qf, src_run))
+            continue;
+
+        QFi qfi;
+        qf_iterator_from_position(qf, &qfi, src_run);
+        while (!qfi_end(&qfi) && qfi.run == src_run) {
+            const uint64_t memento_count = qfi_memento_count(&qfi);
+            if (!remap_cursor_reserve_mementos(c, memento_count))
+                return false;
+            uint64_t hash, bucket;
+            qfi_get_hash(&qfi, &hash, c->mementos);
+            hash_to_bucket_and_fingerprint(c->dest, hash, &bucket, &fingerprint);
+            assert(bucket == c->dest_run);
+            if (qf->metadata->expandable) {
+                const uint32_t len = highbit_position(GET_FINGERPRINT(qf, qfi.current));
+                remap_expandable_fingerprint(c->dest, hash, fingerprint_shift + len,
+                                            c->dest_run, &fingerprint);
+            }
+            if (!reserve_scratch(c->dest, &c->merged, &c->merged_capacity,
+                                c->merged_len + memento_count, 2))
+                return false;
+            for (uint64_t i = 0; i < memento_count; i++) {
+                c->merged[2 * c->merged_len] = fingerprint;
+                c->merged[2 * c->merged_len + 1] = c->mementos[i];
+                c->merged_len++;
+            }
+            qfi_next(&qfi);
+        }
+    }
+    qsort(c->merged, c->merged_len, 2 * sizeof(uint64_t), compare_fingerprint_memento_pairs);
+    return true;
+}
+
+// Merging counterpart of remap_cursor_next.
+// NEW IN MEMENTO
+static inline int64_t remap_cursor_next_merged(remap_cursor *c)
+{
+    while (c->merged_pos == c->merged_len) {
+        if (c->src_run_open)
+            c->dest_run++;
+        if (c->dest_run >= c->end_run)
+            return QFI_INVALID;
+        if (!remap_cursor_gather(c))
+            return QF_NO_MEMORY;
+        c->src_run_open = true;
+    }
+    c->bucket = c->dest_run;
+    c->fingerprint = c->merged[2 * c->merged_pos];
+    uint64_t end = c->merged_pos;
+    while (end < c->merged_len && c->merged[2 * end] == c->fingerprint)
+        end++;
+    const uint64_t memento_count = end - c->merged_pos;
+    if (!remap_cursor_reserve_mementos(c, memento_count))
+        return QF_NO_MEMORY;
+    for (uint64_t i = 0; i < memento_count; i++)
+        c->mementos[i] = c->merged[2 * (c->merged_pos + i) + 1];
+    c->merged_pos = end;
+    return memento_count;
+}
+
+// Returns the number of mementos in the next prefix set, QFI_INVALID once
+// all the home slots have been visited, or QF_NO_MEMORY.
+// NEW IN MEMENTO
+static inline int64_t remap_cursor_next(remap_cursor *c)
+{
+    if (c->merging)
+        return remap_cursor_next_merged(c);
+
+    const QF *qf = c->qf;
+    while (true) {
+        if (!c->src_run_open) {
+            if (c->dest_run >= c->end_run)
+                return QFI_INVALID;
+            uint32_t fingerprint_shift;
+            uint64_t src_run, fingerprint;
+            const uint64_t hash = bucket_to_hash(c->dest, c->dest_run, &fingerprint_shift);
+            hash_to_bucket_and_fingerprint(qf, hash, &src_run, &fingerprint);
+            if (!is_occupied(qf, src_run)) {
+                c->dest_run++;
+                continue;
+            }
+            // Runs are usually visited in order, or several times in a row,
+            // so the iterator rarely has to be looked up from scratch
+            if (c->src_run_started && src_run == c->src_run)
+                c->qfi = c->src_run_start;
+            else if (!c->src_run_started || qfi_end(&c->qfi) || c->qfi.run != src_run)
+                qf_iterator_from_position(qf, &c->qfi, src_run);
+            c->src_run = src_run;
+            c->src_run_start = c->qfi;
+            c->src_run_started = true;
+            c->src_run_hash = bucket_to_hash(qf, c->src_run, &c->src_fingerprint_shift);
+            c->src_run_open = true;
+        }
+        if (qfi_end(&c->qfi) || c->qfi.run != c->src_run) {
+            c->src_run_open = false;
+            c->dest_run++;
+            continue;
+        }
+
+        const uint64_t fingerprint = GET_FINGERPRINT(qf, c->qfi.current);
+        bool belongs;
+        if (qf->metadata->expandable) {
+            // Strip the marker bit of the fingerprint
+            const uint32_t len = highbit_position(fingerprint);
+            const uint64_t hash = c->src_run_hash 
+                    | ((fingerprint ^ (1ULL << len)) << c->src_fingerprint_shift);
+            c->bucket = c->dest_run;
+            belongs = remap_expandable_fingerprint(c->dest, hash, c->src_fingerprint_shift + len,
+                                                    c->dest_run, &c->fingerprint);
+        }
+        else {
+            const uint64_t hash = c->src_run_hash | (fingerprint << c->src_fingerprint_shift);
+            hash_to_bucket_and_fingerprint(c->dest, hash, &c->bucket, &c->fingerprint);
+            belongs = c->bucket == c->dest_run;
+        }
+        if (!belongs) {
+            qfi_next(&c->qfi);
+            continue;
+        }
+        const uint64_t memento_count = qfi_memento_count(&c->qfi);
+        if (!remap_cursor_reserve_mementos(c, memento_count))
+            return QF_NO_MEMORY;
+        uint64_t unused_hash;
+        qfi_get_hash(&c->qfi, &unused_hash, c->mementos);
+        qfi_next(&c->qfi);
+        return memento_count;
+    }
+}
+
+// NEW IN MEMENTO
+static inline void add_writer_counts(QF *qf, const sequential_writer *w)
+{
+    qf->metadata->nelts += w->nelts;
+    qf->metadata->ndistinct_elts += w->ndistinct_elts;
+    qf->metadata->noccupied_slots += w->noccupied_slots;
+}
+
+// Copies the contents of `qf` into the empty filter `new_qf`, which may be
+// larger or smaller than `qf`. Returns the number of mementos copied,
+// QF_NO_SPACE or QF_NO_MEMORY.
+// NEW IN MEMENTO
+static int64_t stream_into_filter(const QF *qf, QF *new_qf)
+{
+    remap_cursor cursor;
+    sequential_writer writer;
+    if (!remap_cursor_init(&cursor, qf, new_qf, 0, new_qf->metadata->nslots))
+        return QF_NO_MEMORY;
+    sequential_writer_init(&writer, new_qf, 0);
+
+    int64_t ret_numkeys = 0, memento_count;
+    while ((memento_count = remap_cursor_next(&cursor)) >= 0) {
+        int ret = sequential_writer_append(&writer, cursor.bucket, cursor.fingerprint,
+                                            cursor.mementos, memento_count);
+        if (ret < 0) {
+            remap_cursor_destroy(&cursor);
+            return ret;
+        }
+        ret_numkeys += memento_count;
+    }
+    remap_cursor_destroy(&cursor);
+    if (memento_count == QF_NO_MEMORY)
+        return QF_NO_MEMORY;
+    sequential_writer_finish(&writer);
+    add_writer_counts(new_qf, &writer);
+    return ret_numkeys;
+}
+
+/*
+ * Parallel resizing splits the home slots of the new filter into contiguous
+ * ranges that start at a block boundary, and gives each range to a worker. A cluster may spill out of one range into the next, so
+ * the copy happens in two passes. In the first pass every worker computes
+ * where its output would end if nothing spilled into it, and how many slots
+ * it writes; a prefix scan over the workers then yields the slot at which
+ * each worker has to start. In the second pass the workers write their
+ * ranges. The words at the border of two ranges are shared, so a worker does
+ * not write the runs whose home block lies within reach of the previous
+ * worker's writes. It records them instead, and they are written by the
+ * calling thread once all workers are done, stitching the ranges together.
+ */
+
+// NEW IN MEMENTO
+typedef struct {
+    const QF *qf;
+    QF *new_qf;
+    uint64_t first_run;
+    uint64_t end_run;
+    uint64_t free_end;      // End of the output if nothing spills into it
+    uint64_t slot_cnt;
+    uint64_t start_pos;     // Slot at which the output actually starts
+    uint64_t fence;         // Runs homed before this block are deferred
+    uint64_t *deferred;     // [bucket, fingerprint, count, mementos...]*
+    uint64_t deferred_len;
+    uint64_t deferred_capacity;
+    sequential_writer writer;
+    int64_t ret;
+    bool threaded;          // Whether the worker runs on a thread of its own
+} resize_worker;
+
+// NEW IN MEMENTO
+static void *resize_worker_measure(void *arg)
+{
+    resize_worker *rw = (resize_worker *)arg;
+    remap_cursor cursor;
+    rw->ret = 0;
+    if (!remap_cursor_init(&cursor, rw->qf, rw->new_qf, rw->first_run, rw->end_run)) {
+        rw->ret = QF_NO_MEMORY;
+        return NULL;
+    }
+
+    uint64_t pos = 0, run = 0;
+    bool run_open = false;
+    int64_t memento_count;
+    rw->slot_cnt = 0;
+    while ((memento_count = remap_cursor_next(&cursor)) >= 0) {
+        const uint64_t slot_cnt = prefix_set_slot_count(rw->new_qf, cursor.fingerprint,
+                                                        cursor.mementos, memento_count);
+        sequential_writer_skip(&pos, &run, &run_open, cursor.bucket, slot_cnt);
+        rw->slot_cnt += slot_cnt;
+    }
+    if (memento_count == QF_NO_MEMORY)
+        rw->ret = QF_NO_MEMORY;
+    rw->free_end = pos;
+    remap_cursor_destroy(&cursor);
+    return NULL;
+}
+
+// NEW IN MEMENTO
+static inline bool resize_worker_defer(resize_worker *rw, const uint64_t bucket,
+                    const uint64_t fingerprint, const uint64_t *mementos,
+                    const uint64_t memento_count)
+{
+    if (rw->deferred_len + memento_count + 3 > rw->deferred_capacity) {
+        uint64_t capacity = rw->deferred_capacity;
+        while (rw->deferred_len + memento_count + 3 > capacity)
+            capacity = 2 * capacity + 64;
+        uint64_t *deferred = (uint64_t *)qf_realloc(&rw->new_qf->runtimedata->allocator,
+                                    rw->deferred, rw->deferred_capacity * sizeof(uint64_t),
+                                    capacity * sizeof(uint64_t), sizeof(uint64_t));
+        if (deferred == NULL) {
+            fprintf(stderr, "Couldn't allocate memory for the resize worker.\n");
+            return false;
+        }
+        rw->deferred = deferred;
+        rw->deferred_capacity = capacity;
+    }
+    rw->deferred[rw->deferred_len++] = bucket;
+    rw->deferred[rw->deferred_len++] = fingerprint;
+    rw->deferred[rw->deferred_len++] = memento_count;
+    memcpy(rw->deferred + rw->deferred_len, mementos, memento_count * sizeof(uint64_t));
+    rw->deferred_len += memento_count;
+    return true;
+}
+
+// NEW IN MEMENTO
+static void *resize_worker_write(void *arg)
+{
+    resize_worker *rw = (resize_worker *)arg;
+    remap_cursor cursor;
+    if (!remap_cursor_init(&cursor, rw->qf, rw->new_qf, rw->first_run, rw->end_run)) {
+        rw->ret = QF_NO_MEMORY;
+        return NULL;
+    }
+
+    uint64_t pos = rw->start_pos, run = 0;
+    bool run_open = false, deferring = true;
+    int64_t memento_count;
+    rw->ret = 0;
+    while ((memento_count = remap_cursor_next(&cursor)) >= 0) {
+        if (deferring && cursor.bucket / QF_SLOTS_PER_BLOCK < rw->fence) {
+            const uint64_t slot_cnt = prefix_set_slot_count(rw->new_qf, cursor.fingerprint,
+                                                            cursor.mementos, memento_count);
+            sequential_writer_skip(&pos, &run, &run_open, cursor.bucket, slot_cnt);
+            if (!resize_worker_defer(rw, cursor.bucket, cursor.fingerprint, 
+                                    cursor.mementos, memento_count)) {
+                memento_count = QF_NO_MEMORY;
+                break;
+            }
+        }
+        else {
+            if (deferring) {
+                sequential_writer_init(&rw->writer, rw->new_qf, pos);
+                deferring = false;
+            }
+            int ret = sequential_writer_append(&rw->writer, cursor.bucket, cursor.fingerprint,
+                                                cursor.mementos, memento_count);
+            if (ret < 0) {
+                rw->ret = ret;
+                break;
+            }
+        }
+        rw->ret += memento_count;
+    }
+    if (memento_count == QF_NO_MEMORY)
+        rw->ret = QF_NO_MEMORY;
+    if (deferring)
+        sequential_writer_init(&rw->writer, rw->new_qf, pos);
+    else
+        sequential_writer_finish(&rw->writer);
+    remap_cursor_destroy(&cursor);
+    return NULL;
+}
+
+// Runs `work` for every worker, each on a thread of its own, and waits for
+// them. A worker whose thread cannot be created runs on the calling thread
+// instead, so the resize degrades to a serial one rather than failing.
+// NEW IN MEMENTO
+static void run_resize_workers(resize_worker *workers, pthread_t *threads,
+                               const uint32_t num_threads, void *(*work)(void *))
+{
+    for (uint32_t i = 0; i < num_threads; i++) {
+        workers[i].threaded = (pthread_create(&threads[i], NULL, work, &workers[i]) == 0);
+        if (!workers[i].threaded)
+            work(&workers[i]);
+    }
+    for (uint32_t i = 0; i < num_threads; i++) {
+        if (workers[i].threaded)
+            pthread_join(threads[i], NULL);
+    }
+}
+
+// NEW IN MEMENTO
+static int64_t stream_into_filter_parallel(const QF *qf, QF *new_qf, uint32_t num_threads)
+{
+    const uint64_t nblocks = (new_qf->metadata->nslots + QF_SLOTS_PER_BLOCK - 1) / QF_SLOTS_PER_BLOCK;
+    if (num_threads > nblocks)
+        num_threads = nblocks;
+    if (num_threads <= 1)
+        return stream_into_filter(qf, new_qf);
+
+    const qf_allocator *allocator = &new_qf->runtimedata->allocator;
+    resize_worker *workers = (resize_worker *)qf_zalloc(allocator, 
+                                            num_threads * sizeof(resize_worker), sizeof(uint64_t));
+    pthread_t *threads = (pthread_t *)qf_alloc(allocator, num_threads * sizeof(pthread_t),
+                                                sizeof(uint64_t));
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for the resize workers.\n");
+        qf_dealloc(allocator, workers, num_threads * sizeof(resize_worker));
+        qf_dealloc(allocator, threads, num_threads * sizeof(pthread_t));
+        return QF_NO_MEMORY;
+    }
+    for (uint32_t i = 0; i < num_threads; i++) {
+        workers[i].qf = qf;
+        workers[i].new_qf = new_qf;
+        workers[i].first_run = nblocks * i / num_threads * QF_SLOTS_PER_BLOCK;
+        workers[i].end_run = nblocks * (i + 1) / num_threads * QF_SLOTS_PER_BLOCK;
+        if (workers[i].end_run > new_qf->metadata->nslots)
+            workers[i].end_run = new_qf->metadata->nslots;
+    }
+
+    int64_t ret_numkeys = 0;
+    run_resize_workers(workers, threads, num_threads, resize_worker_measure);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        if (workers[i].ret < 0) {
+            ret_numkeys = workers[i].ret;
+            goto cleanup;
+        }
+    }
+
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < num_threads; i++) {
+        workers[i].start_pos = pos;
+        workers[i].fence = (i == 0 || pos == 0 ? 0 : (pos - 1) / QF_SLOTS_PER_BLOCK + 2);
+        pos = (workers[i].free_end > pos + workers[i].slot_cnt ? workers[i].free_end
+                                                                : pos + workers[i].slot_cnt);
+    }
+    if (pos > new_qf->metadata->xnslots) {
+        ret_numkeys = QF_NO_SPACE;
+        goto cleanup;
+    }
+
+    run_resize_workers(workers, threads, num_threads, resize_worker_write);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        if (workers[i].ret < 0) {
+            ret_numkeys = workers[i].ret;
+            goto cleanup;
+        }
+        ret_numkeys += workers[i].ret;
+        add_writer_counts(new_qf, &workers[i].writer);
+    }
+
+    // Stitch the ranges together
+    for (uint32_t i = 0; i < num_threads; i++) {
+        sequential_writer writer;
+        sequential_writer_init(&writer, new_qf, workers[i].start_pos);
+        for (uint64_t j = 0; j < workers[i].deferred_len; j += 3 + workers[i].deferred[j + 2]) {
+            const uint64_t *entry = workers[i].deferred + j;
+            sequential_writer_append(&writer, entry[0], entry[1], entry + 3, entry[2]);
+        }
+        sequential_writer_finish(&writer);
+        add_writer_counts(new_qf, &writer);
+    }
+
+cleanup:
+    for (uint32_t i = 0; i < num_threads; i++)
+        qf_dealloc(allocator, workers[i].deferred, workers[i].deferred_capacity * sizeof(uint64_t));
+    qf_dealloc(allocator, workers, num_threads * sizeof(resize_worker));
+    qf_dealloc(allocator, threads, num_threads * sizeof(pthread_t));
+    return ret_numkeys;
+}
+
+// Key bits of a copy of `qf` with `nslots` slots. Expandable filters keep
+// the length of their fingerprints and lengthen their keys instead.
+// NEW IN MEMENTO
+static inline uint64_t resized_key_bits(const QF *qf, const uint64_t nslots)
+{
+    if (!qf->metadata->expandable)
+        return qf->metadata->key_bits;
+    uint64_t extension_bits, split_buckets;
+    round_to_split_size(qf->metadata->original_nslots, nslots, &extension_bits, &split_buckets);
+    return qf->metadata->key_bits + extension_bits - get_extension_bits(qf);
+}
+
+static int64_t resize_malloc(QF *qf, uint64_t nslots, uint32_t num_threads)   // NEW IN MEMENTO
+{
+#ifdef DEBUG
+    uint64_t occupied_cnt = 0, runend_cnt = 0;
+    for (uint32_t i = 0; i < qf->metadata->nblocks; i++) {
+        occupied_cnt += popcnt(BLOCK_OCCUPIEDS(qf, i)[0]);
+        runend_cnt += popcnt(BLOCK_RUNENDS(qf, i)[0]);
+        assert(occupied_cnt >= runend_cnt);
+    }
+    assert(occupied_cnt == runend_cnt);
+#endif /* DEBUG */
+
+	// The new table would live in anonymous memory, away from the file or
+	// the shared memory segment that the filter is kept in
+	if (qf->runtimedata->shared_locks || qf->runtimedata->f_info.filepath != NULL) {
+		fprintf(stderr, "A filter in a file or in shared memory cannot be resized.\n");
+		return QF_INVALID;
+	}
+
+	QF new_qf;
+	const qf_alloc_options options = filter_alloc_options(qf);
+	if (!malloc_filter(&new_qf, nslots, resized_key_bits(qf, nslots),
+                         qf->metadata->memento_bits, qf->metadata->hash_mode,
+                         qf->metadata->seed, qf->metadata->original_quotient_bits,
+                         qf->metadata->original_nslots, &options))
+		return QF_NO_MEMORY;
+	qf_resize_policy policy;
+	qf_get_resize_policy(qf, &policy);
+	qf_set_resize_policy(&new_qf, &policy);
+
+	// copy keys from qf into new_qf
+	int64_t ret_numkeys = (num_threads > 1 ? stream_into_filter_parallel(qf, &new_qf, num_threads)
+                                            : stream_into_filter(qf, &new_qf));
+	if (ret_numkeys < 0) {
+		fprintf(stderr, "Failed to copy the keys into the new CQF.\n");
+		qf_free(&new_qf);
+		return ret_numkeys;
+	}
+	if (qf->runtimedata->dirty_regions != NULL && !init_dirty_regions(&new_qf, true)) {
+		qf_free(&new_qf);
+		return QF_NO_MEMORY;
+	}
+
+	qf_free(qf);
+	memcpy(qf, &new_qf, sizeof(QF));
+
+#ifdef DEBUG
+    perror("FINAL CHECK");
+    occupied_cnt = 0, runend_cnt = 0;
+    for (uint32_t i = 0; i < qf->metadata->nblocks; i++) {
+        occupied_cnt += popcnt(BLOCK_OCCUPIEDS(qf, i)[0]);
+        runend_cnt += popcnt(BLOCK_RUNENDS(qf, i)[0]);
+        assert(occupied_cnt >= runend_cnt);
+
+        if (0 < BLOCK_OFFSET(qf, i) 
+                && BLOCK_OFFSET(qf, i) < BITMASK(8 * sizeof(qf->blocks[0].offset))) {
+            assert(is_runend(qf, i * QF_SLOTS_PER_BLOCK + BLOCK_OFFSET(qf, i) - 1));
+        }
+    }
+    assert(occupied_cnt == runend_cnt);
+#endif /* DEBUG */
+
+	return ret_numkeys;
+}
+
+int64_t qf_resize_malloc(QF *qf, uint64_t nslots)   // NEW IN MEMENTO
+{
+    return resize_malloc(qf, nslots, 1);
+}
+
+int64_t qf_resize_malloc_parallel(QF *qf, uint64_t nslots, uint32_t num_threads)    // NEW IN MEMENTO
+{
+    return resize_malloc(qf, nslots, num_threads);
+}
+
+int64_t qf_shrink(QF *qf, uint64_t nslots)    // NEW IN MEMENTO
+{
+    const uint64_t orig_nslots = qf->metadata->original_nslots;
+    uint64_t extension_bits, split_buckets;
+    if (nslots < orig_nslots)
+        nslots = orig_nslots;
+    if (round_to_split_size(orig_nslots, nslots, &extension_bits, &split_buckets) 
+            >= qf->metadata->nslots)
+        return qf->metadata->nelts;
+    return resize_malloc(qf, nslots, 1);
+}
+
+/*
+ * Merging streams the prefix sets of several filters into one, the same way
+ * resizing does. Every input gets a remap cursor that yields its prefix sets
+ * in the order of the output. The merge repeatedly takes the smallest
+ * (home slot, fingerprint) among the cursors, joins the mementos of all the
+ * prefix sets that agree on it into one sorted prefix set, and appends the
+ * result with a sequential writer.
+ */
+
+// NEW IN MEMENTO
+static int compare_mementos(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Copies the contents of the filters in `qf_arr` into the empty filter
+// `dest`. Returns the number of mementos copied, QF_NO_SPACE or QF_NO_MEMORY.
+// NEW IN MEMENTO
+static int64_t merge_into_filter(const QF *const qf_arr[], const int nqf, QF *dest)
+{
+    const qf_allocator *allocator = &dest->runtimedata->allocator;
+    remap_cursor *cursors = (remap_cursor *)qf_alloc(allocator, nqf * sizeof(remap_cursor),
+                                                    sizeof(uint64_t));
+    int64_t *counts = (int64_t *)qf_alloc(allocator, nqf * sizeof(int64_t), sizeof(uint64_t));
+    uint64_t mementos_capacity = 1024;
+    uint64_t *mementos = (uint64_t *)qf_alloc(allocator, mementos_capacity * sizeof(uint64_t),
+                                            sizeof(uint64_t));
+    sequential_writer writer;
+    int ninit = 0;
+    int64_t ret_numkeys = 0;
+    if (cursors == NULL || counts == NULL || mementos == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for the merge.\n");
+        ret_numkeys = QF_NO_MEMORY;
+        goto cleanup;
+    }
+    for (; ninit < nqf; ninit++) {
+        if (!remap_cursor_init(&cursors[ninit], qf_arr[ninit], dest, 0, dest->metadata->nslots)) {
+            ret_numkeys = QF_NO_MEMORY;
+            goto cleanup;
+        }
+        counts[ninit] = remap_cursor_next(&cursors[ninit]);
+        if (counts[ninit] == QF_NO_MEMORY) {
+            ninit++;
+            ret_numkeys = QF_NO_MEMORY;
+            goto cleanup;
+        }
+    }
+
+    sequential_writer_init(&writer, dest, 0);
+    while (true) {
+        int min_ind = -1;
+        for (int i = 0; i < nqf; i++) {
+            if (counts[i] < 0)
+                continue;
+            if (min_ind < 0 || cursors[i].bucket < cursors[min_ind].bucket
+                    || (cursors[i].bucket == cursors[min_ind].bucket
+                        && cursors[i].fingerprint < cursors[min_ind].fingerprint))
+                min_ind = i;
+        }
+        if (min_ind < 0)
+            break;
+
+        const uint64_t bucket = cursors[min_ind].bucket;
+        const uint64_t fingerprint = cursors[min_ind].fingerprint;
+        uint64_t memento_count = 0, nsets = 0;
+        for (int i = min_ind; i < nqf; i++) {
+            while (counts[i] >= 0 && cursors[i].bucket == bucket
+                    && cursors[i].fingerprint == fingerprint) {
+                if (!reserve_scratch(dest, &mementos, &mementos_capacity,
+                                    memento_count + counts[i], 1)) {
+                    ret_numkeys = QF_NO_MEMORY;
+                    goto cleanup;
+                }
+                memcpy(mementos + memento_count, cursors[i].mementos,
+                        counts[i] * sizeof(uint64_t));
+                memento_count += counts[i];
+                nsets++;
+                counts[i] = remap_cursor_next(&cursors[i]);
+                if (counts[i] == QF_NO_MEMORY) {
+                    ret_numkeys = QF_NO_MEMORY;
+                    goto cleanup;
+                }
+            }
+        }
+        if (nsets > 1)
+            qsort(mementos, memento_count, sizeof(uint64_t), compare_mementos);
+        int ret = sequential_writer_append(&writer, bucket, fingerprint, mementos, memento_count);
+        if (ret < 0) {
+            ret_numkeys = ret;
+            goto cleanup;
+        }
+        ret_numkeys += memento_count;
+    }
+    sequential_writer_finish(&writer);
+    add_writer_counts(dest, &writer);
+
+cleanup:
+    for (int i = 0; i < ninit; i++)
+        remap_cursor_destroy(&cursors[i]);
+    qf_dealloc(allocator, cursors, nqf * sizeof(remap_cursor));
+    qf_dealloc(allocator, counts, nqf * sizeof(int64_t));
+    qf_dealloc(allocator, mementos, mementos_capacity * sizeof(uint64_t));
+    return ret_numkeys;
+}
 
-#ifdef DEBUG
-        assert(fingerprint_size < 64);
-        assert(fingerprint_size > 0);
-
-        fprintf(stderr, "MOVING PREFIX SET: hash=");
-        for (int32_t i = 63; i >= 0; i--)
-            fprintf(stderr, "%lu", (key >> i) & 1);
-        fprintf(stderr, " fingerprint_size=%lu --- memento_count=%lu mementos=[", fingerprint_size, memento_count);
-        for (uint32_t i = 0; i < memento_count; i++)
-            fprintf(stderr, "%lu, ", mementos[i]);
-        fprintf(stderr, "\b\b]\n");
-#endif /* DEBUG */
-		qfi_next(&qfi);
+int64_t qf_multi_merge(const QF *const qf_arr[], int nqf, QF *qfr)    // NEW IN MEMENTO
+{
+    assert(nqf > 0);
+    const QF *largest = qf_arr[0];
+    uint64_t noccupied_slots = 0;
+    for (int i = 0; i < nqf; i++) {
+        const qfmetadata *a = qf_arr[0]->metadata, *b = qf_arr[i]->metadata;
+        if (a->hash_mode != b->hash_mode || a->seed != b->seed
+                || a->memento_bits != b->memento_bits
+                || a->original_quotient_bits != b->original_quotient_bits
+                || a->original_nslots != b->original_nslots
+                || a->expandable != b->expandable) {
+            fprintf(stderr, "Input QFs do not have the same geometry, hash mode or seed.\n");
+            return QF_INVALID;
+        }
+        if (b->nslots > largest->metadata->nslots)
+            largest = qf_arr[i];
+        noccupied_slots += b->noccupied_slots;
+    }
 
-		int ret = insert_mementos(&new_qf, key, mementos, memento_count, 
-                        new_qf.metadata->fingerprint_bits, QF_NO_LOCK | QF_KEY_IS_HASH);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to insert key: %" PRIx64 " into the new CQF.\n", key);
-			return ret;
-		}
-#ifdef DEBUG
-        qf_dump(&new_qf);
-#endif /* DEBUG */
-		ret_numkeys += memento_count;
-	} while(!qfi_end(&qfi));
+    // The output gets the load factor of the first input, and is doubled if
+    // the prefix sets do not fit after all
+    uint64_t nslots = noccupied_slots / qf_arr[0]->metadata->max_load_factor + 1;
+    if (nslots < largest->metadata->nslots)
+        nslots = largest->metadata->nslots;
+    const qf_alloc_options options = filter_alloc_options(qf_arr[0]);
+    qf_resize_policy policy;
+    qf_get_resize_policy(qf_arr[0], &policy);
+    while (true) {
+        if (!malloc_filter(qfr, nslots, resized_key_bits(largest, nslots),
+                            largest->metadata->memento_bits, largest->metadata->hash_mode,
+                            largest->metadata->seed, largest->metadata->original_quotient_bits,
+                            largest->metadata->original_nslots, &options))
+            return QF_NO_MEMORY;
+        qf_set_resize_policy(qfr, &policy);
+        const int64_t ret_numkeys = merge_into_filter(qf_arr, nqf, qfr);
+        if (ret_numkeys >= 0)
+            return ret_numkeys;
+        nslots = 2 * qfr->metadata->nslots;
+        qf_free(qfr);
+        if (ret_numkeys != QF_NO_SPACE)
+            return ret_numkeys;
+    }
+}
 
-	qf_free(qf);
-	memcpy(qf, &new_qf, sizeof(QF));
+int64_t qf_merge(const QF *qfa, const QF *qfb, QF *qfc)    // NEW IN MEMENTO
+{
+    const QF *qf_arr[2] = {qfa, qfb};
+    return qf_multi_merge(qf_arr, 2, qfc);
+}
 
-#ifdef DEBUG
-    perror("FINAL CHECK");
-    occupied_cnt = 0, runend_cnt = 0;
-    for (uint32_t i = 0; i < qf->metadata->nblocks; i++) {
-        occupied_cnt += popcnt(get_block(qf, i)->occupieds[0]);
-        runend_cnt += popcnt(get_block(qf, i)->runends[0]);
-        assert(occupied_cnt >= runend_cnt);
+/*
+ * Splitting undoes the last doubling of a filter. The top bit of the
+ * quotients, the last hash bit that the filter took away from the
+ * fingerprints, picks the output of every prefix set, and in the outputs it
+ * goes back to being the lowest bit of the fingerprints. Within each output
+ * the prefix sets keep the order they have in `src`, so a single iterator
+ * pass writes both outputs front to back.
+ */
+int64_t qf_split(const QF *src, QF *lo, QF *hi)    // NEW IN MEMENTO
+{
+    const uint64_t extension_bits = get_extension_bits(src);
+    if (extension_bits == 0 || src->metadata->split_buckets != 0 
+            || src->metadata->expandable) {
+        fprintf(stderr, "The QF cannot be split in halves.\n");
+        return QF_INVALID;
+    }
+    const uint64_t half_nslots = src->metadata->original_nslots << (extension_bits - 1);
+    const qf_alloc_options options = filter_alloc_options(src);
+    qf_resize_policy policy;
+    qf_get_resize_policy(src, &policy);
+    QF *halves[2] = {lo, hi};
+    for (int i = 0; i < 2; i++) {
+        if (!malloc_filter(halves[i], half_nslots, src->metadata->key_bits,
+                            src->metadata->memento_bits, src->metadata->hash_mode,
+                            src->metadata->seed, src->metadata->original_quotient_bits,
+                            src->metadata->original_nslots, &options)) {
+            if (i == 1)
+                qf_free(lo);
+            return QF_NO_MEMORY;
+        }
+        qf_set_resize_policy(halves[i], &policy);
+    }
 
-        if (0 < get_block(qf, i)->offset && get_block(qf, i)->offset < 255) {
-            assert(is_runend(qf, i * QF_SLOTS_PER_BLOCK + get_block(qf, i)->offset - 1));
+    const qf_allocator *allocator = &lo->runtimedata->allocator;
+    uint64_t mementos_capacity = 1024;
+    uint64_t *mementos = (uint64_t *)qf_alloc(allocator, mementos_capacity * sizeof(uint64_t),
+                                            sizeof(uint64_t));
+    int64_t ret_numkeys = (mementos == NULL ? QF_NO_MEMORY : 0);
+    sequential_writer writers[2];
+    sequential_writer_init(&writers[0], lo, 0);
+    sequential_writer_init(&writers[1], hi, 0);
+    const uint32_t split_shift = src->metadata->original_quotient_bits + extension_bits - 1;
+    QFi qfi;
+    qf_iterator_from_position(src, &qfi, 0);
+    while (ret_numkeys >= 0 && !qfi_end(&qfi)) {
+        if (!reserve_scratch(lo, &mementos, &mementos_capacity, qfi_memento_count(&qfi), 1)) {
+            ret_numkeys = QF_NO_MEMORY;
+            break;
         }
+        uint64_t hash, bucket, fingerprint;
+        const int memento_count = qfi_get_hash(&qfi, &hash, mementos);
+        const uint64_t side = (hash >> split_shift) & 1ULL;
+        hash_to_bucket_and_fingerprint(halves[side], hash, &bucket, &fingerprint);
+        const int ret = sequential_writer_append(&writers[side], bucket, fingerprint,
+                                                mementos, memento_count);
+        ret_numkeys = (ret < 0 ? ret : ret_numkeys + memento_count);
+        qfi_next(&qfi);
     }
-    assert(occupied_cnt == runend_cnt);
-#endif /* DEBUG */
+    qf_dealloc(allocator, mementos, mementos_capacity * sizeof(uint64_t));
+    if (ret_numkeys < 0) {
+        qf_free(lo);
+        qf_free(hi);
+        return ret_numkeys;
+    }
+    for (int i = 0; i < 2; i++) {
+        sequential_writer_finish(&writers[i]);
+        add_writer_counts(halves[i], &writers[i]);
+    }
+    return ret_numkeys;
+}
 
-	return ret_numkeys;
+int qf_split_side(const QF *qf, uint64_t key, uint8_t flags)    // NEW IN MEMENTO
+{
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+			key = MurmurHash64A(((void *)&key), sizeof(key), qf->metadata->seed);
+		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
+			key = hash_64(key, BITMASK(63));
+	}
+    const uint64_t extension_bits = get_extension_bits(qf);
+    assert(extension_bits > 0);
+    return (key >> (qf->metadata->original_quotient_bits + extension_bits - 1)) & 1ULL;
 }
 
 uint64_t qf_resize(QF *qf, uint64_t nslots, void* buffer, uint64_t buffer_len)  // NEW IN MEMENTO
 {
-	QF new_qf;
-	new_qf.runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
-	if (new_qf.runtimedata == NULL) {
-		perror("Couldn't allocate memory for runtime data.\n");
-		exit(EXIT_FAILURE);
+	// The new table would live in anonymous memory, away from the file or
+	// the shared memory segment that the filter is kept in
+	if (qf->runtimedata->shared_locks || qf->runtimedata->f_info.filepath != NULL) {
+		fprintf(stderr, "A filter in a file or in shared memory cannot be resized.\n");
+		return 0;
 	}
 
-	uint64_t init_size = init_filter(&new_qf, nslots, qf->metadata->key_bits + 1,
-                                    qf->metadata->memento_bits,
-                                    qf->metadata->hash_mode, qf->metadata->seed,
-                                    buffer, buffer_len, qf->metadata->original_quotient_bits);
+	QF new_qf;
 
-	if (init_size > buffer_len)
+	const uint64_t orig_nslots = qf->metadata->original_nslots;
+	const uint64_t new_key_bits = resized_key_bits(qf, nslots);
+	uint64_t init_size = init_filter(&new_qf, nslots, new_key_bits, qf->metadata->memento_bits,
+                                    qf->metadata->hash_mode, qf->metadata->seed,
+                                    NULL, 0, qf->metadata->original_quotient_bits,
+                                    orig_nslots, qf->metadata->block_layout,
+                                    qf->metadata->expandable, false);
+	if (buffer == NULL || init_size > buffer_len)
 		return init_size;
 
-	if (qf->metadata->auto_resize)
-		qf_set_auto_resize(&new_qf, true);
+	if (!alloc_runtime(&new_qf, &qf->runtimedata->allocator))
+		return 0;
+	if (init_filter(&new_qf, nslots, new_key_bits, qf->metadata->memento_bits,
+                    qf->metadata->hash_mode, qf->metadata->seed,
+                    buffer, buffer_len, qf->metadata->original_quotient_bits,
+                    orig_nslots, qf->metadata->block_layout, qf->metadata->expandable,
+                    false) != init_size) {
+		qf_dealloc(&qf->runtimedata->allocator, new_qf.runtimedata, sizeof(qfruntime));
+		return 0;
+	}
 
-	// copy keys from qf into new_qf
-	QFi qfi;
-	qf_iterator_from_position(qf, &qfi, 0);
-    uint64_t key, memento_count, mementos[1024], fingerprint_size;
-	do {
-		memento_count = qfi_get_hash(&qfi, &key, mementos);
-		qfi_next(&qfi);
-        fingerprint_size = highbit_position(key) - qf->metadata->key_bits 
-                                        + qf->metadata->fingerprint_bits;
-        if (memento_count > 1)
-            fingerprint_size /= 2;
+	qf_resize_policy policy;
+	qf_get_resize_policy(qf, &policy);
+	qf_set_resize_policy(&new_qf, &policy);
 
-		int ret = insert_mementos(&new_qf, key, mementos, memento_count, 
-                            fingerprint_size - 1, QF_NO_LOCK | QF_KEY_IS_HASH);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to insert key: %" PRIx64 " into the new CQF.\n", key);
-			abort();
-		}
-	} while(!qfi_end(&qfi));
+	// copy keys from qf into new_qf
+	const int64_t ret_numkeys = stream_into_filter(qf, &new_qf);
+	if (ret_numkeys == QF_NO_MEMORY) {
+		qf_destroy(&new_qf);
+		return 0;
+	}
+	if (ret_numkeys < 0) {
+		fprintf(stderr, "Failed to copy the keys into the new CQF.\n");
+		abort();
+	}
+	if (qf->runtimedata->dirty_regions != NULL && !init_dirty_regions(&new_qf, true)) {
+		qf_destroy(&new_qf);
+		return 0;
+	}
 
 	qf_free(qf);
 	memcpy(qf, &new_qf, sizeof(QF));
@@ -2612,6 +5446,59 @@ uint64_t qf_resize(QF *qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 	return init_size;
 }
 
+void qf_get_default_resize_policy(qf_resize_policy *policy)     // NEW IN MEMENTO
+{
+	policy->auto_resize = false;
+	policy->max_load_factor = MAX_LOAD_FACTOR;
+	policy->max_probe_distance = DISTANCE_FROM_HOME_SLOT_CUTOFF;
+	policy->growth_factor = 2.0;
+	policy->auto_shrink = false;
+	policy->shrink_load_factor = SHRINK_LOAD_FACTOR;
+	policy->resize_callback = NULL;
+	policy->resize_callback_arg = NULL;
+}
+
+// Whether the thresholds of `policy` are in range, see qf_resize_policy.
+// NEW IN MEMENTO
+static inline bool resize_policy_is_valid(const qf_resize_policy *policy)
+{
+	if (!(0.0 < policy->max_load_factor && policy->max_load_factor <= 1.0)
+            || !(policy->growth_factor > 1.0)
+            || !(0.0 < policy->shrink_load_factor
+                && policy->shrink_load_factor < policy->max_load_factor / 2)) {
+		fprintf(stderr, "The resize policy is out of range.\n");
+		return false;
+	}
+	return true;
+}
+
+bool qf_set_resize_policy(QF *qf, const qf_resize_policy *policy)     // NEW IN MEMENTO
+{
+	if (!resize_policy_is_valid(policy))
+		return false;
+	qf->metadata->auto_resize = policy->auto_resize ? 1 : 0;
+	qf->metadata->max_load_factor = policy->max_load_factor;
+	qf->metadata->max_probe_distance = policy->max_probe_distance;
+	qf->metadata->growth_factor = policy->growth_factor;
+	qf->metadata->auto_shrink = policy->auto_shrink ? 1 : 0;
+	qf->metadata->shrink_load_factor = policy->shrink_load_factor;
+	qf->runtimedata->resize_callback = policy->resize_callback;
+	qf->runtimedata->resize_callback_arg = policy->resize_callback_arg;
+	return true;
+}
+
+void qf_get_resize_policy(const QF *qf, qf_resize_policy *policy)     // NEW IN MEMENTO
+{
+	policy->auto_resize = qf->metadata->auto_resize == 1;
+	policy->max_load_factor = qf->metadata->max_load_factor;
+	policy->max_probe_distance = qf->metadata->max_probe_distance;
+	policy->growth_factor = qf->metadata->growth_factor;
+	policy->auto_shrink = qf->metadata->auto_shrink == 1;
+	policy->shrink_load_factor = qf->metadata->shrink_load_factor;
+	policy->resize_callback = qf->runtimedata->resize_callback;
+	policy->resize_callback_arg = qf->runtimedata->resize_callback_arg;
+}
+
 void qf_set_auto_resize(QF* qf, bool enabled)
 {
 	if (enabled)
@@ -2620,21 +5507,95 @@ void qf_set_auto_resize(QF* qf, bool enabled)
 		qf->metadata->auto_resize = 0;
 }
 
+bool qf_set_growth_factor(QF *qf, double growth_factor)     // NEW IN MEMENTO
+{
+	qf_resize_policy policy;
+	qf_get_resize_policy(qf, &policy);
+	policy.growth_factor = growth_factor;
+	return qf_set_resize_policy(qf, &policy);
+}
+
+void qf_set_auto_shrink(QF *qf, bool enabled)     // NEW IN MEMENTO
+{
+	qf->metadata->auto_shrink = enabled ? 1 : 0;
+}
+
+bool qf_set_shrink_load_factor(QF *qf, double load_factor)     // NEW IN MEMENTO
+{
+	qf_resize_policy policy;
+	qf_get_resize_policy(qf, &policy);
+	policy.shrink_load_factor = load_factor;
+	return qf_set_resize_policy(qf, &policy);
+}
+
+// Resizes the filter to `nslots` slots on behalf of the resize policy, after
+// consulting the resize callback. Returns QF_NO_SPACE if the callback
+// cancels the resize or the contents do not fit.
+// NEW IN MEMENTO
+static int64_t policy_resize(QF *qf, uint64_t nslots)
+{
+    if (qf->runtimedata->resize_callback != NULL
+            && !qf->runtimedata->resize_callback(qf, &nslots, 
+                                            qf->runtimedata->resize_callback_arg))
+        return QF_NO_SPACE;
+    if (nslots < qf->metadata->nslots)
+        return qf_shrink(qf, nslots);
+    return qf_resize_malloc(qf, nslots);
+}
+
+// Makes room for `new_slot_count` more slots if the filter is loaded beyond
+// the maximum load factor. Returns QF_NO_SPACE if it is and the policy does
+// not allow growing it.
+// NEW IN MEMENTO
+static inline int policy_reserve(QF *qf, const uint64_t new_slot_count)
+{
+	if (qf->metadata->noccupied_slots >= qf->metadata->nslots * qf->metadata->max_load_factor 
+            || qf->metadata->noccupied_slots + new_slot_count >= qf->metadata->nslots) {
+		if (!qf->metadata->auto_resize)
+			return QF_NO_SPACE;
+        const uint64_t nslots = qf->metadata->nslots * qf->metadata->growth_factor;
+		if (policy_resize(qf, nslots > qf->metadata->nslots ? nslots 
+                                                            : qf->metadata->nslots + 1) < 0)
+			return QF_NO_SPACE;
+	}
+	return 0;
+}
+
+// Grows the filter if an insertion landed too far away from its home slot.
+// NEW IN MEMENTO
+static inline void policy_check_probe_distance(QF *qf, const int64_t distance)
+{
+	if (distance > (int64_t) qf->metadata->max_probe_distance) {
+		if (qf->metadata->auto_resize) {
+            const uint64_t nslots = qf->metadata->nslots * qf->metadata->growth_factor;
+			policy_resize(qf, nslots > qf->metadata->nslots ? nslots 
+                                                            : qf->metadata->nslots + 1);
+		} else {
+			fprintf(stderr, "The CQF is filling up.\n");
+		}
+	}
+}
+
+// Shrinks the filter once its load drops below the shrink load factor, to
+// twice that load.
+// NEW IN MEMENTO
+static inline void policy_check_shrink(QF *qf)
+{
+    const double load_factor = qf->metadata->shrink_load_factor;
+    if (!qf->metadata->auto_shrink || qf->metadata->nslots <= qf->metadata->original_nslots
+            || qf->metadata->noccupied_slots >= qf->metadata->nslots * load_factor)
+        return;
+    policy_resize(qf, qf->metadata->noccupied_slots / (2 * load_factor));
+}
+
 int qf_insert_mementos(QF *qf, uint64_t key, uint64_t mementos[], uint64_t memento_count, 
                         uint8_t flags)  // NEW IN MEMENTO
 {
     uint32_t new_slot_count = 1 + (memento_count + 1) / 2;
-	// We fill up the CQF up to 95% load factor.
+	// We fill up the CQF up to the maximum load factor of the resize policy.
 	// This is a very conservative check.
-	if (qf->metadata->noccupied_slots >= qf->metadata->nslots * 0.95 ||
-            qf->metadata->noccupied_slots + new_slot_count >= qf->metadata->nslots) {
-		if (qf->metadata->auto_resize) {
-			fprintf(stdout, "Resizing the CQF.\n");
-			qf_resize_malloc(qf, qf->metadata->nslots * 2);
-		} else {
-			return QF_NO_SPACE;
-        }
-	}
+	if (policy_reserve(qf, new_slot_count) < 0)
+		return QF_NO_SPACE;
 	if (memento_count == 0)
 		return 0;
 
@@ -2645,33 +5606,20 @@ int qf_insert_mementos(QF *qf, uint64_t key, uint64_t mementos[], uint64_t memen
             // Large hash!
 			key = hash_64(key, BITMASK(63));
 	}
-    const uint64_t orig_nslots = qf->metadata->nslots >> (qf->metadata->key_bits 
-                                                        - qf->metadata->fingerprint_bits 
-                                                        - qf->metadata->original_quotient_bits);
-    uint64_t fast_reduced_part = fast_reduce(((key & BITMASK(qf->metadata->original_quotient_bits)) 
-                                << (32 - qf->metadata->original_quotient_bits)), orig_nslots);
-    key &= ~(BITMASK(qf->metadata->original_quotient_bits));
-    key |= fast_reduced_part;
-	uint64_t hash = key;
+	uint64_t hash = reduce_hash(qf, key);
 #ifdef DEBUG
     fprintf(stderr, "KEY HASH=%lu\n", hash);
 #endif /* DEBUG */
 	int ret = insert_mementos(qf, hash, mementos, memento_count, 
-                                qf->metadata->fingerprint_bits, flags);
+                                qf->metadata->fingerprint_bits + qf->metadata->expandable,
+                                flags);
 #ifdef DEBUG
     perror("DONE!");
 #endif /* DEBUG */
 
 	// check for fullness based on the distance from the home slot to the slot
 	// in which the key is inserted
-	if (ret > DISTANCE_FROM_HOME_SLOT_CUTOFF) {
-		if (qf->metadata->auto_resize) {
-			fprintf(stdout, "Resizing the CQF.\n");
-			qf_resize_malloc(qf, qf->metadata->nslots * 2);
-		} else {
-			fprintf(stderr, "The CQF is filling up.\n");
-		}
-	}
+	policy_check_probe_distance(qf, ret);
 	return ret;
 }
 
@@ -2680,26 +5628,17 @@ int64_t qf_insert_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 #ifdef DEBUG
     uint64_t occupied_cnt = 0, runend_cnt = 0;
     for (uint32_t i = 0; i < qf->metadata->nblocks; i++) {
-        occupied_cnt += popcnt(get_block(qf, i)->occupieds[0]);
-        runend_cnt += popcnt(get_block(qf, i)->runends[0]);
+        occupied_cnt += popcnt(BLOCK_OCCUPIEDS(qf, i)[0]);
+        runend_cnt += popcnt(BLOCK_RUNENDS(qf, i)[0]);
         assert(occupied_cnt >= runend_cnt);
     }
     assert(occupied_cnt == runend_cnt);
 #endif /* DEBUG */
 
-	// We fill up the CQF up to 95% load factor.
+	// We fill up the CQF up to the maximum load factor of the resize policy.
 	// This is a very conservative check.
-	if (qf->metadata->noccupied_slots >= qf->metadata->nslots * 0.95 ||
-            qf->metadata->noccupied_slots + 1 >= qf->metadata->nslots) {
-		if (qf->metadata->auto_resize) {
-			fprintf(stderr, "========================================================= Resizing the CQF.\n");
-            fflush(stderr);
-			qf_resize_malloc(qf, qf->metadata->nslots * 2);
-            perror("RESIZING DONE");
-		} else {
-			return QF_NO_SPACE;
-        }
-	}
+	if (policy_reserve(qf, 1) < 0)
+		return QF_NO_SPACE;
 
 	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
 		if (qf->metadata->hash_mode == QF_HASH_DEFAULT) {
@@ -2709,21 +5648,11 @@ int64_t qf_insert_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
             // Large hash!
 			key = hash_64(key, BITMASK(63));
 	}
-    const uint64_t orig_nslots = qf->metadata->nslots >> (qf->metadata->key_bits 
-                                                        - qf->metadata->fingerprint_bits 
-                                                        - qf->metadata->original_quotient_bits);
-    const uint64_t fast_reduced_part = fast_reduce(((key & BITMASK(qf->metadata->original_quotient_bits)) 
-                                << (32 - qf->metadata->original_quotient_bits)), orig_nslots);
-    key &= ~(BITMASK(qf->metadata->original_quotient_bits));
-    key |= fast_reduced_part;
-	uint64_t hash = key;
+	uint64_t hash = reduce_hash(qf, key);
 
 	int64_t res = 0;
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - qf->metadata->fingerprint_bits;
-    const uint64_t hash_fingerprint = (hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits);
-    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
-	const uint64_t hash_bucket_index = (fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                        | ((hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
+    uint64_t hash_bucket_index, hash_fingerprint;
+    hash_to_bucket_and_fingerprint(qf, hash, &hash_bucket_index, &hash_fingerprint);
 
 
 #ifdef DEBUG
@@ -2777,15 +5706,15 @@ int64_t qf_insert_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
             }
             for (uint32_t i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; 
                     i <= next_empty_slot / QF_SLOTS_PER_BLOCK; i++) {
-                if (get_block(qf, i)->offset + 1
+                if (BLOCK_OFFSET(qf, i) + 1
                                 <= BITMASK(8 * sizeof(qf->blocks[0].offset)))
-                    get_block(qf, i)->offset++;
+                    MUTABLE_BLOCK_OFFSET(qf, i)++;
             }
             set_slot(qf, insert_index, (hash_fingerprint << qf->metadata->memento_bits) 
                                         | memento);
-            METADATA_WORD(qf, runends, runend_index) &= ~(1ULL << 
+            MUTABLE_METADATA_WORD(qf, runends, runend_index) &= ~(1ULL << 
                     ((runend_index % QF_SLOTS_PER_BLOCK) % 64));
-            METADATA_WORD(qf, runends, runend_index + 1) |= 1ULL << 
+            MUTABLE_METADATA_WORD(qf, runends, runend_index + 1) |= 1ULL << 
                     (((runend_index + 1) % QF_SLOTS_PER_BLOCK) % 64);
             modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
             modify_metadata(qf, &qf->metadata->noccupied_slots, 1);
@@ -2812,13 +5741,13 @@ int64_t qf_insert_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 
         for (uint32_t i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; 
                 i <= next_empty_slot / QF_SLOTS_PER_BLOCK; i++) {
-            if (get_block(qf, i)->offset + 1
+            if (BLOCK_OFFSET(qf, i) + 1
                     <= BITMASK(8 * sizeof(qf->blocks[0].offset)))
-                get_block(qf, i)->offset++;
+                MUTABLE_BLOCK_OFFSET(qf, i)++;
         }
-        METADATA_WORD(qf, runends, insert_index) |= 1ULL << 
+        MUTABLE_METADATA_WORD(qf, runends, insert_index) |= 1ULL << 
                 ((insert_index % QF_SLOTS_PER_BLOCK) % 64);
-        METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
+        MUTABLE_METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
                 ((hash_bucket_index % QF_SLOTS_PER_BLOCK) % 64);
         modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
         modify_metadata(qf, &qf->metadata->noccupied_slots, 1);
@@ -2830,6 +5759,9 @@ int64_t qf_insert_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 	}
 
     modify_metadata(qf, &qf->metadata->nelts, 1);
+    // check for fullness based on the distance from the home slot to the slot
+    // in which the key is inserted
+    policy_check_probe_distance(qf, res);
     return res;
 }
 
@@ -2838,6 +5770,8 @@ void qf_bulk_load(QF *qf, uint64_t *sorted_hashes, uint64_t n, uint8_t flags)
     assert(flags & QF_KEY_IS_HASH);
 
     const uint64_t fingerprint_mask = BITMASK(qf->metadata->fingerprint_bits);
+    const uint64_t fingerprint_marker = (qf->metadata->expandable 
+                                            ? 1ULL << qf->metadata->fingerprint_bits : 0);
     const uint64_t memento_mask = BITMASK(qf->metadata->memento_bits);
 
     uint64_t prefix = sorted_hashes[0] >> qf->metadata->memento_bits;
@@ -2853,7 +5787,7 @@ void qf_bulk_load(QF *qf, uint64_t *sorted_hashes, uint64_t n, uint8_t flags)
             memento_list[prefix_set_size++] = sorted_hashes[i] & memento_mask;
         else {
             const uint32_t slots_written = write_prefix_set(qf, current_pos,
-                                                prefix & fingerprint_mask, 
+                                                (prefix & fingerprint_mask) | fingerprint_marker,
                                                 memento_list, prefix_set_size);
             current_pos += slots_written;
             total_slots_written += slots_written;
@@ -2863,19 +5797,19 @@ void qf_bulk_load(QF *qf, uint64_t *sorted_hashes, uint64_t n, uint8_t flags)
 
             next_run = prefix >> qf->metadata->fingerprint_bits;
             if (current_run != next_run) {
-                METADATA_WORD(qf, occupieds, current_run) |= 
+                MUTABLE_METADATA_WORD(qf, occupieds, current_run) |= 
                             (1ULL << ((current_run % QF_SLOTS_PER_BLOCK) % 64));
-                METADATA_WORD(qf, runends, (current_pos - 1)) |= 
+                MUTABLE_METADATA_WORD(qf, runends, (current_pos - 1)) |= 
                             (1ULL << (((current_pos - 1) % QF_SLOTS_PER_BLOCK) % 64));
                 for (uint64_t block_ind = current_run / QF_SLOTS_PER_BLOCK + 1;
                         block_ind <= (current_pos - 1) / QF_SLOTS_PER_BLOCK; block_ind++) {
                     const uint32_t cnt = current_pos - (block_ind * QF_SLOTS_PER_BLOCK < old_pos ? old_pos 
                                                                            : block_ind * QF_SLOTS_PER_BLOCK);
-                    if (get_block(qf, block_ind)->offset + cnt
+                    if (BLOCK_OFFSET(qf, block_ind) + cnt
                             < BITMASK(8 * sizeof(qf->blocks[0].offset)))
-                        get_block(qf, block_ind)->offset += cnt;
+                        MUTABLE_BLOCK_OFFSET(qf, block_ind) += cnt;
                     else
-                        get_block(qf, block_ind)->offset = BITMASK(8 * sizeof(qf->blocks[0].offset));
+                        MUTABLE_BLOCK_OFFSET(qf, block_ind) = BITMASK(8 * sizeof(qf->blocks[0].offset));
                 }
                 current_run = next_run;
                 old_pos = current_pos;
@@ -2884,23 +5818,23 @@ void qf_bulk_load(QF *qf, uint64_t *sorted_hashes, uint64_t n, uint8_t flags)
         }
     }
     const uint32_t slots_written = write_prefix_set(qf, current_pos,
-                                                prefix & fingerprint_mask, 
+                                                (prefix & fingerprint_mask) | fingerprint_marker,
                                                 memento_list, prefix_set_size);
     current_pos += slots_written;
     total_slots_written += slots_written;
-    METADATA_WORD(qf, occupieds, current_run) |= 
+    MUTABLE_METADATA_WORD(qf, occupieds, current_run) |= 
                         (1ULL << ((current_run % QF_SLOTS_PER_BLOCK) % 64));
-    METADATA_WORD(qf, runends, (current_pos - 1)) |= 
+    MUTABLE_METADATA_WORD(qf, runends, (current_pos - 1)) |= 
                         (1ULL << (((current_pos - 1) % QF_SLOTS_PER_BLOCK) % 64));
     for (uint64_t block_ind = current_run / QF_SLOTS_PER_BLOCK + 1;
             block_ind <= (current_pos - 1) / QF_SLOTS_PER_BLOCK; block_ind++) {
         const uint32_t cnt = current_pos - (block_ind * QF_SLOTS_PER_BLOCK < old_pos ? old_pos 
                                                             : block_ind * QF_SLOTS_PER_BLOCK);
-        if (get_block(qf, block_ind)->offset + cnt
+        if (BLOCK_OFFSET(qf, block_ind) + cnt
                 < BITMASK(8 * sizeof(qf->blocks[0].offset)))
-            get_block(qf, block_ind)->offset += cnt;
+            MUTABLE_BLOCK_OFFSET(qf, block_ind) += cnt;
         else
-            get_block(qf, block_ind)->offset = BITMASK(8 * sizeof(qf->blocks[0].offset));
+            MUTABLE_BLOCK_OFFSET(qf, block_ind) = BITMASK(8 * sizeof(qf->blocks[0].offset));
     }
 
     modify_metadata(qf, &qf->metadata->ndistinct_elts, distinct_prefix_cnt);
@@ -2921,19 +5855,8 @@ int32_t qf_delete_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
             // Large hash!
 			key = hash_64(key, BITMASK(63));
 	}
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - qf->metadata->fingerprint_bits;
-    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
-    const uint64_t orig_nslots = qf->metadata->nslots >> (qf->metadata->key_bits 
-                                                        - qf->metadata->fingerprint_bits 
-                                                        - qf->metadata->original_quotient_bits);
-    const uint64_t fast_reduced_part = fast_reduce(((key & BITMASK(orig_quotient_size)) 
-                                << (32 - orig_quotient_size)), orig_nslots);
-    key &= ~(BITMASK(qf->metadata->original_quotient_bits));
-    key |= fast_reduced_part;
-	uint64_t hash = key;
-	const uint64_t hash_bucket_index = (fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                        | ((hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
-	const uint64_t hash_fingerprint = (hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits); 
+	uint64_t hash_bucket_index, hash_fingerprint;
+	hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, key), &hash_bucket_index, &hash_fingerprint);
 
 	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
 		if (!qf_lock(qf, hash_bucket_index, /*small*/ true, flags))
@@ -2943,14 +5866,15 @@ int32_t qf_delete_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
     int64_t runstart_index = hash_bucket_index == 0 ? 0 
                                     : run_end(qf, hash_bucket_index - 1) + 1;
     int64_t fingerprint_pos = runstart_index;
-    uint64_t sorted_positions[50], ind = 0;
+    // Only the longest matches are kept
+    uint64_t sorted_positions[64], ind = 0;
     while (true) {
-        fingerprint_pos = next_matching_fingerprint_in_run(qf, fingerprint_pos, hash_fingerprint);
+        fingerprint_pos = next_compatible_fingerprint_in_run(qf, fingerprint_pos, hash_fingerprint);
         if (fingerprint_pos < 0) {
             // Matching fingerprints exhausted
             break;
         }
-        sorted_positions[ind++] = fingerprint_pos;
+        sorted_positions[ind++ % 64] = fingerprint_pos;
         const uint64_t current_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos);
         const uint64_t next_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos + 1);
         if (!is_runend(qf, fingerprint_pos) && 
@@ -2970,9 +5894,9 @@ int32_t qf_delete_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
     }
 
     bool handled = false;
-    for (int32_t i = ind - 1; i >= 0; i--) {
+    for (int64_t i = ind - 1; i >= 0 && i + 64 >= (int64_t) ind; i--) {
         int32_t old_slot_count, new_slot_count;
-        remove_mementos_from_prefix_set(qf, sorted_positions[i], &memento,
+        remove_mementos_from_prefix_set(qf, sorted_positions[i % 64], &memento,
                             &handled, 1, &new_slot_count, &old_slot_count);
         if (handled) {
             if (new_slot_count < old_slot_count) {
@@ -2980,9 +5904,10 @@ int32_t qf_delete_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
                 remove_slots_and_shift_remainders_and_runends_and_offsets(qf,
                                                                           only_item_in_run,
                                                                           hash_bucket_index,
-                                                                          sorted_positions[i] + new_slot_count,
+                                                                          sorted_positions[i % 64] + new_slot_count,
                                                                           old_slot_count - new_slot_count);
             }
+            modify_metadata(qf, &qf->metadata->nelts, -1);
             break;
         }
     }
@@ -2991,6 +5916,9 @@ int32_t qf_delete_single(QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 		qf_unlock(qf, hash_bucket_index, /*small*/ true);
 	}
 
+    if (handled)
+        policy_check_shrink(qf);
+
     return handled ? 0 : QF_DOESNT_EXIST;
 }
 
@@ -3077,21 +6005,13 @@ int qf_point_query(const QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 			key = hash_64(key, BITMASK(63));
 	}
 	const uint64_t hash = key;
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - \
-                                            qf->metadata->fingerprint_bits;
-    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
-    const uint64_t orig_nslots = qf->metadata->nslots >> (qf->metadata->key_bits 
-                                                        - qf->metadata->fingerprint_bits 
-                                                        - qf->metadata->original_quotient_bits);
-    const uint64_t fast_reduced_part = fast_reduce(((hash & BITMASK(qf->metadata->original_quotient_bits)) 
-                                << (32 - qf->metadata->original_quotient_bits)), orig_nslots);
-	const uint64_t hash_bucket_index = (fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                        | ((hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
+    uint64_t hash_bucket_index, hash_fingerprint;
+    hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, hash), &hash_bucket_index, &hash_fingerprint);
 
 #ifdef DEBUG
     fprintf(stderr, "POINT QUERY: bucket_index=%lu fingerprint=", hash_bucket_index);
-    for (int i = 2 * qf->metadata->fingerprint_bits - 1; i >= 0; i--) {
-        fprintf(stderr, "%lu", (hash >> (i + bucket_index_hash_size)) & 1);
+    for (int i = qf->metadata->fingerprint_bits - 1; i >= 0; i--) {
+        fprintf(stderr, "%lu", (hash_fingerprint >> i) & 1);
     }
     fprintf(stderr, " memento=%lu\n", memento);
 #endif /* DEBUG */
@@ -3099,7 +6019,6 @@ int qf_point_query(const QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 	if (!is_occupied(qf, hash_bucket_index))
 		return false;
 
-    const uint64_t hash_fingerprint = (hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits);
 #ifdef DEBUG
     PRINT_WORD_BITS(hash_fingerprint);
 #endif /* DEBUG */
@@ -3115,7 +6034,7 @@ int qf_point_query(const QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 #ifdef DEBUG
         fprintf(stderr, "WELP fingerprint_pos=%lu\n", fingerprint_pos);
 #endif /* DEBUG */
-        fingerprint_pos = next_matching_fingerprint_in_run(qf, fingerprint_pos,
+        fingerprint_pos = next_compatible_fingerprint_in_run(qf, fingerprint_pos,
                                                             hash_fingerprint);
         if (fingerprint_pos < 0) {
             // Matching fingerprints exhausted
@@ -3128,8 +6047,7 @@ int qf_point_query(const QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
 
         const uint64_t current_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos);
         const uint64_t next_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos + 1);
-        const int positive_res = (highbit_position(current_fingerprint) == qf->metadata->fingerprint_bits 
-                                    ? 1 : 2);
+        const int positive_res = match_result(qf, current_fingerprint, hash_fingerprint);
         if (!is_runend(qf, fingerprint_pos) && 
                 current_fingerprint > next_fingerprint) {
             if (lower_bound_mementos_for_fingerprint(qf, fingerprint_pos, memento) == memento)
@@ -3154,6 +6072,61 @@ int qf_point_query(const QF *qf, uint64_t key, uint64_t memento, uint8_t flags)
     return 0;
 }
 
+// Whether the prefix set of `fingerprint` in home slot `bucket` may hold a
+// memento in [`l_memento`, `r_memento`]. Returns 0, or the positive result
+// of qf_range_query.
+// NEW IN MEMENTO
+static inline int prefix_range_query(const QF *qf, const uint64_t bucket,
+                                    const uint64_t fingerprint, const uint64_t l_memento,
+                                    const uint64_t r_memento)
+{
+    if (!is_occupied(qf, bucket))
+        return 0;
+
+    int64_t runstart_index = bucket == 0 ? 0 : run_end(qf, bucket - 1) + 1;
+    if (runstart_index < bucket)
+        runstart_index = bucket;
+
+    // Find the shortest matching fingerprint that gives a positive
+    int64_t fingerprint_pos = runstart_index;
+    while (true) {
+        fingerprint_pos = next_compatible_fingerprint_in_run(qf, fingerprint_pos,
+                                                        fingerprint);
+        if (fingerprint_pos < 0) {
+            // Matching fingerprints exhausted
+            break;
+        }
+
+        const uint64_t current_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos);
+        const uint64_t next_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos + 1);
+        const int positive_res = match_result(qf, current_fingerprint, fingerprint);
+        if (!is_runend(qf, fingerprint_pos) && 
+                current_fingerprint > next_fingerprint) {
+            const uint64_t candidate_memento = lower_bound_mementos_for_fingerprint(qf, 
+                                                fingerprint_pos, l_memento);
+            if (l_memento <= candidate_memento && candidate_memento <= r_memento)
+                return positive_res;
+
+            const uint64_t m1 = GET_MEMENTO(qf, fingerprint_pos);
+            const uint64_t m2 = GET_MEMENTO(qf, fingerprint_pos + 1);
+            fingerprint_pos += 2;
+            if (m1 >= m2)
+                fingerprint_pos += number_of_slots_used_for_memento_list(qf,
+                                                            fingerprint_pos);
+        }
+        else {
+            const uint64_t candidate_memento = GET_MEMENTO(qf, fingerprint_pos);
+            if (l_memento <= candidate_memento && candidate_memento <= r_memento)
+                return positive_res;
+            fingerprint_pos++;
+        }
+
+        if (is_runend(qf, fingerprint_pos - 1))
+            break;
+    }
+    return 0;
+}
+
 int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
                                   uint64_t r_key, uint64_t r_memento, uint8_t flags)    // NEW IN MEMENTO
 {
@@ -3169,80 +6142,22 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
 			r_key = hash_64(r_key, BITMASK(63));
         }
 	}
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - \
-                                            qf->metadata->fingerprint_bits;
-    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
-    const uint64_t orig_nslots = qf->metadata->nslots >> (qf->metadata->key_bits 
-                                                        - qf->metadata->fingerprint_bits 
-                                                        - qf->metadata->original_quotient_bits);
-
 	const uint64_t l_hash = l_key;
-    const uint64_t l_fast_reduced_part = fast_reduce(((l_hash & BITMASK(qf->metadata->original_quotient_bits)) 
-                                << (32 - qf->metadata->original_quotient_bits)), orig_nslots);
-	const uint64_t l_hash_bucket_index = (l_fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                        | ((l_hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
-	const uint64_t l_hash_fingerprint = (l_hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits);
+	uint64_t l_hash_bucket_index, l_hash_fingerprint;
+	hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, l_hash), &l_hash_bucket_index,
+                                    &l_hash_fingerprint);
 
 	const uint64_t r_hash = r_key;
-    const uint64_t r_fast_reduced_part = fast_reduce(((r_hash & BITMASK(qf->metadata->original_quotient_bits)) 
-                                << (32 - qf->metadata->original_quotient_bits)), orig_nslots);
-	const uint64_t r_hash_bucket_index = (r_fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                        | ((r_hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
-	const uint64_t r_hash_fingerprint = (r_hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits);
+	uint64_t r_hash_bucket_index, r_hash_fingerprint;
+	hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, r_hash), &r_hash_bucket_index,
+                                    &r_hash_fingerprint);
 
-    uint64_t candidate_memento;
     if (l_hash == r_hash) { // Range contained in a single prefix.
 #ifdef DEBUG
         perror("RANGE QUERY: SINGLE PREFIX");
 #endif /* DEBUG */
-        if (!is_occupied(qf, l_hash_bucket_index)) {
-            return 0;
-        }
-
-        int64_t runstart_index = l_hash_bucket_index == 0 ? 0 
-            : run_end(qf, l_hash_bucket_index - 1) + 1;
-        if (runstart_index < l_hash_bucket_index)
-            runstart_index = l_hash_bucket_index;
-
-        // Find the shortest matching fingerprint that gives a positive
-        int64_t fingerprint_pos = runstart_index;
-        while (true) {
-            fingerprint_pos = next_matching_fingerprint_in_run(qf, fingerprint_pos,
-                                                            l_hash_fingerprint);
-            if (fingerprint_pos < 0) {
-                // Matching fingerprints exhausted
-                break;
-            }
-
-            const uint64_t current_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos);
-            const uint64_t next_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos + 1);
-            const int positive_res = (highbit_position(current_fingerprint) == qf->metadata->fingerprint_bits 
-                                        ? 1 : 2);
-            if (!is_runend(qf, fingerprint_pos) && 
-                    current_fingerprint > next_fingerprint) {
-                candidate_memento = lower_bound_mementos_for_fingerprint(qf, 
-                                                    fingerprint_pos, l_memento);
-                if (l_memento <= candidate_memento && candidate_memento <= r_memento)
-                    return positive_res;
-
-                const uint64_t m1 = GET_MEMENTO(qf, fingerprint_pos);
-                const uint64_t m2 = GET_MEMENTO(qf, fingerprint_pos + 1);
-                fingerprint_pos += 2;
-                if (m1 >= m2)
-                    fingerprint_pos += number_of_slots_used_for_memento_list(qf,
-                                                                fingerprint_pos);
-            }
-            else {
-                candidate_memento = GET_MEMENTO(qf, fingerprint_pos);
-                if (l_memento <= candidate_memento && candidate_memento <= r_memento)
-                    return positive_res;
-                fingerprint_pos++;
-            }
-
-            if (is_runend(qf, fingerprint_pos - 1))
-                break;
-        }
-        return 0;
+        return prefix_range_query(qf, l_hash_bucket_index, l_hash_fingerprint,
+                                    l_memento, r_memento);
     }
     else {  // Range intersects two prefixes
 #ifdef DEBUG
@@ -3271,7 +6186,7 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
             // Find the shortest matching fingerprint that gives a positive
             int64_t fingerprint_pos = l_runstart_index;
             while (true) {
-                fingerprint_pos = next_matching_fingerprint_in_run(qf, fingerprint_pos,
+                fingerprint_pos = next_compatible_fingerprint_in_run(qf, fingerprint_pos,
                                                                 l_hash_fingerprint);
                 if (fingerprint_pos < 0) {
                     // Matching fingerprints exhausted
@@ -3280,8 +6195,8 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
 
                 const uint64_t current_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos);
                 const uint64_t next_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos + 1);
-                const int positive_res = (highbit_position(current_fingerprint) == qf->metadata->fingerprint_bits 
-                                            ? 1 : 2);
+                const int positive_res = match_result(qf, current_fingerprint,
+                                                        l_hash_fingerprint);
                 if (!is_runend(qf, fingerprint_pos) && 
                         current_fingerprint > next_fingerprint) {
                     uint64_t m1 = GET_MEMENTO(qf, fingerprint_pos);
@@ -3320,11 +6235,9 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
                     mid_hash = hash_64(mid_hash, BITMASK(63));
                 }
             }
-            const uint64_t mid_fast_reduced_part = fast_reduce(((mid_hash & BITMASK(qf->metadata->original_quotient_bits)) 
-                        << (32 - qf->metadata->original_quotient_bits)), orig_nslots);
-            const uint64_t mid_hash_bucket_index = (mid_fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                | ((mid_hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
-            const uint64_t mid_hash_fingerprint = (mid_hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits);
+            uint64_t mid_hash_bucket_index, mid_hash_fingerprint;
+            hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, mid_hash), &mid_hash_bucket_index,
+                                            &mid_hash_fingerprint);
 
             if (!is_occupied(qf, mid_hash_bucket_index))
                 continue;
@@ -3336,7 +6249,8 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
             // Check the current middle prefix
             if (mid_runstart_index < qf->metadata->xnslots) {
                 // Find a matching fingerprint
-                int64_t fingerprint_pos = next_matching_fingerprint_in_run(qf, mid_runstart_index, mid_hash_fingerprint);
+                int64_t fingerprint_pos = next_compatible_fingerprint_in_run(qf, mid_runstart_index,
+                                                                        mid_hash_fingerprint);
                 if (fingerprint_pos >= 0) {
                     // A matching fingerprint exists
                     return true;
@@ -3349,7 +6263,7 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
             // Find the shortest matching fingerprint that gives a positive
             int64_t fingerprint_pos = r_runstart_index;
             while (true) {
-                fingerprint_pos = next_matching_fingerprint_in_run(qf, fingerprint_pos,
+                fingerprint_pos = next_compatible_fingerprint_in_run(qf, fingerprint_pos,
                                                                 r_hash_fingerprint);
                 if (fingerprint_pos < 0) {
                     // Matching fingerprints exhausted
@@ -3358,8 +6272,8 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
 
                 const uint64_t current_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos);
                 const uint64_t next_fingerprint = GET_FINGERPRINT(qf, fingerprint_pos + 1);
-                const int positive_res = (highbit_position(current_fingerprint) == qf->metadata->fingerprint_bits 
-                                            ? 1 : 2);
+                const int positive_res = match_result(qf, current_fingerprint,
+                                                        r_hash_fingerprint);
                 if (!is_runend(qf, fingerprint_pos) && 
                         current_fingerprint > next_fingerprint) {
                     uint64_t m1 = GET_MEMENTO(qf, fingerprint_pos);
@@ -3391,6 +6305,104 @@ int qf_range_query(const QF *qf, uint64_t l_key, uint64_t l_memento,
     }
 }
 
+/*
+ * Probing many filters for the same range hashes every prefix once, since
+ * the filters share their hash mode and seed. The home slots are computed
+ * for a batch of filters up front and prefetched, so the cache misses of the
+ * filters overlap instead of being taken one after the other.
+ */
+#define MULTI_QUERY_BATCH 64
+
+int64_t qf_multi_range_query(const QF *const *filters, size_t n, uint64_t l_key,
+                            uint64_t l_memento, uint64_t r_key, uint64_t r_memento,
+                            uint64_t *may_contain, uint8_t flags)    // NEW IN MEMENTO
+{
+    if (n == 0)
+        return 0;
+    const enum qf_hashmode hash_mode = filters[0]->metadata->hash_mode;
+    const uint32_t seed = filters[0]->metadata->seed;
+    for (size_t i = 1; i < n; i++) {
+        assert(filters[i]->metadata->hash_mode == hash_mode);
+        assert(filters[i]->metadata->seed == seed);
+    }
+    memset(may_contain, 0, (n + 63) / 64 * sizeof(uint64_t));
+
+    uint64_t l_hash = l_key, r_hash = r_key;
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		if (hash_mode == QF_HASH_DEFAULT) {
+			l_hash = MurmurHash64A(((void *) &l_key), sizeof(l_key), seed);
+			r_hash = MurmurHash64A(((void *) &r_key), sizeof(r_key), seed);
+        }
+		else if (hash_mode == QF_HASH_INVERTIBLE) {
+			l_hash = hash_64(l_key, BITMASK(63));
+			r_hash = hash_64(r_key, BITMASK(63));
+        }
+	}
+
+    size_t positive_cnt = 0;
+    uint64_t buckets[2][MULTI_QUERY_BATCH], fingerprints[2][MULTI_QUERY_BATCH];
+    for (size_t batch_start = 0; batch_start < n; batch_start += MULTI_QUERY_BATCH) {
+        const size_t batch_len = (n - batch_start < MULTI_QUERY_BATCH ? n - batch_start
+                                                                    : MULTI_QUERY_BATCH);
+        for (size_t j = 0; j < batch_len; j++) {
+            const QF *qf = filters[batch_start + j];
+            for (int side = 0; side < 2; side++) {
+                hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, side ? r_hash : l_hash),
+                                            &buckets[side][j], &fingerprints[side][j]);
+                __builtin_prefetch(&METADATA_WORD(qf, occupieds, buckets[side][j]));
+                __builtin_prefetch(BLOCK_SLOTS(qf, buckets[side][j] / QF_SLOTS_PER_BLOCK));
+                if (l_hash == r_hash)
+                    break;
+            }
+        }
+        for (size_t j = 0; j < batch_len; j++) {
+            const QF *qf = filters[batch_start + j];
+            const uint64_t max_memento = BITMASK(qf->metadata->memento_bits);
+            bool positive;
+            if (l_hash == r_hash)
+                positive = prefix_range_query(qf, buckets[0][j], fingerprints[0][j],
+                                                l_memento, r_memento);
+            else
+                positive = prefix_range_query(qf, buckets[0][j], fingerprints[0][j],
+                                                l_memento, max_memento)
+                            || prefix_range_query(qf, buckets[1][j], fingerprints[1][j],
+                                                0, r_memento);
+            if (positive) {
+                may_contain[(batch_start + j) / 64] |= 1ULL << ((batch_start + j) % 64);
+                positive_cnt++;
+            }
+        }
+    }
+
+    // Middle prefixes only need to be probed in the filters that are still
+    // negative
+    if (l_hash != r_hash) {
+        for (uint64_t mid_key = l_key + 1; mid_key < r_key && positive_cnt < n;
+                mid_key++) {
+            uint64_t mid_hash = mid_key;
+            if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+                if (hash_mode == QF_HASH_DEFAULT)
+                    mid_hash = MurmurHash64A(((void *) &mid_key), sizeof(mid_key), seed);
+                else if (hash_mode == QF_HASH_INVERTIBLE)
+                    mid_hash = hash_64(mid_key, BITMASK(63));
+            }
+            for (size_t i = 0; i < n; i++) {
+                if ((may_contain[i / 64] >> (i % 64)) & 1ULL)
+                    continue;
+                const QF *qf = filters[i];
+                uint64_t bucket, fingerprint;
+                hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, mid_hash), &bucket, &fingerprint);
+                if (prefix_range_query(qf, bucket, fingerprint, 0,
+                                        BITMASK(qf->metadata->memento_bits))) {
+                    may_contain[i / 64] |= 1ULL << (i % 64);
+                    positive_cnt++;
+                }
+            }
+        }
+    }
+    return (int64_t) positive_cnt;
+}
+
 /* Getters */
 enum qf_hashmode qf_get_hashmode(const QF *qf) {
 	return qf->metadata->hash_mode;
@@ -3407,6 +6419,12 @@ bool qf_is_auto_resize_enabled(const QF *qf) {
 		return true;
 	return false;
 }
+double qf_get_growth_factor(const QF *qf) {   // NEW IN MEMENTO
+	return qf->metadata->growth_factor;
+}
+bool qf_is_auto_shrink_enabled(const QF *qf) {   // NEW IN MEMENTO
+	return qf->metadata->auto_shrink == 1;
+}
 uint64_t qf_get_total_size_in_bytes(const QF *qf) {
 	return qf->metadata->total_size_in_bytes;
 }
@@ -3417,6 +6435,41 @@ uint64_t qf_get_num_occupied_slots(const QF *qf) {
 	return qf->metadata->noccupied_slots;
 }
 
+/****************** NEW IN MEMENTO ******************/
+void qf_get_memory_breakdown(const QF *qf, qf_memory_stats *stats)
+{
+	const qfmetadata *md = qf->metadata;
+	const qfruntime *runtime = qf->runtimedata;
+	const uint64_t slot_bits = md->nblocks * QF_SLOTS_PER_BLOCK * md->bits_per_slot;
+	stats->slot_bytes = md->nslots * md->bits_per_slot / 8;
+	stats->overflow_slot_bytes = slot_bits / 8 - stats->slot_bytes;
+	stats->bitmap_bytes = md->nblocks * 2 * QF_METADATA_WORDS_PER_BLOCK * sizeof(uint64_t);
+	stats->offset_bytes = md->nblocks * sizeof(qf_block_offset_t);
+	stats->metadata_bytes = blocks_offset_for_layout(md->block_layout);
+	uint64_t table_bytes = (runtime->mapped_size > 0 ? runtime->mapped_size
+                                    : stats->metadata_bytes + md->total_size_in_bytes);
+	// The locks of a filter in shared memory are mapped along with its table
+	if (runtime->shared_locks)
+		table_bytes -= lock_array_bytes(runtime->num_locks);
+	stats->slack_bytes = table_bytes - stats->metadata_bytes - slot_bits / 8 
+                            - stats->bitmap_bytes - stats->offset_bytes;
+
+	stats->runtime_bytes = sizeof(qfruntime);
+	if (runtime->dirty_regions != NULL)
+		stats->runtime_bytes += region_bitmap_bytes(qf);
+	if (runtime->snapshot_dirty_regions != NULL)
+		stats->runtime_bytes += region_bitmap_bytes(qf);
+	if (runtime->f_info.filepath != NULL)
+		stats->runtime_bytes += strlen(runtime->f_info.filepath) + 1;
+	stats->lock_bytes = lock_array_bytes(runtime->num_locks);
+#ifdef LOG_WAIT_TIME
+	stats->lock_bytes += (runtime->num_locks + 1) * sizeof(wait_time_data);
+#endif
+
+	stats->total_bytes = table_bytes + stats->runtime_bytes + stats->lock_bytes;
+	stats->bits_per_key = (md->nelts > 0 ? 8.0 * stats->total_bytes / md->nelts : 0.0);
+}
+
 uint64_t qf_get_num_key_bits(const QF *qf) {
 	return qf->metadata->key_bits;
 }
@@ -3441,19 +6494,21 @@ uint64_t qf_get_num_distinct_key_value_pairs(const QF *qf) {
 int64_t qf_iterator_from_position(const QF *qf, QFi *qfi, uint64_t position)
 {
 	if (position == 0xffffffffffffffff) {
-		qfi->current = 0xffffffffffffffff;
+		qfi->run = qfi->current = 0xffffffffffffffff;
 		qfi->qf = qf;
 		return QFI_INVALID;
 	}
 	assert(position < qf->metadata->nslots);
 	if (!is_occupied(qf, position)) {
-		uint64_t block_index = position;
-		uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-		if (idx == 64) {
-			while (idx == 64 && block_index < qf->metadata->nblocks) {
-				block_index++;
-				idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-			}
+		uint64_t block_index = position / QF_SLOTS_PER_BLOCK;
+		uint64_t idx = bitselect(BLOCK_OCCUPIEDS(qf, block_index)[0] 
+                                & ~BITMASK(position % QF_SLOTS_PER_BLOCK), 0);
+		while (idx == 64 && ++block_index < qf->metadata->nblocks)
+			idx = bitselect(BLOCK_OCCUPIEDS(qf, block_index)[0], 0);
+		if (block_index == qf->metadata->nblocks) {
+			qfi->qf = qf;
+			qfi->run = qfi->current = qf->metadata->xnslots;
+			return QFI_INVALID;
 		}
 		position = block_index * QF_SLOTS_PER_BLOCK + idx;
 	}
@@ -3468,10 +6523,9 @@ int64_t qf_iterator_from_position(const QF *qf, QFi *qfi, uint64_t position)
 #ifdef LOG_CLUSTER_LENGTH
 	qfi->c_info = (cluster_data* )calloc(qf->metadata->nslots/32,
 																			 sizeof(cluster_data));
-	if (qfi->c_info == NULL) {
+	// NEW IN MEMENTO: without memory, the iterator just does not log clusters
+	if (qfi->c_info == NULL)
 		perror("Couldn't allocate memory for c_info.");
-		exit(EXIT_FAILURE);
-	}
 	qfi->cur_start_index = position;
 	qfi->cur_length = 1;
 #endif
@@ -3500,18 +6554,8 @@ int64_t qf_iterator_by_key(const QF *qf, QFi *qfi, uint64_t key, uint8_t flags)
 	}
 	uint64_t hash = key;
 
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - \
-                                            qf->metadata->fingerprint_bits;
-    const uint32_t orig_quotient_size = qf->metadata->original_quotient_bits;
-    const uint64_t orig_nslots = qf->metadata->nslots >> (qf->metadata->key_bits 
-                                                        - qf->metadata->fingerprint_bits 
-                                                        - qf->metadata->original_quotient_bits);
-	const uint64_t fast_reduced_part = fast_reduce(((hash & BITMASK(orig_quotient_size)) 
-                                                    << (32 - orig_quotient_size)), orig_nslots);
-	const uint64_t hash_bucket_index = (fast_reduced_part << (bucket_index_hash_size - orig_quotient_size))
-                        | ((hash >> orig_quotient_size) & BITMASK(bucket_index_hash_size - orig_quotient_size));
-	const uint64_t hash_fingerprint = ((hash >> bucket_index_hash_size) & BITMASK(qf->metadata->fingerprint_bits))
-                                        | (1ULL << qf->metadata->fingerprint_bits);
+	uint64_t hash_bucket_index, hash_fingerprint;
+	hash_to_bucket_and_fingerprint(qf, reduce_hash(qf, hash), &hash_bucket_index, &hash_fingerprint);
     
     bool target_found = false;
 	// If a run starts at "position" move the iterator to point it to the
@@ -3541,11 +6585,11 @@ int64_t qf_iterator_by_key(const QF *qf, QFi *qfi, uint64_t key, uint8_t flags)
 		uint64_t position = hash_bucket_index;
 		assert(position < qf->metadata->nslots);
 		uint64_t block_index = position / QF_SLOTS_PER_BLOCK;
-		uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
+		uint64_t idx = bitselect(BLOCK_OCCUPIEDS(qf, block_index)[0], 0);
 		if (idx == 64) {
 			while(idx == 64 && block_index < qf->metadata->nblocks) {
 				block_index++;
-				idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
+				idx = bitselect(BLOCK_OCCUPIEDS(qf, block_index)[0], 0);
 			}
 		}
 		position = block_index * QF_SLOTS_PER_BLOCK + idx;
@@ -3582,63 +6626,25 @@ static int qfi_get(const QFi *qfi, uint64_t *key, uint64_t *mementos)   // NEW I
         m2 = GET_MEMENTO(qf, qfi->current + 1);
         if (m1 < m2) {
             mementos[res++] = m1;
-            mementos[res++] = m2;
-        }
-        else {
-            // Mementos stored as sorted list
-            const uint64_t memento_bits = qf->metadata->memento_bits;
-            const uint64_t max_memento_value = (1ULL << memento_bits) - 1;
-
-            mementos[res++] = m2;
-            const uint64_t pos = qfi->current + 2;
-            uint64_t data = 0;
-            int32_t filled_bits = 0;
-            int64_t data_bit_pos = (pos % QF_SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot;
-            uint64_t data_block_ind = pos / QF_SLOTS_PER_BLOCK;
-            GET_NEXT_DATA_WORD_IF_EMPTY(qf, data, filled_bits, memento_bits,
-                                        data_bit_pos, data_block_ind);
-
-            uint64_t memento_count = data & max_memento_value;
-            data >>= memento_bits;
-            filled_bits -= memento_bits;
-            if (memento_count == max_memento_value) {
-                uint64_t length = 2, pw = 1;
-                memento_count = 0;
-                while (length) {
-                    GET_NEXT_DATA_WORD_IF_EMPTY(qf, data, filled_bits, memento_bits,
-                                                data_bit_pos, data_block_ind);
-                    const uint64_t current_fragment = data & max_memento_value;
-                    if (current_fragment == max_memento_value) {
-                        length++;
-                    }
-                    else {
-                        length--;
-                        memento_count += pw * current_fragment;
-                        pw *= max_memento_value;
-                    }
-                    data >>= memento_bits;
-                    filled_bits -= memento_bits;
-                }
-            }
-            for (uint32_t i = 0; i < memento_count; i++) {
-                GET_NEXT_DATA_WORD_IF_EMPTY(qf, data, filled_bits, memento_bits,
-                                            data_bit_pos, data_block_ind);
-                mementos[res++] = data & max_memento_value;
-                data >>= memento_bits;
-                filled_bits -= memento_bits;
-            }
-            mementos[res++] = m1;
+            mementos[res++] = m2;
+        }
+        else {
+            // Mementos stored as sorted list
+            mementos[res++] = m2;
+            memento_list_reader reader;
+            const uint64_t memento_count = memento_list_begin(qf, qfi->current + 2, &reader);
+            for (uint32_t i = 0; i < memento_count; i++)
+                mementos[res++] = memento_list_next(qf, &reader);
+            mementos[res++] = m1;
         }
     }
     else {
         mementos[res++] = GET_MEMENTO(qf, qfi->current);
     }
-    const uint32_t bucket_index_hash_size = qf->metadata->key_bits - qf->metadata->fingerprint_bits;
-    const uint32_t original_quotient_bits = qf->metadata->original_quotient_bits;
-    const uint64_t original_bucket_index = qfi->run >> (bucket_index_hash_size - original_quotient_bits);
-    const uint64_t bucket_extension = ((qfi->run & BITMASK(bucket_index_hash_size - original_quotient_bits)) 
-                                            << original_quotient_bits);
-    *key = original_bucket_index | (f1 << bucket_index_hash_size) | bucket_extension;
+    if (qf->metadata->expandable)
+        f1 ^= 1ULL << highbit_position(f1);
+    uint32_t fingerprint_shift;
+    *key = bucket_to_hash(qf, qfi->run, &fingerprint_shift) | (f1 << fingerprint_shift);
 	return res;
 }
 
@@ -3714,17 +6720,14 @@ int qfi_next(QFi *qfi)  // NEW IN MEMENTO
 			uint64_t old_current = qfi->current;
 #endif
 			uint64_t block_index = qfi->run / QF_SLOTS_PER_BLOCK;
-			uint64_t rank = bitrank(get_block(qfi->qf, block_index)->occupieds[0],
+			uint64_t rank = bitrank(BLOCK_OCCUPIEDS(qfi->qf, block_index)[0],
                                     qfi->run % QF_SLOTS_PER_BLOCK);
-            uint64_t next_run = bitselect(get_block(qfi->qf, block_index)
-                                            ->occupieds[0], rank);
+            uint64_t next_run = bitselect(BLOCK_OCCUPIEDS(qfi->qf, block_index)[0], rank);
 			if (next_run == 64) {
 				rank = 0;
-				while (next_run == 64 && block_index < qfi->qf->metadata->nblocks) {
-					block_index++;
-					next_run = bitselect(get_block(qfi->qf, block_index)->occupieds[0],
+				while (next_run == 64 && ++block_index < qfi->qf->metadata->nblocks)
+					next_run = bitselect(BLOCK_OCCUPIEDS(qfi->qf, block_index)[0],
 															 rank);
-				}
 			}
 			if (block_index == qfi->qf->metadata->nblocks) {
 				/* set the index values to max. */
@@ -3737,7 +6740,7 @@ int qfi_next(QFi *qfi)  // NEW IN MEMENTO
 				qfi->current = qfi->run;
 #ifdef LOG_CLUSTER_LENGTH
 			if (qfi->current > old_current + 1) { /* new cluster. */
-				if (qfi->cur_length > 10) {
+				if (qfi->cur_length > 10 && qfi->c_info != NULL) {
 					qfi->c_info[qfi->num_clusters].start_index = qfi->cur_start_index;
 					qfi->c_info[qfi->num_clusters].length = qfi->cur_length;
 					qfi->num_clusters++;
@@ -3770,132 +6773,799 @@ bool qfi_end(const QFi *qfi)
 	return false;
 }
 
-#ifdef QF_ITERATOR
-/*
- * Merge qfa and qfb into qfc
- */
-/*
- * iterate over both qf (qfa and qfb)
- * simultaneously
- * for each index i
- * min(get_value(qfa, ia) < get_value(qfb, ib))
- * insert(min, ic)
- * increment either ia or ib, whichever is minimum.
- */
-void qf_merge(const QF *qfa, const QF *qfb, QF *qfc)
+/****************** NEW IN MEMENTO ******************/
+bool qf_sharded_malloc(qf_sharded *sqf, uint32_t num_shards, uint64_t nslots_per_shard,
+                        uint64_t key_bits, uint64_t memento_bits, enum qf_hashmode hash_mode,
+                        uint32_t seed, const qf_alloc_options *options)
+{
+	assert(num_shards > 0 && popcnt(num_shards) == 1);
+	// The shard bits are taken from above the key bits of the hash
+	const uint64_t hash_bits = (hash_mode == QF_HASH_INVERTIBLE ? 63 : 64);
+	if (key_bits + __builtin_ctz(num_shards) > hash_bits) {
+		fprintf(stderr, "%lu key bits and %u shards need more than %lu hash bits.\n",
+                        key_bits, num_shards, hash_bits);
+		return false;
+	}
+	const qf_allocator *allocator = (options != NULL && options->allocator != NULL
+                                        ? options->allocator : &system_allocator);
+	sqf->shards = (QF *)qf_zalloc(allocator, num_shards * sizeof(QF), sizeof(uint64_t));
+	if (sqf->shards == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for the shards.\n");
+		return false;
+	}
+	sqf->num_shards = num_shards;
+	sqf->shard_bits = __builtin_ctz(num_shards);
+	sqf->hash_mode = hash_mode;
+	sqf->seed = seed;
+	sqf->allocator = *allocator;
+
+	for (uint32_t i = 0; i < num_shards; i++) {
+		if (!malloc_filter(&sqf->shards[i], nslots_per_shard, key_bits, memento_bits,
+                            hash_mode, seed, 0, 0, options)) {
+			while (i > 0)
+				qf_free(&sqf->shards[--i]);
+			qf_dealloc(&sqf->allocator, sqf->shards, num_shards * sizeof(QF));
+			sqf->shards = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool qf_sharded_free(qf_sharded *sqf)
+{
+	assert(sqf->shards != NULL);
+	bool res = true;
+	for (uint32_t i = 0; i < sqf->num_shards; i++)
+		res &= qf_free(&sqf->shards[i]);
+	qf_dealloc(&sqf->allocator, sqf->shards, sqf->num_shards * sizeof(QF));
+	sqf->shards = NULL;
+	return res;
+}
+
+uint32_t qf_sharded_get_num_shards(const qf_sharded *sqf)
 {
-	QFi qfia, qfib;
-	qf_iterator_from_position(qfa, &qfia, 0);
-	qf_iterator_from_position(qfb, &qfib, 0);
+	return sqf->num_shards;
+}
 
-	if (qfa->metadata->hash_mode != qfc->metadata->hash_mode &&
-			qfa->metadata->seed != qfc->metadata->seed &&
-			qfb->metadata->hash_mode  != qfc->metadata->hash_mode &&
-			qfb->metadata->seed  != qfc->metadata->seed) {
-		fprintf(stderr, "Output QF and input QFs do not have the same hash mode or seed.\n");
-		exit(1);
+QF *qf_sharded_get_shard(const qf_sharded *sqf, uint32_t index)
+{
+	assert(index < sqf->num_shards);
+	return &sqf->shards[index];
+}
+
+// Returns the prefix hash of `key`, as the shards would compute it, and
+// stores the index of its shard in `shard`. Invertible hashes are 63 bits
+// wide, so their shard comes from bits 62 and below.
+// NEW IN MEMENTO
+static inline uint64_t sharded_prefix_hash(const qf_sharded *sqf, uint64_t key,
+                                           uint8_t flags, uint32_t *shard)
+{
+	uint32_t hash_bits = 64;
+	if (sqf->hash_mode == QF_HASH_INVERTIBLE)
+		hash_bits = 63;
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		if (sqf->hash_mode == QF_HASH_DEFAULT)
+			key = MurmurHash64A(((void *)&key), sizeof(key), sqf->seed);
+		else if (sqf->hash_mode == QF_HASH_INVERTIBLE)
+			key = hash_64(key, BITMASK(63));
 	}
+	*shard = (sqf->shard_bits == 0 ? 0 : key >> (hash_bits - sqf->shard_bits));
+	return key;
+}
 
-	uint64_t keya, valuea, counta, keyb, valueb, countb;
-	qfi_get_hash(&qfia, &keya, &valuea, &counta);
-	qfi_get_hash(&qfib, &keyb, &valueb, &countb);
-	do {
-		if (keya < keyb) {
-			qf_insert(qfc, keya, valuea, counta, QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfia);
-			qfi_get_hash(&qfia, &keya, &valuea, &counta);
+uint32_t qf_sharded_shard_of(const qf_sharded *sqf, uint64_t key, uint8_t flags)
+{
+	uint32_t shard;
+	sharded_prefix_hash(sqf, key, flags, &shard);
+	return shard;
+}
+
+bool qf_sharded_set_resize_policy(qf_sharded *sqf, const qf_resize_policy *policy)
+{
+	if (!resize_policy_is_valid(policy))
+		return false;
+	for (uint32_t i = 0; i < sqf->num_shards; i++)
+		qf_set_resize_policy(&sqf->shards[i], policy);
+	return true;
+}
+
+int qf_sharded_insert_mementos(qf_sharded *sqf, uint64_t key, uint64_t mementos[],
+                                uint64_t memento_count, uint8_t flags)
+{
+	uint32_t shard;
+	const uint64_t hash = sharded_prefix_hash(sqf, key, flags, &shard);
+	return qf_insert_mementos(&sqf->shards[shard], hash, mementos, memento_count,
+                                flags | QF_KEY_IS_HASH);
+}
+
+int64_t qf_sharded_insert_single(qf_sharded *sqf, uint64_t key, uint64_t memento,
+                                 uint8_t flags)
+{
+	uint32_t shard;
+	const uint64_t hash = sharded_prefix_hash(sqf, key, flags, &shard);
+	return qf_insert_single(&sqf->shards[shard], hash, memento, flags | QF_KEY_IS_HASH);
+}
+
+int qf_sharded_delete_single(qf_sharded *sqf, uint64_t key, uint64_t memento, uint8_t flags)
+{
+	uint32_t shard;
+	const uint64_t hash = sharded_prefix_hash(sqf, key, flags, &shard);
+	return qf_delete_single(&sqf->shards[shard], hash, memento, flags | QF_KEY_IS_HASH);
+}
+
+int qf_sharded_point_query(const qf_sharded *sqf, uint64_t key, uint64_t memento,
+                           uint8_t flags)
+{
+	uint32_t shard;
+	const uint64_t hash = sharded_prefix_hash(sqf, key, flags, &shard);
+	return qf_point_query(&sqf->shards[shard], hash, memento, flags | QF_KEY_IS_HASH);
+}
+
+// Splits the range into one single-prefix query per prefix, each on the
+// shard of its prefix.
+// NEW IN MEMENTO
+int qf_sharded_range_query(const qf_sharded *sqf, uint64_t l_key, uint64_t l_memento,
+                           uint64_t r_key, uint64_t r_memento, uint8_t flags)
+{
+	assert(l_key <= r_key);
+	const uint64_t max_memento = BITMASK(sqf->shards[0].metadata->memento_bits);
+	uint64_t key = l_key;
+	while (true) {
+		uint32_t shard;
+		const uint64_t hash = sharded_prefix_hash(sqf, key, flags, &shard);
+		const int res = qf_range_query(&sqf->shards[shard],
+                                        hash, key == l_key ? l_memento : 0,
+                                        hash, key == r_key ? r_memento : max_memento,
+                                        flags | QF_KEY_IS_HASH);
+		if (res != 0)
+			return res;
+		if (key == r_key)
+			return 0;
+		key++;
+	}
+}
+
+uint64_t qf_sharded_get_sum_of_counts(const qf_sharded *sqf)
+{
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < sqf->num_shards; i++)
+		sum += qf_get_sum_of_counts(&sqf->shards[i]);
+	return sum;
+}
+
+uint64_t qf_sharded_get_total_size_in_bytes(const qf_sharded *sqf)
+{
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < sqf->num_shards; i++)
+		size += qf_get_total_size_in_bytes(&sqf->shards[i]);
+	return size;
+}
+
+// Creates an empty partition filter with room for `num_keys` keys. Its
+// original size is a power of two, so that its hashes are not reduced and
+// the prefixes can be read back.
+// NEW IN MEMENTO
+static bool malloc_partition(const qf_partitioned *pqf, QF *qf, const uint64_t num_keys)
+{
+	qf_alloc_options options = pqf->options;
+	options.allocator = &pqf->allocator;
+	options.expandable = false;
+	uint64_t nslots = QF_SLOTS_PER_BLOCK;
+	while (nslots < pqf->nslots || nslots < 2 * num_keys)
+		nslots *= 2;
+	if (!malloc_filter(qf, nslots, pqf->key_bits, pqf->memento_bits, QF_HASH_NONE, 0,
+                        0, 0, &options))
+		return false;
+	qf_set_resize_policy(qf, &pqf->policy);
+	return true;
+}
+
+/****************** NEW IN MEMENTO ******************/
+bool qf_partitioned_malloc(qf_partitioned *pqf, uint64_t nslots, uint64_t key_bits,
+                            uint64_t memento_bits, uint64_t split_threshold,
+                            const qf_alloc_options *options)
+{
+	memset(pqf, 0, sizeof(*pqf));
+	if (options != NULL)
+		pqf->options = *options;
+	pqf->allocator = (options != NULL && options->allocator != NULL
+                        ? *options->allocator : system_allocator);
+	pqf->options.allocator = NULL;
+	pqf->nslots = nslots;
+	pqf->key_bits = key_bits;
+	pqf->memento_bits = memento_bits;
+	pqf->split_threshold = split_threshold;
+	qf_get_default_resize_policy(&pqf->policy);
+	pqf->policy.auto_resize = true;
+
+	pqf->capacity = 4;
+	pqf->partitions = (qf_partition *)qf_zalloc(&pqf->allocator,
+                                        pqf->capacity * sizeof(qf_partition), sizeof(uint64_t));
+	if (pqf->partitions == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for the partitions.\n");
+		return false;
+	}
+	if (!malloc_partition(pqf, &pqf->partitions[0].qf, 0)) {
+		qf_dealloc(&pqf->allocator, pqf->partitions, pqf->capacity * sizeof(qf_partition));
+		pqf->partitions = NULL;
+		return false;
+	}
+	pqf->partitions[0].min_key = 0;
+	pqf->partitions[0].split_count = split_threshold;
+	pqf->num_partitions = 1;
+	return true;
+}
+
+bool qf_partitioned_free(qf_partitioned *pqf)
+{
+	assert(pqf->partitions != NULL);
+	bool res = true;
+	for (uint32_t i = 0; i < pqf->num_partitions; i++)
+		res &= qf_free(&pqf->partitions[i].qf);
+	qf_dealloc(&pqf->allocator, pqf->partitions, pqf->capacity * sizeof(qf_partition));
+	pqf->partitions = NULL;
+	return res;
+}
+
+uint32_t qf_partitioned_get_num_partitions(const qf_partitioned *pqf)
+{
+	return pqf->num_partitions;
+}
+
+// The largest prefix of the partition at `index`.
+// NEW IN MEMENTO
+static inline uint64_t partition_max_key(const qf_partitioned *pqf, const uint32_t index)
+{
+	return (index + 1 < pqf->num_partitions ? pqf->partitions[index + 1].min_key - 1
+                                            : UINT64_MAX);
+}
+
+QF *qf_partitioned_get_partition(const qf_partitioned *pqf, uint32_t index,
+                                 uint64_t *min_key, uint64_t *max_key)
+{
+	assert(index < pqf->num_partitions);
+	if (min_key != NULL)
+		*min_key = pqf->partitions[index].min_key;
+	if (max_key != NULL)
+		*max_key = partition_max_key(pqf, index);
+	return &pqf->partitions[index].qf;
+}
+
+// The index of the partition holding `key`.
+// NEW IN MEMENTO
+static inline uint32_t find_partition(const qf_partitioned *pqf, const uint64_t key)
+{
+	uint32_t lo = 0, hi = pqf->num_partitions;
+	while (hi - lo > 1) {
+		const uint32_t mid = (lo + hi) / 2;
+		if (pqf->partitions[mid].min_key <= key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// A keepsake box read back from a partition during a split.
+typedef struct partition_box {
+	uint64_t key;
+	uint64_t count;
+} partition_box;
+
+static int compare_partition_boxes(const void *a, const void *b)
+{
+	const uint64_t key_a = ((const partition_box *)a)->key;
+	const uint64_t key_b = ((const partition_box *)b)->key;
+	return (key_a > key_b) - (key_a < key_b);
+}
+
+// The prefix hash of `key` in the partitions: an invertible hash on
+// `key_bits` bits, so that splits can tell the prefix of a keepsake box.
+// NEW IN MEMENTO
+static inline uint64_t partition_hash(const qf_partitioned *pqf, const uint64_t key)
+{
+	return hash_64(key, BITMASK(pqf->key_bits));
+}
+
+static inline uint64_t partition_key(const qf_partitioned *pqf, const uint64_t hash)
+{
+	return hash_64i(hash, BITMASK(pqf->key_bits));
+}
+
+// Moves every keepsake box of `src` into `left` if its prefix is below
+// `split_key`, and into `right` otherwise.
+// NEW IN MEMENTO
+static int split_partition_keys(const qf_partitioned *pqf, const QF *src, QF *left, QF *right,
+                                const uint64_t split_key, uint64_t *mementos)
+{
+	QFi qfi;
+	qf_iterator_from_position(src, &qfi, 0);
+	while (!qfi_end(&qfi)) {
+		uint64_t hash;
+		const int count = qfi_get_hash(&qfi, &hash, mementos);
+		QF *dest = (partition_key(pqf, hash) < split_key ? left : right);
+		const int ret = qf_insert_mementos(dest, hash, mementos, count, QF_NO_LOCK);
+		if (ret < 0)
+			return (ret == QF_NO_SPACE ? QF_NO_MEMORY : ret);
+		qfi_next(&qfi);
+	}
+	return 0;
+}
+
+int qf_partitioned_split(qf_partitioned *pqf, uint32_t index)
+{
+	assert(index < pqf->num_partitions);
+	const uint64_t nelts = qf_get_sum_of_counts(&pqf->partitions[index].qf);
+	if (nelts == 0)
+		return QF_INVALID;
+	if (pqf->num_partitions == pqf->capacity) {
+		qf_partition *partitions = (qf_partition *)qf_realloc(&pqf->allocator, pqf->partitions,
+                                            pqf->capacity * sizeof(qf_partition),
+                                            2 * pqf->capacity * sizeof(qf_partition),
+                                            sizeof(uint64_t));
+		if (partitions == NULL)
+			return QF_NO_MEMORY;
+		pqf->partitions = partitions;
+		pqf->capacity *= 2;
+	}
+	qf_partition *part = &pqf->partitions[index];
+
+	partition_box *boxes = (partition_box *)qf_alloc(&pqf->allocator,
+                                            nelts * sizeof(partition_box), sizeof(uint64_t));
+	uint64_t *mementos = (uint64_t *)qf_alloc(&pqf->allocator, nelts * sizeof(uint64_t),
+                                            sizeof(uint64_t));
+	if (boxes == NULL || mementos == NULL) {
+		qf_dealloc(&pqf->allocator, boxes, nelts * sizeof(partition_box));
+		qf_dealloc(&pqf->allocator, mementos, nelts * sizeof(uint64_t));
+		return QF_NO_MEMORY;
+	}
+	uint64_t num_boxes = 0;
+	QFi qfi;
+	qf_iterator_from_position(&part->qf, &qfi, 0);
+	while (!qfi_end(&qfi)) {
+		uint64_t hash;
+		boxes[num_boxes].count = qfi_get_hash(&qfi, &hash, mementos);
+		boxes[num_boxes++].key = partition_key(pqf, hash);
+		qfi_next(&qfi);
+	}
+	qsort(boxes, num_boxes, sizeof(partition_box), compare_partition_boxes);
+
+	// Split at the first prefix past half of the keys, and at the second
+	// distinct prefix if that is the first one.
+	uint64_t i = 0, left_count = 0;
+	while (i < num_boxes && 2 * (left_count + boxes[i].count) <= nelts)
+		left_count += boxes[i++].count;
+	while (i < num_boxes && boxes[i].key == boxes[0].key)
+		left_count += boxes[i++].count;
+	int ret = QF_INVALID;
+	QF left, right;
+	if (i < num_boxes) {
+		const uint64_t split_key = boxes[i].key;
+		ret = QF_NO_MEMORY;
+		if (malloc_partition(pqf, &left, left_count)) {
+			if (malloc_partition(pqf, &right, nelts - left_count)) {
+				ret = split_partition_keys(pqf, &part->qf, &left, &right, split_key, mementos);
+				if (ret == 0) {
+					qf_free(&part->qf);
+					part->qf = left;
+					part->split_count = pqf->split_threshold;
+					memmove(part + 2, part + 1, (pqf->num_partitions - index - 1)
+                                                    * sizeof(qf_partition));
+					part[1].min_key = split_key;
+					part[1].split_count = pqf->split_threshold;
+					part[1].qf = right;
+					pqf->num_partitions++;
+				}
+				else
+					qf_free(&right);
+			}
+			if (ret != 0)
+				qf_free(&left);
 		}
-		else {
-			qf_insert(qfc, keyb, valueb, countb, QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfib);
-			qfi_get_hash(&qfib, &keyb, &valueb, &countb);
+	}
+	qf_dealloc(&pqf->allocator, boxes, nelts * sizeof(partition_box));
+	qf_dealloc(&pqf->allocator, mementos, nelts * sizeof(uint64_t));
+	return ret;
+}
+
+// Splits the partition at `index` if it has grown past its split count.
+// NEW IN MEMENTO
+static void maybe_split_partition(qf_partitioned *pqf, const uint32_t index)
+{
+	if (pqf->split_threshold == 0
+            || qf_get_sum_of_counts(&pqf->partitions[index].qf) <= pqf->partitions[index].split_count)
+		return;
+	// Retry once the partition has doubled, rather than on every insertion
+	if (qf_partitioned_split(pqf, index) != 0)
+		pqf->partitions[index].split_count *= 2;
+}
+
+bool qf_partitioned_set_resize_policy(qf_partitioned *pqf, const qf_resize_policy *policy)
+{
+	if (!resize_policy_is_valid(policy))
+		return false;
+	pqf->policy = *policy;
+	for (uint32_t i = 0; i < pqf->num_partitions; i++)
+		qf_set_resize_policy(&pqf->partitions[i].qf, policy);
+	return true;
+}
+
+int qf_partitioned_insert_mementos(qf_partitioned *pqf, uint64_t key, uint64_t mementos[],
+                                   uint64_t memento_count, uint8_t flags)
+{
+	const uint32_t index = find_partition(pqf, key);
+	const int ret = qf_insert_mementos(&pqf->partitions[index].qf, partition_hash(pqf, key),
+                                        mementos, memento_count, flags);
+	if (ret >= 0)
+		maybe_split_partition(pqf, index);
+	return ret;
+}
+
+int64_t qf_partitioned_insert_single(qf_partitioned *pqf, uint64_t key, uint64_t memento,
+                                     uint8_t flags)
+{
+	const uint32_t index = find_partition(pqf, key);
+	const int64_t ret = qf_insert_single(&pqf->partitions[index].qf, partition_hash(pqf, key),
+                                        memento, flags);
+	if (ret >= 0)
+		maybe_split_partition(pqf, index);
+	return ret;
+}
+
+int qf_partitioned_delete_single(qf_partitioned *pqf, uint64_t key, uint64_t memento,
+                                 uint8_t flags)
+{
+	return qf_delete_single(&pqf->partitions[find_partition(pqf, key)].qf,
+                            partition_hash(pqf, key), memento, flags);
+}
+
+int qf_partitioned_point_query(const qf_partitioned *pqf, uint64_t key, uint64_t memento,
+                               uint8_t flags)
+{
+	return qf_point_query(&pqf->partitions[find_partition(pqf, key)].qf,
+                            partition_hash(pqf, key), memento, flags);
+}
+
+// Visits the partitions the range overlaps, skipping empty ones, with one
+// single-prefix query per prefix, since the partitions hash the prefixes.
+// NEW IN MEMENTO
+int qf_partitioned_range_query(const qf_partitioned *pqf, uint64_t l_key, uint64_t l_memento,
+                               uint64_t r_key, uint64_t r_memento, uint8_t flags)
+{
+	assert(l_key <= r_key);
+	const uint64_t max_memento = BITMASK(pqf->memento_bits);
+	for (uint32_t i = find_partition(pqf, l_key);
+            i < pqf->num_partitions && pqf->partitions[i].min_key <= r_key; i++) {
+		const QF *qf = &pqf->partitions[i].qf;
+		const uint64_t max_key = partition_max_key(pqf, i);
+		if (qf_get_sum_of_counts(qf) == 0)
+			continue;
+		uint64_t key = (l_key < pqf->partitions[i].min_key ? pqf->partitions[i].min_key : l_key);
+		while (true) {
+			const uint64_t hash = partition_hash(pqf, key);
+			const int res = qf_range_query(qf, hash, key == l_key ? l_memento : 0,
+                                            hash, key == r_key ? r_memento : max_memento,
+                                            flags);
+			if (res != 0)
+				return res;
+			if (key == r_key || key == max_key)
+				break;
+			key++;
 		}
-	} while(!qfi_end(&qfia) && !qfi_end(&qfib));
+	}
+	return 0;
+}
+
+uint64_t qf_partitioned_get_sum_of_counts(const qf_partitioned *pqf)
+{
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < pqf->num_partitions; i++)
+		sum += qf_get_sum_of_counts(&pqf->partitions[i].qf);
+	return sum;
+}
+
+uint64_t qf_partitioned_get_total_size_in_bytes(const qf_partitioned *pqf)
+{
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < pqf->num_partitions; i++)
+		size += qf_get_total_size_in_bytes(&pqf->partitions[i].qf);
+	return size;
+}
+
+/****************** NEW IN MEMENTO ******************/
+bool qf_windowed_malloc(qf_windowed *wqf, uint32_t num_epochs, uint64_t epoch_length,
+                        uint64_t nslots_per_epoch, uint64_t key_bits, uint64_t memento_bits,
+                        enum qf_hashmode hash_mode, uint32_t seed,
+                        const qf_alloc_options *options)
+{
+	assert(num_epochs > 0 && epoch_length > 0);
+	memset(wqf, 0, sizeof(*wqf));
+	if (options != NULL)
+		wqf->options = *options;
+	wqf->allocator = (options != NULL && options->allocator != NULL
+                        ? *options->allocator : system_allocator);
+	wqf->options.allocator = NULL;
+	wqf->num_epochs = num_epochs;
+	wqf->epoch_length = epoch_length;
+	wqf->nslots = nslots_per_epoch;
+	wqf->key_bits = key_bits;
+	wqf->memento_bits = memento_bits;
+	wqf->hash_mode = hash_mode;
+	wqf->seed = seed;
+	qf_get_default_resize_policy(&wqf->policy);
+	wqf->policy.auto_resize = true;
+
+	wqf->epochs = (qf_window_epoch *)qf_zalloc(&wqf->allocator,
+                                    num_epochs * sizeof(qf_window_epoch), sizeof(uint64_t));
+	if (wqf->epochs == NULL) {
+		fprintf(stderr, "Couldn't allocate memory for the epochs.\n");
+		return false;
+	}
+	return true;
+}
 
-	if (!qfi_end(&qfia)) {
-		do {
-			qfi_get_hash(&qfia, &keya, &valuea, &counta);
-			qf_insert(qfc, keya, valuea, counta, QF_NO_LOCK | QF_KEY_IS_HASH);
-		} while(!qfi_next(&qfia));
+bool qf_windowed_free(qf_windowed *wqf)
+{
+	assert(wqf->epochs != NULL);
+	bool res = true;
+	for (uint32_t i = 0; i < wqf->num_epochs; i++) {
+		if (wqf->epochs[i].allocated)
+			res &= qf_free(&wqf->epochs[i].qf);
 	}
-	if (!qfi_end(&qfib)) {
-		do {
-			qfi_get_hash(&qfib, &keyb, &valueb, &countb);
-			qf_insert(qfc, keyb, valueb, countb, QF_NO_LOCK | QF_KEY_IS_HASH);
-		} while(!qfi_next(&qfib));
+	qf_dealloc(&wqf->allocator, wqf->epochs, wqf->num_epochs * sizeof(qf_window_epoch));
+	wqf->epochs = NULL;
+	return res;
+}
+
+// Whether epoch `id` has fallen out of the window.
+// NEW IN MEMENTO
+static inline bool window_epoch_expired(const qf_windowed *wqf, const uint64_t id)
+{
+	return id < wqf->expired_id || (wqf->started && id + wqf->num_epochs <= wqf->newest_id);
+}
+
+// Frees the filters of the epochs that have fallen out of the window.
+// NEW IN MEMENTO
+static void drop_expired_window_epochs(qf_windowed *wqf)
+{
+	for (uint32_t i = 0; i < wqf->num_epochs; i++) {
+		qf_window_epoch *epoch = &wqf->epochs[i];
+		if (epoch->allocated && window_epoch_expired(wqf, epoch->id)) {
+			qf_free(&epoch->qf);
+			epoch->allocated = false;
+		}
 	}
 }
 
-/*
- * Merge an array of qfs into the resultant QF
- */
-void qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr)
-{
-	int i;
-	QFi qfi_arr[nqf];
-	int smallest_idx = 0;
-	uint64_t smallest_key = UINT64_MAX;
-	for (i=0; i<nqf; i++) {
-		if (qf_arr[i]->metadata->hash_mode != qfr->metadata->hash_mode &&
-				qf_arr[i]->metadata->seed != qfr->metadata->seed) {
-			fprintf(stderr, "Output QF and input QFs do not have the same hash mode or seed.\n");
-			exit(1);
+// The ring entry that holds epoch `id`, or NULL if it has no filter.
+// NEW IN MEMENTO
+static inline qf_window_epoch *find_window_epoch(const qf_windowed *wqf, const uint64_t id)
+{
+	qf_window_epoch *epoch = &wqf->epochs[id % wqf->num_epochs];
+	return (epoch->allocated && epoch->id == id ? epoch : NULL);
+}
+
+QF *qf_windowed_get_epoch(const qf_windowed *wqf, uint64_t time)
+{
+	qf_window_epoch *epoch = find_window_epoch(wqf, time / wqf->epoch_length);
+	return epoch != NULL ? &epoch->qf : NULL;
+}
+
+void qf_windowed_expire(qf_windowed *wqf, uint64_t time)
+{
+	const uint64_t end_id = time / wqf->epoch_length;
+	if (end_id > wqf->expired_id) {
+		wqf->expired_id = end_id;
+		drop_expired_window_epochs(wqf);
+	}
+}
+
+// The ring entry of the epoch of `time`, which is opened if it is newer than
+// all the others. Returns NULL with `*ret` set if the epoch has expired or
+// its filter cannot be allocated.
+// NEW IN MEMENTO
+static qf_window_epoch *open_window_epoch(qf_windowed *wqf, const uint64_t time, int *ret)
+{
+	const uint64_t id = time / wqf->epoch_length;
+	if (window_epoch_expired(wqf, id)) {
+		*ret = QF_INVALID;
+		return NULL;
+	}
+	if (!wqf->started || id > wqf->newest_id) {
+		wqf->newest_id = id;
+		wqf->started = true;
+		drop_expired_window_epochs(wqf);
+	}
+	qf_window_epoch *epoch = &wqf->epochs[id % wqf->num_epochs];
+	if (epoch->allocated)
+		return epoch;
+	qf_alloc_options options = wqf->options;
+	options.allocator = &wqf->allocator;
+	if (!malloc_filter(&epoch->qf, wqf->nslots, wqf->key_bits, wqf->memento_bits,
+                        wqf->hash_mode, wqf->seed, 0, 0, &options)) {
+		*ret = QF_NO_MEMORY;
+		return NULL;
+	}
+	qf_set_resize_policy(&epoch->qf, &wqf->policy);
+	epoch->id = id;
+	epoch->allocated = true;
+	return epoch;
+}
+
+bool qf_windowed_set_resize_policy(qf_windowed *wqf, const qf_resize_policy *policy)
+{
+	if (!resize_policy_is_valid(policy))
+		return false;
+	wqf->policy = *policy;
+	for (uint32_t i = 0; i < wqf->num_epochs; i++) {
+		if (wqf->epochs[i].allocated)
+			qf_set_resize_policy(&wqf->epochs[i].qf, policy);
+	}
+	return true;
+}
+
+int qf_windowed_insert_mementos(qf_windowed *wqf, uint64_t time, uint64_t key,
+                                uint64_t mementos[], uint64_t memento_count, uint8_t flags)
+{
+	int ret;
+	qf_window_epoch *epoch = open_window_epoch(wqf, time, &ret);
+	if (epoch == NULL)
+		return ret;
+	return qf_insert_mementos(&epoch->qf, key, mementos, memento_count, flags);
+}
+
+int64_t qf_windowed_insert_single(qf_windowed *wqf, uint64_t time, uint64_t key,
+                                  uint64_t memento, uint8_t flags)
+{
+	int ret;
+	qf_window_epoch *epoch = open_window_epoch(wqf, time, &ret);
+	if (epoch == NULL)
+		return ret;
+	return qf_insert_single(&epoch->qf, key, memento, flags);
+}
+
+int qf_windowed_delete_single(qf_windowed *wqf, uint64_t time, uint64_t key,
+                              uint64_t memento, uint8_t flags)
+{
+	qf_window_epoch *epoch = find_window_epoch(wqf, time / wqf->epoch_length);
+	if (epoch == NULL)
+		return QF_INVALID;
+	return qf_delete_single(&epoch->qf, key, memento, flags);
+}
+
+int qf_windowed_range_query(const qf_windowed *wqf, uint64_t l_time, uint64_t r_time,
+                            uint64_t l_key, uint64_t l_memento, uint64_t r_key,
+                            uint64_t r_memento, uint8_t flags)
+{
+	const QF *filters[64];
+	uint64_t may_contain;
+	size_t n = 0;
+	const uint64_t l_id = l_time / wqf->epoch_length, r_id = r_time / wqf->epoch_length;
+	for (uint32_t i = 0; i < wqf->num_epochs; i++) {
+		const qf_window_epoch *epoch = &wqf->epochs[i];
+		if (!epoch->allocated || epoch->id < l_id || epoch->id > r_id)
+			continue;
+		filters[n++] = &epoch->qf;
+		if (n == 64) {
+			if (qf_multi_range_query(filters, n, l_key, l_memento, r_key, r_memento,
+                                    &may_contain, flags) > 0)
+				return 1;
+			n = 0;
 		}
-		qf_iterator_from_position(qf_arr[i], &qfi_arr[i], 0);
 	}
+	if (n > 0 && qf_multi_range_query(filters, n, l_key, l_memento, r_key, r_memento,
+                                    &may_contain, flags) > 0)
+		return 1;
+	return 0;
+}
+
+int qf_windowed_point_query(const qf_windowed *wqf, uint64_t l_time, uint64_t r_time,
+                            uint64_t key, uint64_t memento, uint8_t flags)
+{
+	return qf_windowed_range_query(wqf, l_time, r_time, key, memento, key, memento, flags);
+}
+
+uint64_t qf_windowed_get_sum_of_counts(const qf_windowed *wqf)
+{
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < wqf->num_epochs; i++) {
+		if (wqf->epochs[i].allocated)
+			sum += qf_get_sum_of_counts(&wqf->epochs[i].qf);
+	}
+	return sum;
+}
 
-	DEBUG_CQF("Merging %d CQFs\n", nqf);
-	for (i=0; i<nqf; i++) {
-		DEBUG_CQF("CQF %d\n", i);
-		DEBUG_DUMP(qf_arr[i]);
+uint64_t qf_windowed_get_total_size_in_bytes(const qf_windowed *wqf)
+{
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < wqf->num_epochs; i++) {
+		if (wqf->epochs[i].allocated)
+			size += qf_get_total_size_in_bytes(&wqf->epochs[i].qf);
 	}
+	return size;
+}
 
-	while (nqf > 1) {
-		uint64_t keys[nqf];
-		uint64_t values[nqf];
-		uint64_t counts[nqf];
-		for (i=0; i<nqf; i++)
-			qfi_get_hash(&qfi_arr[i], &keys[i], &values[i], &counts[i]);
+/****************** NEW IN MEMENTO ******************/
+void qf_string_codec_init(qf_string_codec *codec, uint32_t prefix_bits,
+                            const void *common_prefix, size_t common_prefix_len)
+{
+	assert(prefix_bits > 0 && prefix_bits <= 64);
+	assert(common_prefix != NULL || common_prefix_len == 0);
+	codec->common_prefix = (const uint8_t *)common_prefix;
+	codec->common_prefix_len = common_prefix_len;
+	codec->prefix_bits = prefix_bits;
+}
 
-		do {
-			smallest_key = UINT64_MAX;
-			for (i=0; i<nqf; i++) {
-				if (keys[i] < smallest_key) {
-					smallest_key = keys[i]; smallest_idx = i;
-				}
-			}
-			qf_insert(qfr, keys[smallest_idx], values[smallest_idx],
-								counts[smallest_idx], QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfi_arr[smallest_idx]);
-			qfi_get_hash(&qfi_arr[smallest_idx], &keys[smallest_idx],
-									 &values[smallest_idx],
-							&counts[smallest_idx]);
-		} while(!qfi_end(&qfi_arr[smallest_idx]));
-
-		/* remove the qf that is exhausted from the array */
-		if (smallest_idx < nqf-1)
-			memmove(&qfi_arr[smallest_idx], &qfi_arr[smallest_idx+1],
-							(nqf-smallest_idx-1)*sizeof(qfi_arr[0]));
-		nqf--;
-	}
-	if (!qfi_end(&qfi_arr[0])) {
-		uint64_t iters = 0;
-		do {
-			uint64_t key, value, count;
-			qfi_get_hash(&qfi_arr[0], &key, &value, &count);
-			qf_insert(qfr, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfi_arr[0]);
-			iters++;
-		} while(!qfi_end(&qfi_arr[0]));
-		DEBUG_CQF("Num of iterations: %" PRIx64 "\n", iters);
+uint64_t qf_string_encode(const qf_string_codec *codec, const void *key, size_t len)
+{
+	const uint8_t *bytes = (const uint8_t *)key;
+	if (codec->common_prefix_len > 0) {
+		const size_t cmp_len = len < codec->common_prefix_len ? len : codec->common_prefix_len;
+		const int cmp = (cmp_len > 0 ? memcmp(bytes, codec->common_prefix, cmp_len) : 0);
+		if (cmp < 0 || (cmp == 0 && len < codec->common_prefix_len))
+			return 0;
+		if (cmp > 0)
+			return BITMASK(codec->prefix_bits);
+		bytes += codec->common_prefix_len;
+		len -= codec->common_prefix_len;
 	}
 
-	DEBUG_CQF("%s", "Final CQF after merging.\n");
-	DEBUG_DUMP(qfr);
+	// The first 8 bytes as a big-endian word, so that comparing words
+	// compares the bytes in order
+	uint64_t word = 0;
+	for (size_t i = 0; i < sizeof(word); i++)
+		word = (word << 8) | (i < len ? bytes[i] : 0);
+	return word >> (64 - codec->prefix_bits);
+}
 
-	return;
+static inline void string_to_key_and_memento(const QF *qf, const qf_string_codec *codec,
+                                            const void *key, size_t len,
+                                            uint64_t *prefix_key, uint64_t *memento)
+{
+	assert(codec->prefix_bits > qf->metadata->memento_bits);
+	const uint64_t encoding = qf_string_encode(codec, key, len);
+	*prefix_key = encoding >> qf->metadata->memento_bits;
+	*memento = encoding & BITMASK(qf->metadata->memento_bits);
+}
+
+int64_t qf_insert_string(QF *qf, const qf_string_codec *codec, const void *key,
+                            size_t len, uint8_t flags)
+{
+	uint64_t prefix_key, memento;
+	string_to_key_and_memento(qf, codec, key, len, &prefix_key, &memento);
+	return qf_insert_single(qf, prefix_key, memento, flags);
+}
+
+int qf_delete_string(QF *qf, const qf_string_codec *codec, const void *key,
+                            size_t len, uint8_t flags)
+{
+	uint64_t prefix_key, memento;
+	string_to_key_and_memento(qf, codec, key, len, &prefix_key, &memento);
+	return qf_delete_single(qf, prefix_key, memento, flags);
+}
+
+int qf_point_query_string(const QF *qf, const qf_string_codec *codec,
+                            const void *key, size_t len, uint8_t flags)
+{
+	uint64_t prefix_key, memento;
+	string_to_key_and_memento(qf, codec, key, len, &prefix_key, &memento);
+	return qf_point_query(qf, prefix_key, memento, flags);
 }
 
+int qf_range_query_string(const QF *qf, const qf_string_codec *codec,
+                            const void *l_key, size_t l_len, const void *r_key,
+                            size_t r_len, uint8_t flags)
+{
+	uint64_t l_prefix_key, l_memento, r_prefix_key, r_memento;
+	string_to_key_and_memento(qf, codec, l_key, l_len, &l_prefix_key, &l_memento);
+	string_to_key_and_memento(qf, codec, r_key, r_len, &r_prefix_key, &r_memento);
+	assert(l_prefix_key < r_prefix_key
+            || (l_prefix_key == r_prefix_key && l_memento <= r_memento));
+	return qf_range_query(qf, l_prefix_key, l_memento, r_prefix_key, r_memento, flags);
+}
+
+#ifdef QF_ITERATOR
 /* find cosine similarity between two QFs. */
 uint64_t qf_inner_product(const QF *qfa, const QF *qfb)
 {
@@ -30,8 +30,13 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <openssl/rand.h>
+#include <algorithm>
 
 #include "memento.h"
 #include "memento_int.h"
@@ -424,6 +429,23 @@ void test_iterators() {
     result_length = qfi_get_hash(iter, &hash_result, memento_result);
     assert(result_length < 0); // Done iterating!
 
+    fprintf(stderr, "%s-------- CHECKING ITERATORS BY KEY --------%s\n", k_green, k_white);
+    // Without hashing, the low bits of a key are its home slot
+    QF by_key_qf;
+    qf_malloc(&by_key_qf, 1024, 24, memento_bits, QF_HASH_NONE, SEED);
+    srand(SEED);
+    uint64_t by_keys[800];
+    for (uint32_t i = 0; i < 800; i++) {
+        by_keys[i] = rand() & ((1ULL << 24) - 1);
+        assert(qf_insert_single(&by_key_qf, by_keys[i], i & ((1ULL << memento_bits) - 1),
+                                QF_NO_LOCK) >= 0);
+    }
+    for (uint32_t i = 0; i < 800; i++) {
+        assert(qf_iterator_by_key(&by_key_qf, iter, by_keys[i], QF_NO_LOCK) >= 0);
+        assert(iter->run == (by_keys[i] & 1023));
+    }
+    qf_free(&by_key_qf);
+
     fprintf(stderr, "%s-------- DONE --------%s\n", k_green, k_white);
     
     qf_free(qf);
@@ -1240,6 +1262,1972 @@ void test_delete_single() {
     qf_free(qf);
 }
 
+void test_resize_streaming() {
+    QF qf;
+    const uint64_t initial_nslots = 1000;
+    const uint64_t num_keys = 800;
+    qf_malloc(&qf, initial_nslots, 24, memento_bits, QF_HASH_DEFAULT, SEED);
+
+    uint64_t keys[num_keys], key_mementos[num_keys];
+    uint64_t hash_result, result_mementos[256];
+
+    fprintf(stderr, "%s######################### EXECUTING test_resize_streaming ########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+    const uint64_t nelts = qf.metadata->nelts;
+    const uint64_t ndistinct_elts = qf.metadata->ndistinct_elts;
+
+    for (uint32_t round = 0; round < 3; round++) {
+        fprintf(stderr, "%s-------- EXPANDING FILTER --------%s\n", k_green, k_white);
+        assert(qf_resize_malloc(&qf, qf.metadata->nslots * 2) == (int64_t) nelts);
+        assert(qf.metadata->nelts == nelts);
+        assert(qf.metadata->ndistinct_elts == ndistinct_elts);
+
+        fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+        for (uint32_t i = 0; i < num_keys; i++)
+            assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+
+        fprintf(stderr, "%s-------- CHECKING ITERATION --------%s\n", k_green, k_white);
+        QFi iter;
+        qf_iterator_from_position(&qf, &iter, 0);
+        uint64_t last_run = 0, memento_cnt = 0;
+        while (!qfi_end(&iter)) {
+            assert(iter.run >= last_run);
+            assert(iter.current >= iter.run);
+            last_run = iter.run;
+            memento_cnt += qfi_get_hash(&iter, &hash_result, result_mementos);
+            qfi_next(&iter);
+        }
+        assert(memento_cnt == nelts);
+        assert(qf.metadata->noccupied_slots >= ndistinct_elts);
+    }
+
+    fprintf(stderr, "%s-------- EXPANDING FILTER IN PLACE --------%s\n", k_green, k_white);
+    // qf_resize keeps the length of the key, and with it the fingerprints
+    const uint64_t buffer_len = qf_resize(&qf, qf.metadata->nslots * 2, NULL, 0);
+    void *buffer = malloc(buffer_len);
+    assert(qf_resize(&qf, qf.metadata->nslots * 2, buffer, buffer_len) == buffer_len);
+    assert(qf.metadata->key_bits == 24 && qf.metadata->nelts == nelts);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    qf_destroy(&qf);
+    free(buffer);
+
+    fprintf(stderr, "%s-------- CHECKING AGAINST RE-INSERTION --------%s\n", k_green, k_white);
+    // Streaming must lay out the table exactly as re-inserting every prefix
+    // set into an empty filter of the new size would. The hashes returned by
+    // the iterator are only valid keys with a power-of-two original size.
+    qf_malloc(&qf, 1024, 24, memento_bits, QF_HASH_DEFAULT, SEED);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    for (uint32_t round = 0; round < 3; round++) {
+        QF reinserted;
+        qf_malloc(&reinserted, 1024, 24, memento_bits, QF_HASH_DEFAULT, SEED);
+        assert(qf_resize_malloc(&reinserted, qf.metadata->nslots * 2) == 0);
+        QFi iter;
+        qf_iterator_from_position(&qf, &iter, 0);
+        while (!qfi_end(&iter)) {
+            const int result_length = qfi_get_hash(&iter, &hash_result, result_mementos);
+            assert(qf_insert_mementos(&reinserted, hash_result, result_mementos, result_length,
+                                        QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+            qfi_next(&iter);
+        }
+        assert(qf_resize_malloc(&qf, qf.metadata->nslots * 2) == (int64_t) nelts);
+        assert(qf.metadata->total_size_in_bytes == reinserted.metadata->total_size_in_bytes);
+        assert(memcmp(qf.blocks, reinserted.blocks, qf.metadata->total_size_in_bytes) == 0);
+        qf_free(&reinserted);
+    }
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+}
+
+void test_resize_parallel() {
+    QF qf, par_qf;
+    const uint64_t initial_nslots = 5000;
+    const uint64_t num_keys = 4200;
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_malloc(&par_qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+
+    uint64_t hash_result, result_mementos[256];
+    uint64_t par_hash_result, par_result_mementos[256];
+
+    fprintf(stderr, "%s######################### EXECUTING test_resize_parallel ########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        // Some keys repeat to get longer memento lists
+        const uint64_t key = (i % 4 == 0 ? rand() % 100 : rand());
+        const uint64_t memento = rand() & ((1ULL << memento_bits) - 1);
+        assert(qf_insert_single(&qf, key, memento, QF_NO_LOCK) >= 0);
+        assert(qf_insert_single(&par_qf, key, memento, QF_NO_LOCK) >= 0);
+    }
+
+    for (uint32_t num_threads = 2; num_threads <= 8; num_threads *= 2) {
+        fprintf(stderr, "%s-------- EXPANDING FILTER WITH %u THREADS --------%s\n", 
+                                                k_green, num_threads, k_white);
+        const int64_t numkeys = qf_resize_malloc(&qf, qf.metadata->nslots * 2);
+        assert(qf_resize_malloc_parallel(&par_qf, par_qf.metadata->nslots * 2, num_threads) == numkeys);
+        assert(qf.metadata->nelts == par_qf.metadata->nelts);
+        assert(qf.metadata->ndistinct_elts == par_qf.metadata->ndistinct_elts);
+        assert(qf.metadata->noccupied_slots == par_qf.metadata->noccupied_slots);
+
+        fprintf(stderr, "%s-------- CHECKING ITERATION --------%s\n", k_green, k_white);
+        QFi iter, par_iter;
+        qf_iterator_from_position(&qf, &iter, 0);
+        qf_iterator_from_position(&par_qf, &par_iter, 0);
+        while (!qfi_end(&iter)) {
+            assert(!qfi_end(&par_iter));
+            assert(iter.run == par_iter.run);
+            assert(iter.current == par_iter.current);
+            const int result_length = qfi_get_hash(&iter, &hash_result, result_mementos);
+            assert(qfi_get_hash(&par_iter, &par_hash_result, par_result_mementos) == result_length);
+            assert(hash_result == par_hash_result);
+            for (int i = 0; i < result_length; i++)
+                assert(result_mementos[i] == par_result_mementos[i]);
+            qfi_next(&iter);
+            qfi_next(&par_iter);
+        }
+        assert(qfi_end(&par_iter));
+    }
+
+    fprintf(stderr, "%s-------- EXPANDING FILTER WITHOUT THREADS --------%s\n", k_green, k_white);
+    // Cap the address space of a child process, and use up the thread stacks
+    // that fit in it, so the workers have to run on the calling thread
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        unsigned long vm_pages;
+        FILE *statm = fopen("/proc/self/statm", "r");
+        assert(statm != NULL && fscanf(statm, "%lu", &vm_pages) == 1);
+        fclose(statm);
+        struct rlimit limit;
+        limit.rlim_cur = limit.rlim_max = vm_pages * sysconf(_SC_PAGESIZE) + (4ULL << 20);
+        assert(setrlimit(RLIMIT_AS, &limit) == 0);
+        pthread_t thread;
+        uint32_t num_sleepers = 0;
+        while (pthread_create(&thread, NULL, [](void *) -> void * { pause(); return NULL; },
+                                NULL) == 0)
+            assert(++num_sleepers < 64);
+
+        const int64_t numkeys = qf_resize_malloc(&qf, qf.metadata->nslots * 2);
+        assert(qf_resize_malloc_parallel(&par_qf, par_qf.metadata->nslots * 2, 4) == numkeys);
+        assert(qf.metadata->noccupied_slots == par_qf.metadata->noccupied_slots);
+        assert(memcmp(qf.blocks, par_qf.blocks, qf.metadata->total_size_in_bytes) == 0);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+    qf_free(&par_qf);
+}
+
+void test_resize_fractional() {
+    QF qf, par_qf;
+    const uint64_t initial_nslots = 3000;
+    const uint64_t num_keys = 9000;
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_malloc(&par_qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+
+    uint64_t keys[num_keys], key_mementos[num_keys];
+
+    fprintf(stderr, "%s######################### EXECUTING test_resize_fractional ########################%s\n",
+                                                            k_red, k_white);
+    srand(SEED);
+    uint32_t inserted = 0;
+    for (uint32_t round = 0; round < 6; round++) {
+        fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+        while (qf.metadata->noccupied_slots < 0.9 * qf.metadata->nslots) {
+            keys[inserted] = rand();
+            key_mementos[inserted] = rand() & ((1ULL << memento_bits) - 1);
+            assert(qf_insert_single(&qf, keys[inserted], key_mementos[inserted], QF_NO_LOCK) >= 0);
+            assert(qf_insert_single(&par_qf, keys[inserted], key_mementos[inserted], QF_NO_LOCK) >= 0);
+            inserted++;
+        }
+
+        fprintf(stderr, "%s-------- EXPANDING FILTER BY 1.25x --------%s\n", k_green, k_white);
+        const uint64_t old_nslots = qf.metadata->nslots;
+        const uint64_t new_nslots = old_nslots * 5 / 4;
+        const int64_t numkeys = qf_resize_malloc(&qf, new_nslots);
+        assert(numkeys == (int64_t) qf.metadata->nelts);
+        assert(qf.metadata->nslots >= new_nslots);
+        assert(qf.metadata->nslots < new_nslots + old_nslots / QF_SPLIT_GROUP_SIZE + 1);
+        assert(qf_resize_malloc_parallel(&par_qf, new_nslots, 4) == numkeys);
+        assert(qf.metadata->nslots == par_qf.metadata->nslots);
+        assert(qf.metadata->noccupied_slots == par_qf.metadata->noccupied_slots);
+        assert(memcmp(qf.blocks, par_qf.blocks, qf.metadata->total_size_in_bytes) == 0);
+
+        fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+        for (uint32_t i = 0; i < inserted; i++)
+            assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    }
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+    qf_free(&par_qf);
+}
+
+void test_shrink() {
+    QF qf, par_qf;
+    const uint64_t initial_nslots = 1000;
+    const uint64_t num_keys = 12000;
+    const uint64_t num_deleted = 11300;
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_malloc(&par_qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_resize_malloc(&qf, 16 * initial_nslots);
+    qf_resize_malloc(&par_qf, 16 * initial_nslots);
+
+    uint64_t keys[num_keys], key_mementos[num_keys];
+
+    fprintf(stderr, "%s############################# EXECUTING test_shrink ##############################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        assert(qf_insert_single(&par_qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+
+    fprintf(stderr, "%s-------- DELETING MOST OF THE KEYS --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_deleted; i++) {
+        assert(qf_delete_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+        assert(qf_delete_single(&par_qf, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+    }
+
+    const uint64_t targets[] = {3 * initial_nslots, initial_nslots + 100, initial_nslots / 2};
+    for (uint64_t target : targets) {
+        fprintf(stderr, "%s-------- SHRINKING FILTER TO %lu SLOTS --------%s\n", k_green, target, k_white);
+        const int64_t numkeys = qf_shrink(&qf, target);
+        assert(numkeys == (int64_t) (num_keys - num_deleted));
+        assert(qf.metadata->nelts == num_keys - num_deleted);
+        assert(qf.metadata->nslots >= (target > initial_nslots ? target : initial_nslots));
+        assert(qf.metadata->nslots < target + target / QF_SPLIT_GROUP_SIZE + 1
+                || qf.metadata->nslots == initial_nslots);
+        assert(qf_resize_malloc_parallel(&par_qf, qf.metadata->nslots, 4) == numkeys);
+        assert(qf.metadata->nslots == par_qf.metadata->nslots);
+        assert(qf.metadata->noccupied_slots == par_qf.metadata->noccupied_slots);
+        assert(memcmp(qf.blocks, par_qf.blocks, qf.metadata->total_size_in_bytes) == 0);
+
+        fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+        for (uint32_t i = num_deleted; i < num_keys; i++)
+            assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    }
+    assert(qf.metadata->nslots == initial_nslots);
+    qf_free(&qf);
+    qf_free(&par_qf);
+
+    fprintf(stderr, "%s-------- AUTOMATIC SHRINKING --------%s\n", k_green, k_white);
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_resize_policy policy;
+    qf_get_default_resize_policy(&policy);
+    policy.auto_resize = true;
+    policy.auto_shrink = true;
+    qf_set_resize_policy(&qf, &policy);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    const uint64_t peak_nslots = qf.metadata->nslots;
+    for (uint32_t i = 0; i < num_deleted; i++) {
+        assert(qf_delete_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+        assert(qf.metadata->noccupied_slots >= 0.25 * qf.metadata->nslots
+                || qf.metadata->nslots == initial_nslots);
+    }
+    assert(qf.metadata->nslots < peak_nslots);
+    for (uint32_t i = num_deleted; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+}
+
+struct resize_log {
+    uint64_t resize_cnt;
+    uint64_t max_resize_cnt;
+    uint64_t last_nslots;
+};
+
+static bool log_resize(const QF *qf, uint64_t *nslots, void *arg) {
+    resize_log *log = (resize_log *) arg;
+    assert(*nslots > qf_get_nslots(qf));
+    if (log->resize_cnt == log->max_resize_cnt)
+        return false;
+    log->resize_cnt++;
+    log->last_nslots = *nslots;
+    return true;
+}
+
+void test_resize_policy() {
+    QF qf;
+    const uint64_t initial_nslots = 1000;
+    const uint64_t num_keys = 20000;
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+
+    resize_log log = {0, 4, 0};
+    qf_resize_policy policy;
+    qf_get_default_resize_policy(&policy);
+    policy.auto_resize = true;
+    policy.max_load_factor = 0.5;
+    policy.growth_factor = 1.5;
+    policy.shrink_load_factor = 0.2;
+    policy.resize_callback = log_resize;
+    policy.resize_callback_arg = &log;
+    assert(qf_set_resize_policy(&qf, &policy));
+    // The shorthands set single fields of the policy
+    assert(qf_get_growth_factor(&qf) == 1.5);
+    assert(qf_set_growth_factor(&qf, 3.0));
+    assert(qf_get_growth_factor(&qf) == 3.0);
+    assert(qf_set_growth_factor(&qf, 1.5));
+    assert(!qf_is_auto_shrink_enabled(&qf));
+    qf_set_auto_shrink(&qf, true);
+    assert(qf_set_shrink_load_factor(&qf, 0.1));
+    qf_get_resize_policy(&qf, &policy);
+    assert(qf_is_auto_shrink_enabled(&qf) && policy.auto_shrink);
+    assert(policy.shrink_load_factor == 0.1 && policy.growth_factor == 1.5);
+    qf_set_auto_shrink(&qf, false);
+    assert(qf_set_shrink_load_factor(&qf, 0.2));
+    // Thresholds out of range are rejected, and the policy stays as it was
+    qf_resize_policy bad_policy = policy;
+    bad_policy.max_load_factor = 1.5;
+    assert(!qf_set_resize_policy(&qf, &bad_policy));
+    bad_policy = policy;
+    bad_policy.shrink_load_factor = 0.25;
+    assert(!qf_set_resize_policy(&qf, &bad_policy));
+    assert(!qf_set_growth_factor(&qf, 1.0));
+    assert(!qf_set_shrink_load_factor(&qf, 0.3));
+    qf_get_resize_policy(&qf, &policy);
+    assert(policy.max_load_factor == 0.5 && policy.growth_factor == 1.5);
+    assert(policy.shrink_load_factor == 0.2);
+
+    fprintf(stderr, "%s########################## EXECUTING test_resize_policy ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    uint64_t keys[num_keys], key_mementos[num_keys];
+    uint32_t inserted = 0;
+    for (; inserted < num_keys; inserted++) {
+        keys[inserted] = rand();
+        key_mementos[inserted] = rand() & ((1ULL << memento_bits) - 1);
+        const uint64_t old_nslots = qf_get_nslots(&qf);
+        const int64_t ret = qf_insert_single(&qf, keys[inserted], key_mementos[inserted], QF_NO_LOCK);
+        if (ret == QF_NO_SPACE)
+            break;
+        assert(ret >= 0);
+        assert(qf_get_num_occupied_slots(&qf) <= 0.5 * qf_get_nslots(&qf) + 1);
+        if (qf_get_nslots(&qf) != old_nslots) {
+            assert(qf_get_nslots(&qf) >= log.last_nslots);
+            assert(log.last_nslots == (uint64_t) (1.5 * old_nslots));
+        }
+    }
+    // The callback stops the filter from growing after four resizes
+    assert(log.resize_cnt == log.max_resize_cnt);
+    assert(inserted < num_keys);
+
+    qf_resize_policy current;
+    qf_get_resize_policy(&qf, &current);
+    assert(current.auto_resize && current.max_load_factor == 0.5 && current.growth_factor == 1.5);
+    assert(current.resize_callback == log_resize && current.resize_callback_arg == &log);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < inserted; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+}
+
+void test_malloc_ex() {
+    const uint64_t initial_nslots = 3000;
+    const uint64_t num_keys = 5000;
+    uint64_t keys[num_keys], key_mementos[num_keys];
+
+    fprintf(stderr, "%s############################ EXECUTING test_malloc_ex ############################%s\n",
+                                                            k_red, k_white);
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+    }
+
+    const qf_alloc_options all_options[] = {
+        {QF_PAGES_DEFAULT, QF_NUMA_DEFAULT, 0, false,
+         QF_BLOCK_LAYOUT_PACKED, false, NULL, false},
+        {QF_PAGES_TRANSPARENT_HUGE, QF_NUMA_DEFAULT, 0, false,
+         QF_BLOCK_LAYOUT_PACKED, false, NULL, false},
+        {QF_PAGES_HUGE_2MB, QF_NUMA_DEFAULT, 0, true,
+         QF_BLOCK_LAYOUT_PACKED, false, NULL, false},
+        {QF_PAGES_HUGE_1GB, QF_NUMA_DEFAULT, 0, false,
+         QF_BLOCK_LAYOUT_PACKED, false, NULL, false},
+        {QF_PAGES_DEFAULT, QF_NUMA_BIND, 1, true,
+         QF_BLOCK_LAYOUT_PACKED, false, NULL, false},
+        {QF_PAGES_TRANSPARENT_HUGE, QF_NUMA_INTERLEAVE, 1, false,
+         QF_BLOCK_LAYOUT_PACKED, false, NULL, false},
+        {QF_PAGES_DEFAULT, QF_NUMA_DEFAULT, 0, false,
+         QF_BLOCK_LAYOUT_CACHE_ALIGNED, false, NULL, false},
+        {QF_PAGES_HUGE_2MB, QF_NUMA_DEFAULT, 0, false,
+         QF_BLOCK_LAYOUT_CACHE_ALIGNED, false, NULL, false},
+        {QF_PAGES_DEFAULT, QF_NUMA_DEFAULT, 0, false,
+         QF_BLOCK_LAYOUT_SPLIT, false, NULL, false},
+        {QF_PAGES_TRANSPARENT_HUGE, QF_NUMA_DEFAULT, 0, true,
+         QF_BLOCK_LAYOUT_SPLIT, false, NULL, false},
+    };
+    QF packed_qf;
+    qf_malloc(&packed_qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_resize_malloc(&packed_qf, 2 * initial_nslots);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_single(&packed_qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    for (const qf_alloc_options &options : all_options) {
+        fprintf(stderr, "%s-------- PAGE SIZE %d, NUMA POLICY %d, PREFAULT %d, LAYOUT %d --------%s\n", 
+                        k_green, options.page_size, options.numa_policy, options.prefault,
+                        options.block_layout, k_white);
+        QF qf;
+        if (!qf_malloc_ex(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED, &options)) {
+            // Only NUMA binding may be unavailable
+            assert(options.numa_policy != QF_NUMA_DEFAULT);
+            continue;
+        }
+        assert(qf_get_num_occupied_slots(&qf) == 0);
+        for (uint32_t i = 0; i < num_keys / 2; i++)
+            assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        assert(qf_resize_malloc(&qf, 2 * initial_nslots) == num_keys / 2);
+        assert(qf.runtimedata->alloc_options.page_size == options.page_size);
+        assert(qf.runtimedata->alloc_options.numa_policy == options.numa_policy);
+        for (uint32_t i = num_keys / 2; i < num_keys; i++)
+            assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        for (uint32_t i = 0; i < num_keys; i++)
+            assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+        if (options.block_layout == QF_BLOCK_LAYOUT_CACHE_ALIGNED) {
+            assert((uintptr_t) qf.blocks->occupieds % sizeof(uint64_t) == 0);
+            assert(qf.metadata->block_size % 64 == 0);
+        }
+        if (options.block_layout == QF_BLOCK_LAYOUT_SPLIT) {
+            assert(qf.metadata->occupieds_layout.stride == sizeof(uint64_t));
+            assert(qf.metadata->runends_layout.stride == sizeof(uint64_t));
+            assert(((uintptr_t) qf.blocks + qf.metadata->slots_layout.start) % 64 == 0);
+        }
+        // The layout does not change what the filter stores
+        assert(qf.metadata->nslots == packed_qf.metadata->nslots);
+        for (uint32_t i = 0; i < 1000; i++) {
+            const uint64_t l = rand(), r = l + rand() % 1000000;
+            const uint64_t l_memento = rand() & ((1ULL << memento_bits) - 1);
+            const uint64_t r_memento = rand() & ((1ULL << memento_bits) - 1);
+            assert(qf_range_query(&qf, l, l_memento, r, r_memento, QF_NO_LOCK)
+                    == qf_range_query(&packed_qf, l, l_memento, r, r_memento, QF_NO_LOCK));
+        }
+        qf_free(&qf);
+    }
+    qf_free(&packed_qf);
+
+    fprintf(stderr, "%s-------- PREFAULT ONLY --------%s\n", k_green, k_white);
+    qf_alloc_options options = {};
+    options.prefault = true;
+    QF qf;
+    assert(qf_malloc_ex(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED, &options));
+    const uint64_t mapped_size = qf.runtimedata->mapped_size;
+    assert(mapped_size > 0);
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t num_pages = (mapped_size + page_size - 1) / page_size;
+    unsigned char *resident = new unsigned char[num_pages];
+    assert(mincore(qf.metadata, mapped_size, resident) == 0);
+    for (uint64_t i = 0; i < num_pages; i++)
+        assert(resident[i] & 1);
+    delete[] resident;
+    qf_free(&qf);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+}
+
+void test_long_clusters() {
+    QF qf;
+    const uint64_t num_slots = 1ULL << 13;
+    const uint64_t num_keys = 60;
+    const uint64_t list_len = 300;
+    qf_malloc(&qf, num_slots, 28, memento_bits, QF_HASH_NONE, SEED);
+    const uint64_t quotient_bits = qf.metadata->original_quotient_bits;
+
+    fprintf(stderr, "%s########################## EXECUTING test_long_clusters ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    // All the keys share a home slot, so they form one cluster that spans
+    // many blocks
+    srand(SEED);
+    uint64_t keys[num_keys], mementos[num_keys][list_len];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = (((uint64_t) i + 1) << quotient_bits) | 1234;
+        for (uint32_t j = 0; j < list_len; j++)
+            mementos[i][j] = rand() & ((1ULL << memento_bits) - 1);
+        std::sort(mementos[i], mementos[i] + list_len);
+        assert(qf_insert_mementos(&qf, keys[i], mementos[i], list_len, 
+                                    QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    }
+    assert(qf.metadata->noccupied_slots > 4 * 256);
+
+    const uint64_t max_offset = (1ULL << (8 * sizeof(qf.blocks[0].offset))) - 1;
+    uint64_t saturated_cnt = 0;
+    for (uint64_t i = 0; i < qf.metadata->nblocks; i++) {
+        const qf_block_offset_t *offset = (const qf_block_offset_t *) ((const char *) qf.blocks
+                        + qf.metadata->offsets_layout.start + i * qf.metadata->offsets_layout.stride);
+        saturated_cnt += (*offset == max_offset);
+    }
+    assert(QF_BLOCK_OFFSET_WIDTH == 8 ? saturated_cnt > 0 : saturated_cnt == 0);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        for (uint32_t j = 0; j < list_len; j++)
+            assert(qf_point_query(&qf, keys[i], mementos[i][j], QF_NO_LOCK | QF_KEY_IS_HASH));
+        assert(qf_range_query(&qf, keys[i], 0, keys[i], (1ULL << memento_bits) - 1, 
+                                QF_NO_LOCK | QF_KEY_IS_HASH));
+    }
+
+    fprintf(stderr, "%s-------- ITERATING OVER THE FILTER --------%s\n", k_green, k_white);
+    QFi qfi;
+    uint64_t key, iter_mementos[list_len], num_iterated = 0;
+    qf_iterator_from_position(&qf, &qfi, 0);
+    while (!qfi_end(&qfi)) {
+        num_iterated += qfi_get_hash(&qfi, &key, iter_mementos);
+        qfi_next(&qfi);
+    }
+    assert(num_iterated == num_keys * list_len);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+}
+
+void test_file_backed() {
+    const uint64_t num_slots = 1ULL << 14;
+    const uint64_t num_keys = num_slots * 0.8;
+    char filename[] = "/tmp/memento_test_XXXXXX";
+    const int tmp_fd = mkstemp(filename);
+    assert(tmp_fd >= 0);
+    close(tmp_fd);
+
+    fprintf(stderr, "%s########################## EXECUTING test_file_backed ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    uint64_t keys[num_keys], key_mementos[num_keys];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+    }
+    QF qf;
+    assert(qf_create_file(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, filename));
+    for (uint32_t i = 0; i < num_keys / 2; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    assert(qf_sync(&qf));
+    qf_free(&qf);
+
+    fprintf(stderr, "%s-------- REOPENING THE FILTER --------%s\n", k_green, k_white);
+    assert(qf_open_file(&qf, filename, QF_USEFILE_READ_WRITE));
+    assert(qf.metadata->nelts == num_keys / 2);
+    for (uint32_t i = 0; i < num_keys / 2; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    for (uint32_t i = num_keys / 2; i < num_keys; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    // The table must stay in the file
+    assert(qf_resize_malloc(&qf, num_slots * 2) == QF_INVALID);
+    assert(qf_resize_malloc_parallel(&qf, num_slots * 2, 4) == QF_INVALID);
+    assert(qf_resize(&qf, num_slots * 2, NULL, 0) == 0);
+    assert(qf_get_nslots(&qf) == num_slots && qf_sync(&qf));
+    qf_free(&qf);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    assert(qf_open_file(&qf, filename, QF_USEFILE_READ_ONLY));
+    assert(qf.metadata->nelts == num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    QF malloc_qf;
+    qf_malloc(&malloc_qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_single(&malloc_qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    for (uint32_t i = 0; i < 1000; i++) {
+        const uint64_t l = rand(), r = l + rand() % 1000000;
+        assert(qf_range_query(&qf, l, 0, r, 0, QF_NO_LOCK)
+                == qf_range_query(&malloc_qf, l, 0, r, 0, QF_NO_LOCK));
+    }
+    // A table laid out for another width of the block offsets is rejected
+    const uint64_t table_size = (char *)malloc_qf.blocks - (char *)malloc_qf.metadata
+                                + qf_get_total_size_in_bytes(&malloc_qf);
+    char *table = (char *)malloc(table_size);
+    memcpy(table, malloc_qf.metadata, table_size);
+    ((qfmetadata *)table)->block_offset_width = 2 * QF_BLOCK_OFFSET_WIDTH;
+    QF used_qf;
+    assert(qf_use(&used_qf, table, table_size) == 0);
+    ((qfmetadata *)table)->block_offset_width = QF_BLOCK_OFFSET_WIDTH;
+    assert(qf_use(&used_qf, table, table_size) == table_size);
+    free(qf_destroy(&used_qf));
+    qf_free(&malloc_qf);
+    qf_free(&qf);
+
+    // A file that does not hold a filter is rejected
+    FILE *f = fopen(filename, "r+");
+    const uint64_t bad_magic = 0;
+    assert(fwrite(&bad_magic, sizeof(bad_magic), 1, f) == 1);
+    fclose(f);
+    assert(!qf_open_file(&qf, filename, QF_USEFILE_READ_ONLY));
+    unlink(filename);
+
+    // New files hold data, so they are not executable
+    assert(qf_create_file(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, filename));
+    struct stat sb;
+    assert(stat(filename, &sb) == 0 && (sb.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0);
+    qf_free(&qf);
+    unlink(filename);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+}
+
+// The checksum of the serialized format, computed bit by bit.
+static uint32_t serial_crc32c(const uint8_t *buf, uint64_t len) {
+    uint32_t crc = ~0U;
+    for (; len > 0; buf++, len--) {
+        crc ^= *buf;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+void test_serialization() {
+    const uint64_t initial_nslots = 3000;
+    const uint64_t num_keys = initial_nslots * 1.5;
+    char filename[] = "/tmp/memento_test_XXXXXX";
+    const int fd = mkstemp(filename);
+    assert(fd >= 0);
+
+    fprintf(stderr, "%s########################## EXECUTING test_serialization ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    QF qf;
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    qf_resize_malloc(&qf, 2 * initial_nslots + initial_nslots / 4);
+    uint64_t keys[num_keys], key_mementos[num_keys];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+    assert(qf_serialize_to_fd(&qf, fd));
+    const off_t serialized_size = lseek(fd, 0, SEEK_CUR);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    const enum qf_block_layout layouts[] = {QF_BLOCK_LAYOUT_PACKED, QF_BLOCK_LAYOUT_SPLIT};
+    for (const enum qf_block_layout layout : layouts) {
+        qf_alloc_options options = {QF_PAGES_DEFAULT, QF_NUMA_DEFAULT, 0, false, layout, false,
+                                    NULL, false};
+        QF loaded_qf;
+        lseek(fd, 0, SEEK_SET);
+        assert(qf_deserialize_from_fd(&loaded_qf, fd, &options));
+        assert(loaded_qf.metadata->nslots == qf.metadata->nslots);
+        assert(loaded_qf.metadata->split_buckets == qf.metadata->split_buckets);
+        assert(loaded_qf.metadata->nelts == qf.metadata->nelts);
+        for (uint32_t i = 0; i < num_keys; i++)
+            assert(qf_point_query(&loaded_qf, keys[i], key_mementos[i], QF_NO_LOCK));
+        for (uint32_t i = 0; i < 1000; i++) {
+            const uint64_t l = rand(), r = l + rand() % 1000000;
+            assert(qf_range_query(&loaded_qf, l, 0, r, 0, QF_NO_LOCK)
+                    == qf_range_query(&qf, l, 0, r, 0, QF_NO_LOCK));
+        }
+        qf_free(&loaded_qf);
+    }
+
+    fprintf(stderr, "%s-------- CHECKING THE FIRST VERSION OF THE FORMAT --------%s\n", 
+                    k_green, k_white);
+    // Version 1 is version 2 without the last header field
+    const uint32_t v2_header_size = 16 + 8 * 23 + 4, v1_header_size = v2_header_size - 8;
+    uint8_t *data = new uint8_t[serialized_size];
+    assert(pread(fd, data, serialized_size, 0) == serialized_size);
+    assert(data[8] == 2 && data[12] == v2_header_size);
+    data[8] = 1;
+    data[12] = v1_header_size;
+    memmove(data + v1_header_size - 4, data + v2_header_size - 4, serialized_size - (v2_header_size - 4));
+    const uint32_t crc = serial_crc32c(data, v1_header_size - 4);
+    for (uint32_t i = 0; i < 4; i++)
+        data[v1_header_size - 4 + i] = crc >> (8 * i);
+    char v1_filename[] = "/tmp/memento_test_XXXXXX";
+    const int v1_fd = mkstemp(v1_filename);
+    assert(v1_fd >= 0);
+    assert(write(v1_fd, data, serialized_size - 8) == serialized_size - 8);
+    lseek(v1_fd, 0, SEEK_SET);
+    QF loaded_qf;
+    assert(qf_deserialize_from_fd(&loaded_qf, v1_fd, NULL));
+    assert(!loaded_qf.metadata->expandable);
+    assert(loaded_qf.metadata->nelts == qf.metadata->nelts);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&loaded_qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    qf_free(&loaded_qf);
+    // Unknown versions are rejected
+    data[8] = 3;
+    assert(pwrite(v1_fd, data, v1_header_size, 0) == v1_header_size);
+    lseek(v1_fd, 0, SEEK_SET);
+    assert(!qf_deserialize_from_fd(&loaded_qf, v1_fd, NULL));
+    delete[] data;
+    close(v1_fd);
+    unlink(v1_filename);
+
+    fprintf(stderr, "%s-------- CHECKING CORRUPTED DATA --------%s\n", k_green, k_white);
+    uint8_t byte;
+    assert(pread(fd, &byte, 1, serialized_size / 2) == 1);
+    byte ^= 0x10;
+    assert(pwrite(fd, &byte, 1, serialized_size / 2) == 1);
+    lseek(fd, 0, SEEK_SET);
+    assert(!qf_deserialize_from_fd(&loaded_qf, fd, NULL));
+    byte ^= 0x10;
+    assert(pwrite(fd, &byte, 1, serialized_size / 2) == 1);
+    assert(ftruncate(fd, serialized_size - 1) == 0);
+    lseek(fd, 0, SEEK_SET);
+    assert(!qf_deserialize_from_fd(&loaded_qf, fd, NULL));
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+    close(fd);
+    unlink(filename);
+}
+
+void test_incremental_checkpoint() {
+    const uint64_t num_slots = 1ULL << 20;
+    const uint64_t num_keys = num_slots * 0.6;
+    const uint64_t num_updates = 32;
+    const uint32_t num_checkpoints = 3;
+    char filename[] = "/tmp/memento_test_XXXXXX";
+    const int fd = mkstemp(filename);
+    assert(fd >= 0);
+
+    fprintf(stderr, "%s########################## EXECUTING test_incremental_checkpoint ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    QF qf;
+    qf_malloc(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    assert(qf_start_dirty_tracking(&qf));
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_single(&qf, rand(), rand() & ((1ULL << memento_bits) - 1), QF_NO_LOCK) >= 0);
+    assert(qf_serialize_to_fd(&qf, fd));
+    const off_t base_size = lseek(fd, 0, SEEK_CUR);
+
+    fprintf(stderr, "%s-------- TAKING CHECKPOINTS --------%s\n", k_green, k_white);
+    off_t checkpoint_ends[num_checkpoints + 1];
+    for (uint32_t c = 0; c <= num_checkpoints; c++) {
+        if (c == num_checkpoints)       // The last checkpoint follows a resize
+            qf_resize_malloc(&qf, qf.metadata->nslots * 2);
+        for (uint32_t i = 0; i < num_updates; i++) {
+            const uint64_t key = rand(), memento = rand() & ((1ULL << memento_bits) - 1);
+            assert(qf_insert_single(&qf, key, memento, QF_NO_LOCK) >= 0);
+            if (i % 4 == 0)
+                assert(qf_delete_single(&qf, key, memento, QF_NO_LOCK) >= 0);
+            if (i % 16 == 0) {
+                uint64_t mementos[8];
+                for (uint32_t j = 0; j < 8; j++)
+                    mementos[j] = rand() & ((1ULL << memento_bits) - 1);
+                std::sort(mementos, mementos + 8);
+                assert(qf_insert_mementos(&qf, rand(), mementos, 8, QF_NO_LOCK) >= 0);
+            }
+        }
+        assert(qf_checkpoint_incremental(&qf, fd));
+        checkpoint_ends[c] = lseek(fd, 0, SEEK_CUR);
+    }
+    // Scattered updates touch a fraction of the regions
+    assert(checkpoint_ends[0] - base_size < base_size / 2);
+
+    fprintf(stderr, "%s-------- RESTORING THE FILTER --------%s\n", k_green, k_white);
+    QF restored_qf;
+    lseek(fd, 0, SEEK_SET);
+    assert(qf_deserialize_from_fd(&restored_qf, fd, NULL));
+    for (uint32_t c = 0; c <= num_checkpoints; c++)
+        assert(qf_apply_checkpoint_from_fd(&restored_qf, fd));
+    assert(restored_qf.metadata->nslots == qf.metadata->nslots);
+    assert(restored_qf.metadata->nelts == qf.metadata->nelts);
+    assert(restored_qf.metadata->noccupied_slots == qf.metadata->noccupied_slots);
+    assert(memcmp(restored_qf.blocks, qf.blocks, qf.metadata->total_size_in_bytes) == 0);
+
+    fprintf(stderr, "%s-------- CHECKING CORRUPTED DATA --------%s\n", k_green, k_white);
+    QF partial_qf;
+    lseek(fd, 0, SEEK_SET);
+    assert(qf_deserialize_from_fd(&partial_qf, fd, NULL));
+    assert(ftruncate(fd, checkpoint_ends[0] - 1) == 0);
+    const uint64_t nelts = partial_qf.metadata->nelts;
+    assert(!qf_apply_checkpoint_from_fd(&partial_qf, fd));
+    assert(partial_qf.metadata->nelts == nelts);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&partial_qf);
+    qf_free(&restored_qf);
+    qf_free(&qf);
+    close(fd);
+    unlink(filename);
+}
+
+void test_snapshot() {
+    const uint64_t num_slots = 1ULL << 16;
+    const uint64_t batch_size = num_slots / 8;
+    const uint32_t num_batches = 4;
+
+    fprintf(stderr, "%s########################## EXECUTING test_snapshot ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    uint64_t keys[batch_size * num_batches], key_mementos[batch_size * num_batches];
+    for (uint32_t i = 0; i < batch_size * num_batches; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+    }
+    for (int layout = QF_BLOCK_LAYOUT_PACKED; layout <= QF_BLOCK_LAYOUT_SPLIT; layout++) {
+        qf_alloc_options options = {};
+        options.block_layout = (enum qf_block_layout)layout;
+        options.snapshots = true;
+        QF qf;
+        assert(qf_malloc_ex(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, &options));
+
+        // Every snapshot must keep the contents the filter had when it was
+        // taken: the first one is taken from a shared table, the second one
+        // while the first is alive, and the third one after both are released
+        QF snaps[num_batches - 1];
+        uint8_t *contents[num_batches - 1];
+        uint64_t nelts[num_batches - 1];
+        const uint64_t size = qf.metadata->total_size_in_bytes;
+        for (uint32_t b = 0; b < num_batches; b++) {
+            if (b == 2) {
+                for (uint32_t i = 0; i < b; i++) {
+                    assert(snaps[i].metadata->nelts == nelts[i]);
+                    assert(memcmp(snaps[i].blocks, contents[i], size) == 0);
+                    qf_free(&snaps[i]);
+                    free(contents[i]);
+                }
+            }
+            for (uint32_t i = b * batch_size; i < (b + 1) * batch_size; i++)
+                assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+            if (b == num_batches - 1)
+                break;
+            assert(qf_snapshot(&qf, &snaps[b]));
+            assert(memcmp(snaps[b].blocks, qf.blocks, size) == 0);
+            contents[b] = (uint8_t *)malloc(size);
+            memcpy(contents[b], qf.blocks, size);
+            nelts[b] = qf.metadata->nelts;
+        }
+
+        fprintf(stderr, "%s-------- CHECKING THE SNAPSHOTS --------%s\n", k_green, k_white);
+        for (uint32_t b = 2; b < num_batches - 1; b++) {
+            assert(snaps[b].metadata->nelts == nelts[b]);
+            assert(memcmp(snaps[b].blocks, contents[b], size) == 0);
+            for (uint32_t i = 0; i < (b + 1) * batch_size; i++)
+                assert(qf_point_query(&snaps[b], keys[i], key_mementos[i], QF_NO_LOCK));
+        }
+        for (uint32_t i = 0; i < batch_size * num_batches; i++)
+            assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+
+        // Resizing moves the filter to a new table, and leaves the snapshot be
+        qf_resize_malloc(&qf, num_slots * 2);
+        assert(memcmp(snaps[2].blocks, contents[2], size) == 0);
+        for (uint32_t i = 0; i < batch_size * num_batches; i++)
+            assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+        QF resized_snap;
+        assert(qf_snapshot(&qf, &resized_snap));
+        assert(resized_snap.metadata->nelts == qf.metadata->nelts);
+        qf_free(&resized_snap);
+        qf_free(&snaps[2]);
+        free(contents[2]);
+        qf_free(&qf);
+    }
+
+    fprintf(stderr, "%s-------- CHECKING COPIED SNAPSHOTS --------%s\n", k_green, k_white);
+    QF qf, snap;
+    qf_malloc(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    for (uint32_t i = 0; i < batch_size; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    assert(qf_snapshot(&qf, &snap));
+    for (uint32_t i = batch_size; i < 2 * batch_size; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    assert(snap.metadata->nelts == batch_size);
+    for (uint32_t i = 0; i < batch_size; i++)
+        assert(qf_point_query(&snap, keys[i], key_mementos[i], QF_NO_LOCK));
+    qf_free(&snap);
+    qf_free(&qf);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+}
+
+// Allocator hooks that keep track of the memory in use, and fail once a
+// budget is exhausted
+struct counting_arena {
+    uint64_t live_bytes;
+    uint64_t num_allocs;
+    uint64_t budget;
+    uint64_t allocs_left;       // the allocations that may succeed before all others fail
+};
+
+static void *arena_alloc(void *ctx, size_t size, size_t alignment) {
+    counting_arena *arena = (counting_arena *)ctx;
+    if (__atomic_load_n(&arena->live_bytes, __ATOMIC_RELAXED) + size > arena->budget)
+        return NULL;
+    if (arena->allocs_left != UINT64_MAX
+            && __atomic_fetch_sub(&arena->allocs_left, 1, __ATOMIC_RELAXED) == 0) {
+        arena->allocs_left = 0;
+        return NULL;
+    }
+    void *ptr;
+    if (posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, size) != 0)
+        return NULL;
+    __atomic_add_fetch(&arena->live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&arena->num_allocs, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+static void arena_free(void *ctx, void *ptr, size_t size) {
+    counting_arena *arena = (counting_arena *)ctx;
+    __atomic_sub_fetch(&arena->live_bytes, size, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+void test_allocator() {
+    const uint64_t num_slots = 1ULL << 14;
+    const uint64_t num_keys = num_slots * 0.8;
+
+    fprintf(stderr, "%s########################## EXECUTING test_allocator ##########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    uint64_t keys[num_keys], key_mementos[num_keys];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+    }
+    counting_arena arena = {0, 0, UINT64_MAX, UINT64_MAX};
+    // Without realloc, growing the scratch space of resizes goes through
+    // alloc and free
+    const qf_allocator allocator = {arena_alloc, NULL, arena_free, &arena};
+    qf_alloc_options options = {};
+    options.block_layout = QF_BLOCK_LAYOUT_CACHE_ALIGNED;
+    options.allocator = &allocator;
+    QF qf;
+    assert(qf_malloc_ex(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, &options));
+    assert(arena.live_bytes >= qf_get_total_size_in_bytes(&qf));
+    assert(((uintptr_t)qf.metadata & 63) == 0);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+
+    fprintf(stderr, "%s-------- RESIZING THE FILTER --------%s\n", k_green, k_white);
+    const uint64_t num_allocs = arena.num_allocs;
+    assert(qf_resize_malloc(&qf, num_slots * 2) == (int64_t)num_keys);
+    assert(qf_resize_malloc_parallel(&qf, num_slots * 4, 4) == (int64_t)num_keys);
+    assert(qf_shrink(&qf, num_slots) == (int64_t)num_keys);
+    assert(arena.num_allocs > num_allocs);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+
+    fprintf(stderr, "%s-------- RUNNING OUT OF MEMORY --------%s\n", k_green, k_white);
+    // A failed resize leaves the filter as it was
+    arena.budget = arena.live_bytes + qf_get_total_size_in_bytes(&qf);
+    assert(qf_resize_malloc(&qf, num_slots * 2) == QF_NO_MEMORY);
+    assert(qf_resize_malloc_parallel(&qf, num_slots * 2, 4) == QF_NO_MEMORY);
+    assert(qf.metadata->nslots == num_slots);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    QF small_qf;
+    assert(!qf_malloc_ex(&small_qf, num_slots * 2, 28, memento_bits, QF_HASH_DEFAULT, SEED,
+                        &options));
+    qf_free(&qf);
+    assert(arena.live_bytes == 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+}
+
+void test_allocation_failures() {
+    const uint64_t num_slots = 1ULL << 14;
+    const uint64_t num_keys = num_slots * 0.8;
+    char filename[] = "/tmp/memento_test_XXXXXX";
+    const int fd = mkstemp(filename);
+    assert(fd >= 0);
+    char checkpoint_filename[] = "/tmp/memento_test_XXXXXX";
+    const int checkpoint_fd = mkstemp(checkpoint_filename);
+    assert(checkpoint_fd >= 0);
+
+    fprintf(stderr, "%s###################### EXECUTING test_allocation_failures #####################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    uint64_t keys[num_keys], key_mementos[num_keys];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & ((1ULL << memento_bits) - 1);
+    }
+    counting_arena arena = {0, 0, UINT64_MAX, UINT64_MAX};
+    const qf_allocator allocator = {arena_alloc, NULL, arena_free, &arena};
+    qf_alloc_options options = {};
+    options.snapshots = true;
+    options.allocator = &allocator;
+    QF qf;
+    assert(qf_malloc_ex(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, &options));
+    for (uint32_t i = 0; i < num_keys / 2; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+
+    // Every operation below is retried with one more allocation allowed to
+    // succeed, until it goes through. A failed attempt must not leak and
+    // must leave the filter as it was.
+    fprintf(stderr, "%s-------- STARTING DIRTY TRACKING --------%s\n", k_green, k_white);
+    uint64_t live_bytes = arena.live_bytes;
+    arena.allocs_left = 0;
+    assert(!qf_start_dirty_tracking(&qf));
+    assert(arena.live_bytes == live_bytes);
+    arena.allocs_left = UINT64_MAX;
+    assert(qf_start_dirty_tracking(&qf));
+
+    fprintf(stderr, "%s-------- SERIALIZING THE FILTER --------%s\n", k_green, k_white);
+    live_bytes = arena.live_bytes;
+    arena.allocs_left = 0;
+    assert(!qf_serialize_to_fd(&qf, fd));
+    assert(arena.live_bytes == live_bytes);
+    arena.allocs_left = UINT64_MAX;
+    assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    assert(qf_serialize_to_fd(&qf, fd));
+
+    fprintf(stderr, "%s-------- DESERIALIZING THE FILTER --------%s\n", k_green, k_white);
+    QF loaded_qf;
+    for (uint64_t allowed = 0; ; allowed++) {
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        arena.allocs_left = allowed;
+        const bool ok = qf_deserialize_from_fd(&loaded_qf, fd, &options);
+        arena.allocs_left = UINT64_MAX;
+        if (ok)
+            break;
+        assert(arena.live_bytes == live_bytes);
+    }
+    for (uint32_t i = 0; i < num_keys / 2; i++)
+        assert(qf_point_query(&loaded_qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    assert(qf_start_dirty_tracking(&loaded_qf));
+
+    fprintf(stderr, "%s-------- TAKING CHECKPOINTS --------%s\n", k_green, k_white);
+    for (uint32_t i = num_keys / 2; i < num_keys * 3 / 4; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    live_bytes = arena.live_bytes;
+    arena.allocs_left = 0;
+    assert(!qf_checkpoint_incremental(&qf, checkpoint_fd));
+    assert(arena.live_bytes == live_bytes);
+    arena.allocs_left = UINT64_MAX;
+    assert(qf_checkpoint_incremental(&qf, checkpoint_fd));
+    assert(lseek(checkpoint_fd, 0, SEEK_SET) == 0);
+    assert(qf_apply_checkpoint_from_fd(&loaded_qf, checkpoint_fd));
+    for (uint32_t i = 0; i < num_keys * 3 / 4; i++)
+        assert(qf_point_query(&loaded_qf, keys[i], key_mementos[i], QF_NO_LOCK));
+
+    fprintf(stderr, "%s-------- RESIZING THE FILTER --------%s\n", k_green, k_white);
+    for (uint64_t allowed = 0; ; allowed++) {
+        live_bytes = arena.live_bytes;
+        arena.allocs_left = allowed;
+        const int64_t ret = qf_resize_malloc(&qf, num_slots * 2);
+        arena.allocs_left = UINT64_MAX;
+        if (ret >= 0)
+            break;
+        assert(ret == QF_NO_MEMORY);
+        assert(arena.live_bytes == live_bytes);
+        assert(qf.metadata->nslots == num_slots);
+    }
+    assert(qf.metadata->nslots == num_slots * 2);
+    assert(qf.runtimedata->dirty_regions != NULL);
+    for (uint32_t i = num_keys * 3 / 4; i < num_keys; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+
+    fprintf(stderr, "%s-------- APPLYING A CHECKPOINT OF A RESIZED FILTER --------%s\n", k_green, k_white);
+    const off_t checkpoint_start = lseek(checkpoint_fd, 0, SEEK_CUR);
+    assert(qf_checkpoint_incremental(&qf, checkpoint_fd));
+    for (uint64_t allowed = 0; ; allowed++) {
+        live_bytes = arena.live_bytes;
+        assert(lseek(checkpoint_fd, checkpoint_start, SEEK_SET) == checkpoint_start);
+        arena.allocs_left = allowed;
+        const bool ok = qf_apply_checkpoint_from_fd(&loaded_qf, checkpoint_fd);
+        arena.allocs_left = UINT64_MAX;
+        if (ok)
+            break;
+        assert(arena.live_bytes == live_bytes);
+        assert(loaded_qf.metadata->nslots == num_slots);
+    }
+    assert(loaded_qf.metadata->nslots == num_slots * 2);
+    assert(loaded_qf.runtimedata->dirty_regions != NULL);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&loaded_qf, keys[i], key_mementos[i], QF_NO_LOCK));
+
+    fprintf(stderr, "%s-------- TAKING SNAPSHOTS --------%s\n", k_green, k_white);
+    for (uint32_t round = 0; round < 2; round++) {
+        QF snap;
+        for (uint64_t allowed = 0; ; allowed++) {
+            live_bytes = arena.live_bytes;
+            arena.allocs_left = allowed;
+            const bool ok = qf_snapshot(&qf, &snap);
+            arena.allocs_left = UINT64_MAX;
+            if (ok)
+                break;
+            assert(arena.live_bytes == live_bytes);
+            assert(qf_insert_single(&qf, keys[allowed], key_mementos[allowed], QF_NO_LOCK) >= 0);
+            assert(qf_delete_single(&qf, keys[allowed], key_mementos[allowed], QF_NO_LOCK) >= 0);
+        }
+        for (uint32_t i = 0; i < num_keys; i++)
+            assert(qf_point_query(&snap, keys[i], key_mementos[i], QF_NO_LOCK));
+        assert(qf_delete_single(&qf, keys[round], key_mementos[round], QF_NO_LOCK) >= 0);
+        assert(qf_insert_single(&qf, keys[round], key_mementos[round], QF_NO_LOCK) >= 0);
+        qf_free(&snap);
+    }
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK));
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&loaded_qf);
+    qf_free(&qf);
+    assert(arena.live_bytes == 0);
+    close(fd);
+    unlink(filename);
+    close(checkpoint_fd);
+    unlink(checkpoint_filename);
+}
+
+void test_memory_breakdown() {
+    const uint64_t num_slots = 1ULL << 16;
+    const uint64_t num_keys = num_slots * 0.9;
+
+    fprintf(stderr, "%s########################## EXECUTING test_memory_breakdown ##########################%s\n",
+                                                            k_red, k_white);
+    srand(SEED);
+    for (int layout = QF_BLOCK_LAYOUT_PACKED; layout <= QF_BLOCK_LAYOUT_SPLIT; layout++) {
+        fprintf(stderr, "%s-------- CHECKING LAYOUT %d --------%s\n", k_green, layout, k_white);
+        qf_alloc_options options = {};
+        options.block_layout = (enum qf_block_layout)layout;
+        QF qf;
+        assert(qf_malloc_ex(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, &options));
+        qf_memory_stats stats;
+        qf_get_memory_breakdown(&qf, &stats);
+        assert(stats.bits_per_key == 0.0);
+        assert(stats.slot_bytes == num_slots * qf_get_bits_per_slot(&qf) / 8);
+        // Two bits of metadata per slot
+        assert(stats.bitmap_bytes == (stats.slot_bytes + stats.overflow_slot_bytes) * 8
+                                        / qf_get_bits_per_slot(&qf) / 4);
+        assert(stats.total_bytes == stats.slot_bytes + stats.overflow_slot_bytes
+                                    + stats.bitmap_bytes + stats.offset_bytes
+                                    + stats.metadata_bytes + stats.slack_bytes
+                                    + stats.runtime_bytes + stats.lock_bytes);
+        assert(stats.total_bytes > qf_get_total_size_in_bytes(&qf));
+        // Only the padded layouts have more than a few words of slack
+        if (layout != QF_BLOCK_LAYOUT_CACHE_ALIGNED)
+            assert(stats.slack_bytes < 4 * 64);
+        // The lock array ends with the metadata lock
+        assert(stats.lock_bytes == (qf.runtimedata->num_locks + 1) * sizeof(int));
+        assert(stats.runtime_bytes >= sizeof(qfruntime));
+
+        for (uint32_t i = 0; i < num_keys; i++)
+            assert(qf_insert_single(&qf, rand(), rand() & ((1ULL << memento_bits) - 1), 
+                                    QF_NO_LOCK) >= 0);
+        qf_get_memory_breakdown(&qf, &stats);
+        assert(stats.bits_per_key == 8.0 * stats.total_bytes / qf_get_sum_of_counts(&qf));
+        assert(stats.bits_per_key > qf_get_bits_per_slot(&qf) + 2);
+        assert(qf_start_dirty_tracking(&qf));
+        qf_memory_stats tracked_stats;
+        qf_get_memory_breakdown(&qf, &tracked_stats);
+        assert(tracked_stats.runtime_bytes > stats.runtime_bytes);
+        qf_free(&qf);
+    }
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+}
+
+void test_sharded() {
+    const uint32_t num_shards = 4;
+    const uint64_t initial_nslots = 1024;
+    const uint64_t num_keys = 20000;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s########################## EXECUTING test_sharded ##########################%s\n",
+                                                            k_red, k_white);
+    qf_sharded sqf;
+    assert(qf_sharded_malloc(&sqf, num_shards, initial_nslots, 28, memento_bits,
+                                QF_HASH_DEFAULT, SEED, NULL));
+    assert(qf_sharded_get_num_shards(&sqf) == num_shards);
+    // The shard bits must fit in the hash next to the key bits
+    qf_sharded too_wide;
+    assert(!qf_sharded_malloc(&too_wide, num_shards, initial_nslots, 62, memento_bits,
+                                QF_HASH_INVERTIBLE, SEED, NULL));
+    assert(!qf_sharded_malloc(&too_wide, num_shards, initial_nslots, 63, memento_bits,
+                                QF_HASH_DEFAULT, SEED, NULL));
+    assert(qf_sharded_malloc(&too_wide, num_shards, initial_nslots, 61, memento_bits,
+                                QF_HASH_INVERTIBLE, SEED, NULL));
+    qf_sharded_free(&too_wide);
+    qf_resize_policy policy;
+    qf_get_default_resize_policy(&policy);
+    policy.auto_resize = true;
+    qf_sharded_set_resize_policy(&sqf, &policy);
+
+    fprintf(stderr, "%s-------- CHECKING AN EMPTY FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    for (uint32_t i = 0; i < 1000; i++) {
+        const uint64_t l_key = rand();
+        assert(qf_sharded_point_query(&sqf, l_key, rand() & max_memento, QF_NO_LOCK) == 0);
+        assert(qf_sharded_range_query(&sqf, l_key, 0, l_key + 3, max_memento, QF_NO_LOCK) == 0);
+    }
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    uint64_t shard_counts[num_shards] = {};
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & max_memento;
+        assert(qf_sharded_insert_single(&sqf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        shard_counts[qf_sharded_shard_of(&sqf, keys[i], 0)]++;
+    }
+    assert(qf_sharded_get_sum_of_counts(&sqf) == num_keys);
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < num_shards; i++) {
+        // Every shard grew on its own to hold its share of the keys
+        QF *shard = qf_sharded_get_shard(&sqf, i);
+        assert(shard_counts[i] > num_keys / num_shards / 2);
+        assert(qf_get_sum_of_counts(shard) == shard_counts[i]);
+        assert(qf_get_nslots(shard) > initial_nslots);
+        total_size += qf_get_total_size_in_bytes(shard);
+    }
+    assert(qf_sharded_get_total_size_in_bytes(&sqf) == total_size);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const uint64_t key = keys[i], memento = key_mementos[i];
+        assert(qf_sharded_point_query(&sqf, key, memento, QF_NO_LOCK));
+        assert(qf_sharded_range_query(&sqf, key, memento, key, memento, QF_NO_LOCK));
+        assert(qf_sharded_range_query(&sqf, key - 1, max_memento, key, memento, QF_NO_LOCK));
+        assert(qf_sharded_range_query(&sqf, key, memento, key + 1, 0, QF_NO_LOCK));
+        assert(qf_sharded_range_query(&sqf, key - 2, 0, key + 2, 0, QF_NO_LOCK));
+    }
+
+    fprintf(stderr, "%s-------- DELETING STUFF FROM THE FILTER --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_sharded_delete_single(&sqf, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+    assert(qf_sharded_get_sum_of_counts(&sqf) == 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_sharded_free(&sqf);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_partitioned() {
+    const uint64_t initial_nslots = 1024;
+    const uint64_t split_threshold = 4096;
+    const uint64_t num_keys = 40000;
+    const uint64_t hot_min_key = 1000000, hot_range = 8000;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s########################## EXECUTING test_partitioned ##########################%s\n",
+                                                            k_red, k_white);
+    qf_partitioned pqf;
+    assert(qf_partitioned_malloc(&pqf, initial_nslots, 32, memento_bits, split_threshold, NULL));
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    srand(SEED);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        // Half of the keys fall into a hot range
+        keys[i] = (i % 2 ? hot_min_key + rand() % hot_range : rand());
+        key_mementos[i] = rand() & max_memento;
+        assert(qf_partitioned_insert_single(&pqf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+    assert(qf_partitioned_get_sum_of_counts(&pqf) == num_keys);
+    const uint32_t num_partitions = qf_partitioned_get_num_partitions(&pqf);
+    assert(num_partitions > num_keys / split_threshold);
+    uint64_t expected_min_key = 0, hot_partitions = 0, total_size = 0;
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        uint64_t min_key, max_key;
+        QF *part = qf_partitioned_get_partition(&pqf, i, &min_key, &max_key);
+        assert(min_key == expected_min_key && min_key <= max_key);
+        expected_min_key = max_key + 1;
+        assert(qf_get_sum_of_counts(part) <= split_threshold);
+        hot_partitions += (min_key >= hot_min_key && max_key < hot_min_key + hot_range);
+        total_size += qf_get_total_size_in_bytes(part);
+    }
+    assert(expected_min_key == 0);
+    // The hot range was split out of the partition it started in
+    assert(hot_partitions > 1);
+    assert(qf_partitioned_get_total_size_in_bytes(&pqf) == total_size);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const uint64_t key = keys[i], memento = key_mementos[i];
+        assert(qf_partitioned_point_query(&pqf, key, memento, QF_NO_LOCK));
+        assert(qf_partitioned_range_query(&pqf, key, memento, key, memento, QF_NO_LOCK));
+        assert(qf_partitioned_range_query(&pqf, key - 1, max_memento, key, memento, QF_NO_LOCK));
+        assert(qf_partitioned_range_query(&pqf, key, memento, key + 1, 0, QF_NO_LOCK));
+    }
+    uint64_t *sorted_keys = new uint64_t[num_keys];
+    memcpy(sorted_keys, keys, num_keys * sizeof(uint64_t));
+    std::sort(sorted_keys, sorted_keys + num_keys);
+    uint32_t false_positives = 0;
+    for (uint32_t i = 0; i < 1000; i++) {
+        const uint64_t l_key = rand();
+        const uint64_t r_key = l_key + rand() % 64;
+        const uint64_t *next_key = std::lower_bound(sorted_keys, sorted_keys + num_keys, l_key);
+        const bool present = next_key != sorted_keys + num_keys && *next_key <= r_key;
+        const bool res = qf_partitioned_range_query(&pqf, l_key, 0, r_key, max_memento,
+                                                    QF_NO_LOCK) != 0;
+        assert(res || !present);
+        false_positives += res && !present;
+    }
+    // The prefix hashes keep all 32 bits of the prefixes
+    assert(false_positives < 10);
+    delete[] sorted_keys;
+    // A range over every partition
+    assert(qf_partitioned_range_query(&pqf, 0, 0, hot_min_key + hot_range, 0, QF_NO_LOCK));
+
+    fprintf(stderr, "%s-------- DELETING STUFF FROM THE FILTER --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_partitioned_delete_single(&pqf, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+    assert(qf_partitioned_get_sum_of_counts(&pqf) == 0);
+    qf_partitioned_free(&pqf);
+
+    fprintf(stderr, "%s-------- SPLITTING A SINGLE PREFIX --------%s\n", k_green, k_white);
+    assert(qf_partitioned_malloc(&pqf, initial_nslots, 32, memento_bits, 0, NULL));
+    assert(qf_partitioned_split(&pqf, 0) == QF_INVALID);
+    for (uint32_t i = 0; i < 20; i++)
+        assert(qf_partitioned_insert_single(&pqf, 42, i, QF_NO_LOCK) >= 0);
+    assert(qf_partitioned_split(&pqf, 0) == QF_INVALID);
+    assert(qf_partitioned_insert_single(&pqf, 7, 0, QF_NO_LOCK) >= 0);
+    assert(qf_partitioned_split(&pqf, 0) == 0);
+    assert(qf_partitioned_get_num_partitions(&pqf) == 2);
+    uint64_t min_key;
+    qf_partitioned_get_partition(&pqf, 1, &min_key, NULL);
+    assert(min_key == 42);
+    for (uint32_t i = 0; i < 20; i++)
+        assert(qf_partitioned_point_query(&pqf, 42, i, QF_NO_LOCK));
+    assert(qf_partitioned_point_query(&pqf, 7, 0, QF_NO_LOCK));
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_partitioned_free(&pqf);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_shm() {
+    const uint64_t num_slots = 1ULL << 16;
+    const uint64_t num_keys = num_slots * 0.8;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+    char name[64];
+    snprintf(name, sizeof(name), "/memento_test_%d", getpid());
+
+    fprintf(stderr, "%s########################## EXECUTING test_shm ##########################%s\n",
+                                                            k_red, k_white);
+    QF qf;
+    assert(qf_create_shm(&qf, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, name));
+    srand(SEED);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & max_memento;
+    }
+
+    fprintf(stderr, "%s-------- READING FROM ANOTHER PROCESS --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys / 2; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_WAIT_FOR_LOCK) >= 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        QF reader;
+        assert(qf_attach_shm(&reader, name, QF_USEFILE_READ_ONLY));
+        assert(qf_get_sum_of_counts(&reader) == num_keys / 2);
+        for (uint32_t i = 0; i < num_keys / 2; i++)
+            assert(qf_point_query(&reader, keys[i], key_mementos[i], QF_WAIT_FOR_LOCK));
+        qf_free(&reader);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    fprintf(stderr, "%s-------- WRITING FROM TWO PROCESSES --------%s\n", k_green, k_white);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        QF writer;
+        assert(qf_attach_shm(&writer, name, QF_USEFILE_READ_WRITE));
+        for (uint32_t i = num_keys / 2; i < num_keys * 3 / 4; i++)
+            assert(qf_insert_single(&writer, keys[i], key_mementos[i], QF_WAIT_FOR_LOCK) >= 0);
+        qf_free(&writer);
+        _exit(0);
+    }
+    for (uint32_t i = num_keys * 3 / 4; i < num_keys; i++)
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_WAIT_FOR_LOCK) >= 0);
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(qf_get_sum_of_counts(&qf) == num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_WAIT_FOR_LOCK));
+
+    fprintf(stderr, "%s-------- KEEPING THE SEGMENT IN PLACE --------%s\n", k_green, k_white);
+    QF other;
+    assert(!qf_create_shm(&other, num_slots, 28, memento_bits, QF_HASH_DEFAULT, SEED, name));
+    assert(qf_resize_malloc(&qf, num_slots * 2) == QF_INVALID);
+    assert(qf_resize(&qf, num_slots * 2, NULL, 0) == 0);
+    assert(qf_get_nslots(&qf) == num_slots && qf_get_sum_of_counts(&qf) == num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_WAIT_FOR_LOCK));
+    qf_memory_stats stats;
+    qf_get_memory_breakdown(&qf, &stats);
+    assert(stats.total_bytes == qf.runtimedata->mapped_size + stats.runtime_bytes);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+    assert(qf_unlink_shm(name));
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_merge() {
+    const uint64_t initial_nslots = 1000;
+    const uint64_t num_keys = 9000;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+    const uint64_t part_sizes[] = {initial_nslots, 4 * initial_nslots, 10 * initial_nslots};
+    const uint64_t part_ends[] = {600, 3600, num_keys};
+
+    fprintf(stderr, "%s########################### EXECUTING test_merge ###########################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTERS --------%s\n", k_green, k_white);
+    QF parts[3];
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    srand(SEED);
+    for (uint32_t p = 0, i = 0; p < 3; p++) {
+        // The partitions are resized differently, so their fingerprints
+        // have different lengths
+        qf_malloc(&parts[p], initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+        if (part_sizes[p] > initial_nslots)
+            assert(qf_resize_malloc(&parts[p], part_sizes[p]) >= 0);
+        for (; i < part_ends[p]; i++) {
+            // Some keys are shared by several partitions
+            keys[i] = (i % 5 == 0 && i >= part_ends[0] ? keys[i % part_ends[0]] : rand());
+            key_mementos[i] = rand() & max_memento;
+            assert(qf_insert_single(&parts[p], keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        }
+    }
+
+    fprintf(stderr, "%s-------- MERGING TWO FILTERS --------%s\n", k_green, k_white);
+    QF merged;
+    assert(qf_merge(&parts[1], &parts[0], &merged) == (int64_t) part_ends[1]);
+    assert(qf_get_sum_of_counts(&merged) == part_ends[1]);
+    assert(qf_get_nslots(&merged) >= qf_get_nslots(&parts[1]));
+    for (uint32_t i = 0; i < part_ends[1]; i++)
+        assert(qf_point_query(&merged, keys[i], key_mementos[i], QF_NO_LOCK));
+    qf_free(&merged);
+
+    fprintf(stderr, "%s-------- MERGING ALL FILTERS --------%s\n", k_green, k_white);
+    const QF *inputs[] = {&parts[0], &parts[1], &parts[2]};
+    assert(qf_multi_merge(inputs, 3, &merged) == (int64_t) num_keys);
+    assert(qf_get_sum_of_counts(&merged) == num_keys);
+    assert(merged.metadata->noccupied_slots <= parts[0].metadata->noccupied_slots
+            + parts[1].metadata->noccupied_slots + parts[2].metadata->noccupied_slots);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const uint64_t key = keys[i], memento = key_mementos[i];
+        assert(qf_point_query(&merged, key, memento, QF_NO_LOCK));
+        assert(qf_range_query(&merged, key, memento, key + 1, 0, QF_NO_LOCK));
+    }
+
+    fprintf(stderr, "%s-------- CHECKING THE MERGED FILTER --------%s\n", k_green, k_white);
+    // The merged filter is a regular filter that can grow and shrink
+    assert(qf_insert_single(&merged, 1234567, 0, QF_NO_LOCK) >= 0);
+    assert(qf_resize_malloc(&merged, 2 * qf_get_nslots(&merged)) == (int64_t) num_keys + 1);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&merged, keys[i], key_mementos[i], QF_NO_LOCK));
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_delete_single(&merged, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+    assert(qf_get_sum_of_counts(&merged) == 1);
+    qf_free(&merged);
+
+    fprintf(stderr, "%s-------- MERGING INCOMPATIBLE FILTERS --------%s\n", k_green, k_white);
+    QF other;
+    qf_malloc(&other, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED + 1);
+    assert(qf_merge(&parts[0], &other, &merged) == QF_INVALID);
+    qf_free(&other);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    for (uint32_t p = 0; p < 3; p++)
+        qf_free(&parts[p]);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_split() {
+    const uint64_t initial_nslots = 1000;
+    const uint64_t num_keys = 12000;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s########################### EXECUTING test_split ###########################%s\n",
+                                                            k_red, k_white);
+    QF qf, lo, hi;
+    qf_malloc(&qf, initial_nslots, 28, memento_bits, QF_HASH_DEFAULT, SEED);
+    assert(qf_split(&qf, &lo, &hi) == QF_INVALID);
+    assert(qf_resize_malloc(&qf, 16 * initial_nslots) == 0);
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & max_memento;
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+
+    fprintf(stderr, "%s-------- SPLITTING THE FILTER --------%s\n", k_green, k_white);
+    assert(qf_split(&qf, &lo, &hi) == (int64_t) num_keys);
+    assert(qf_get_nslots(&lo) == qf_get_nslots(&qf) / 2);
+    assert(qf_get_nslots(&hi) == qf_get_nslots(&qf) / 2);
+    assert(lo.metadata->fingerprint_bits == qf.metadata->fingerprint_bits + 1);
+    uint64_t side_counts[2] = {};
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const int side = qf_split_side(&qf, keys[i], 0);
+        QF *half = (side == 0 ? &lo : &hi);
+        side_counts[side]++;
+        assert(qf_point_query(half, keys[i], key_mementos[i], QF_NO_LOCK));
+        assert(qf_range_query(half, keys[i], key_mementos[i], keys[i] + 1, 0, QF_NO_LOCK));
+    }
+    assert(qf_get_sum_of_counts(&lo) == side_counts[0]);
+    assert(qf_get_sum_of_counts(&hi) == side_counts[1]);
+    assert(side_counts[0] > num_keys / 3 && side_counts[1] > num_keys / 3);
+
+    fprintf(stderr, "%s-------- CHECKING FALSE POSITIVES --------%s\n", k_green, k_white);
+    // Both halves are exactly as accurate as the filter they come from
+    for (uint32_t i = 0; i < 100000; i++) {
+        const uint64_t key = rand(), memento = rand() & max_memento;
+        const int side = qf_split_side(&qf, key, 0);
+        assert(qf_point_query(side == 0 ? &lo : &hi, key, memento, QF_NO_LOCK)
+                    == qf_point_query(&qf, key, memento, QF_NO_LOCK));
+    }
+
+    fprintf(stderr, "%s-------- MERGING THE HALVES BACK --------%s\n", k_green, k_white);
+    QF merged;
+    assert(qf_merge(&lo, &hi, &merged) == (int64_t) num_keys);
+    assert(qf_get_nslots(&merged) > qf_get_nslots(&lo));
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&merged, keys[i], key_mementos[i], QF_NO_LOCK));
+    qf_free(&merged);
+    assert(qf_resize_malloc(&lo, qf_get_nslots(&qf)) == (int64_t) side_counts[0]);
+    assert(qf_merge(&lo, &hi, &merged) == (int64_t) num_keys);
+    assert(qf_get_nslots(&merged) == qf_get_nslots(&qf));
+    assert(merged.metadata->noccupied_slots == qf.metadata->noccupied_slots);
+    assert(memcmp(merged.blocks, qf.blocks, qf.metadata->total_size_in_bytes) == 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&merged);
+    qf_free(&lo);
+    qf_free(&hi);
+    qf_free(&qf);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_multi_range_query() {
+    const uint32_t num_filters = 70;
+    const uint64_t keys_per_filter = 400;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s##################### EXECUTING test_multi_range_query #####################%s\n",
+                                                            k_red, k_white);
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTERS --------%s\n", k_green, k_white);
+    // Sorted runs of different sizes, as in an LSM tree
+    QF *filters = new QF[num_filters];
+    const QF **filter_ptrs = new const QF *[num_filters];
+    uint64_t *keys = new uint64_t[num_filters * keys_per_filter];
+    uint64_t *key_mementos = new uint64_t[num_filters * keys_per_filter];
+    srand(SEED);
+    for (uint32_t f = 0; f < num_filters; f++) {
+        qf_malloc(&filters[f], 1000 + (f % 3) * 1000, 24, memento_bits, QF_HASH_DEFAULT, SEED);
+        filter_ptrs[f] = &filters[f];
+        for (uint32_t i = f * keys_per_filter; i < (f + 1) * keys_per_filter; i++) {
+            keys[i] = rand() % 100000;
+            key_mementos[i] = rand() & max_memento;
+            assert(qf_insert_single(&filters[f], keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        }
+    }
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    uint64_t may_contain[(num_filters + 63) / 64];
+    for (uint32_t q = 0; q < 20000; q++) {
+        uint64_t l_key, l_memento, r_key, r_memento;
+        if (q < 5000) {
+            // Ranges around inserted points
+            const uint64_t i = rand() % (num_filters * keys_per_filter);
+            l_key = keys[i] - (q & 1);
+            l_memento = (q & 1 ? rand() & max_memento : key_mementos[i]);
+            r_key = keys[i] + (q & 2 ? 2 : 0);
+            r_memento = (q & 2 ? rand() & max_memento : key_mementos[i]);
+        }
+        else {
+            l_key = rand() % 100000;
+            l_memento = rand() & max_memento;
+            r_key = l_key + rand() % 3;
+            r_memento = rand() & max_memento;
+            if (l_key == r_key && r_memento < l_memento)
+                std::swap(l_memento, r_memento);
+        }
+        int64_t positive_cnt = 0;
+        for (uint32_t f = 0; f < num_filters; f++)
+            positive_cnt += (qf_range_query(&filters[f], l_key, l_memento, r_key, r_memento,
+                                            QF_NO_LOCK) > 0);
+        assert(qf_multi_range_query(filter_ptrs, num_filters, l_key, l_memento, r_key,
+                                    r_memento, may_contain, QF_NO_LOCK) == positive_cnt);
+        for (uint32_t f = 0; f < num_filters; f++)
+            assert(((may_contain[f / 64] >> (f % 64)) & 1)
+                    == (qf_range_query(&filters[f], l_key, l_memento, r_key, r_memento,
+                                        QF_NO_LOCK) > 0));
+    }
+    // No filters, no positives
+    assert(qf_multi_range_query(NULL, 0, 0, 0, 100, 0, may_contain, QF_NO_LOCK) == 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    for (uint32_t f = 0; f < num_filters; f++)
+        qf_free(&filters[f]);
+    delete[] filters;
+    delete[] filter_ptrs;
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_windowed() {
+    const uint32_t num_epochs = 4;
+    const uint64_t epoch_length = 1000;
+    const uint64_t num_times = 10 * epoch_length;
+    const uint64_t keys_per_time = 3;
+    const uint64_t num_keys = num_times * keys_per_time;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s########################## EXECUTING test_windowed #########################%s\n",
+                                                            k_red, k_white);
+    qf_windowed wqf;
+    assert(qf_windowed_malloc(&wqf, num_epochs, epoch_length, 1024, 28, memento_bits,
+                                QF_HASH_DEFAULT, SEED, NULL));
+    assert(qf_windowed_get_epoch(&wqf, 0) == NULL);
+    assert(qf_windowed_point_query(&wqf, 0, UINT64_MAX, 1, 0, QF_NO_LOCK) == 0);
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const uint64_t time = i / keys_per_time;
+        keys[i] = rand();
+        key_mementos[i] = rand() & max_memento;
+        assert(qf_windowed_insert_single(&wqf, time, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        // Late arrivals go to older epochs, as long as they are in the window
+        if (time >= num_epochs * epoch_length && i % 100 == 0) {
+            const uint64_t old_time = time - (num_epochs - 1) * epoch_length;
+            assert(qf_windowed_insert_single(&wqf, old_time, keys[i], key_mementos[i],
+                                                QF_NO_LOCK) >= 0);
+            assert(qf_windowed_delete_single(&wqf, old_time, keys[i], key_mementos[i],
+                                                QF_NO_LOCK) == 0);
+            assert(qf_windowed_insert_single(&wqf, old_time - epoch_length, keys[i],
+                                                key_mementos[i], QF_NO_LOCK) == QF_INVALID);
+        }
+    }
+
+    fprintf(stderr, "%s-------- CHECKING THE EPOCHS --------%s\n", k_green, k_white);
+    const uint64_t first_live_time = num_times - num_epochs * epoch_length;
+    const uint64_t live_keys = num_epochs * epoch_length * keys_per_time;
+    assert(qf_windowed_get_sum_of_counts(&wqf) == live_keys);
+    uint64_t total_size = 0;
+    for (uint64_t time = 0; time < num_times; time += epoch_length) {
+        QF *epoch = qf_windowed_get_epoch(&wqf, time);
+        assert((epoch != NULL) == (time >= first_live_time));
+        if (epoch != NULL) {
+            assert(qf_get_sum_of_counts(epoch) == epoch_length * keys_per_time);
+            total_size += qf_get_total_size_in_bytes(epoch);
+        }
+    }
+    assert(qf_windowed_get_total_size_in_bytes(&wqf) == total_size);
+
+    fprintf(stderr, "%s-------- CHECKING QUERIES --------%s\n", k_green, k_white);
+    for (uint32_t i = first_live_time * keys_per_time; i < num_keys; i++) {
+        const uint64_t time = i / keys_per_time, key = keys[i], memento = key_mementos[i];
+        assert(qf_windowed_point_query(&wqf, time, time, key, memento, QF_NO_LOCK));
+        assert(qf_windowed_point_query(&wqf, 0, UINT64_MAX, key, memento, QF_NO_LOCK));
+        assert(qf_windowed_range_query(&wqf, time, time + 1, key - 1, max_memento,
+                                        key, memento, QF_NO_LOCK));
+        assert(qf_windowed_range_query(&wqf, time - 1, time, key, memento,
+                                        key + 1, 0, QF_NO_LOCK));
+    }
+    // Expired keys and time ranges without epochs are negatives
+    uint64_t false_positives = 0;
+    for (uint32_t i = 0; i < first_live_time * keys_per_time; i++)
+        false_positives += qf_windowed_point_query(&wqf, 0, UINT64_MAX, keys[i],
+                                                    key_mementos[i], QF_NO_LOCK);
+    assert(false_positives < first_live_time * keys_per_time / 100);
+    for (uint32_t i = first_live_time * keys_per_time; i < num_keys; i += 97)
+        assert(qf_windowed_point_query(&wqf, num_times, UINT64_MAX, keys[i],
+                                        key_mementos[i], QF_NO_LOCK) == 0);
+
+    fprintf(stderr, "%s-------- EXPIRING EPOCHS --------%s\n", k_green, k_white);
+    qf_windowed_expire(&wqf, num_times - epoch_length);
+    assert(qf_windowed_get_sum_of_counts(&wqf) == epoch_length * keys_per_time);
+    assert(qf_windowed_get_epoch(&wqf, num_times - epoch_length - 1) == NULL);
+    assert(qf_windowed_insert_single(&wqf, num_times - epoch_length - 1, 1, 0, QF_NO_LOCK)
+                == QF_INVALID);
+    for (uint32_t i = (num_times - epoch_length) * keys_per_time; i < num_keys; i++)
+        assert(qf_windowed_point_query(&wqf, 0, UINT64_MAX, keys[i], key_mementos[i],
+                                        QF_NO_LOCK));
+    // A jump far ahead expires everything
+    assert(qf_windowed_insert_single(&wqf, 100 * num_times, 1, 0, QF_NO_LOCK) >= 0);
+    assert(qf_windowed_get_sum_of_counts(&wqf) == 1);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_windowed_free(&wqf);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_expandable() {
+    const uint64_t initial_nslots = 128;
+    const uint64_t fingerprint_bits = 12;
+    const uint64_t num_keys = 50000;
+    const uint64_t num_queries = 200000;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s######################## EXECUTING test_expandable ########################%s\n",
+                                                            k_red, k_white);
+    // Both filters start with 12-bit fingerprints and double their way up to
+    // hold all the keys
+    QF qf, plain_qf;
+    qf_alloc_options options = {};
+    options.expandable = true;
+    assert(qf_malloc_ex(&qf, initial_nslots, 7 + fingerprint_bits, memento_bits,
+                        QF_HASH_DEFAULT, SEED, &options));
+    assert(qf_malloc(&plain_qf, initial_nslots, 7 + fingerprint_bits, memento_bits,
+                        QF_HASH_DEFAULT, SEED));
+    assert(qf.metadata->bits_per_slot == plain_qf.metadata->bits_per_slot + 1);
+    qf_set_auto_resize(&qf, true);
+    qf_set_auto_resize(&plain_qf, true);
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = rand();
+        key_mementos[i] = rand() & max_memento;
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+        assert(qf_insert_single(&plain_qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+    assert(qf_get_nslots(&qf) >= 256 * initial_nslots);
+    assert(qf_get_num_key_fingerprint_bits(&qf) == fingerprint_bits);
+    assert(qf_get_num_key_fingerprint_bits(&plain_qf) < 4);
+    assert(qf_get_sum_of_counts(&qf) == num_keys);
+
+    fprintf(stderr, "%s-------- CHECKING FOR FALSE NEGATIVES --------%s\n", k_green, k_white);
+    uint32_t shortened_matches = 0;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const int res = qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK);
+        assert(res > 0);
+        assert(qf_range_query(&qf, keys[i], key_mementos[i], keys[i] + 1, 0, QF_NO_LOCK) > 0);
+        // The keys inserted before the doublings lost fingerprint bits
+        shortened_matches += (i < 100 && res == 2);
+    }
+    assert(shortened_matches > 50);
+    assert(qf_point_query(&qf, keys[num_keys - 1], key_mementos[num_keys - 1], QF_NO_LOCK) == 1);
+    QFi qfi;
+    qf_iterator_from_position(&qf, &qfi, 0);
+    uint64_t iterated = 0, hash, mementos[1024];
+    do {
+        iterated += qfi_get_hash(&qfi, &hash, mementos);
+    } while (qfi_next(&qfi) >= 0);
+    assert(iterated == num_keys);
+
+    fprintf(stderr, "%s-------- CHECKING FALSE POSITIVES --------%s\n", k_green, k_white);
+    // The new keys keep the full fingerprints, while the plain filter runs
+    // out of fingerprint bits
+    uint64_t false_positives = 0, plain_false_positives = 0;
+    for (uint32_t i = 0; i < num_queries; i++) {
+        const uint64_t key = (1ULL << 32) + rand();
+        false_positives += qf_range_query(&qf, key, 0, key, max_memento, QF_NO_LOCK) > 0;
+        plain_false_positives += qf_range_query(&plain_qf, key, 0, key, max_memento,
+                                                QF_NO_LOCK) > 0;
+    }
+    fprintf(stderr, "fpr=%lf plain_fpr=%lf\n", (double) false_positives / num_queries,
+                                            (double) plain_false_positives / num_queries);
+    assert(false_positives < 0.02 * num_queries);
+    assert(4 * false_positives < plain_false_positives);
+
+    fprintf(stderr, "%s-------- DELETING AND SHRINKING --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i += 2)
+        assert(qf_delete_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) == 0);
+    assert(qf_get_sum_of_counts(&qf) == num_keys / 2);
+    const uint64_t nslots = qf_get_nslots(&qf);
+    assert(qf_shrink(&qf, nslots / 2) >= 0);
+    assert(qf_get_nslots(&qf) == nslots / 2);
+    assert(qf_get_num_key_fingerprint_bits(&qf) == fingerprint_bits);
+    for (uint32_t i = 1; i < num_keys; i += 2)
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK) > 0);
+
+    fprintf(stderr, "%s-------- SERIALIZING THE FILTER --------%s\n", k_green, k_white);
+    char filename[] = "/tmp/memento_test_XXXXXX";
+    const int fd = mkstemp(filename);
+    assert(fd >= 0);
+    assert(qf_serialize_to_fd(&qf, fd));
+    QF loaded;
+    lseek(fd, 0, SEEK_SET);
+    assert(qf_deserialize_from_fd(&loaded, fd, NULL));
+    close(fd);
+    unlink(filename);
+    assert(loaded.metadata->expandable);
+    assert(qf_resize_malloc(&loaded, 2 * nslots) == (int64_t) num_keys / 2);
+    for (uint32_t i = 1; i < num_keys; i += 2)
+        assert(qf_point_query(&loaded, keys[i], key_mementos[i], QF_NO_LOCK) > 0);
+    qf_free(&loaded);
+
+    fprintf(stderr, "%s-------- RESIZING A PLAIN FILTER IN PLACE --------%s\n", k_green, k_white);
+    // qf_resize keeps the keys of a plain filter, and with them its fingerprints
+    const uint64_t buffer_len = qf_resize(&plain_qf, 2 * qf_get_nslots(&plain_qf), NULL, 0);
+    void *buffer = malloc(buffer_len);
+    assert(qf_resize(&plain_qf, 2 * qf_get_nslots(&plain_qf), buffer, buffer_len) == buffer_len);
+    assert(plain_qf.metadata->key_bits == 7 + fingerprint_bits);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_point_query(&plain_qf, keys[i], key_mementos[i], QF_NO_LOCK) > 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_destroy(&plain_qf);
+    free(buffer);
+    qf_free(&qf);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_large_filter() {
+    const uint64_t nslots = (1ULL << 32) + (1ULL << 30);
+    const uint64_t num_keys = 20000;
+    const uint64_t max_memento = (1ULL << memento_bits) - 1;
+
+    fprintf(stderr, "%s######################## EXECUTING test_large_filter ########################%s\n",
+                                                            k_red, k_white);
+    // The table lives in a memory file, so only the pages that are written
+    // take up memory
+    qf_alloc_options options = {};
+    options.snapshots = true;
+    QF qf;
+    if (!qf_malloc_ex(&qf, nslots, 33 + 5, memento_bits, QF_HASH_DEFAULT, SEED, &options)) {
+        fprintf(stderr, "%s-------- STATUS: SKIPPED --------%s\n", k_green, k_white);
+        return;
+    }
+    assert(qf_get_nslots(&qf) == nslots);
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    uint64_t *keys = new uint64_t[num_keys];
+    uint64_t *key_mementos = new uint64_t[num_keys];
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = ((uint64_t) rand() << 31) | rand();
+        key_mementos[i] = rand() & max_memento;
+        assert(qf_insert_single(&qf, keys[i], key_mementos[i], QF_NO_LOCK) >= 0);
+    }
+    for (uint32_t i = 0; i < num_keys; i++) {
+        assert(qf_point_query(&qf, keys[i], key_mementos[i], QF_NO_LOCK) > 0);
+        assert(qf_range_query(&qf, keys[i], key_mementos[i], keys[i] + 1, 0, QF_NO_LOCK) > 0);
+    }
+
+    fprintf(stderr, "%s-------- CHECKING THE HOME SLOTS --------%s\n", k_green, k_white);
+    // The home slots past 2^32 get their share of the keys
+    QFi qfi;
+    qf_iterator_from_position(&qf, &qfi, 1ULL << 32);
+    uint64_t high_keys = 0, hash, mementos[1024];
+    while (!qfi_end(&qfi)) {
+        high_keys += qfi_get_hash(&qfi, &hash, mementos);
+        qfi_next(&qfi);
+    }
+    const double expected = (double) num_keys * (nslots - (1ULL << 32)) / nslots;
+    assert(0.8 * expected < high_keys && high_keys < 1.2 * expected);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+    delete[] keys;
+    delete[] key_mementos;
+}
+
+void test_string_keys() {
+    const char *common_prefix = "https://www.example.com/";
+    const size_t common_prefix_len = strlen(common_prefix);
+    const uint32_t num_keys = 5000;
+    const uint32_t max_path_len = 12;
+    const uint32_t url_len = 40;
+
+    fprintf(stderr, "%s######################### EXECUTING test_string_keys ########################%s\n",
+                                                            k_red, k_white);
+    qf_string_codec codec;
+    qf_string_codec_init(&codec, 48, common_prefix, common_prefix_len);
+    QF qf;
+    qf_malloc(&qf, 1ULL << 14, 30, memento_bits, QF_HASH_DEFAULT, SEED);
+
+    fprintf(stderr, "%s-------- CHECKING THE ENCODING --------%s\n", k_green, k_white);
+    // Keys outside the common prefix go to the ends of the encoding range
+    assert(qf_string_encode(&codec, "", 0) == 0);
+    assert(qf_string_encode(&codec, "http://", 7) == 0);
+    assert(qf_string_encode(&codec, "https://www.", 12) == 0);
+    assert(qf_string_encode(&codec, "https://www.z", 13) == (1ULL << 48) - 1);
+    assert(qf_string_encode(&codec, common_prefix, common_prefix_len) == 0);
+    qf_string_codec plain_codec;
+    qf_string_codec_init(&plain_codec, 16, NULL, 0);
+    assert(qf_string_encode(&plain_codec, "ab", 2) == 0x6162);
+    assert(qf_string_encode(&plain_codec, "abc", 3) == 0x6162);
+    assert(qf_string_encode(&plain_codec, "a", 1) == 0x6100);
+
+    char (*urls)[url_len] = new char[num_keys][url_len];
+    srand(SEED);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        strcpy(urls[i], common_prefix);
+        const uint32_t path_len = 3 + rand() % (max_path_len - 2);
+        for (uint32_t j = 0; j < path_len; j++)
+            urls[i][common_prefix_len + j] = 'a' + rand() % 13;
+        urls[i][common_prefix_len + path_len] = '\0';
+    }
+    for (uint32_t i = 1; i < num_keys; i++) {
+        const uint64_t a = qf_string_encode(&codec, urls[i - 1], strlen(urls[i - 1]));
+        const uint64_t b = qf_string_encode(&codec, urls[i], strlen(urls[i]));
+        const int cmp = strcmp(urls[i - 1], urls[i]);
+        assert(cmp >= 0 || a <= b);
+        assert(cmp <= 0 || a >= b);
+    }
+
+    fprintf(stderr, "%s-------- INSERTING STUFF INTO THE FILTER --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i++)
+        assert(qf_insert_string(&qf, &codec, urls[i], strlen(urls[i]), QF_NO_LOCK) >= 0);
+
+    fprintf(stderr, "%s-------- QUERYING THE FILTER --------%s\n", k_green, k_white);
+    char l_url[url_len + 1], r_url[url_len + 1];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const size_t len = strlen(urls[i]);
+        assert(qf_point_query_string(&qf, &codec, urls[i], len, QF_NO_LOCK) > 0);
+        // The URLs between the parent of the path and the path itself
+        memcpy(l_url, urls[i], len - 1);
+        assert(qf_range_query_string(&qf, &codec, l_url, len - 1, urls[i], len,
+                                        QF_NO_LOCK) > 0);
+        // The URLs that extend the path
+        memcpy(r_url, urls[i], len);
+        r_url[len] = '\xff';
+        assert(qf_range_query_string(&qf, &codec, urls[i], len, r_url, len + 1,
+                                        QF_NO_LOCK) > 0);
+    }
+    // Paths from the other half of the alphabet were never inserted
+    uint32_t false_positives = 0;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        const size_t len = strlen(urls[i]);
+        memcpy(l_url, urls[i], len);
+        l_url[common_prefix_len] += 13;
+        false_positives += qf_point_query_string(&qf, &codec, l_url, len, QF_NO_LOCK) > 0;
+    }
+    fprintf(stderr, "false positive rate: %lf\n", (double) false_positives / num_keys);
+    assert(false_positives < num_keys / 100);
+
+    fprintf(stderr, "%s-------- DELETING STUFF FROM THE FILTER --------%s\n", k_green, k_white);
+    for (uint32_t i = 0; i < num_keys; i += 2)
+        assert(qf_delete_string(&qf, &codec, urls[i], strlen(urls[i]), QF_NO_LOCK) == 0);
+    for (uint32_t i = 1; i < num_keys; i += 2)
+        assert(qf_point_query_string(&qf, &codec, urls[i], strlen(urls[i]), QF_NO_LOCK) > 0);
+    fprintf(stderr, "%s-------- STATUS: OK --------%s\n", k_green, k_white);
+
+    qf_free(&qf);
+    delete[] urls;
+}
+
 void test_uniform_distribution(QF *qf) {
     srand(5);
 
@@ -1461,11 +3449,64 @@ void test_skew(QF *qf) {
     }
 }
 
+// The tests by name. test_expansion and test_without_hashing run last when
+// running them all, since they fail one of their range queries and abort.
+static const struct {
+    const char *name;
+    void (*run)();
+} all_tests[] = {
+    {"iterators", test_iterators},
+    {"insert_single", test_insert_single},
+    {"delete_single", test_delete_single},
+    {"resize_streaming", test_resize_streaming},
+    {"resize_parallel", test_resize_parallel},
+    {"resize_fractional", test_resize_fractional},
+    {"shrink", test_shrink},
+    {"resize_policy", test_resize_policy},
+    {"malloc_ex", test_malloc_ex},
+    {"long_clusters", test_long_clusters},
+    {"file_backed", test_file_backed},
+    {"serialization", test_serialization},
+    {"incremental_checkpoint", test_incremental_checkpoint},
+    {"snapshot", test_snapshot},
+    {"allocator", test_allocator},
+    {"allocation_failures", test_allocation_failures},
+    {"memory_breakdown", test_memory_breakdown},
+    {"sharded", test_sharded},
+    {"partitioned", test_partitioned},
+    {"shm", test_shm},
+    {"merge", test_merge},
+    {"split", test_split},
+    {"multi_range_query", test_multi_range_query},
+    {"windowed", test_windowed},
+    {"expandable", test_expandable},
+    {"large_filter", test_large_filter},
+    {"string_keys", test_string_keys},
+    {"expansion", test_expansion},
+    {"without_hashing", test_without_hashing},
+};
+
 int main(int argc, char **argv) {
-    test_without_hashing();
-    test_iterators();
-    test_expansion();
-    test_insert_single();
-    test_delete_single();
+    const size_t num_tests = sizeof(all_tests) / sizeof(all_tests[0]);
+    if (argc == 1) {
+        for (size_t i = 0; i < num_tests; i++)
+            all_tests[i].run();
+        return 0;
+    }
+    // Run only the tests named on the command line, with or without the
+    // `test_` in front of their names
+    for (int arg = 1; arg < argc; arg++) {
+        const char *name = argv[arg];
+        if (strncmp(name, "test_", 5) == 0)
+            name += 5;
+        size_t i = 0;
+        while (i < num_tests && strcmp(all_tests[i].name, name) != 0)
+            i++;
+        if (i == num_tests) {
+            fprintf(stderr, "Unknown test %s\n", argv[arg]);
+            return 1;
+        }
+        all_tests[i].run();
+    }
+    return 0;
 }
-